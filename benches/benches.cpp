@@ -0,0 +1,19 @@
+#include <benchmark/benchmark.h>
+
+// Strip trace records like a release build would
+#define TOAD_LOG_LEVEL TOAD_LEVEL_DEBUG
+
+#include "buffers.hpp"
+#include "capture.hpp"
+#include "checksum.hpp"
+#include "flows.hpp"
+#include "logging.hpp"
+#include "neighbors.hpp"
+#include "packets.hpp"
+#include "pipeline.hpp"
+#include "routes.hpp"
+#include "tap.hpp"
+#include "tcp.hpp"
+#include "topology.hpp"
+
+BENCHMARK_MAIN();
@@ -0,0 +1,57 @@
+#include <benchmark/benchmark.h>
+#include <memory>
+#include <thread>
+
+#include "bytes/buffer.hpp"
+
+using namespace toad;
+
+/// @brief What `Buffer(sz)` used to cost, a `shared_ptr` with its own control
+/// block and a zeroed heap allocation.
+static void BM_BufferAllocSharedPtr(benchmark::State &state) {
+  sz size = state.range(0);
+  for (auto _ : state) {
+    std::shared_ptr<u8[]> buffer(new u8[size]);
+    std::memset(buffer.get(), 0, size);
+    benchmark::DoNotOptimize(buffer.get());
+  }
+}
+BENCHMARK(BM_BufferAllocSharedPtr)->Arg(64)->Arg(1514)->Arg(9000);
+
+static void BM_BufferAllocPooled(benchmark::State &state) {
+  sz size = state.range(0);
+  for (auto _ : state) {
+    Buffer buffer(size, uninitialized);
+    benchmark::DoNotOptimize(buffer.data());
+  }
+}
+BENCHMARK(BM_BufferAllocPooled)->Arg(64)->Arg(1514)->Arg(9000);
+
+/// @brief A receive path: allocate, slice the headers off, drop.
+static void BM_BufferSliceChain(benchmark::State &state) {
+  for (auto _ : state) {
+    Buffer frame(1514, uninitialized);
+    Buffer ip = frame.slice(14, frame.size());
+    Buffer icmp = ip.slice(20, ip.size());
+    benchmark::DoNotOptimize(icmp.data());
+  }
+}
+BENCHMARK(BM_BufferSliceChain);
+
+/// @brief Frames allocated by the NIC thread and freed by a worker, every
+/// chunk goes back through the remote free stack.
+static void BM_BufferCrossThreadFree(benchmark::State &state) {
+  constexpr sz BATCH = 256;
+  std::vector<Buffer> batch;
+  batch.reserve(BATCH);
+
+  for (auto _ : state) {
+    for (sz i = 0; i < BATCH; i++)
+      batch.emplace_back(1514, uninitialized);
+
+    std::thread([&batch]() { batch.clear(); }).join();
+  }
+
+  state.SetItemsProcessed(state.iterations() * BATCH);
+}
+BENCHMARK(BM_BufferCrossThreadFree);
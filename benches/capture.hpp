@@ -0,0 +1,35 @@
+#include <benchmark/benchmark.h>
+
+#include "nic/capture.hpp"
+
+using namespace toad;
+
+/// @brief The hook on the packet path while nothing is captured.
+static void BM_CaptureIdle(benchmark::State &state) {
+  std::vector<u8> frame(1514);
+
+  for (auto _ : state) {
+    capture::frame(frame, capture::Direction::Inbound);
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_CaptureIdle);
+
+/// @brief The hook while capturing into `/dev/null`, a batch is taken every
+/// `CAPTURE_RING_RECORDS / 2` frames like an event loop would.
+static void BM_CaptureRunning(benchmark::State &state) {
+  std::vector<u8> frame(1514);
+  auto &tap = capture::tap();
+  tap.start("/dev/null", {}, state.range(0));
+
+  sz frames = 0;
+  for (auto _ : state) {
+    capture::frame(frame, capture::Direction::Inbound);
+    if (++frames % (capture::CAPTURE_RING_RECORDS / 2) == 0)
+      benchmark::DoNotOptimize(tap.take_batch());
+  }
+
+  tap.stop();
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CaptureRunning)->Arg(128)->Arg(1514);
@@ -0,0 +1,68 @@
+#include <benchmark/benchmark.h>
+#include <random>
+
+#include "nic/checksum.hpp"
+
+using namespace toad;
+
+static auto random_bytes(sz length) -> std::vector<u8> {
+  std::mt19937 rng(1624);
+  std::vector<u8> bytes(length);
+  for (auto &byte : bytes)
+    byte = rng();
+  return bytes;
+}
+
+/// @brief The checksum as it used to be, a word per iteration and a branch on
+/// every carry.
+static void BM_ChecksumWordLoop(benchmark::State &state) {
+  auto bytes = random_bytes(state.range(0));
+
+  for (auto _ : state) {
+    u32 acc = 0;
+    for (sz i = 0; i + 1 < bytes.size(); i += 2) {
+      u16 word = (bytes[i] << 8) | bytes[i + 1];
+      acc += word;
+      if (acc > 0xFFFF)
+        acc = (acc & 0xFFFF) + 1;
+    }
+    benchmark::DoNotOptimize(acc);
+  }
+
+  state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_ChecksumWordLoop)->RangeMultiplier(8)->Range(64, 64 << 10);
+
+template <auto sum> static void BM_ChecksumWith(benchmark::State &state) {
+  auto bytes = random_bytes(state.range(0));
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(sum(bytes.data(), bytes.size(), nullptr));
+
+  state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_ChecksumWith<_sum_scalar<>>)
+    ->Name("BM_ChecksumScalar")
+    ->RangeMultiplier(8)
+    ->Range(64, 64 << 10);
+#if defined(__x86_64__)
+BENCHMARK(BM_ChecksumWith<_sum_sse2<>>)
+    ->Name("BM_ChecksumSSE2")
+    ->RangeMultiplier(8)
+    ->Range(64, 64 << 10);
+BENCHMARK(BM_ChecksumWith<_sum_avx2<>>)
+    ->Name("BM_ChecksumAVX2")
+    ->RangeMultiplier(8)
+    ->Range(64, 64 << 10);
+#endif
+
+/// @brief What callers get, with the dispatch and the final fold.
+static void BM_ChecksumDispatched(benchmark::State &state) {
+  auto bytes = random_bytes(state.range(0));
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(checksum(std::span(bytes)));
+
+  state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_ChecksumDispatched)->RangeMultiplier(8)->Range(64, 64 << 10);
@@ -0,0 +1,97 @@
+#include <benchmark/benchmark.h>
+
+#include "nic/flow.hpp"
+#include "nic/pipeline.hpp"
+
+using namespace toad;
+
+/// @brief Concurrent flows the benchmarks track.
+constexpr sz BENCH_FLOWS = 1'000'000;
+
+static auto bench_flow_key(u32 i) -> FlowKey {
+  return FlowKey(IPv4({10, (u8)(i >> 16), (u8)(i >> 8), (u8)i}),
+                 IPv4({93, 184, 216, 34}), 1024 + (i % 50000), 443,
+                 PROTOCOL_TCP);
+}
+
+/// @brief A million flows, and keys of them in an order no prefetcher can
+/// follow.
+struct BenchFlows {
+  FlowTable<u64> table{BENCH_FLOWS};
+  std::vector<FlowKey> keys;
+
+  BenchFlows() {
+    for (u32 i = 0; i < BENCH_FLOWS; i++)
+      table.insert(bench_flow_key(i), i, 0);
+
+    u64 state = 0x2545F4914F6CDD1D;
+    for (sz i = 0; i < BENCH_FLOWS; i++) {
+      state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+      keys.push_back(bench_flow_key(state % BENCH_FLOWS));
+    }
+  }
+};
+
+static auto bench_flows() -> BenchFlows & {
+  static BenchFlows flows;
+  return flows;
+}
+
+/// @brief Fills an empty table up to a million flows.
+static void BM_FlowInsert(benchmark::State &state) {
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto table = std::make_unique<FlowTable<u64>>(BENCH_FLOWS);
+    state.ResumeTiming();
+
+    for (u32 i = 0; i < BENCH_FLOWS; i++)
+      benchmark::DoNotOptimize(table->insert(bench_flow_key(i), i, 0));
+  }
+  state.SetItemsProcessed(state.iterations() * BENCH_FLOWS);
+}
+BENCHMARK(BM_FlowInsert)->Unit(benchmark::kMillisecond);
+
+/// @brief Finds flows among a million, one at a time.
+static void BM_FlowLookup(benchmark::State &state) {
+  auto &flows = bench_flows();
+
+  for (auto _ : state)
+    for (auto &key : flows.keys)
+      benchmark::DoNotOptimize(flows.table.find(key, 1));
+  state.SetItemsProcessed(state.iterations() * flows.keys.size());
+}
+BENCHMARK(BM_FlowLookup)->Unit(benchmark::kMillisecond);
+
+/// @brief The same lookups a pipeline vector at a time.
+static void BM_FlowLookupBatch(benchmark::State &state) {
+  auto &flows = bench_flows();
+  std::array<u64 *, PIPELINE_VECTOR_SIZE> values;
+
+  for (auto _ : state)
+    for (sz i = 0; i + PIPELINE_VECTOR_SIZE <= flows.keys.size();
+         i += PIPELINE_VECTOR_SIZE) {
+      flows.table.find_batch(
+          std::span(flows.keys).subspan(i, PIPELINE_VECTOR_SIZE), values, 1);
+      benchmark::DoNotOptimize(values);
+    }
+  state.SetItemsProcessed(state.iterations() * flows.keys.size());
+}
+BENCHMARK(BM_FlowLookupBatch)->Unit(benchmark::kMillisecond);
+
+/// @brief Sweeps a million flows of which every other one went idle, in
+/// timer sized steps.
+static void BM_FlowExpire(benchmark::State &state) {
+  sz expired = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto table = std::make_unique<FlowTable<u64>>(BENCH_FLOWS, 100);
+    for (u32 i = 0; i < BENCH_FLOWS; i++)
+      table->insert(bench_flow_key(i), i, i % 2 ? 0 : 100);
+    state.ResumeTiming();
+
+    for (sz swept = 0; swept < table->slots(); swept += 4096)
+      expired += table->expire(150, 4096, [](const FlowKey &, u64) {});
+  }
+  state.SetItemsProcessed(expired);
+}
+BENCHMARK(BM_FlowExpire)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,96 @@
+#include <benchmark/benchmark.h>
+#include <spdlog/sinks/null_sink.h>
+
+#include "log.hpp"
+
+using namespace toad;
+
+/// @brief Installs a logger with the production pattern writing to a null
+/// sink, so only the cost of the log call itself is measured.
+struct NullLogger {
+  std::shared_ptr<spdlog::logger> previous;
+
+  NullLogger(spdlog::level::level_enum level) {
+    previous = spdlog::default_logger();
+    auto formatter = std::make_unique<spdlog::pattern_formatter>();
+    formatter->add_flag<CorrelationIdFormatter>('Z');
+    formatter->set_pattern(
+        "%Y-%m-%d %H:%M:%S.%e [%L] [cid=%Z] [thread %t] %v");
+
+    auto logger = std::make_shared<spdlog::logger>(
+        "bench", std::make_shared<spdlog::sinks::null_sink_mt>());
+    logger->set_formatter(std::move(formatter));
+    logger->set_level(level);
+    spdlog::set_default_logger(logger);
+  }
+
+  ~NullLogger() { spdlog::set_default_logger(previous); }
+};
+
+/// @brief One hop of the relay: a read completion is logged and the bytes
+/// are forwarded to the other socket.
+template <typename Log>
+static void relay_hop(benchmark::State &state, Log log) {
+  std::vector<u8> in(1024, 0xAB), out(1024);
+  int fd = 7;
+
+  for (auto _ : state) {
+    log(in.size(), fd);
+    std::memcpy(out.data(), in.data(), in.size());
+    benchmark::DoNotOptimize(out.data());
+  }
+
+  state.SetBytesProcessed(state.iterations() * in.size());
+}
+
+static void BM_RelayNoLog(benchmark::State &state) {
+  relay_hop(state, [](sz, int) {});
+}
+
+BENCHMARK(BM_RelayNoLog);
+
+/// @brief Below `TOAD_LOG_LEVEL`, compiled out entirely.
+static void BM_RelayLogStripped(benchmark::State &state) {
+  NullLogger logger(spdlog::level::trace);
+  relay_hop(state, [](sz read, int fd) {
+    TOAD_TRACE("Read {} bytes from client_fd={}", read, fd);
+  });
+}
+
+BENCHMARK(BM_RelayLogStripped);
+
+/// @brief Compiled in, but filtered by the runtime level.
+static void BM_RelayLogFiltered(benchmark::State &state) {
+  NullLogger logger(spdlog::level::info);
+  relay_hop(state, [](sz read, int fd) {
+    TOAD_DEBUG("Read {} bytes from client_fd={}", read, fd);
+  });
+}
+
+BENCHMARK(BM_RelayLogFiltered);
+
+static void BM_RelayLogAsync(benchmark::State &state) {
+  NullLogger logger(spdlog::level::trace);
+  auto &async = logging::AsyncLogger::instance();
+  async.start();
+  u64 dropped = async.dropped.load();
+
+  relay_hop(state, [](sz read, int fd) {
+    TOAD_INFO("Read {} bytes from client_fd={}", read, fd);
+  });
+
+  async.stop();
+  state.counters["dropped"] = async.dropped.load() - dropped;
+}
+
+BENCHMARK(BM_RelayLogAsync);
+
+/// @brief What every relay hop used to pay: synchronous spdlog formatting.
+static void BM_RelayLogSpdlog(benchmark::State &state) {
+  NullLogger logger(spdlog::level::trace);
+  relay_hop(state, [](sz read, int fd) {
+    spdlog::info("Read {} bytes from client_fd={}", read, fd);
+  });
+}
+
+BENCHMARK(BM_RelayLogSpdlog);
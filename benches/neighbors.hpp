@@ -0,0 +1,82 @@
+#include <benchmark/benchmark.h>
+#include <mutex>
+#include <unordered_map>
+
+#include "nic/neighbor.hpp"
+
+using namespace toad;
+
+static auto neighbor_ip(u32 i) -> IPv4 {
+  return IPv4({10, (u8)(i >> 16), (u8)(i >> 8), (u8)i});
+}
+
+/// @brief Addresses to look up, in an order no prefetcher can follow.
+static auto neighbor_lookups(sz neighbors) -> std::vector<IPv4> {
+  std::vector<IPv4> lookups;
+  u64 state = 0x2545F4914F6CDD1D;
+  for (sz i = 0; i < 4096; i++) {
+    state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+    lookups.push_back(neighbor_ip(state % neighbors));
+  }
+  return lookups;
+}
+
+/// @brief Lock-free lookups of known neighbors, from every benchmark
+/// thread at once.
+static void BM_NeighborLookup(benchmark::State &state) {
+  static NeighborCache *cache = nullptr;
+  sz neighbors = state.range(0);
+  if (state.thread_index() == 0) {
+    cache = new NeighborCache(neighbors);
+    for (u32 i = 0; i < neighbors; i++)
+      cache->confirm(neighbor_ip(i), MAC({0x02, 0, 0, 0, 0, (u8)i}), 0, true);
+  }
+  auto lookups = neighbor_lookups(neighbors);
+
+  for (auto _ : state)
+    for (auto &ip : lookups)
+      benchmark::DoNotOptimize(cache->lookup(ip));
+
+  state.SetItemsProcessed(state.iterations() * lookups.size());
+  if (state.thread_index() == 0) {
+    delete cache;
+    cache = nullptr;
+  }
+}
+BENCHMARK(BM_NeighborLookup)->Arg(100000)->ThreadRange(1, 4)->UseRealTime();
+
+/// @brief The same lookups through a mutex and a `std::unordered_map`, what
+/// the cache would be without the sequence locks.
+static void BM_NeighborLookupLocked(benchmark::State &state) {
+  static std::mutex *mutex = nullptr;
+  static std::unordered_map<u32, MAC> *table = nullptr;
+  sz neighbors = state.range(0);
+  if (state.thread_index() == 0) {
+    mutex = new std::mutex();
+    table = new std::unordered_map<u32, MAC>();
+    for (u32 i = 0; i < neighbors; i++)
+      (*table)[NeighborCache::_ip_bits(neighbor_ip(i))] =
+          MAC({0x02, 0, 0, 0, 0, (u8)i});
+  }
+  auto lookups = neighbor_lookups(neighbors);
+
+  for (auto _ : state)
+    for (auto &ip : lookups) {
+      std::lock_guard guard(*mutex);
+      auto it = table->find(NeighborCache::_ip_bits(ip));
+      std::optional<MAC> mac;
+      if (it != table->end())
+        mac = it->second;
+      benchmark::DoNotOptimize(mac);
+    }
+
+  state.SetItemsProcessed(state.iterations() * lookups.size());
+  if (state.thread_index() == 0) {
+    delete table;
+    delete mutex;
+  }
+}
+BENCHMARK(BM_NeighborLookupLocked)
+    ->Arg(100000)
+    ->ThreadRange(1, 4)
+    ->UseRealTime();
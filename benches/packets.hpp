@@ -0,0 +1,259 @@
+#include <benchmark/benchmark.h>
+
+#include "nic/arp.hpp"
+#include "nic/ethernet.hpp"
+#include "nic/icmp.hpp"
+#include "nic/ipv4.hpp"
+
+using namespace toad;
+
+/// @brief A ping and an ARP who-has, as captured on a TAP device.
+static auto captured_frames() -> std::vector<Buffer> {
+  std::vector<u8> echo_request = {
+      0x5a, 0x3c, 0x1e, 0x9d, 0x0b, 0x42, 0xf6, 0xa1, 0xc2, 0xd3, 0xe4, 0xf5,
+      0x08, 0x00, 0x45, 0x00, 0x00, 0x54, 0x6e, 0x1f, 0x40, 0x00, 0x40, 0x01,
+      0xb8, 0x87, 0x0a, 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x02, 0x08, 0x00,
+      0x9c, 0xe5, 0x1c, 0x2b, 0x00, 0x01, 0xa1, 0xc3, 0xf1, 0x66, 0x00, 0x00,
+      0x00, 0x00, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+      0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25,
+      0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31,
+      0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d,
+      0x3e, 0x3f,
+  };
+
+  std::vector<u8> arp_request = {
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf6, 0xa1, 0xc2, 0xd3, 0xe4, 0xf5,
+      0x08, 0x06, 0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01, 0xf6, 0xa1,
+      0xc2, 0xd3, 0xe4, 0xf5, 0x0a, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x0a, 0x00, 0x00, 0x02,
+  };
+
+  // Mostly pings, like a TAP device answering `ping -f`
+  std::vector<Buffer> frames;
+  for (sz i = 0; i < 64; i++)
+    frames.emplace_back(i % 8 == 0 ? arp_request : echo_request);
+  return frames;
+}
+
+/// @brief Decodes every frame down to its innermost layer. The payloads are
+/// slices of the frame, so the cost is the header parsing alone.
+static void BM_ParseCapturedFrames(benchmark::State &state) {
+  auto frames = captured_frames();
+
+  for (auto _ : state) {
+    for (auto &buffer : frames) {
+      ByteIStream frame_stream(buffer);
+      auto frame = EthernetFrame<DirectionIn>::try_from_stream(frame_stream);
+
+      if (frame.ethertype == ETHERTYPE_ARP) {
+        ByteIStream arp_stream(frame.payload);
+        auto arp = ArpIPv4<DirectionIn>::try_from_stream(arp_stream);
+        benchmark::DoNotOptimize(arp);
+        continue;
+      }
+
+      ByteIStream ip_stream(frame.payload);
+      auto ip = Ip<DirectionIn>::try_from_stream(ip_stream);
+      ByteIStream icmp_stream(ip.payload);
+      auto icmp = Icmp<DirectionIn>::try_from_stream(icmp_stream);
+      benchmark::DoNotOptimize(icmp);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * frames.size());
+}
+BENCHMARK(BM_ParseCapturedFrames);
+
+/// @brief The IPv4 header decoded the way it used to be, one bounds checked
+/// call per field and the bit fields unpacked by hand.
+static void BM_IpHeaderDecodeChecked(benchmark::State &state) {
+  auto frames = captured_frames();
+  Buffer ip = frames[1].slice(14, frames[1].size());
+
+  for (auto _ : state) {
+    ByteIStream stream(ip);
+    u8 version_ihl = 0, dscp_ecn = 0, ttl = 0, protocol = 0;
+    u16 total_length = 0, identification = 0, flags_fragment_offset = 0,
+        checksum = 0;
+    std::array<u8, 4> src = {}, dst = {};
+
+    stream.read_u8(&version_ihl)
+        .read_u8(&dscp_ecn)
+        .read_u16(&total_length)
+        .read_u16(&identification)
+        .read_u16(&flags_fragment_offset)
+        .read_u8(&ttl)
+        .read_u8(&protocol)
+        .read_u16(&checksum)
+        .read_array(&src)
+        .read_array(&dst);
+
+    u8 ihl = version_ihl & 0xF, flags = flags_fragment_offset >> 13;
+    u16 fragment_offset = flags_fragment_offset & 0x1FFF;
+    benchmark::DoNotOptimize(ihl);
+    benchmark::DoNotOptimize(flags);
+    benchmark::DoNotOptimize(fragment_offset);
+    benchmark::DoNotOptimize(total_length);
+    benchmark::DoNotOptimize(src);
+    benchmark::DoNotOptimize(dst);
+    benchmark::DoNotOptimize(stream.errc);
+  }
+}
+BENCHMARK(BM_IpHeaderDecodeChecked);
+
+/// @brief Same fields through `IpHeader`, one bounds check for the header and
+/// a load, swap, shift and mask per field.
+static void BM_IpHeaderDecodeSchema(benchmark::State &state) {
+  auto frames = captured_frames();
+  Buffer ip = frames[1].slice(14, frames[1].size());
+
+  for (auto _ : state) {
+    ByteIStream stream(ip);
+    const u8 *header = stream.read_header(IP_HEADER_SIZE);
+    if (!header)
+      continue;
+
+    auto parsed = Ip<DirectionIn>::load_header(header);
+    benchmark::DoNotOptimize(parsed.ihl);
+    benchmark::DoNotOptimize(parsed.flags);
+    benchmark::DoNotOptimize(parsed.fragment_offset);
+    benchmark::DoNotOptimize(parsed.total_length);
+    benchmark::DoNotOptimize(parsed.src);
+    benchmark::DoNotOptimize(parsed.dst);
+  }
+}
+BENCHMARK(BM_IpHeaderDecodeSchema);
+
+/// @brief Forwards every frame the way a router would, through views: the
+/// headers are checked where they lie and the TTL and the checksum patched in
+/// place, nothing is decoded into owned structs.
+static void BM_ForwardCapturedFramesInPlace(benchmark::State &state) {
+  auto frames = captured_frames();
+
+  for (auto _ : state) {
+    for (auto &buffer : frames) {
+      auto frame = EthernetView<DirectionIn>::try_from(buffer);
+      if (!frame)
+        continue;
+
+      if (frame->ethertype() == ETHERTYPE_ARP) {
+        auto arp = ArpIPv4View<DirectionIn>::try_from(frame->payload());
+        benchmark::DoNotOptimize(arp);
+        continue;
+      }
+
+      auto ip = IpView<DirectionIn>::try_from(frame->payload());
+      if (!ip)
+        continue;
+
+      auto out = ip->reverse();
+      out.decrement_ttl();
+      benchmark::DoNotOptimize(out.header());
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * frames.size());
+}
+BENCHMARK(BM_ForwardCapturedFramesInPlace);
+
+static auto captured_echo() -> Icmp<DirectionOut> {
+  auto frames = captured_frames();
+  ByteIStream stream(frames[1]);
+  stream.skip(EthernetHeader::SIZE + IP_HEADER_SIZE);
+  return Icmp<DirectionOut>(Icmp<DirectionIn>::try_from_stream(stream));
+}
+
+/// @brief How the checksum used to be computed, by serializing the message
+/// into a scratch buffer first.
+static void BM_IcmpChecksumReserialize(benchmark::State &state) {
+  auto icmp = captured_echo();
+
+  for (auto _ : state) {
+    Buffer buffer((icmp.buffer_size() + 1) & ~1);
+    ByteOStream stream(buffer);
+    icmp.try_to_stream(stream);
+    buffer.data()[2] = 0;
+    buffer.data()[3] = 0;
+    benchmark::DoNotOptimize(checksum(buffer.span()));
+  }
+}
+BENCHMARK(BM_IcmpChecksumReserialize);
+
+static void BM_IcmpChecksumInPlace(benchmark::State &state) {
+  auto icmp = captured_echo();
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(icmp.calculate_checksum());
+}
+BENCHMARK(BM_IcmpChecksumInPlace);
+
+/// @brief Writing the reply out and checksumming it in the same pass, against
+/// writing it and computing the checksum separately.
+static void BM_IcmpWriteThenChecksum(benchmark::State &state) {
+  auto icmp = captured_echo();
+  Buffer out(icmp.buffer_size(), uninitialized);
+
+  for (auto _ : state) {
+    icmp.checksum = icmp.calculate_checksum();
+    ByteOStream stream(out);
+    icmp.try_to_stream(stream);
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+BENCHMARK(BM_IcmpWriteThenChecksum);
+
+static void BM_IcmpWriteWithChecksum(benchmark::State &state) {
+  auto icmp = captured_echo();
+  Buffer out(icmp.buffer_size(), uninitialized);
+
+  for (auto _ : state) {
+    ByteOStream stream(out);
+    icmp.try_to_stream_with_checksum(stream);
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+BENCHMARK(BM_IcmpWriteWithChecksum);
+
+/// @brief Answering a ping the way the responder used to: decoded into owned
+/// structs, then every header pushed and checksummed again.
+static void BM_EchoReplyRebuilt(benchmark::State &state) {
+  auto frames = captured_frames();
+  Buffer frame(frames[1].size(), uninitialized);
+
+  for (auto _ : state) {
+    std::memcpy(frame.data(), frames[1].data(), frame.size());
+    ByteIStream stream(frame);
+    auto eth = EthernetFrame<DirectionIn>::try_from_stream(stream);
+    ByteIStream ip_stream(eth.payload);
+    auto ip = Ip<DirectionIn>::try_from_stream(ip_stream);
+    ByteIStream icmp_stream(ip.payload);
+    auto icmp = Icmp<DirectionIn>::try_from_stream(icmp_stream);
+
+    Icmp<DirectionOut> icmp_reply(icmp);
+    icmp_reply.type = IcmpType::EchoReply;
+    Ip<DirectionOut> ip_reply(ip);
+    std::swap(ip_reply.src, ip_reply.dst);
+
+    PacketBuffer packet(icmp.payload);
+    icmp_reply.push_onto(packet);
+    ip_reply.push_onto(packet);
+    EthernetFrame<DirectionOut>(eth.src, eth.dst, ETHERTYPE_IPV4)
+        .push_onto(packet);
+    benchmark::DoNotOptimize(packet.data());
+  }
+}
+BENCHMARK(BM_EchoReplyRebuilt);
+
+/// @brief The same reply patched where it lies, both checksums updated for
+/// the words that changed. The copy restores the request for the next round.
+static void BM_EchoReplyInPlace(benchmark::State &state) {
+  auto frames = captured_frames();
+  Buffer frame(frames[1].size(), uninitialized);
+
+  for (auto _ : state) {
+    std::memcpy(frame.data(), frames[1].data(), frame.size());
+    benchmark::DoNotOptimize(echo_reply_in_place(
+        frame.span(), EthernetHeader::SIZE + IP_HEADER_SIZE));
+  }
+}
+BENCHMARK(BM_EchoReplyInPlace);
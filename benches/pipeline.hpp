@@ -0,0 +1,77 @@
+#include <benchmark/benchmark.h>
+
+#include "nic/pipeline.hpp"
+
+using namespace toad;
+
+/// @brief Counts what leaves the pipeline and lets go of it.
+struct CountingDevice {
+  u64 frames = 0;
+
+  void queue_eth(const EthernetView<DirectionOut> &frame) {
+    benchmark::DoNotOptimize(frame.buffer.data());
+    frames++;
+  }
+  void flush() {}
+};
+
+/// @brief Pings for us, pings to forward and ARP requests for us, mixed the
+/// way they would arrive.
+static auto synthetic_frames(sz count) -> std::vector<std::vector<u8>> {
+  auto templates = captured_frames();
+  std::vector<u8> echo(templates[1].data(),
+                       templates[1].data() + templates[1].size());
+  std::vector<u8> arp(templates[0].data(),
+                      templates[0].data() + templates[0].size());
+  std::vector<u8> transit = echo;
+  transit[33] = 7;
+  // Patch the header checksum for the new destination
+  u16 sum = (transit[24] << 8) | transit[25];
+  u16 patched = checksum(sum).update(0x0002, 0x0007);
+  transit[24] = patched >> 8;
+  transit[25] = patched & 0xFF;
+
+  std::vector<std::vector<u8>> frames;
+  for (sz i = 0; i < count; i++)
+    frames.push_back(i % 8 == 0 ? arp : i % 4 == 0 ? transit : echo);
+  return frames;
+}
+
+/// @brief Runs `state.range(0)` frames through the pipeline, either as
+/// vectors or one frame at a time. Every frame is copied into a fresh pooled
+/// buffer first, the way a NIC would fill its ring, since the pipeline
+/// answers in place. Both variants pay for that alike.
+static void pipeline_bench(benchmark::State &state, sz vector_size) {
+  auto templates = synthetic_frames(state.range(0));
+  Pipeline pipeline(MAC({0x5a, 0x3c, 0x1e, 0x9d, 0x0b, 0x42}),
+                    IPv4({10, 0, 0, 2}));
+  pipeline.next_hop = MAC({0x02, 0, 0, 0, 0, 0xFE});
+  CountingDevice device;
+  std::vector<Buffer> frames(templates.size());
+
+  for (auto _ : state) {
+    for (sz i = 0; i < templates.size(); i++) {
+      frames[i] = Buffer(templates[i].size(), uninitialized);
+      std::memcpy(frames[i].data(), templates[i].data(), templates[i].size());
+    }
+
+    std::span<Buffer> all(frames);
+    for (sz i = 0; i < all.size(); i += vector_size)
+      pipeline.process(all.subspan(i, std::min(vector_size, all.size() - i)),
+                       device);
+  }
+
+  state.SetItemsProcessed(state.iterations() * templates.size());
+  state.counters["sent"] = benchmark::Counter(
+      device.frames, benchmark::Counter::kAvgIterations);
+}
+
+static void BM_PipelineVectors(benchmark::State &state) {
+  pipeline_bench(state, PIPELINE_VECTOR_SIZE);
+}
+BENCHMARK(BM_PipelineVectors)->Arg(256)->Arg(4096);
+
+static void BM_PipelineFrameAtATime(benchmark::State &state) {
+  pipeline_bench(state, 1);
+}
+BENCHMARK(BM_PipelineFrameAtATime)->Arg(256)->Arg(4096);
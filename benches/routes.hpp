@@ -0,0 +1,81 @@
+#include <benchmark/benchmark.h>
+
+#include "nic/pipeline.hpp"
+#include "nic/route.hpp"
+
+using namespace toad;
+
+/// @brief Prefixes in a full Internet table, give or take.
+constexpr sz FULL_TABLE_PREFIXES = 950'000;
+/// @brief Addresses looked up per iteration, enough to miss the caches.
+constexpr sz ROUTE_LOOKUPS = 1 << 20;
+
+struct SyntheticRoutes {
+  RouteTable table{1 << 14};
+  std::vector<u32> addresses;
+};
+
+/// @brief A table shaped like a full BGP feed: mostly /24s, a fifth /22s and
+/// /23s, the rest shorter, and a few longer ones for the groups. A thousand
+/// gateways share the routes. Addresses to look up are drawn from under the
+/// prefixes, in no order a prefetcher can follow.
+static auto synthetic_routes() -> SyntheticRoutes & {
+  static SyntheticRoutes *routes = nullptr;
+  if (routes)
+    return *routes;
+
+  routes = new SyntheticRoutes();
+  u64 state = 0x2545F4914F6CDD1D;
+  auto next = [&]() -> u32 {
+    state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+    return (u32)state;
+  };
+
+  std::vector<std::pair<u32, u8>> prefixes;
+  for (sz i = 0; i < FULL_TABLE_PREFIXES; i++) {
+    u32 shape = next() % 100;
+    u8 length = shape < 60   ? 24
+                : shape < 80 ? 22 + next() % 2
+                : shape < 99 ? 12 + next() % 10
+                             : 25 + next() % 8;
+    u32 address = next() & RouteTable::_netmask(length);
+    routes->table.add(RouteTable::_ip(address), length,
+                      IPv4({192, 168, (u8)(i >> 8 & 3), (u8)i}));
+    prefixes.emplace_back(address, length);
+  }
+
+  for (sz i = 0; i < ROUTE_LOOKUPS; i++) {
+    auto [address, length] = prefixes[next() % prefixes.size()];
+    u32 host = next() & ~RouteTable::_netmask(length);
+    routes->addresses.push_back(address | host);
+  }
+  return *routes;
+}
+
+/// @brief Lookups one address at a time.
+static void BM_RouteLookup(benchmark::State &state) {
+  auto &routes = synthetic_routes();
+
+  for (auto _ : state)
+    for (u32 address : routes.addresses)
+      benchmark::DoNotOptimize(routes.table.lookup(address));
+
+  state.SetItemsProcessed(state.iterations() * routes.addresses.size());
+}
+BENCHMARK(BM_RouteLookup);
+
+/// @brief The same lookups a pipeline vector at a time.
+static void BM_RouteLookupBulk(benchmark::State &state) {
+  auto &routes = synthetic_routes();
+  std::array<u32, PIPELINE_VECTOR_SIZE> hops;
+
+  for (auto _ : state)
+    for (sz i = 0; i < routes.addresses.size(); i += PIPELINE_VECTOR_SIZE) {
+      routes.table.lookup_bulk(
+          std::span(routes.addresses).subspan(i, PIPELINE_VECTOR_SIZE), hops);
+      benchmark::DoNotOptimize(hops);
+    }
+
+  state.SetItemsProcessed(state.iterations() * routes.addresses.size());
+}
+BENCHMARK(BM_RouteLookupBulk);
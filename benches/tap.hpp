@@ -0,0 +1,136 @@
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <linux/if_arp.h>
+#include <thread>
+
+#include "concurrency.hpp"
+#include "nic/device.hpp"
+
+using namespace toad;
+
+/// @brief Makes the kernel resolve `ip` to `mac` without asking, so the
+/// traffic sent to it goes straight out of the TAP device.
+static bool add_static_neighbor(const char *device, const char *ip, MAC mac) {
+  int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock_fd < 0)
+    return false;
+
+  arpreq request;
+  std::memset(&request, 0, sizeof(request));
+  auto *addr = (sockaddr_in *)&request.arp_pa;
+  addr->sin_family = AF_INET;
+  inet_pton(AF_INET, ip, &addr->sin_addr);
+  request.arp_ha.sa_family = ARPHRD_ETHER;
+  std::memcpy(request.arp_ha.sa_data, mac.data(), 6);
+  request.arp_flags = ATF_COM | ATF_PERM;
+  std::strncpy(request.arp_dev, device, sizeof(request.arp_dev) - 1);
+
+  bool ok = ioctl(sock_fd, SIOCSARP, &request) == 0;
+  close(sock_fd);
+  return ok;
+}
+
+/// @brief Frames drained from one queue, a cache line per queue.
+struct alignas(CACHE_LINE_SIZE) DrainedFrames {
+  std::atomic<u64> count = 0;
+};
+
+/// @brief Counts the frames of a queue as its consumer would see them.
+static Task drain_queue(DeviceQueue &queue, DrainedFrames &drained) {
+  auto frames = queue.frames();
+  while (co_await frames->recv())
+    drained.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+/// @brief Sends UDP from `flows` source ports to a neighbor behind a TAP
+/// device with `state.range(0)` queues and drains every queue through its
+/// `DeviceQueue`, on an event loop and worker pinned to a CPU of its own.
+/// The kernel hashes the flows over the queues, so the frames drained per
+/// second should grow with the queues until the senders become the
+/// bottleneck.
+/// NOTE: needs CAP_NET_ADMIN, skipped otherwise.
+static void BM_TapMultiQueueDrain(benchmark::State &state) {
+  constexpr const char *NAME = "toadbench0";
+  constexpr const char *PEER = "10.77.0.2";
+  constexpr sz SENDERS = 2, FLOWS = 64;
+  sz queue_count = state.range(0);
+
+  auto device =
+      Device::try_new(NAME, "10.77.0.1", "255.255.255.0", queue_count);
+  if (!device) {
+    state.SkipWithError("Creating a TAP device needs CAP_NET_ADMIN");
+    return;
+  }
+  MAC peer_mac(std::array<u8, 6>{0x02, 0, 0, 0x77, 0, 2});
+  if (!add_static_neighbor(NAME, PEER, peer_mac)) {
+    state.SkipWithError("Adding a static neighbor failed");
+    return;
+  }
+
+  auto topology = Topology::discover();
+  auto cpus = topology.cpus_on_node(0);
+
+  // The first queue normally stays on the default event loop, which nothing
+  // runs here, so it gets a loop like the rest
+  std::optional<QueueLoop> first;
+  if (cpus.empty())
+    first.emplace();
+  else
+    first.emplace(cpus.back(), 0);
+  device->queues[0].io = &first->io;
+  device->queues[0].executor = &first->executor;
+  first->start();
+  device->serve_queues(cpus);
+
+  std::vector<DrainedFrames> drained(queue_count);
+  for (sz i = 0; i < queue_count; i++)
+    device->queues[i].spawn(drain_queue(device->queues[i], drained[i]));
+
+  std::atomic<bool> stop = false;
+  std::vector<std::thread> threads;
+
+  for (sz i = 0; i < SENDERS; i++)
+    threads.emplace_back([&, i]() {
+      std::vector<int> sockets;
+      for (sz flow = i; flow < FLOWS; flow += SENDERS) {
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        sockaddr_in peer = {};
+        peer.sin_family = AF_INET;
+        peer.sin_port = htons(9000);
+        inet_pton(AF_INET, PEER, &peer.sin_addr);
+        if (fd >= 0 && connect(fd, (sockaddr *)&peer, sizeof(peer)) == 0)
+          sockets.push_back(fd);
+      }
+
+      std::array<u8, 64> payload = {};
+      while (!stop.load(std::memory_order_relaxed))
+        for (int fd : sockets)
+          send(fd, payload.data(), payload.size(), 0);
+
+      for (int fd : sockets)
+        close(fd);
+    });
+
+  for (auto _ : state)
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  stop = true;
+  for (auto &thread : threads)
+    thread.join();
+
+  u64 total = 0;
+  for (sz i = 0; i < queue_count; i++)
+    total += drained[i].count.load(std::memory_order_relaxed);
+  // Stops the loops before the counters they write to go away
+  first.reset();
+  device.reset();
+
+  state.SetItemsProcessed(total);
+  state.counters["queues"] = queue_count;
+}
+BENCHMARK(BM_TapMultiQueueDrain)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->Iterations(10)
+    ->UseRealTime();
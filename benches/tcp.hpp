@@ -0,0 +1,73 @@
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <thread>
+
+#include "nic/tcp.hpp"
+
+using namespace toad;
+
+/// @brief Bytes moved per iteration, enough for the window to open fully.
+constexpr sz TCP_BENCH_BYTES = 16 << 20;
+
+static Task tcp_bench_send(TcpStack &stack, IPv4 ip, sz size,
+                           std::atomic<bool> &done) {
+  {
+    auto socket = co_await stack.submit_connect_ipv4(ip, 9);
+    Buffer piece(1 << 16);
+    for (sz sent = 0; socket && sent < size; sent += piece.size())
+      if (!co_await stack.submit_write(*socket, BufferChain(piece)))
+        break;
+  }
+  done = true;
+}
+
+static Task tcp_bench_receive(TcpStack &stack, TcpListener &listener,
+                              std::atomic<bool> &done) {
+  {
+    auto socket = co_await stack.submit_accept_ipv4(listener);
+    while (socket && co_await stack.submit_read_some(*socket, 1 << 16))
+      ;
+  }
+  done = true;
+}
+
+/// @brief One connection between two stacks in memory, carried a vector of
+/// segments each way per round. Measures the stack alone: segmentation,
+/// checksums, ACK processing and reassembly into the reader's buffers.
+/// Every `state.range(0)`th segment is lost, zero loses none.
+static void BM_TcpBulkTransfer(benchmark::State &state) {
+  const IPv4 client_ip({10, 0, 0, 1}), server_ip({10, 0, 0, 2});
+  sz loss = state.range(0);
+  u64 segments = 0;
+
+  for (auto _ : state) {
+    TcpStack client(client_ip), server(server_ip);
+    Executor executor(1);
+    auto listener = server.new_listener(9);
+    std::atomic<bool> sent = false, received = false;
+    executor.spawn(tcp_bench_receive(server, listener, received));
+    executor.spawn(tcp_bench_send(client, server_ip, TCP_BENCH_BYTES, sent));
+
+    u64 now = 0, carried = 0;
+    auto carry = [&](TcpStack &from, TcpStack &to) {
+      std::vector<Buffer> packets;
+      for (auto &packet : from.poll(now))
+        if (!loss || ++carried % loss != 0)
+          packets.push_back(packet.view());
+      if (!packets.empty())
+        to.input(packets, now);
+    };
+    while (!sent || !received) {
+      now += 100'000;
+      carry(client, server);
+      carry(server, client);
+      std::this_thread::yield();
+    }
+    segments += client.segments_sent;
+  }
+
+  state.SetBytesProcessed(state.iterations() * TCP_BENCH_BYTES);
+  state.counters["segments"] =
+      benchmark::Counter(segments, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_TcpBulkTransfer)->Arg(0)->Arg(100)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,106 @@
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <thread>
+
+#include "concurrency/topology.hpp"
+
+using namespace toad;
+
+/// @brief Restores the affinity of the benchmark thread once a pinned
+/// benchmark is over, so the rest of the suite is unaffected.
+struct AffinityGuard {
+  cpu_set_t saved;
+
+  AffinityGuard() { sched_getaffinity(0, sizeof(saved), &saved); }
+  ~AffinityGuard() { sched_setaffinity(0, sizeof(saved), &saved); }
+};
+
+/// @brief Every (cpu node, memory node) pair, so the output reads as a
+/// matrix of local versus remote access.
+static void node_pairs(benchmark::internal::Benchmark *bench) {
+  auto topology = Topology::discover();
+  for (u32 cpu_node = 0; cpu_node < topology.num_nodes; cpu_node++)
+    for (u32 mem_node = 0; mem_node < topology.num_nodes; mem_node++)
+      if (!topology.cpus_on_node(cpu_node).empty())
+        bench->Args({cpu_node, mem_node});
+}
+
+/// @brief Streams over a buffer bound to `mem_node` from a thread pinned on
+/// `cpu_node`. The difference between the diagonal and the rest is the
+/// bandwidth lost when a worker touches buffers from another node.
+static void BM_NodeStreamRead(benchmark::State &state) {
+  auto topology = Topology::discover();
+  u32 cpu_node = state.range(0), mem_node = state.range(1);
+
+  AffinityGuard guard;
+  pin_this_thread(topology.cpus_on_node(cpu_node)[0], cpu_node);
+
+  constexpr sz SIZE = 64 << 20;
+  auto *data = (u64 *)node_local_alloc(SIZE, mem_node);
+  std::memset(data, 1, SIZE);
+
+  for (auto _ : state) {
+    u64 acc = 0;
+    for (sz i = 0; i < SIZE / sizeof(u64); i++)
+      acc += data[i];
+    benchmark::DoNotOptimize(acc);
+  }
+
+  state.SetBytesProcessed(state.iterations() * SIZE);
+  state.counters["remote"] = cpu_node != mem_node;
+  node_local_free(data, SIZE);
+}
+
+BENCHMARK(BM_NodeStreamRead)->Apply(node_pairs)->Unit(benchmark::kMillisecond);
+
+/// @brief Bounces a cache line between a thread on node 0 and a thread on
+/// `range(1)`. Approximates what a connection migrating between workers on
+/// different nodes pays for every handoff of its coroutine frame.
+static void BM_NodeCacheLineBounce(benchmark::State &state) {
+  auto topology = Topology::discover();
+  u32 peer_node = state.range(1);
+
+  auto local = topology.cpus_on_node(0);
+  auto remote = topology.cpus_on_node(peer_node);
+  // Prefer a distinct CPU so the bounce actually crosses cores
+  u32 peer_cpu = remote.size() > 1 || remote[0] != local[0] ? remote.back()
+                                                             : remote[0];
+
+  AffinityGuard guard;
+  pin_this_thread(local[0], 0);
+
+  alignas(64) std::atomic<u64> line{0};
+  std::atomic<bool> stop{false};
+
+  std::thread peer([&]() {
+    pin_this_thread(peer_cpu, peer_node);
+    u64 seen = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+      u64 value = line.load(std::memory_order_acquire);
+      if (value != seen && value % 2 == 1) {
+        seen = value + 1;
+        line.store(seen, std::memory_order_release);
+      }
+    }
+  });
+
+  u64 value = 0;
+  for (auto _ : state) {
+    line.store(++value, std::memory_order_release);
+    while (line.load(std::memory_order_acquire) != value + 1)
+      std::this_thread::yield();
+    value++;
+  }
+
+  stop = true;
+  peer.join();
+  state.counters["remote"] = peer_node != 0;
+}
+
+BENCHMARK(BM_NodeCacheLineBounce)
+    ->Apply([](benchmark::internal::Benchmark *bench) {
+      auto topology = Topology::discover();
+      for (u32 node = 0; node < topology.num_nodes; node++)
+        if (!topology.cpus_on_node(node).empty())
+          bench->Args({0, node});
+    });
@@ -1,2 +1,4 @@
 #include "bytes/buffer.hpp"
 #include "bytes/bytestream.hpp"
+#include "bytes/chain.hpp"
+#include "bytes/packet_buffer.hpp"
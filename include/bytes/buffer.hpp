@@ -2,58 +2,146 @@
 
 #include <memory>
 #include <optional>
+#include <span>
+#include <utility>
+#include <vector>
 
+#include "../concurrency/topology.hpp"
 #include "defs.hpp"
+#include "pool.hpp"
 
 namespace toad {
 
-/// @brief Shared thread-safe lock-free buffer of bytes.
+/// @brief Tag for the constructor that skips zeroing the bytes.
+struct Uninitialized {};
+constexpr Uninitialized uninitialized;
+
+/// @brief Shared thread-safe lock-free buffer of bytes. Backed by a pooled
+/// chunk with the reference count in its header, see `pool.hpp`.
 struct Buffer {
-  std::shared_ptr<u8[]> _shared;
+  BufferHeader *_header;
   sz _offset, _size;
 
-  Buffer() : _shared{}, _offset(0), _size(0) {}
+  Buffer() : _header(nullptr), _offset(0), _size(0) {}
+
+  Buffer(const Buffer &buf)
+      : _header(buf._header), _offset(buf._offset), _size(buf._size) {
+    if (_header)
+      _header->retain();
+  }
+
+  Buffer &operator=(const Buffer &buf) {
+    if (buf._header)
+      buf._header->retain();
+    _drop();
+    _header = buf._header;
+    _offset = buf._offset;
+    _size = buf._size;
+    return *this;
+  }
+
+  Buffer(Buffer &&buf)
+      : _header(std::exchange(buf._header, nullptr)), _offset(buf._offset),
+        _size(buf._size) {}
 
-  Buffer(const Buffer &buf) = default;
-  Buffer &operator=(const Buffer &buf) = default;
+  Buffer &operator=(Buffer &&buf) {
+    if (this == &buf)
+      return *this;
 
-  Buffer(Buffer &&buf) = default;
-  Buffer &operator=(Buffer &&buf) = default;
+    _drop();
+    _header = std::exchange(buf._header, nullptr);
+    _offset = buf._offset;
+    _size = buf._size;
+    return *this;
+  }
 
   template <sz size>
   explicit Buffer(std::span<u8, size> span)
-      : _shared(std::shared_ptr<u8[]>(new u8[span.size()])), _size(span.size()),
-        _offset(0) {
-    std::memcpy(_shared.get(), span.data(), span.size());
+      : Buffer(span.size(), uninitialized) {
+    std::memcpy(data(), span.data(), span.size());
   }
 
+  /// @brief Takes ownership of memory allocated with `new u8[]`.
   explicit Buffer(u8 *ptr, sz size)
-      : _shared(std::shared_ptr<u8[]>(ptr)), _size(size), _offset(0) {}
+      : _header(new BufferHeader()), _offset(0), _size(size) {
+    _header->data = ptr;
+    _header->capacity = size;
+    _header->release = [](BufferHeader *header) {
+      delete[] header->data;
+      delete header;
+    };
+  }
 
-  explicit Buffer(sz size)
-      : _shared(std::shared_ptr<u8[]>(new u8[size])), _size(size), _offset(0) {
+  explicit Buffer(sz size) : Buffer(size, uninitialized) {
     std::memset(data(), 0, size);
   }
 
+  /// @brief For buffers that are about to be overwritten anyway, e.g. read
+  /// targets.
+  Buffer(sz size, Uninitialized)
+      : _header(allocate_buffer(size)), _offset(0), _size(size) {}
+
   Buffer(const std::vector<u8> &vec, std::optional<sz> size = std::nullopt)
-      : _size(size.value_or(vec.size())), _offset(0) {
-    _shared = std::shared_ptr<u8[]>{new u8[this->_size]};
+      : Buffer(size.value_or(vec.size()), uninitialized) {
     std::memcpy(data(), vec.data(), this->_size);
   }
 
-  u8 *data() const { return _shared.get() + _offset; }
+  ~Buffer() { _drop(); }
+
+  void _drop() {
+    if (_header)
+      _header->drop();
+    _header = nullptr;
+  }
+
+  /// @brief Allocates a zeroed buffer whose pages live on the given NUMA node.
+  /// Meant for long-lived buffers, every call is an `mmap`.
+  static auto on_node(sz size, u32 node = this_thread_node()) -> Buffer {
+    Buffer buffer;
+    u8 *ptr = (u8 *)node_local_alloc(size, node);
+    ASSERT(ptr != nullptr, "Failed to allocate {} bytes on node {}", size,
+           node);
+
+    buffer._header = new BufferHeader();
+    buffer._header->data = ptr;
+    buffer._header->capacity = size;
+    buffer._header->release = [](BufferHeader *header) {
+      node_local_free(header->data, header->capacity);
+      delete header;
+    };
+    buffer._size = size;
+    return buffer;
+  }
+
+  u8 *data() const { return _header ? _header->data + _offset : nullptr; }
   auto size() const -> sz { return _size; }
+  /// @brief Bytes of the chunk behind the buffer, which a slice of it keeps
+  /// alive as a whole.
+  auto capacity() const -> sz { return _header ? _header->capacity : 0; }
+  auto span() const -> std::span<u8> { return {data(), _size}; }
   auto operator[](sz idx) -> u8 & { return data()[idx]; }
   auto operator[](sz idx) const -> const u8 & { return data()[idx]; }
 
-  auto slice(sz length) -> Buffer { return slice(0, length); }
+  auto slice(sz length) const & -> Buffer { return slice(0, length); }
+  auto slice(sz length) && -> Buffer {
+    return std::move(*this).slice(0, length);
+  }
 
-  auto slice(sz from, sz to) -> Buffer {
+  auto slice(sz from, sz to) const & -> Buffer {
     Buffer slice = *this;
     slice._offset = slice._offset + from;
     slice._size = to - from;
     return slice;
   }
+
+  /// @brief Narrows a temporary in place, without touching the reference
+  /// count.
+  auto slice(sz from, sz to) && -> Buffer {
+    Buffer slice = std::move(*this);
+    slice._offset = slice._offset + from;
+    slice._size = to - from;
+    return slice;
+  }
 };
 
 } // namespace toad
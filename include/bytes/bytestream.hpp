@@ -1,5 +1,9 @@
 #pragma once
 
+#include <optional>
+#include <span>
+#include <type_traits>
+
 #include "buffer.hpp"
 
 namespace toad {
@@ -7,6 +11,8 @@ namespace toad {
 enum struct ByteStreamErrorCode {
   Ok,
   NotEnoughData,
+  /// @brief The bytes are there, but a header describes itself impossibly
+  Malformed,
 };
 
 template <typename B>
@@ -16,6 +22,17 @@ concept ByteBuffer = requires(B buffer, sz idx) {
   { buffer[idx] } -> std::same_as<u8 &>;
 };
 
+/// @brief What packet parsers read from, a `ByteIStream` over one buffer or
+/// a `ChainIStream` over a rope of them.
+template <typename S>
+concept ByteReader = requires(S stream, sz size, Buffer *out) {
+  { stream.remaining() } -> std::same_as<sz>;
+  { stream.read_header(size) } -> std::same_as<const u8 *>;
+  { stream.read_buffer(out) } -> std::same_as<S &>;
+  { stream.skip(size) } -> std::same_as<S &>;
+  { stream.errc } -> std::convertible_to<ByteStreamErrorCode>;
+};
+
 // NOTE(Artur): one might think that this works with a forward iterator, but
 // this is a convenience structure for interacting with an underlying buffer
 // that is being dynammicaly pushed into. Hence, if it was to use a
@@ -82,10 +99,49 @@ template <ByteBuffer B> struct ByteIStream {
     return *this;
   }
 
-  [[deprecated("No implementation currently exists. Needs to be "
-               "filled in.")]]
-  auto read_buffer(Buffer *buffer) -> ByteIStream & {
-    ASSERT(false, ":C");
+  /// @brief Reads `count` bytes, everything remaining by default. When the
+  /// underlying buffer is a `Buffer` the result is a slice sharing its
+  /// allocation, so nested packets are decoded without copying.
+  auto read_buffer(Buffer *out, std::optional<sz> count = std::nullopt)
+      -> ByteIStream & {
+    sz size = count.value_or(remaining());
+    if (cursor + size <= buffer.size()) {
+      if constexpr (std::is_same_v<B, Buffer>)
+        *out = buffer.slice(cursor, cursor + size);
+      else
+        *out = Buffer(std::span<u8>(buffer.data() + cursor, size));
+      cursor += size;
+    } else {
+      errc = ByteStreamErrorCode::NotEnoughData;
+      last_size = size;
+    }
+
+    return *this;
+  }
+
+  /// @brief Bounds checks a whole fixed size header at once.
+  /// @return Pointer to its first byte or `nullptr` if there is not enough
+  /// data, the cursor is moved past it
+  auto read_header(sz size) -> const u8 * {
+    if (cursor + size <= buffer.size()) {
+      const u8 *header = buffer.data() + cursor;
+      cursor += size;
+      return header;
+    }
+
+    errc = ByteStreamErrorCode::NotEnoughData;
+    last_size = size;
+    return nullptr;
+  }
+
+  auto skip(sz count) -> ByteIStream & {
+    if (cursor + count <= buffer.size()) {
+      cursor += count;
+    } else {
+      errc = ByteStreamErrorCode::NotEnoughData;
+      last_size = count;
+    }
+
     return *this;
   }
 };
@@ -141,6 +197,20 @@ template <ByteBuffer B> struct ByteOStream {
     return *this;
   }
 
+  /// @brief Reserves a whole fixed size header at once.
+  /// @return Pointer to its first byte or `nullptr` if there is no room, the
+  /// cursor is moved past it
+  auto write_header(sz size) -> u8 * {
+    if (cursor + size <= buffer.size()) {
+      u8 *header = buffer.data() + cursor;
+      cursor += size;
+      return header;
+    }
+
+    errc = ByteStreamErrorCode::NotEnoughData;
+    return nullptr;
+  }
+
   auto write_buffer(const Buffer &buf) -> ByteOStream & {
     if (cursor + buf._size <= buffer.size()) {
       std::memcpy(buffer.data() + cursor, buf.data(), buf._size);
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <array>
+#include <climits>
+#include <deque>
+#include <optional>
+#include <sys/uio.h>
+#include <vector>
+
+#include "buffer.hpp"
+#include "bytestream.hpp"
+#include "defs.hpp"
+
+namespace toad {
+
+/// @brief A rope of `Buffer` slices, read and written as if it was one
+/// contiguous buffer. Appending, prepending and splitting only move slices
+/// around, the bytes are never copied unless asked to with `linearize`.
+struct BufferChain {
+  std::deque<Buffer> _chunks;
+  sz _size = 0;
+
+  BufferChain() {}
+
+  BufferChain(Buffer buffer) { append(std::move(buffer)); }
+
+  auto size() const -> sz { return _size; }
+  bool empty() const { return _size == 0; }
+  auto chunks() const -> const std::deque<Buffer> & { return _chunks; }
+
+  void append(Buffer buffer) {
+    if (buffer.size() == 0)
+      return;
+    _size += buffer.size();
+    _chunks.push_back(std::move(buffer));
+  }
+
+  void append(BufferChain &&chain) {
+    for (auto &chunk : chain._chunks)
+      append(std::move(chunk));
+    chain.clear();
+  }
+
+  void prepend(Buffer buffer) {
+    if (buffer.size() == 0)
+      return;
+    _size += buffer.size();
+    _chunks.push_front(std::move(buffer));
+  }
+
+  void prepend(BufferChain &&chain) {
+    for (auto it = chain._chunks.rbegin(); it != chain._chunks.rend(); it++)
+      prepend(std::move(*it));
+    chain.clear();
+  }
+
+  void clear() {
+    _chunks.clear();
+    _size = 0;
+  }
+
+  /// @brief Takes the first `length` bytes off into a chain of their own. A
+  /// chunk straddling the split point is sliced in two.
+  auto split(sz length) -> BufferChain {
+    ASSERT(length <= _size, "Can not split {} bytes off a chain of {}", length,
+           _size);
+
+    BufferChain front;
+    while (length > 0) {
+      Buffer &chunk = _chunks.front();
+      if (chunk.size() <= length) {
+        length -= chunk.size();
+        _size -= chunk.size();
+        front.append(std::move(chunk));
+        _chunks.pop_front();
+      } else {
+        front.append(chunk.slice(length));
+        chunk = std::move(chunk).slice(length, chunk.size());
+        _size -= length;
+        length = 0;
+      }
+    }
+
+    return front;
+  }
+
+  /// @brief Drops the first `length` bytes.
+  void trim_front(sz length) { split(length); }
+
+  /// @brief Describes the chain for `readv`/`writev`. The chain must outlive
+  /// the vectored operation. Only the first `max_chunks` chunks are
+  /// described, the kernel refuses more than `IOV_MAX` at once, so longer
+  /// chains go out as a series of short writes.
+  auto to_iovec(sz max_chunks = IOV_MAX) const -> std::vector<struct iovec> {
+    std::vector<struct iovec> iov;
+    iov.reserve(std::min(_chunks.size(), max_chunks));
+    for (auto &chunk : _chunks) {
+      if (iov.size() == max_chunks)
+        break;
+      iov.push_back({chunk.data(), chunk.size()});
+    }
+    return iov;
+  }
+
+  /// @brief Copies everything into one contiguous buffer. A single chunk is
+  /// returned as is.
+  auto linearize() const -> Buffer {
+    if (_chunks.size() == 1)
+      return _chunks.front();
+
+    Buffer buffer(_size, uninitialized);
+    sz offset = 0;
+    for (auto &chunk : _chunks) {
+      std::memcpy(buffer.data() + offset, chunk.data(), chunk.size());
+      offset += chunk.size();
+    }
+    return buffer;
+  }
+};
+
+/// @brief Largest header `ChainIStream::read_header` assembles out of
+/// several chunks, an IPv4 or TCP header with every option.
+constexpr sz CHAIN_MAX_HEADER = 60;
+
+/// @brief `ByteIStream` over a `BufferChain`. Fields straddling a chunk
+/// boundary are assembled byte by byte, everything else is read in place.
+struct ChainIStream {
+  const BufferChain &chain;
+  /// @brief Chunk the cursor is in and the offset into it
+  sz _chunk = 0, _offset = 0;
+  sz cursor = 0, last_size = 0;
+  ByteStreamErrorCode errc = ByteStreamErrorCode::Ok;
+  /// @brief Where a header straddling a chunk boundary is copied to
+  std::array<u8, CHAIN_MAX_HEADER> _bounce;
+
+  ChainIStream(const BufferChain &chain) : chain(chain) {}
+
+  sz remaining() { return chain.size() - cursor; }
+
+  /// @brief Bytes readable in place before the next chunk boundary.
+  auto _contiguous() const -> sz {
+    if (_chunk >= chain._chunks.size())
+      return 0;
+    return chain._chunks[_chunk].size() - _offset;
+  }
+
+  auto _here() const -> const u8 * {
+    return chain._chunks[_chunk].data() + _offset;
+  }
+
+  void _advance(sz length) {
+    cursor += length;
+    _offset += length;
+    while (_chunk < chain._chunks.size() &&
+           _offset >= chain._chunks[_chunk].size()) {
+      _offset -= chain._chunks[_chunk].size();
+      _chunk++;
+    }
+  }
+
+  bool _check(sz length) {
+    if (errc == ByteStreamErrorCode::Ok && length <= remaining())
+      return true;
+
+    errc = ByteStreamErrorCode::NotEnoughData;
+    last_size = length;
+    return false;
+  }
+
+  void _copy(u8 *out, sz length) {
+    while (length > 0) {
+      sz n = std::min(length, _contiguous());
+      std::memcpy(out, _here(), n);
+      out += n;
+      length -= n;
+      _advance(n);
+    }
+  }
+
+  auto read_u8(u8 *out) -> ChainIStream & {
+    if (_check(1))
+      _copy(out, 1);
+    return *this;
+  }
+
+  auto read_u16(u16 *out) -> ChainIStream & {
+    if (_check(2)) {
+      std::array<u8, 2> bytes;
+      _copy(bytes.data(), 2);
+      *out = (bytes[0] << 8) | bytes[1];
+    }
+    return *this;
+  }
+
+  template <sz size>
+  auto read_array(std::array<u8, size> *out) -> ChainIStream & {
+    if (_check(size))
+      _copy(out->data(), size);
+    return *this;
+  }
+
+  auto read_vector(std::vector<u8> *vec, std::optional<sz> count = std::nullopt)
+      -> ChainIStream & {
+    sz size = count.value_or(vec->size());
+    if (_check(size)) {
+      vec->resize(size);
+      _copy(vec->data(), size);
+    }
+    return *this;
+  }
+
+  /// @brief A slice if the bytes are all in one chunk, a copy otherwise. Use
+  /// `read_chain` to never copy.
+  auto read_buffer(Buffer *out, std::optional<sz> count = std::nullopt)
+      -> ChainIStream & {
+    sz size = count.value_or(remaining());
+    if (!_check(size))
+      return *this;
+
+    if (size <= _contiguous()) {
+      *out = chain._chunks[_chunk].slice(_offset, _offset + size);
+      _advance(size);
+    } else {
+      *out = Buffer(size, uninitialized);
+      _copy(out->data(), size);
+    }
+    return *this;
+  }
+
+  auto read_chain(BufferChain *out, std::optional<sz> count = std::nullopt)
+      -> ChainIStream & {
+    sz size = count.value_or(remaining());
+    if (!_check(size))
+      return *this;
+
+    *out = BufferChain();
+    while (size > 0) {
+      sz n = std::min(size, _contiguous());
+      out->append(chain._chunks[_chunk].slice(_offset, _offset + n));
+      size -= n;
+      _advance(n);
+    }
+    return *this;
+  }
+
+  /// @brief Bounds checks a whole fixed size header at once. A header in one
+  /// chunk is read in place, one straddling chunks is copied out first.
+  /// @return Pointer to its first byte or `nullptr` if there is not enough
+  /// data, the cursor is moved past it
+  /// NOTE: a copied header is only valid until the next `read_header`
+  auto read_header(sz size) -> const u8 * {
+    ASSERT(size <= CHAIN_MAX_HEADER, "Headers of {} bytes are not supported",
+           size);
+    if (!_check(size))
+      return nullptr;
+
+    if (size <= _contiguous()) {
+      const u8 *header = _here();
+      _advance(size);
+      return header;
+    }
+
+    _copy(_bounce.data(), size);
+    return _bounce.data();
+  }
+
+  auto skip(sz count) -> ChainIStream & {
+    if (_check(count))
+      _advance(count);
+    return *this;
+  }
+};
+
+} // namespace toad
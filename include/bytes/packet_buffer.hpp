@@ -0,0 +1,103 @@
+#pragma once
+
+#include <span>
+
+#include "buffer.hpp"
+#include "defs.hpp"
+
+namespace toad {
+
+/// @brief Enough room in front of a payload for Ethernet, an IP header with
+/// the maximum amount of options and a transport header.
+constexpr sz PACKET_DEFAULT_HEADROOM = 128;
+
+/// @brief A window into a `Buffer` chunk that can grow in both directions,
+/// like an `sk_buff` or an `rte_mbuf`. The payload is written once and every
+/// layer below prepends its header into the headroom in front of it, so
+/// nothing is moved or copied on the way down.
+///
+///   [ headroom | data | tailroom ]
+///   ^chunk     ^head  ^tail      ^capacity
+struct PacketBuffer {
+  /// @brief The whole chunk, from its first to its last byte
+  Buffer _chunk;
+  sz _head = 0, _tail = 0;
+
+  PacketBuffer() {}
+
+  /// @brief An empty packet with `headroom` bytes reserved in front of it.
+  PacketBuffer(sz capacity, sz headroom = PACKET_DEFAULT_HEADROOM)
+      : _chunk(headroom + capacity, uninitialized), _head(headroom),
+        _tail(headroom) {}
+
+  /// @brief Adopts the chunk a buffer is a slice of. Whatever precedes the
+  /// slice in the chunk becomes headroom, so a payload sliced out of a
+  /// received frame can get its headers back in place.
+  /// SAFETY: the headroom and the tailroom may still be visible through
+  /// other slices of the chunk. Pushing overwrites them, which is what is
+  /// wanted when answering a packet, but nothing else should read them.
+  explicit PacketBuffer(const Buffer &buffer)
+      : _head(buffer._offset), _tail(buffer._offset + buffer._size) {
+    _chunk = buffer;
+    if (_chunk._header) {
+      _chunk._offset = 0;
+      _chunk._size = _chunk._header->capacity;
+    }
+  }
+
+  u8 *data() const { return _chunk.data() + _head; }
+  auto size() const -> sz { return _tail - _head; }
+  auto headroom() const -> sz { return _head; }
+  auto tailroom() const -> sz { return _chunk.size() - _tail; }
+
+  auto span() const -> std::span<u8> { return {data(), size()}; }
+
+  /// @brief The data as a slice sharing the chunk.
+  auto view() const -> Buffer { return _chunk.slice(_head, _tail); }
+
+  /// @brief Prepends `length` bytes and returns a pointer to them.
+  auto push(sz length) -> u8 * {
+    if (length > headroom())
+      reserve_headroom(length + PACKET_DEFAULT_HEADROOM);
+
+    _head -= length;
+    return data();
+  }
+
+  /// @brief Appends `length` bytes and returns a pointer to them.
+  auto put(sz length) -> u8 * {
+    ASSERT(length <= tailroom(), "Not enough tailroom, {} < {}", tailroom(),
+           length);
+    u8 *tail = _chunk.data() + _tail;
+    _tail += length;
+    return tail;
+  }
+
+  /// @brief Strips `length` bytes off the front, returns the new front.
+  auto pull(sz length) -> u8 * {
+    ASSERT(length <= size(), "Can not pull {} bytes out of {}", length,
+           size());
+    _head += length;
+    return data();
+  }
+
+  /// @brief Cuts the data down to `length` bytes.
+  void trim(sz length) {
+    if (length < size())
+      _tail = _head + length;
+  }
+
+  /// @brief Makes sure at least `length` bytes can be pushed. This is the
+  /// only path that copies, taken when a payload was built without headroom.
+  void reserve_headroom(sz length) {
+    if (length <= headroom())
+      return;
+
+    PacketBuffer grown(size() + tailroom(), length);
+    if (size() > 0)
+      std::memcpy(grown.put(size()), data(), size());
+    *this = std::move(grown);
+  }
+};
+
+} // namespace toad
@@ -0,0 +1,391 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <mutex>
+#include <sys/mman.h>
+#include <vector>
+
+#include "../concurrency/topology.hpp"
+#include "defs.hpp"
+
+namespace toad {
+
+struct BufferArena;
+
+/// @brief Sits in front of the bytes of every `Buffer` allocation and holds
+/// the reference count inline, so there is no separate control block.
+///
+/// NOTE: the count is biased (Choi et al., "Biased Reference Counting",
+/// PACT'18). Packets are mostly sliced and dropped by the thread that
+/// allocated them, so the owning thread of a pooled chunk counts its
+/// references in `biased` with plain arithmetic and only every other thread
+/// pays for atomics on `shared`. Once the owner drops its last reference the
+/// two are merged and everything goes through `shared` from then on. When
+/// `shared` goes negative before that, the chunk is queued for the owner to
+/// merge, since only the owner knows whether references remain.
+struct alignas(64) BufferHeader {
+  static constexpr ssz MERGED = 1;
+  static constexpr ssz QUEUED = 2;
+  static constexpr ssz SHARED_ONE = 4;
+
+  /// @brief Arena of the thread counting in `biased`, `nullptr` once merged
+  std::atomic<BufferArena *> biased_to = nullptr;
+  u32 biased = 0;
+  /// @brief References of all the other threads in units of `SHARED_ONE`,
+  /// with `MERGED` and `QUEUED` in the low bits
+  std::atomic<ssz> shared = SHARED_ONE | MERGED;
+
+  u8 size_class = 0;
+  /// @brief Arena the chunk was carved from, `nullptr` if not pooled
+  BufferArena *arena = nullptr;
+  /// @brief Link in the arena's free lists or its merge queue
+  BufferHeader *next = nullptr;
+
+  u8 *data = nullptr;
+  sz capacity = 0;
+  /// @brief Called once the last reference is gone
+  void (*release)(BufferHeader *) = nullptr;
+
+  inline bool _owned_here() const;
+  inline void retain();
+  inline void drop();
+  /// @brief Folds `biased` into `shared`, owner only.
+  inline void _merge();
+  /// @brief Like `_merge`, but leaves a chunk that is queued for merging
+  /// already to the queue, owner only.
+  inline void _merge_unless_queued();
+
+  /// @brief Approximate amount of references, exact on the owning thread
+  /// when nobody else is touching the chunk.
+  auto references() const -> ssz {
+    return biased + (shared.load(std::memory_order_relaxed) >> 2);
+  }
+};
+
+/// @brief Chunks of a size class hold `64 << class` bytes after the header.
+/// The largest class fits a 64 KiB GSO super-frame behind its virtio header.
+constexpr sz BUFFER_SIZE_CLASSES = 12;
+constexpr sz BUFFER_MIN_CHUNK = 64;
+constexpr sz BUFFER_MAX_CHUNK = BUFFER_MIN_CHUNK << (BUFFER_SIZE_CLASSES - 1);
+/// @brief Every slab is carved into equally sized chunks of one class.
+constexpr sz BUFFER_SLAB_SIZE = 256 << 10;
+
+constexpr auto buffer_size_class(sz size) -> u8 {
+  if (size <= BUFFER_MIN_CHUNK)
+    return 0;
+  return std::bit_width(size - 1) - std::bit_width(BUFFER_MIN_CHUNK - 1);
+}
+
+constexpr auto buffer_class_size(u8 size_class) -> sz {
+  return BUFFER_MIN_CHUNK << size_class;
+}
+
+/// @brief Per-thread pool of buffer chunks. Only the owning thread allocates
+/// and frees into the local lists. Other threads push what they free onto a
+/// lock-free stack that the owner takes over wholesale when it runs dry. The
+/// arena of an exited thread is adopted by the next thread that needs one, so
+/// chunks freed after their owner is gone are not lost. Chunks queued for
+/// merging are taken back whenever the owner allocates or drops a chunk of
+/// its own, and all at once when it exits.
+struct BufferArena {
+  std::array<BufferHeader *, BUFFER_SIZE_CLASSES> _free = {};
+  std::array<std::atomic<BufferHeader *>, BUFFER_SIZE_CLASSES> _remote_free =
+      {};
+  std::vector<std::pair<void *, sz>> _slabs;
+
+  std::atomic<bool> orphaned = false;
+
+  BufferArena() {}
+
+  BufferArena(const BufferArena &) = delete;
+  BufferArena &operator=(const BufferArena &) = delete;
+
+  /// @brief Chunks whose shared count went negative, waiting for the owner
+  /// to merge them
+  std::atomic<BufferHeader *> _merge_queue = nullptr;
+
+  auto allocate(u8 size_class) -> BufferHeader * {
+    if (_merge_queue.load(std::memory_order_relaxed))
+      _drain_merge_queue();
+
+    BufferHeader *chunk = _free[size_class];
+    if (!chunk) {
+      // SAFETY: only the owner ever takes from the remote stack, and it takes
+      // all of it at once, so popping is free of ABA.
+      chunk = _remote_free[size_class].exchange(nullptr,
+                                                std::memory_order_acquire);
+      if (!chunk)
+        chunk = _carve(size_class);
+      if (!chunk)
+        return nullptr;
+    }
+
+    _free[size_class] = chunk->next;
+    chunk->next = nullptr;
+    chunk->biased_to.store(this, std::memory_order_relaxed);
+    chunk->biased = 1;
+    chunk->shared.store(0, std::memory_order_relaxed);
+    return chunk;
+  }
+
+  void _drain_merge_queue() {
+    BufferHeader *chunk =
+        _merge_queue.exchange(nullptr, std::memory_order_acquire);
+    while (chunk) {
+      // Merging may free the chunk, which reuses the link
+      BufferHeader *next = chunk->next;
+      chunk->_merge();
+      chunk = next;
+    }
+  }
+
+  /// @brief Merges every chunk the exiting owner still counts references of,
+  /// so their last references may go anywhere without waiting for a thread
+  /// to adopt the arena.
+  void _unbias() {
+    _drain_merge_queue();
+    for (auto [slab, slab_size] : _slabs) {
+      u8 size_class = ((BufferHeader *)slab)->size_class;
+      sz stride = sizeof(BufferHeader) + buffer_class_size(size_class);
+      for (sz offset = 0; offset + stride <= slab_size; offset += stride) {
+        auto *chunk = (BufferHeader *)((u8 *)slab + offset);
+        if (chunk->biased_to.load(std::memory_order_relaxed) == this)
+          chunk->_merge_unless_queued();
+      }
+    }
+  }
+
+  void free_local(BufferHeader *chunk) {
+    chunk->next = _free[chunk->size_class];
+    _free[chunk->size_class] = chunk;
+  }
+
+  static void _push(std::atomic<BufferHeader *> &head, BufferHeader *chunk) {
+    chunk->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(chunk->next, chunk,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed))
+      ;
+  }
+
+  void free_remote(BufferHeader *chunk) {
+    _push(_remote_free[chunk->size_class], chunk);
+  }
+
+  /// @brief Queues a chunk for the owner to merge. An orphaned arena has no
+  /// owner left to do it, so the caller merges what is queued itself.
+  void queue_merge(BufferHeader *chunk) {
+    _push(_merge_queue, chunk);
+    // SAFETY: pairs with the fence after the exiting owner publishes
+    // `orphaned`, either its last drain sees the chunk or this load sees it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (orphaned.load(std::memory_order_relaxed)) [[unlikely]]
+      _drain_merge_queue();
+  }
+
+  /// @brief Splits a fresh slab into chunks and threads them into the free
+  /// list. Slabs are bound to the node of the thread if it was pinned.
+  auto _carve(u8 size_class) -> BufferHeader * {
+    sz stride = sizeof(BufferHeader) + buffer_class_size(size_class);
+    sz slab_size = std::max(BUFFER_SLAB_SIZE, stride);
+
+    void *slab;
+    if (_this_thread_node) {
+      slab = node_local_alloc(slab_size, *_this_thread_node);
+    } else {
+      slab = mmap(nullptr, slab_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      slab = slab == MAP_FAILED ? nullptr : slab;
+    }
+    if (!slab)
+      return nullptr;
+    _slabs.emplace_back(slab, slab_size);
+
+    BufferHeader *head = nullptr;
+    for (sz offset = slab_size / stride * stride; offset > 0;) {
+      offset -= stride;
+      auto *chunk = new ((u8 *)slab + offset) BufferHeader();
+      chunk->size_class = size_class;
+      chunk->arena = this;
+      chunk->data = (u8 *)(chunk + 1);
+      chunk->capacity = buffer_class_size(size_class);
+      chunk->release = &BufferArena::_release;
+      chunk->next = head;
+      head = chunk;
+    }
+
+    return head;
+  }
+
+  static void _release(BufferHeader *chunk);
+};
+
+/// @brief Owns every arena ever created. Arenas are never freed, their count
+/// is bounded by the peak amount of threads.
+struct BufferArenaRegistry {
+  std::mutex _mutex;
+  std::vector<std::unique_ptr<BufferArena>> _arenas;
+
+  static auto instance() -> BufferArenaRegistry & {
+    // NOTE: leaked on purpose, buffers held by globals are freed during static
+    // destruction and still need their arena.
+    static auto *registry = new BufferArenaRegistry();
+    return *registry;
+  }
+
+  /// @brief Adopts an orphaned arena if there is one, creates one otherwise.
+  auto acquire() -> BufferArena * {
+    std::lock_guard guard(_mutex);
+    for (auto &arena : _arenas) {
+      bool expected = true;
+      if (arena->orphaned.compare_exchange_strong(expected, false))
+        return arena.get();
+    }
+
+    return _arenas.emplace_back(std::make_unique<BufferArena>()).get();
+  }
+};
+
+thread_local BufferArena *_this_buffer_arena = nullptr;
+/// @brief Set once the thread has given up its arena while exiting.
+thread_local bool _this_buffer_arena_gone = false;
+
+/// @brief The calling thread's arena, acquired on first use and orphaned when
+/// the thread exits.
+auto this_buffer_arena() -> BufferArena & {
+  struct Holder {
+    BufferArena *arena = BufferArenaRegistry::instance().acquire();
+    ~Holder() {
+      arena->_unbias();
+      _this_buffer_arena = nullptr;
+      _this_buffer_arena_gone = true;
+      // A chunk marked `QUEUED` during the walk may be pushed after this
+      // drain, publishing `orphaned` first makes its dropper merge it
+      arena->orphaned.store(true, std::memory_order_release);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      arena->_drain_merge_queue();
+    }
+  };
+
+  if (!_this_buffer_arena) {
+    thread_local Holder holder;
+    _this_buffer_arena = holder.arena;
+  }
+
+  return *_this_buffer_arena;
+}
+
+bool BufferHeader::_owned_here() const {
+  BufferArena *owner = biased_to.load(std::memory_order_relaxed);
+  return owner != nullptr && owner == _this_buffer_arena;
+}
+
+void BufferHeader::retain() {
+  if (_owned_here())
+    biased++;
+  else
+    shared.fetch_add(SHARED_ONE, std::memory_order_relaxed);
+}
+
+void BufferHeader::drop() {
+  if (_owned_here()) {
+    BufferArena *owner = _this_buffer_arena;
+    if (--biased == 0) {
+      // The owner is done with it, whatever is left is counted in `shared`
+      biased_to.store(nullptr, std::memory_order_relaxed);
+      ssz previous = shared.fetch_or(MERGED, std::memory_order_acq_rel);
+      if ((previous >> 2) == 0 && !(previous & QUEUED))
+        release(this);
+    }
+
+    // An owner that stopped allocating still takes its chunks back
+    if (owner->_merge_queue.load(std::memory_order_relaxed)) [[unlikely]]
+      owner->_drain_merge_queue();
+    return;
+  }
+
+  ssz now = shared.fetch_sub(SHARED_ONE, std::memory_order_acq_rel) -
+            SHARED_ONE;
+  if (now & MERGED) {
+    if ((now >> 2) == 0 && !(now & QUEUED))
+      release(this);
+    return;
+  }
+
+  if ((now >> 2) >= 0)
+    return;
+
+  // More references were dropped here than taken, the rest are the owner's.
+  // Let the owner merge so the last one to go frees the chunk.
+  while (!(now & (QUEUED | MERGED)))
+    if (shared.compare_exchange_weak(now, now | QUEUED,
+                                     std::memory_order_acq_rel)) {
+      arena->queue_merge(this);
+      return;
+    }
+}
+
+void BufferHeader::_merge() {
+  ssz add = (ssz)biased * SHARED_ONE;
+  biased = 0;
+  biased_to.store(nullptr, std::memory_order_relaxed);
+
+  ssz current = shared.load(std::memory_order_relaxed);
+  ssz merged;
+  do {
+    merged = ((current + add) | MERGED) & ~QUEUED;
+  } while (!shared.compare_exchange_weak(current, merged,
+                                         std::memory_order_acq_rel));
+
+  if ((merged >> 2) == 0)
+    release(this);
+}
+
+void BufferHeader::_merge_unless_queued() {
+  ssz add = (ssz)biased * SHARED_ONE;
+  ssz current = shared.load(std::memory_order_relaxed);
+  ssz merged;
+  do {
+    if (current & QUEUED)
+      return;
+    merged = (current + add) | MERGED;
+  } while (!shared.compare_exchange_weak(current, merged,
+                                         std::memory_order_acq_rel));
+
+  biased = 0;
+  biased_to.store(nullptr, std::memory_order_relaxed);
+  if ((merged >> 2) == 0)
+    release(this);
+}
+
+void BufferArena::_release(BufferHeader *chunk) {
+  if (chunk->arena == _this_buffer_arena)
+    chunk->arena->free_local(chunk);
+  else
+    chunk->arena->free_remote(chunk);
+}
+
+/// @brief Allocates the header and `size` uninitialized bytes. Pooled up to
+/// `BUFFER_MAX_CHUNK`, straight from the heap above that.
+auto allocate_buffer(sz size) -> BufferHeader * {
+  if (size <= BUFFER_MAX_CHUNK && !_this_buffer_arena_gone) {
+    if (auto *chunk = this_buffer_arena().allocate(buffer_size_class(size)))
+      return chunk;
+  }
+
+  void *memory = ::operator new(sizeof(BufferHeader) + size,
+                                std::align_val_t(alignof(BufferHeader)));
+  auto *header = new (memory) BufferHeader();
+  header->data = (u8 *)(header + 1);
+  header->capacity = size;
+  header->release = [](BufferHeader *header) {
+    header->~BufferHeader();
+    ::operator delete(header, std::align_val_t(alignof(BufferHeader)));
+  };
+  return header;
+}
+
+} // namespace toad
@@ -2,7 +2,9 @@
 #include "concurrency/future.hpp"
 #include "concurrency/iocontext.hpp"
 #include "concurrency/join.hpp"
+#include "concurrency/metrics.hpp"
 #include "concurrency/notify.hpp"
 #include "concurrency/pending.hpp"
 #include "concurrency/ring.hpp"
 #include "concurrency/task.hpp"
+#include "concurrency/topology.hpp"
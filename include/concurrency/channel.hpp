@@ -0,0 +1,127 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <optional>
+
+#include "executor.hpp"
+
+namespace toad {
+
+/// @brief Bounded queue from any amount of producers to a single consumer
+/// coroutine, which suspends on `recv` while the queue is empty. Producers
+/// never block, a full channel refuses the value instead, like a NIC ring
+/// dropping frames when nobody keeps up.
+template <typename T> struct Channel {
+  std::mutex _mutex;
+  std::deque<T> _queue;
+  sz _capacity;
+  bool _closed = false;
+  /// @brief Set by `wake`, the next `recv` returns even with nothing queued
+  bool _woken = false;
+  /// @brief The consumer, while it is suspended on an empty channel
+  std::coroutine_handle<> _receiver = nullptr;
+
+  explicit Channel(sz capacity = 1024) : _capacity(capacity) {}
+
+  Channel(const Channel &) = delete;
+  Channel &operator=(const Channel &) = delete;
+
+  /// @return `false` if the channel is full or closed, the value is dropped
+  bool try_send(T value) {
+    std::coroutine_handle<> receiver;
+    {
+      std::lock_guard guard(_mutex);
+      if (_closed || _queue.size() >= _capacity)
+        return false;
+
+      _queue.push_back(std::move(value));
+      receiver = std::exchange(_receiver, nullptr);
+    }
+
+    if (receiver)
+      spawn(receiver);
+    return true;
+  }
+
+  /// @brief Further sends fail, the consumer still drains what is queued.
+  void close() {
+    std::coroutine_handle<> receiver;
+    {
+      std::lock_guard guard(_mutex);
+      _closed = true;
+      receiver = std::exchange(_receiver, nullptr);
+    }
+
+    if (receiver)
+      spawn(receiver);
+  }
+
+  /// @brief Resumes the consumer without a value, its `recv` returns
+  /// `std::nullopt` although the channel is still open. Lets whatever else
+  /// the consumer looks after, like its timers, get its attention.
+  void wake() {
+    std::coroutine_handle<> receiver;
+    {
+      std::lock_guard guard(_mutex);
+      _woken = true;
+      receiver = std::exchange(_receiver, nullptr);
+    }
+
+    if (receiver)
+      spawn(receiver);
+  }
+
+  bool closed() {
+    std::lock_guard guard(_mutex);
+    return _closed;
+  }
+
+  auto size() -> sz {
+    std::lock_guard guard(_mutex);
+    return _queue.size();
+  }
+
+  /// @brief Takes a value without waiting.
+  auto try_recv() -> std::optional<T> {
+    std::lock_guard guard(_mutex);
+    return _pop_locked();
+  }
+
+  auto _pop_locked() -> std::optional<T> {
+    if (_queue.empty())
+      return std::nullopt;
+
+    T value = std::move(_queue.front());
+    _queue.pop_front();
+    return value;
+  }
+
+  struct RecvAwaiter {
+    Channel &channel;
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      std::lock_guard guard(channel._mutex);
+      if (!channel._queue.empty() || channel._closed || channel._woken)
+        return false;
+
+      ASSERT(!channel._receiver, "A channel has a single consumer");
+      channel._receiver = handle;
+      return true;
+    }
+
+    auto await_resume() -> std::optional<T> {
+      std::lock_guard guard(channel._mutex);
+      channel._woken = false;
+      return channel._pop_locked();
+    }
+  };
+
+  /// @brief The next value, `std::nullopt` once the channel is closed and
+  /// drained, or after a `wake`.
+  auto recv() -> RecvAwaiter { return RecvAwaiter{*this}; }
+};
+
+} // namespace toad
@@ -1,10 +1,14 @@
 #pragma once
 
+#include <atomic>
 #include <deque>
+#include <span>
 #include <thread>
 
 #include "../defs.hpp"
+#include "metrics.hpp"
 #include "task.hpp"
+#include "topology.hpp"
 
 namespace toad {
 
@@ -20,43 +24,138 @@ auto this_executor() -> Executor & {
   return *_this_executor;
 }
 
+/// @brief Hint to the CPU that we are in a spin loop.
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+/// @brief Collects everything spawned from this thread while it is alive and
+/// hands it to the executor in one go when it goes out of scope. Nested
+/// batches fold into the outermost one.
+struct SpawnBatch;
+
+thread_local SpawnBatch *_this_spawn_batch = nullptr;
+
 struct Executor {
+  /// @brief How many times an idle worker polls the queue before parking.
+  static constexpr u32 SPIN_ITERATIONS = 128;
+
   std::vector<std::thread> _threads;
   std::deque<Task> _queue;
 
   std::mutex _mutex;
   std::condition_variable _condvar;
 
-  bool is_done = false;
-
-  Executor(sz num_threads = std::thread::hardware_concurrency()) {
-    _this_executor = this;
-    _threads.reserve(num_threads);
-    for (sz i = 0; i < num_threads; i++)
-      _threads.emplace_back([this]() { this->worker_thread(); });
+  // NOTE: the parking protocol follows Go and Tokio. A worker that runs out
+  // of work spins for a little while before it parks. A sleeping worker is
+  // only woken when nobody is spinning, and the woken worker is accounted as
+  // spinning until it finds work. When a spinner finds work it wakes the next
+  // sleeper if more is queued, so a burst of N tasks costs at most one wakeup
+  // per worker instead of one per task.
+  std::atomic<sz> _queued = 0;
+  std::atomic<u32> _spinning = 0;
+  std::atomic<u32> _sleeping = 0;
+  /// @brief Wakeups issued, but not yet claimed by a sleeping worker.
+  /// Guarded by `_mutex`.
+  u32 _wakeups = 0;
+  /// @brief Total amount of `notify_one`s issued, for diagnostics.
+  std::atomic<u64> _notifications = 0;
+
+  WorkerLayout _layout;
+
+  std::atomic<bool> is_done = false;
+
+  Executor(sz num_threads = std::thread::hardware_concurrency())
+      : Executor(WorkerLayout::unpinned(num_threads)) {}
+
+  /// @brief Starts one worker per entry of the layout, each pinned to its CPU
+  /// if the layout is pinned. The first executor created on a thread becomes
+  /// its `this_executor`.
+  explicit Executor(WorkerLayout layout) : _layout(std::move(layout)) {
+    if (!_this_executor)
+      _this_executor = this;
+    _threads.reserve(_layout.num_workers);
+    for (sz i = 0; i < _layout.num_workers; i++)
+      _threads.emplace_back([this, i]() {
+        _layout.pin_worker(i);
+        this->worker_thread();
+      });
   }
 
   void spawn(Task task) {
-    void *addr = task.handle_.address();
-    spdlog::debug("Spawning coroutine at address: {}", addr);
+    [[maybe_unused]] void *addr = task.handle_.address();
+    TOAD_DEBUG("Spawning coroutine at address: {}", addr);
 
-    // Inherit whatever coroutine spawned it
-    task.set_parent_corr_id(thread_correlation_id_);
+    _inherit(task);
 
     if (task.done()) {
-      spdlog::debug("Coroutine at {} already done, not spawning", addr);
+      TOAD_DEBUG("Coroutine at {} already done, not spawning", addr);
       return;
     }
 
+    task.promise().enqueued_ns = metrics::now_ns();
+    metrics::local().tasks_enqueued.add();
+
+    bool notify;
     {
       std::lock_guard lock(_mutex);
       _queue.emplace_back(std::move(task));
-      spdlog::debug("Added coroutine at {} to queue (queue size: {})", addr,
-                    _queue.size());
+      _queued.fetch_add(1, std::memory_order_seq_cst);
+      TOAD_DEBUG("Added coroutine at {} to queue (queue size: {})", addr,
+                 _queue.size());
+      notify = _claim_wakeup_locked();
     }
 
-    // Wake up one thread to go and pick the task up
-    _condvar.notify_one();
+    if (notify)
+      _notify_one();
+  }
+
+  /// @brief Enqueues every task under a single lock acquisition and wakes at
+  /// most one worker. The rest are woken in a chain as the work gets picked up.
+  void spawn_batch(std::span<Task> tasks) {
+    u64 enqueued_ns = metrics::now_ns();
+
+    bool notify;
+    {
+      std::lock_guard lock(_mutex);
+      sz added = 0;
+      for (auto &task : tasks) {
+        if (!task.handle_ || task.done())
+          continue;
+
+        _inherit(task);
+        task.promise().enqueued_ns = enqueued_ns;
+        _queue.emplace_back(std::move(task));
+        added++;
+      }
+
+      if (added == 0)
+        return;
+
+      metrics::local().tasks_enqueued.add(added);
+
+      _queued.fetch_add(added, std::memory_order_seq_cst);
+      TOAD_DEBUG("Added {} coroutines to queue (queue size: {})", added,
+                 _queue.size());
+      notify = _claim_wakeup_locked();
+    }
+
+    if (notify)
+      _notify_one();
+  }
+
+  /// @brief Inherit whatever coroutine spawned it. Only the first spawn
+  /// counts, rescheduling a suspended coroutine keeps its original parent.
+  static void _inherit(Task &task) {
+    auto &promise = task.promise();
+    if (promise.parent_corr_id == 0)
+      promise.parent_corr_id = thread_correlation_id_;
+    if (tracing::thread_traced_)
+      promise.traced = true;
   }
 
   Executor(const Executor &) = delete;
@@ -71,32 +170,178 @@ struct Executor {
     _condvar.notify_all();
     for (auto &thread : _threads)
       thread.join();
+
+    if (_this_executor == this)
+      _this_executor = nullptr;
+  }
+
+  /// @brief Decides whether a sleeping worker has to be woken for freshly
+  /// queued work. Must be called with `_mutex` held, right after pushing.
+  /// @return true if the caller must `_notify_one` after unlocking.
+  bool _claim_wakeup_locked() {
+    if (_spinning.load(std::memory_order_seq_cst) != 0)
+      return false;
+    if (_sleeping.load(std::memory_order_relaxed) <= _wakeups)
+      return false;
+
+    // The woken worker starts out spinning, so anything spawned before it
+    // gets scheduled does not wake anybody else.
+    _wakeups++;
+    _spinning.fetch_add(1, std::memory_order_seq_cst);
+    return true;
+  }
+
+  void _notify_one() {
+    _notifications.fetch_add(1, std::memory_order_relaxed);
+    metrics::local().wakeups.add();
+    _condvar.notify_one();
+  }
+
+  /// @brief Wakes another worker if there is queued work nobody is looking
+  /// for. Cheap when there is nothing to do, only locks if someone sleeps.
+  void _wake_one_if_needed() {
+    if (_queued.load(std::memory_order_seq_cst) == 0 ||
+        _spinning.load(std::memory_order_seq_cst) != 0 ||
+        _sleeping.load(std::memory_order_relaxed) == 0)
+      return;
+
+    bool notify;
+    {
+      std::lock_guard lock(_mutex);
+      notify = !_queue.empty() && _claim_wakeup_locked();
+    }
+
+    if (notify)
+      _notify_one();
+  }
+
+  bool _try_pop(Task &task) {
+    if (_queued.load(std::memory_order_relaxed) == 0)
+      return false;
+
+    std::lock_guard lock(_mutex);
+    return _pop_locked(task);
+  }
+
+  bool _pop_locked(Task &task) {
+    if (_queue.empty())
+      return false;
+
+    task = std::move(_queue.front());
+    _queue.pop_front();
+    _queued.fetch_sub(1, std::memory_order_relaxed);
+    metrics::local().tasks_dequeued.add();
+    return true;
+  }
+
+  bool _spin(Task &task) {
+    for (u32 i = 0; i < SPIN_ITERATIONS; i++) {
+      if (_try_pop(task)) {
+        metrics::local().spin_hits.add();
+        return true;
+      }
+
+      if (is_done)
+        return false;
+
+      if (i % 16 == 15)
+        std::this_thread::yield();
+      else
+        cpu_relax();
+    }
+
+    return false;
+  }
+
+  enum struct ParkResult { GotTask, Woken, Shutdown };
+
+  /// @brief Stops spinning and sleeps until there is work or the executor is
+  /// shutting down.
+  auto _park(Task &task) -> ParkResult {
+    _spinning.fetch_sub(1, std::memory_order_seq_cst);
+
+    std::unique_lock lock(_mutex);
+    // SAFETY: the queue is checked again under the lock after giving up the
+    // spinning slot, so a spawner that saw us spinning can not be missed.
+    if (_pop_locked(task))
+      return ParkResult::GotTask;
+    if (is_done)
+      return ParkResult::Shutdown;
+
+    metrics::local().parks.add();
+    _sleeping.fetch_add(1, std::memory_order_relaxed);
+    _condvar.wait(lock, [this] { return is_done || _wakeups > 0; });
+    _sleeping.fetch_sub(1, std::memory_order_relaxed);
+
+    if (_wakeups > 0) {
+      _wakeups--;
+      return ParkResult::Woken;
+    }
+
+    return _pop_locked(task) ? ParkResult::GotTask : ParkResult::Shutdown;
   }
 
   void worker_thread() {
     _this_executor = this;
+    auto &shard = metrics::local();
 
+    bool spinning = false;
     while (true) {
       Task task;
-      {
-        std::unique_lock lock(_mutex);
-        _condvar.wait(lock, [this] { return is_done || !_queue.empty(); });
 
-        if (is_done && _queue.empty())
-          break;
-        if (_queue.empty())
-          continue;
+      if (!_try_pop(task)) {
+        if (!spinning) {
+          spinning = true;
+          _spinning.fetch_add(1, std::memory_order_seq_cst);
+        }
+
+        if (!_spin(task)) {
+          spinning = false;
+          auto result = _park(task);
+          if (result == ParkResult::Shutdown)
+            break;
+          if (result == ParkResult::Woken) {
+            // The waker accounted us as spinning, go look for the work
+            spinning = true;
+            continue;
+          }
+        }
+      }
 
-        task = std::move(_queue.front());
-        _queue.pop_front();
+      if (spinning) {
+        spinning = false;
+        _spinning.fetch_sub(1, std::memory_order_seq_cst);
       }
 
+      // Pass the baton if there is more work than workers looking for it
+      _wake_one_if_needed();
+
       thread_parent_correlation_id_ = task.promise().parent_corr_id;
       thread_correlation_id_ = task.promise().corr_id;
+      tracing::thread_traced_ = task.promise().traced;
 
       if (!task.done()) {
+        u64 resumed_at = tracing::thread_traced_ ? tracing::now_ns()
+                                                 : metrics::now_ns();
+        if (resumed_at && task.promise().enqueued_ns)
+          shard.queue_wait_ns.record(resumed_at - task.promise().enqueued_ns);
+
         task.resume();
 
+        shard.tasks_run.add();
+        if (resumed_at)
+          shard.task_run_ns.record(tracing::now_ns() - resumed_at);
+
+        if (tracing::thread_traced_) {
+          tracing::tracer().record({resumed_at, tracing::now_ns(),
+                                    thread_correlation_id_,
+                                    thread_parent_correlation_id_,
+                                    tracing::this_thread_tid(),
+                                    tracing::EventKind::Run,
+                                    tracing::thread_awaiting_});
+          tracing::thread_awaiting_ = nullptr;
+        }
+
         // SAFETY(Artur): If the coroutine is done we know that nothing else
         // will ever reschedule it again, so we can simply own it and destroy.
         if (!task.done())
@@ -105,18 +350,73 @@ struct Executor {
 
       thread_correlation_id_ = 0;
       thread_parent_correlation_id_ = 0;
+      tracing::thread_traced_ = false;
     }
 
     _this_executor = nullptr;
   }
 };
 
-void spawn(Task task) { this_executor().spawn(std::move(task)); }
+struct SpawnBatch {
+  std::vector<Task> tasks;
+  SpawnBatch *_outer;
+
+  SpawnBatch() : _outer(_this_spawn_batch) {
+    if (!_outer)
+      _this_spawn_batch = this;
+  }
+
+  SpawnBatch(const SpawnBatch &) = delete;
+  SpawnBatch(SpawnBatch &&) = delete;
+
+  void flush() {
+    if (!tasks.empty())
+      this_executor().spawn_batch(tasks);
+    tasks.clear();
+  }
+
+  ~SpawnBatch() {
+    if (_outer)
+      return;
+
+    _this_spawn_batch = nullptr;
+    flush();
+  }
+};
+
+void spawn(Task task) {
+  if (_this_spawn_batch) {
+    Executor::_inherit(task);
+    _this_spawn_batch->tasks.emplace_back(std::move(task));
+    return;
+  }
+
+  this_executor().spawn(std::move(task));
+}
 
 void spawn(std::coroutine_handle<> coro) {
   spawn(Task(Handle::from_address(coro.address())));
 }
 
+void spawn_batch(std::span<Task> tasks) {
+  if (_this_spawn_batch) {
+    for (auto &task : tasks)
+      spawn(std::move(task));
+    return;
+  }
+
+  this_executor().spawn_batch(tasks);
+}
+
+void spawn_batch(std::span<const std::coroutine_handle<>> coros) {
+  if (coros.size() == 1)
+    return spawn(coros[0]);
+
+  SpawnBatch batch;
+  for (auto coro : coros)
+    spawn(coro);
+}
+
 auto suspend(int times = 1) {
   struct suspend_awaitable {
     int times = 0;
@@ -124,7 +424,7 @@ auto suspend(int times = 1) {
     bool await_ready() { return times == 0; };
     void await_resume() {};
     void await_suspend(Handle handle) {
-      spdlog::info("Suspended...");
+      TOAD_TRACE("Suspended...");
       times--;
       spawn(Task(handle));
     };
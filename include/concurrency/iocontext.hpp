@@ -1,6 +1,7 @@
 #pragma once
 
 #include <liburing.h>
+#include <mutex>
 #include <netinet/in.h>
 #include <span>
 #include <stdio.h>
@@ -12,10 +13,14 @@
 
 #include "../net/listener.hpp"
 #include "../net/socket.hpp"
+#include "../nic/capture.hpp"
 #include "../nic/ipv4.hpp"
 
 #include "future.hpp"
+#include "metrics.hpp"
 #include "pending.hpp"
+#include "topology.hpp"
+#include "trace.hpp"
 
 namespace toad {
 
@@ -23,6 +28,8 @@ struct IOContext;
 
 static IOContext *_this_io_context;
 
+static_assert(std::variant_size_v<PendingVariant> <= metrics::MAX_IO_KINDS);
+
 auto this_io_context() -> IOContext & { return *_this_io_context; }
 
 struct IOContext {
@@ -30,14 +37,51 @@ struct IOContext {
 
   u32 batch_size, timeout_ms;
 
+  /// @brief CPU (and its node) the thread running `event_loop` pins itself to
+  std::optional<u32> event_loop_cpu, event_loop_node;
+  /// @brief Set by `stop`, `event_loop` returns within `timeout_ms`
+  std::atomic<bool> _stopped = false;
+
+  /// @brief Guards the submission queue, workers submit while the event loop
+  /// resubmits and flushes, and liburing synchronizes neither
+  std::mutex _submit_mutex;
+  /// @brief Operations that found the submission queue full, in order. They
+  /// are prepared as soon as `_flush` has made room.
+  std::vector<Pending *> _deferred;
+
+  /// @brief The first context created becomes the default one returned by
+  /// `this_io_context`, others are only reachable through their references.
   IOContext(u32 batch_size = 64, u32 timeout_ms = 5)
       : batch_size(batch_size), timeout_ms(timeout_ms) {
-    _this_io_context = this;
+    if (!_this_io_context)
+      _this_io_context = this;
     if (io_uring_queue_init(batch_size, &_ring, 0) < 0) {
       ASSERT(false, "Failed to init iouring.");
     }
   }
 
+  /// @brief Wraps an operation about to be submitted. Operations are stamped
+  /// for the latency histogram, and for the trace of traced coroutines.
+  auto _track(PendingVariant &&op) -> Pending * {
+    // OPTIMIZE(Artur): maybe allocate these from some sort of ring/slab
+    // allocator or hide the kind in the unused bits of the aligned ptr.
+    // A lot of potential here
+    auto *pending = new Pending(std::move(op));
+
+    metrics::local().io_submitted[pending->op.index()].add();
+    pending->submitted_ns = metrics::now_ns();
+
+    if (tracing::thread_traced_) {
+      pending->traced = true;
+      pending->corr_id = thread_correlation_id_;
+      if (!pending->submitted_ns)
+        pending->submitted_ns = tracing::now_ns();
+      tracing::thread_awaiting_ = pending->kind_name();
+    }
+
+    return pending;
+  }
+
   /// @brief Creates a new listener at 0.0.0.0:port
   /// @param port The port to listen at
   auto new_listener(u16 port) -> Listener {
@@ -61,22 +105,119 @@ struct IOContext {
     return Listener(sockfd, port);
   }
 
+  /// @brief Hands an operation to the ring. Any thread may submit, the entry
+  /// goes out with the event loop's next `io_uring_submit`. When the
+  /// submission queue is full it waits its turn in `_deferred` instead.
+  void _submit(Pending *pending) {
+    std::lock_guard lock(_submit_mutex);
+    // Skipping the line would reorder writes to the same fd
+    if (!_deferred.empty() || !_try_prep(pending))
+      _deferred.push_back(pending);
+  }
+
+  /// @brief Takes a submission queue entry for `pending`.
+  /// @return `false` if the queue is full
+  /// NOTE: call with `_submit_mutex` held
+  bool _try_prep(Pending *pending) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
+    if (!sqe)
+      return false;
+
+    _prep(sqe, pending);
+    return true;
+  }
+
+  void _prep(struct io_uring_sqe *sqe, Pending *pending) {
+    std::visit([&](auto &op) { _prep(sqe, op); }, pending->op);
+    sqe->user_data = (long long)pending;
+  }
+
+  /// @brief Submits everything queued, deferred operations included for as
+  /// long as the kernel takes entries.
+  /// @return The amount of entries submitted
+  auto _flush() -> int {
+    std::lock_guard lock(_submit_mutex);
+
+    int submitted = 0;
+    while (true) {
+      sz prepped = 0;
+      while (prepped < _deferred.size() && _try_prep(_deferred[prepped]))
+        prepped++;
+      _deferred.erase(_deferred.begin(), _deferred.begin() + prepped);
+
+      int n = io_uring_submit(&_ring);
+      if (n <= 0) {
+        if (n < 0)
+          TOAD_ERROR("io_uring_submit failed, code={}", -n);
+        return submitted;
+      }
+      submitted += n;
+      if (_deferred.empty())
+        return submitted;
+    }
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingListen &listen) {
+    io_uring_prep_accept(sqe, listen.sockfd, NULL, NULL, 0);
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingConnect &connect) {
+    io_uring_prep_connect(sqe, connect.sockfd,
+                          (struct sockaddr *)&connect.addr,
+                          sizeof(connect.addr));
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingReadSome &read) {
+    io_uring_prep_read(sqe, read.sockfd, read.buffer.data(),
+                       read.buffer.size(), 0);
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingReadSomeVec &read) {
+    io_uring_prep_read(sqe, read.sockfd, read.vec.data() + read.initial_size,
+                       read.vec.size() - read.initial_size, 0);
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingWriteSome &write) {
+    io_uring_prep_write(sqe, write.sockfd, write.buffer, write.size, 0);
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingWriteChain &write) {
+    io_uring_prep_writev(sqe, write.sockfd, write.iov.data(), write.iov.size(),
+                         0);
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingWriteFile &write) {
+    io_uring_prep_writev(sqe, write.fd, write.iov.data(), write.iov.size(),
+                         write.offset);
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingTapRead &read) {
+    io_uring_prep_read(sqe, read.fd, read.buffer.data(), read.frame_size, 0);
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingTapWrite &write) {
+    if (write.vnet)
+      io_uring_prep_writev(sqe, write.fd, write.iov.data(), write.iov.size(),
+                           0);
+    else
+      io_uring_prep_write(sqe, write.fd, write.frame.data(),
+                          write.frame.size(), 0);
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingPoll &poll) {
+    io_uring_prep_poll_add(sqe, poll.fd, poll.events);
+  }
+
+  void _prep(struct io_uring_sqe *sqe, PendingTimer &timer) {
+    io_uring_prep_timeout(sqe, &timer.interval, 0, 0);
+  }
+
   /// @brief Wait for a @ref listener to accept a new client
   /// @param listener
   /// @return The socket of a new freshly connected client
   Future<Socket> submit_accept_ipv4(const Listener &listener) {
     auto [future, handle] = make_future<Socket>();
-
-    // OPTIMIZE(Artur): maybe allocate these from some sort of ring/slab
-    // allocator or hide the kind in the unused bits of the aligned ptr.
-    // A lot of potential here
-    PendingVariant *pending =
-        new PendingVariant(PendingListen(listener.sockfd, handle));
-
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
-    io_uring_prep_accept(sqe, listener.sockfd, NULL, NULL, 0);
-    sqe->user_data = (long long)pending;
-
+    _submit(_track(PendingListen(listener.sockfd, handle)));
     return std::move(future);
   }
 
@@ -86,15 +227,7 @@ struct IOContext {
     auto [future, handle] = make_future<std::optional<Socket>>();
 
     int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-
-    PendingVariant *pending =
-        new PendingVariant(PendingConnect(sockfd, addr, handle));
-    PendingConnect &connect = std::get<PendingConnect>(*pending);
-
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
-    io_uring_prep_connect(sqe, sockfd, (struct sockaddr *)&connect.addr,
-                          sizeof(addr));
-    sqe->user_data = (long long)pending;
+    _submit(_track(PendingConnect(sockfd, addr, handle)));
 
     return std::move(future);
   }
@@ -114,15 +247,9 @@ struct IOContext {
   /// std::nullopt when the connection is shut down
   Future<std::optional<Buffer>> submit_read_some(const Socket &socket,
                                                  sz max_size) {
-    Buffer buffer(max_size);
+    Buffer buffer(max_size, uninitialized);
     auto [future, handle] = make_future<std::optional<Buffer>>();
-    PendingVariant *pending =
-        new PendingVariant(PendingReadSome(socket._sockfd, buffer, handle));
-
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
-    io_uring_prep_read(sqe, socket._sockfd, buffer.data(), max_size, 0);
-    sqe->user_data = (long long)pending;
-
+    _submit(_track(PendingReadSome(socket._sockfd, buffer, handle)));
     return std::move(future);
   }
 
@@ -131,18 +258,12 @@ struct IOContext {
     auto [future, handle] = make_future<sz>();
 
     sz initial_size = vec.size();
-    PendingVariant *pending = new PendingVariant(
-        PendingReadSomeVec(socket._sockfd, vec, initial_size, handle));
-
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
-
     // resize the vector to accomodate all the element in the future.
     // we will shrink it back afterwards.
     vec.resize(initial_size + max_size);
-    io_uring_prep_read(sqe, socket._sockfd, vec.data() + initial_size, max_size,
-                       0);
+    _submit(_track(
+        PendingReadSomeVec(socket._sockfd, vec, initial_size, handle)));
 
-    sqe->user_data = (long long)pending;
     return std::move(future);
   }
 
@@ -152,17 +273,88 @@ struct IOContext {
     u8 *buf = new u8[size];
     memcpy(buf, buffer.data(), size);
 
-    PendingVariant *pending =
-        new PendingVariant(PendingWriteSome(socket._sockfd, buf));
+    _submit(_track(PendingWriteSome(socket._sockfd, buf, size)));
+  }
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
-    io_uring_prep_write(sqe, socket._sockfd, buf, size, 0);
-    sqe->user_data = (long long)pending;
+  /// @brief Writes a chain of buffers with a single vectored write, without
+  /// linearizing it first.
+  void submit_write_some(const Socket &socket, BufferChain chain) {
+    if (chain.empty())
+      return;
+
+    _submit(_track(PendingWriteChain(socket._sockfd, std::move(chain))));
+  }
+
+  /// @brief Writes a chain of buffers into a file at `offset`, resubmitting
+  /// short writes. Writes to disjoint ranges may finish in any order.
+  void submit_write_at(int fd, BufferChain chain, u64 offset) {
+    if (chain.empty())
+      return;
+
+    _submit(_track(PendingWriteFile(fd, std::move(chain), offset)));
+  }
+
+  /// @brief Reads frames off a TAP device into `frames`, keeping `in_flight`
+  /// reads submitted at all times. Every read lands in its own pooled buffer,
+  /// the frames are slices of it. Stops once the channel is closed. With
+  /// `vnet` every read starts with a `VirtioNetHeader`, which is parsed into
+  /// the frame's `offload`.
+  void submit_read_frames(int fd, sz frame_size, sz in_flight,
+                          std::shared_ptr<FrameChannel> frames,
+                          bool vnet = false) {
+    for (sz i = 0; i < in_flight; i++)
+      _submit(_track(PendingTapRead(fd, frame_size, vnet, frames)));
+  }
+
+  /// @brief Writes whole frames to a TAP device, one write each since the
+  /// device takes a frame per write. Every frame queued before the event loop
+  /// comes around again goes out with the same `io_uring_submit`. With
+  /// `offloads`, the device takes a `VirtioNetHeader` per frame, which is
+  /// gathered in front of the frame instead of copied.
+  void submit_write_frames(int fd, std::span<const Buffer> frames,
+                           std::span<const VirtioNetHeader> offloads = {}) {
+    ASSERT(offloads.empty() || offloads.size() == frames.size(),
+           "Every frame needs its offloads");
+
+    std::lock_guard lock(_submit_mutex);
+    for (sz i = 0; i < frames.size(); i++) {
+      struct io_uring_sqe *sqe =
+          _deferred.empty() ? io_uring_get_sqe(&_ring) : nullptr;
+      if (!sqe) {
+        // The submission queue is full, drop like a full TX ring would
+        metrics::local().frames_dropped.add();
+        continue;
+      }
+
+      Pending *pending = _track(PendingTapWrite(fd, frames[i]));
+      auto &write = std::get<PendingTapWrite>(pending->op);
+      if (!offloads.empty()) {
+        offloads[i].store(write.vnet_header.data());
+        write.iov = {iovec{write.vnet_header.data(), VirtioNetHeader::SIZE},
+                     iovec{write.frame.data(), write.frame.size()}};
+        write.vnet = true;
+      }
+      _prep(sqe, pending);
+    }
+  }
+
+  /// @brief Calls `ready` on the event loop whenever one of `events` is
+  /// pending on `fd`, for as long as it returns `true`. Meant for fds whose
+  /// data is not read through the ring, like the mapped rings of a packet
+  /// socket.
+  void submit_poll(int fd, u32 events, std::function<bool(u32)> ready) {
+    _submit(_track(PendingPoll(fd, events, std::move(ready))));
+  }
+
+  /// @brief Calls `fired` on the event loop every `interval_ns`, for as long
+  /// as it returns `true`.
+  void submit_timer(u64 interval_ns, std::function<bool()> fired) {
+    _submit(_track(PendingTimer(interval_ns, std::move(fired))));
   }
 
   bool _handle_pending(struct io_uring_cqe *cqe, PendingConnect &connect) {
     if (cqe->res < 0) {
-      spdlog::error("Connect failed, code={}", errno);
+      TOAD_ERROR("Connect failed, code={}", errno);
       connect.handle.set_value(std::nullopt);
     } else {
       auto socket = Socket(connect.sockfd);
@@ -173,11 +365,11 @@ struct IOContext {
   }
 
   bool _handle_pending(struct io_uring_cqe *cqe, PendingReadSome &read_some) {
-    int client_fd = read_some.sockfd;
+    [[maybe_unused]] int client_fd = read_some.sockfd;
 
     // TODO: check if the socket closd
     int read = cqe->res;
-    spdlog::info("Read {} bytes from client_fd={}", read, client_fd);
+    TOAD_DEBUG("Read {} bytes from client_fd={}", read, client_fd);
 
     std::optional<Buffer> value =
         read == 0 ? std::nullopt
@@ -188,7 +380,7 @@ struct IOContext {
 
   bool _handle_pending(struct io_uring_cqe *cqe,
                        PendingReadSomeVec &read_some) {
-    int client_fd = read_some.sockfd;
+    [[maybe_unused]] int client_fd = read_some.sockfd;
 
     int read = cqe->res;
     if (read < 0) {
@@ -197,7 +389,7 @@ struct IOContext {
         return false;
     }
 
-    spdlog::info("Read {} bytes from client_fd={}", read, client_fd);
+    TOAD_DEBUG("Read {} bytes from client_fd={}", read, client_fd);
     read_some.vec.resize(read_some.initial_size + read);
 
     read_some.handle.set_value(std::move(read));
@@ -206,7 +398,7 @@ struct IOContext {
 
   bool _handle_pending(struct io_uring_cqe *cqe, PendingListen &listen) {
     int client_fd = cqe->res;
-    spdlog::info("New connection client_fd={}", client_fd);
+    TOAD_DEBUG("New connection client_fd={}", client_fd);
 
     auto socket = Socket(client_fd);
     listen.handle.set_value(std::move(socket));
@@ -215,32 +407,184 @@ struct IOContext {
 
   bool _handle_pending(struct io_uring_cqe *cqe, PendingWriteSome &write_some) {
     if (cqe->res < 0)
-      spdlog::error("Write broke, code={}", errno);
+      TOAD_ERROR("Write broke, code={}", errno);
 
     return false;
   }
 
+  bool _handle_pending(struct io_uring_cqe *cqe, PendingWriteChain &write) {
+    // Nothing written would be resubmitted forever
+    if (cqe->res <= 0) {
+      TOAD_ERROR("Write broke, code={}", -cqe->res);
+      return false;
+    }
+
+    write.chain.trim_front(cqe->res);
+    if (write.chain.empty())
+      return false;
+
+    // Short write, send the rest with the same pending operation
+    write.iov = write.chain.to_iovec();
+    auto *pending = (Pending *)cqe->user_data;
+    metrics::local().io_submitted[pending->op.index()].add();
+    _submit(pending);
+    return true;
+  }
+
+  bool _handle_pending(struct io_uring_cqe *cqe, PendingWriteFile &write) {
+    if (cqe->res <= 0) {
+      TOAD_ERROR("Writing fd={} failed, code={}", write.fd, -cqe->res);
+      return false;
+    }
+
+    write.chain.trim_front(cqe->res);
+    write.offset += cqe->res;
+    if (write.chain.empty())
+      return false;
+
+    write.iov = write.chain.to_iovec();
+    auto *pending = (Pending *)cqe->user_data;
+    metrics::local().io_submitted[pending->op.index()].add();
+    _submit(pending);
+    return true;
+  }
+
+  bool _handle_pending(struct io_uring_cqe *cqe, PendingTapRead &read) {
+    if (read.frames->closed())
+      return false;
+
+    int n = cqe->res;
+    if (n < 0 && n != -EAGAIN && n != -EINTR) {
+      TOAD_ERROR("Reading the TAP device failed, code={}", -n);
+      read.frames->close();
+      return false;
+    }
+
+    sz prefix = read.vnet ? VirtioNetHeader::SIZE : 0;
+    if (n > 0 && (sz)n < prefix + EthernetHeader::SIZE) {
+      TOAD_TRACE("Dropping a runt frame of {} bytes", n);
+    } else if (n > 0) {
+      VirtioNetHeader offload;
+      if (read.vnet)
+        offload = VirtioNetHeader::load(read.buffer.data());
+
+      Buffer buffer = std::move(read.buffer).slice(prefix, n);
+      capture::frame(buffer.span(), capture::Direction::Inbound);
+      ByteIStream stream(buffer);
+      auto frame = EthernetFrame<DirectionIn>::try_from_stream(stream);
+      frame.offload = offload;
+      if (!read.frames->try_send(std::move(frame)))
+        metrics::local().frames_dropped.add();
+
+      read.buffer = Buffer(read.frame_size, uninitialized);
+    }
+
+    auto *pending = (Pending *)cqe->user_data;
+    metrics::local().io_submitted[pending->op.index()].add();
+    _submit(pending);
+    return true;
+  }
+
+  bool _handle_pending(struct io_uring_cqe *cqe, PendingTapWrite &) {
+    if (cqe->res < 0)
+      TOAD_ERROR("Writing a frame to the TAP device failed, code={}",
+                 -cqe->res);
+    return false;
+  }
+
+  bool _handle_pending(struct io_uring_cqe *cqe, PendingTimer &timer) {
+    // A timeout that ran out completes with -ETIME, that is the good case
+    if (cqe->res < 0 && cqe->res != -ETIME) {
+      TOAD_ERROR("Timer failed, code={}", -cqe->res);
+      return false;
+    }
+    if (!timer.fired())
+      return false;
+
+    auto *pending = (Pending *)cqe->user_data;
+    metrics::local().io_submitted[pending->op.index()].add();
+    _submit(pending);
+    return true;
+  }
+
+  bool _handle_pending(struct io_uring_cqe *cqe, PendingPoll &poll) {
+    if (cqe->res < 0 && cqe->res != -EINTR) {
+      TOAD_ERROR("Polling fd={} failed, code={}", poll.fd, -cqe->res);
+      return false;
+    }
+    if (!poll.ready(cqe->res < 0 ? 0 : cqe->res))
+      return false;
+
+    auto *pending = (Pending *)cqe->user_data;
+    metrics::local().io_submitted[pending->op.index()].add();
+    _submit(pending);
+    return true;
+  }
+
+  /// @brief Pin the event loop next to the workers described by `layout`.
+  void pin_event_loop(const WorkerLayout &layout) {
+    event_loop_cpu = layout.event_loop_cpu;
+    event_loop_node = layout.event_loop_node;
+  }
+
+  void pin_event_loop(u32 cpu, std::optional<u32> node = std::nullopt) {
+    event_loop_cpu = cpu;
+    event_loop_node = node;
+  }
+
+  /// @brief Logs a snapshot of the runtime metrics if one was asked for.
+  void report_metrics_if_requested() {
+    auto &registry = metrics::Metrics::instance();
+    if (!registry.report_requested.load(std::memory_order_relaxed) ||
+        !registry.report_requested.exchange(false))
+      return;
+
+    TOAD_INFO("Runtime metrics:\n{}",
+              registry.snapshot().describe(PENDING_KIND_NAMES));
+  }
+
+  /// @brief Makes `event_loop` return. Operations still in flight are
+  /// abandoned along with whatever waits on them.
+  void stop() { _stopped.store(true, std::memory_order_relaxed); }
+
   void event_loop() {
+    if (event_loop_cpu)
+      pin_this_thread(*event_loop_cpu, event_loop_node);
+
     struct __kernel_timespec ts;
     ts.tv_sec = timeout_ms / 1000;
     ts.tv_nsec = (timeout_ms % 1000) * 1000000;
 
     std::vector<struct io_uring_cqe *> cqes(batch_size);
+    auto &shard = metrics::local();
 
     // SAFETY(Artur): TSan might trick you into thinking that here is a
     // datarace. There isn't. The memory fence makes sure that all the reads
     // have finished. Seems correct to me.
 
     // TODO: graceful shutdown
-    while (true) {
+    while (!_stopped.load(std::memory_order_relaxed)) {
+      tracing::tracer().dump_if_requested();
+      report_metrics_if_requested();
+      if (auto batch = capture::tap().take_batch())
+        submit_write_at(batch->fd, BufferChain(std::move(batch->blocks)),
+                        batch->offset);
+
       std::atomic_thread_fence(std::memory_order_acquire);
-      io_uring_submit(&_ring);
+      int submitted = _flush();
+      if (submitted > 0) {
+        shard.submits.add();
+        shard.sqes_submitted.add(submitted);
+        shard.sqes_per_submit.record(submitted);
+      }
 
       int seen = 0;
 
       {
         struct io_uring_cqe *cqe;
         // Wait for timeout or just one cqe
+        // NOTE: this takes no entry of its own only on kernels with
+        // `IORING_FEAT_EXT_ARG`, older ones would race `_submit_mutex`
         int ret = io_uring_wait_cqe_timeout(&_ring, &cqe, &ts);
         if (ret < 0) {
           if (ret == -ETIME) {
@@ -248,23 +592,39 @@ struct IOContext {
             continue;
           } else {
             // fatal error
-            spdlog::error("io_uring_wait_cqe_timeout failed: {}", errno);
+            TOAD_ERROR("io_uring_wait_cqe_timeout failed: {}", errno);
             break;
           }
         }
       }
 
       seen = io_uring_peek_batch_cqe(&_ring, cqes.data(), batch_size);
+      shard.cqes_per_batch.record(seen);
+      u64 reaped_ns = tracing::now_ns();
+
+      // Everything the completions wake up is handed to the executor at once
+      SpawnBatch spawned;
 
       std::atomic_thread_fence(std::memory_order_release);
       for (int i = 0; i < seen; i++) {
         struct io_uring_cqe *cqe = cqes[i];
 
         io_uring_cqe_seen(&_ring, cqe);
-        auto pending = (PendingVariant *)cqe->user_data;
+        auto pending = (Pending *)cqe->user_data;
+
+        shard.io_completed[pending->op.index()].add();
+        if (pending->submitted_ns)
+          shard.io_latency_ns.record(reaped_ns - pending->submitted_ns);
+
+        if (pending->traced)
+          tracing::tracer().record(
+              {pending->submitted_ns, reaped_ns, pending->corr_id, 0,
+               tracing::this_thread_tid(), tracing::EventKind::IoWait,
+               pending->kind_name()});
+
         bool keep_alive = std::visit(
             [&](auto &pending) { return _handle_pending(cqe, pending); },
-            *pending);
+            pending->op);
 
         if (!keep_alive) {
           delete pending;
@@ -273,7 +633,51 @@ struct IOContext {
     }
   }
 
-  ~IOContext() { io_uring_queue_exit(&_ring); }
+  ~IOContext() {
+    if (_this_io_context == this)
+      _this_io_context = nullptr;
+    for (Pending *pending : _deferred)
+      delete pending;
+    io_uring_queue_exit(&_ring);
+  }
+};
+
+/// @brief An event loop with a worker of its own, both pinned to the same
+/// CPU. Whatever its completions wake runs on that worker instead of crossing
+/// over to the shared executor. Spawn the tasks driven by `io` on `executor`.
+struct QueueLoop {
+  IOContext io;
+  /// NOTE: after `io`, so the worker that may still submit to it is joined
+  /// before `io` goes away
+  Executor executor;
+
+  explicit QueueLoop(std::optional<u32> cpu = std::nullopt,
+                     std::optional<u32> node = std::nullopt)
+      : executor(cpu ? WorkerLayout{1, {*cpu}, {node.value_or(0)}, cpu, node}
+                     : WorkerLayout::unpinned(1)) {
+    if (cpu)
+      io.pin_event_loop(*cpu, node);
+  }
+
+  std::thread _thread;
+
+  QueueLoop(const QueueLoop &) = delete;
+  QueueLoop(QueueLoop &&) = delete;
+
+  /// @brief Runs the event loop on a thread of its own until destroyed.
+  void start() {
+    _thread = std::thread([this]() {
+      _this_executor = &executor;
+      io.event_loop();
+    });
+  }
+
+  ~QueueLoop() {
+    if (!_thread.joinable())
+      return;
+    io.stop();
+    _thread.join();
+  }
 };
 
 } // namespace toad
\ No newline at end of file
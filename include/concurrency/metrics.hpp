@@ -0,0 +1,253 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "../defs.hpp"
+#include "spsc.hpp"
+#include "trace.hpp"
+
+namespace toad::metrics {
+
+/// @brief A counter written by exactly one thread and read by anyone.
+/// Avoids the locked read-modify-write of `fetch_add`.
+struct Counter {
+  std::atomic<u64> _value = 0;
+
+  void add(u64 n = 1) {
+    _value.store(_value.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+
+  auto load() const -> u64 { return _value.load(std::memory_order_relaxed); }
+};
+
+/// @brief Log-linear histogram in the spirit of HdrHistogram. Values below
+/// `SUB_BUCKETS` are exact, every power of two above that is split into
+/// `SUB_BUCKETS` buckets, so the relative error stays below 1/`SUB_BUCKETS`.
+/// Single writer, like `Counter`.
+struct Histogram {
+  static constexpr u32 SUB_BITS = 3;
+  static constexpr u32 SUB_BUCKETS = 1 << SUB_BITS;
+  static constexpr u32 BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+  std::array<Counter, BUCKETS> _buckets;
+  Counter _count, _sum;
+  std::atomic<u64> _max = 0;
+
+  static constexpr auto bucket_of(u64 value) -> u32 {
+    if (value < SUB_BUCKETS)
+      return value;
+
+    u32 msb = 63 - std::countl_zero(value);
+    u32 shift = msb - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+  }
+
+  /// @brief Smallest value that lands in the bucket.
+  static constexpr auto lower_bound(u32 bucket) -> u64 {
+    if (bucket < SUB_BUCKETS)
+      return bucket;
+
+    u32 shift = bucket / SUB_BUCKETS - 1;
+    return (u64)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+  }
+
+  void record(u64 value) {
+    _buckets[bucket_of(value)].add();
+    _count.add();
+    _sum.add(value);
+    if (value > _max.load(std::memory_order_relaxed))
+      _max.store(value, std::memory_order_relaxed);
+  }
+};
+
+/// @brief Aggregate of any number of `Histogram`s.
+struct HistogramSnapshot {
+  std::array<u64, Histogram::BUCKETS> buckets = {};
+  u64 count = 0, sum = 0, max = 0;
+
+  void merge(const Histogram &histogram) {
+    for (u32 i = 0; i < Histogram::BUCKETS; i++)
+      buckets[i] += histogram._buckets[i].load();
+    count += histogram._count.load();
+    sum += histogram._sum.load();
+    max = std::max(max, histogram._max.load(std::memory_order_relaxed));
+  }
+
+  /// @param p In the range [0; 1]
+  /// @return Lower bound of the bucket containing the p-th quantile
+  auto percentile(double p) const -> u64 {
+    if (count == 0)
+      return 0;
+
+    u64 rank = std::max<u64>(1, (u64)(p * count + 0.5));
+    u64 seen = 0;
+    for (u32 i = 0; i < Histogram::BUCKETS; i++) {
+      seen += buckets[i];
+      if (seen >= rank)
+        return std::min(Histogram::lower_bound(i), max);
+    }
+
+    return max;
+  }
+
+  auto mean() const -> double { return count ? (double)sum / count : 0.0; }
+};
+
+/// @brief Upper bound on the amount of `PendingVariant` alternatives.
+constexpr sz MAX_IO_KINDS = 16;
+
+/// @brief Counters owned by a single thread. Every shard sits on its own cache
+/// lines, so threads never false-share.
+struct alignas(CACHE_LINE_SIZE) Shard {
+  // Executor
+  Counter tasks_enqueued, tasks_dequeued, tasks_run;
+  Counter wakeups, parks, spin_hits;
+  Histogram task_run_ns, queue_wait_ns;
+
+  // IOContext
+  Counter submits, sqes_submitted;
+  std::array<Counter, MAX_IO_KINDS> io_submitted, io_completed;
+  Histogram sqes_per_submit, cqes_per_batch, io_latency_ns;
+
+  // NIC
+  Counter frames_dropped;
+};
+
+struct Snapshot {
+  u64 tasks_enqueued = 0, tasks_run = 0, queue_depth = 0;
+  u64 wakeups = 0, parks = 0, spin_hits = 0;
+  HistogramSnapshot task_run_ns, queue_wait_ns;
+
+  u64 submits = 0, sqes_submitted = 0;
+  std::array<u64, MAX_IO_KINDS> io_in_flight = {};
+  HistogramSnapshot sqes_per_submit, cqes_per_batch, io_latency_ns;
+
+  u64 frames_dropped = 0;
+
+  /// @brief Human readable summary, one metric per line.
+  /// @param io_kind_names Names of the IO operation kinds, by index
+  auto describe(std::span<const char *const> io_kind_names = {}) const
+      -> std::string {
+    auto hist = [](const HistogramSnapshot &h) {
+      return fmt::format("n={} mean={:.0f} p50={} p99={} p999={} max={}",
+                         h.count, h.mean(), h.percentile(0.5),
+                         h.percentile(0.99), h.percentile(0.999), h.max);
+    };
+
+    std::string out = fmt::format(
+        "tasks: enqueued={} run={} queued={} wakeups={} parks={} "
+        "spin_hits={}\n"
+        "task run ns: {}\n"
+        "task queue wait ns: {}\n"
+        "io: submits={} sqes={}\n"
+        "sqes per submit: {}\n"
+        "cqes per batch: {}\n"
+        "io latency ns: {}\n"
+        "nic: frames_dropped={}\n"
+        "io in flight:",
+        tasks_enqueued, tasks_run, queue_depth, wakeups, parks, spin_hits,
+        hist(task_run_ns), hist(queue_wait_ns), submits, sqes_submitted,
+        hist(sqes_per_submit), hist(cqes_per_batch), hist(io_latency_ns),
+        frames_dropped);
+
+    for (sz i = 0; i < io_kind_names.size() && i < MAX_IO_KINDS; i++)
+      out += fmt::format(" {}={}", io_kind_names[i], io_in_flight[i]);
+
+    return out;
+  }
+};
+
+/// @brief Registry of every thread's shard. Shards of exited threads are kept
+/// so totals never go backwards.
+struct Metrics {
+  /// @brief Latency histograms need two clock reads per sample, they can be
+  /// switched off at runtime. Counters are always on.
+  std::atomic<bool> timing = true;
+  std::atomic<bool> report_requested = false;
+
+  std::mutex _mutex;
+  std::vector<std::unique_ptr<Shard>> _shards;
+
+  static auto instance() -> Metrics & {
+    static Metrics metrics;
+    return metrics;
+  }
+
+  auto local() -> Shard & {
+    thread_local Shard *shard = nullptr;
+    if (!shard) {
+      auto owned = std::make_unique<Shard>();
+      shard = owned.get();
+      std::lock_guard guard(_mutex);
+      _shards.push_back(std::move(owned));
+    }
+
+    return *shard;
+  }
+
+  bool timing_enabled() const {
+    return timing.load(std::memory_order_relaxed);
+  }
+
+  /// @brief Sums every shard. Writers are never stopped, so the snapshot is
+  /// consistent per counter but not across counters.
+  auto snapshot() -> Snapshot {
+    Snapshot s;
+
+    std::lock_guard guard(_mutex);
+    u64 dequeued = 0;
+    std::array<u64, MAX_IO_KINDS> completed = {};
+    for (auto &shard : _shards) {
+      s.tasks_enqueued += shard->tasks_enqueued.load();
+      dequeued += shard->tasks_dequeued.load();
+      s.tasks_run += shard->tasks_run.load();
+      s.wakeups += shard->wakeups.load();
+      s.parks += shard->parks.load();
+      s.spin_hits += shard->spin_hits.load();
+      s.task_run_ns.merge(shard->task_run_ns);
+      s.queue_wait_ns.merge(shard->queue_wait_ns);
+
+      s.submits += shard->submits.load();
+      s.sqes_submitted += shard->sqes_submitted.load();
+      for (sz i = 0; i < MAX_IO_KINDS; i++) {
+        s.io_in_flight[i] += shard->io_submitted[i].load();
+        completed[i] += shard->io_completed[i].load();
+      }
+      s.sqes_per_submit.merge(shard->sqes_per_submit);
+      s.cqes_per_batch.merge(shard->cqes_per_batch);
+      s.io_latency_ns.merge(shard->io_latency_ns);
+
+      s.frames_dropped += shard->frames_dropped.load();
+    }
+
+    // NOTE: the counters are read one after another, clamp the gauges in case
+    // a completion was seen before its submission.
+    s.queue_depth = s.tasks_enqueued > dequeued ? s.tasks_enqueued - dequeued
+                                                : 0;
+    for (sz i = 0; i < MAX_IO_KINDS; i++)
+      s.io_in_flight[i] = s.io_in_flight[i] > completed[i]
+                              ? s.io_in_flight[i] - completed[i]
+                              : 0;
+
+    return s;
+  }
+};
+
+auto local() -> Shard & { return Metrics::instance().local(); }
+
+/// @brief Timestamp for the latency histograms, 0 when timing is off.
+auto now_ns() -> u64 {
+  return Metrics::instance().timing_enabled() ? tracing::now_ns() : 0;
+}
+
+} // namespace toad::metrics
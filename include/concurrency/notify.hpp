@@ -1,11 +1,14 @@
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <condition_variable>
+#include <span>
 
 namespace toad {
 
 void spawn(std::coroutine_handle<>);
+void spawn_batch(std::span<const std::coroutine_handle<>>);
 
 struct Notify {
   struct Awaiter {
@@ -38,10 +41,23 @@ struct Notify {
     fired_.store(true, std::memory_order_release);
     auto current = head_.exchange(nullptr, std::memory_order_acquire);
 
+    // NOTE: waiters are handed over in chunks, so waking many of them costs a
+    // single executor wakeup instead of one per waiter. The next pointer is
+    // read before spawning since the awaiter dies with its coroutine.
+    std::array<std::coroutine_handle<>, 32> chunk;
+    size_t n = 0;
     while (current) {
-      spawn(current->continuation);
+      chunk[n++] = current->continuation;
       current = current->next;
+
+      if (n == chunk.size()) {
+        spawn_batch(std::span(chunk.data(), n));
+        n = 0;
+      }
     }
+
+    if (n > 0)
+      spawn_batch(std::span(chunk.data(), n));
   }
 
   // TODO: notify one
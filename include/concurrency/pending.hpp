@@ -1,9 +1,16 @@
 #pragma once
 
+#include <array>
+#include <functional>
+#include <linux/time_types.h>
 #include <variant>
 
 #include "../bytes/buffer.hpp"
+#include "../bytes/chain.hpp"
+#include "../log.hpp"
 #include "../net/socket.hpp"
+#include "../nic/ethernet.hpp"
+#include "channel.hpp"
 #include "future.hpp"
 
 namespace toad {
@@ -50,13 +57,15 @@ struct PendingReadSome {
 struct PendingWriteSome {
   int sockfd;
   u8 *buffer;
+  sz size;
 
-  PendingWriteSome(int sockfd, u8 *buffer) : sockfd(sockfd), buffer(buffer) {}
+  PendingWriteSome(int sockfd, u8 *buffer, sz size)
+      : sockfd(sockfd), buffer(buffer), size(size) {}
 
   PendingWriteSome(const PendingWriteSome &pw) = delete;
   PendingWriteSome &operator=(const PendingWriteSome &pw) = delete;
 
-  PendingWriteSome(PendingWriteSome &&pw) : sockfd(pw.sockfd) {
+  PendingWriteSome(PendingWriteSome &&pw) : sockfd(pw.sockfd), size(pw.size) {
     this->buffer = pw.buffer;
     pw.buffer = nullptr;
   }
@@ -67,6 +76,7 @@ struct PendingWriteSome {
 
     this->sockfd = pw.sockfd;
     this->buffer = pw.buffer;
+    this->size = pw.size;
     pw.buffer = nullptr;
 
     return *this;
@@ -78,8 +88,112 @@ struct PendingWriteSome {
   }
 };
 
+struct PendingWriteChain {
+  int sockfd;
+  /// @brief Keeps the chunks alive until the kernel is done with them
+  BufferChain chain;
+  std::vector<struct iovec> iov;
+
+  PendingWriteChain(int sockfd, BufferChain chain)
+      : sockfd(sockfd), chain(std::move(chain)), iov(this->chain.to_iovec()) {}
+};
+
+/// @brief A vectored write into a file at a fixed offset, the offset moves
+/// along with short writes.
+struct PendingWriteFile {
+  int fd;
+  /// @brief Keeps the chunks alive until the kernel is done with them
+  BufferChain chain;
+  u64 offset;
+  std::vector<struct iovec> iov;
+
+  PendingWriteFile(int fd, BufferChain chain, u64 offset)
+      : fd(fd), chain(std::move(chain)), offset(offset),
+        iov(this->chain.to_iovec()) {}
+};
+
+using FrameChannel = Channel<EthernetFrame<DirectionIn>>;
+
+/// @brief One of the reads kept in flight on a TAP device. It is resubmitted
+/// with a fresh buffer after every frame, until the channel is closed.
+struct PendingTapRead {
+  int fd;
+  sz frame_size;
+  /// @brief Every frame comes after a `VirtioNetHeader`
+  bool vnet;
+  Buffer buffer;
+  std::shared_ptr<FrameChannel> frames;
+
+  PendingTapRead(int fd, sz frame_size, bool vnet,
+                 std::shared_ptr<FrameChannel> frames)
+      : fd(fd), frame_size(frame_size), vnet(vnet),
+        buffer(frame_size, uninitialized), frames(std::move(frames)) {}
+};
+
+struct PendingTapWrite {
+  int fd;
+  /// @brief Keeps the frame alive until the kernel is done with it
+  Buffer frame;
+  /// @brief Written in front of the frame on devices with offloads
+  std::array<u8, VirtioNetHeader::SIZE> vnet_header;
+  std::array<struct iovec, 2> iov;
+  /// @brief The device takes `vnet_header` and `iov` is gathered
+  bool vnet = false;
+
+  PendingTapWrite(int fd, Buffer frame) : fd(fd), frame(std::move(frame)) {}
+};
+
+/// @brief Waits for an fd to become ready and calls `ready` with the events
+/// that did. It is submitted again for as long as `ready` returns `true`.
+struct PendingPoll {
+  int fd;
+  u32 events;
+  std::function<bool(u32)> ready;
+
+  PendingPoll(int fd, u32 events, std::function<bool(u32)> ready)
+      : fd(fd), events(events), ready(std::move(ready)) {}
+};
+
+/// @brief Calls `fired` every `interval`. It is submitted again for as
+/// long as `fired` returns `true`.
+struct PendingTimer {
+  struct __kernel_timespec interval;
+  std::function<bool()> fired;
+
+  PendingTimer(u64 interval_ns, std::function<bool()> fired)
+      : interval{(long long)(interval_ns / 1'000'000'000),
+                 (long long)(interval_ns % 1'000'000'000)},
+        fired(std::move(fired)) {}
+};
+
 using PendingVariant =
     std::variant<PendingReadSome, PendingListen, PendingConnect,
-                 PendingWriteSome, PendingReadSomeVec>;
+                 PendingWriteSome, PendingReadSomeVec, PendingWriteChain,
+                 PendingTapRead, PendingTapWrite, PendingPoll,
+                 PendingWriteFile, PendingTimer>;
+
+/// @brief Names of the `PendingVariant` alternatives, by index.
+constexpr std::array<const char *, std::variant_size_v<PendingVariant>>
+    PENDING_KIND_NAMES = {"read_some",  "accept",        "connect",
+                          "write_some", "read_some_vec", "write_chain",
+                          "tap_read",   "tap_write",     "poll",
+                          "write_file", "timer"};
+
+/// @brief An IO operation in flight. The kernel hands it back through the
+/// user data of the completion.
+struct Pending {
+  PendingVariant op;
+  /// @brief Coroutine that submitted the operation, only set when traced
+  correlation_id corr_id = 0;
+  /// @brief Submission time, 0 when neither traced nor timed
+  u64 submitted_ns = 0;
+  bool traced = false;
+
+  explicit Pending(PendingVariant &&op) : op(std::move(op)) {}
+
+  auto kind_name() const -> const char * {
+    return PENDING_KIND_NAMES[op.index()];
+  }
+};
 
 }; // namespace toad
\ No newline at end of file
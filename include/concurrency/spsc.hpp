@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../defs.hpp"
+
+namespace toad {
+
+constexpr sz CACHE_LINE_SIZE = 64;
+
+/// @brief Bounded lock-free single-producer single-consumer ring. The
+/// producer writes into a slot in place with `claim`/`commit`, the consumer
+/// reads it in place with `front`/`pop`, so large records are never copied
+/// through temporaries. Big, allocate it on the heap.
+template <typename T, sz Capacity> struct SpscRing {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+  // NOTE: the producer and the consumer live on different threads, keep the
+  // indices on separate lines so they do not false-share. Each side caches
+  // the other's index and only reloads it when the ring looks full/empty.
+  alignas(CACHE_LINE_SIZE) std::atomic<sz> _tail = 0;
+  sz _cached_head = 0;
+  alignas(CACHE_LINE_SIZE) std::atomic<sz> _head = 0;
+  sz _cached_tail = 0;
+  alignas(CACHE_LINE_SIZE) std::array<T, Capacity> _slots;
+
+  SpscRing() {}
+
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  /// @brief Producer side. Returns the next free slot or `nullptr` if the ring
+  /// is full. The slot becomes visible to the consumer after `commit`.
+  auto claim() -> T * {
+    sz tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _cached_head == Capacity) {
+      _cached_head = _head.load(std::memory_order_acquire);
+      if (tail - _cached_head == Capacity)
+        return nullptr;
+    }
+
+    return &_slots[tail & (Capacity - 1)];
+  }
+
+  void commit() {
+    _tail.store(_tail.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  bool try_push(const T &value) {
+    T *slot = claim();
+    if (!slot)
+      return false;
+    *slot = value;
+    commit();
+    return true;
+  }
+
+  /// @brief Consumer side. Returns the oldest committed slot or `nullptr` if
+  /// the ring is empty. The slot is only released back by `pop`.
+  auto front() -> T * { return peek(0); }
+
+  /// @brief Consumer side. Returns the `i`-th oldest committed slot, `front`
+  /// being the 0th, or `nullptr` if fewer are committed.
+  auto peek(sz i) -> T * {
+    sz head = _head.load(std::memory_order_relaxed);
+    if (_cached_tail - head <= i) {
+      _cached_tail = _tail.load(std::memory_order_acquire);
+      if (_cached_tail - head <= i)
+        return nullptr;
+    }
+
+    return &_slots[(head + i) & (Capacity - 1)];
+  }
+
+  void pop() {
+    _head.store(_head.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  /// @brief Approximate, safe to call from either side.
+  auto size() const -> sz {
+    return _tail.load(std::memory_order_acquire) -
+           _head.load(std::memory_order_acquire);
+  }
+
+  bool empty() const { return size() == 0; }
+
+  static constexpr auto capacity() -> sz { return Capacity; }
+};
+
+/// @brief Hands out one ring per thread and lets a single consumer walk all
+/// of them. Rings of exited threads are dropped once they have been drained.
+/// NOTE: the thread local slot is per ring type, so keep a single registry
+/// per `Ring`.
+template <typename Ring> struct PerThreadRings {
+  struct Entry {
+    Ring ring;
+    std::atomic<bool> abandoned = false;
+  };
+
+  std::mutex _mutex;
+  std::vector<std::shared_ptr<Entry>> _entries;
+
+  /// @brief The calling thread's ring, registered on first use.
+  auto local() -> Ring & {
+    struct Holder {
+      std::shared_ptr<Entry> entry;
+      ~Holder() {
+        if (entry)
+          entry->abandoned = true;
+      }
+    };
+    thread_local Holder holder;
+
+    if (!holder.entry) {
+      holder.entry = std::make_shared<Entry>();
+      std::lock_guard guard(_mutex);
+      _entries.push_back(holder.entry);
+    }
+
+    return holder.entry->ring;
+  }
+
+  /// @brief Calls `consume` with every ring. Only one consumer at a time.
+  template <typename F> void for_each(F &&consume) {
+    std::lock_guard guard(_mutex);
+    for (auto &entry : _entries)
+      consume(entry->ring);
+
+    std::erase_if(_entries, [](auto &entry) {
+      return entry->abandoned.load() && entry->ring.empty();
+    });
+  }
+};
+
+} // namespace toad
@@ -4,19 +4,14 @@
 #include <exception>
 #include <optional>
 
-#include <spdlog/pattern_formatter.h>
-
+#include "../log.hpp"
 #include "../prng.hpp"
 #include "executor.hpp"
 #include "notify.hpp"
+#include "trace.hpp"
 
 namespace toad {
 
-using correlation_id = u64;
-
-thread_local correlation_id thread_parent_correlation_id_ = 0;
-thread_local correlation_id thread_correlation_id_ = 0;
-
 /// @brief An owning handle to a coroutine that is not mid-execution
 struct Task {
   struct promise_type {
@@ -24,6 +19,9 @@ struct Task {
 
     correlation_id parent_corr_id = 0;
     correlation_id corr_id = thread_safe_random_u32();
+    bool traced = tracing::tracer().should_sample(corr_id);
+    /// @brief When the coroutine was last queued, 0 if unknown
+    u64 enqueued_ns = 0;
     std::exception_ptr exception;
     Notify continuations;
 
@@ -40,7 +38,7 @@ struct Task {
 
     /// @brief Called IMMEDIATELY after the coroutine is done (i.e. co_return)
     auto final_suspend() noexcept {
-      spdlog::trace("Coroutine done");
+      TOAD_TRACE("Coroutine done");
       continuations.notify_all();
       return std::suspend_always{};
     }
@@ -104,16 +102,3 @@ struct Task {
 using Handle = Task::coroutine_handle;
 
 } // namespace toad
-
-class CorrelationIdFormatter : public spdlog::custom_flag_formatter {
-public:
-  void format(const spdlog::details::log_msg &msg, const std::tm &tm_time,
-              spdlog::memory_buf_t &dest) override {
-    fmt::format_to(std::back_inserter(dest), "{:08X}",
-                   toad::thread_correlation_id_);
-  }
-
-  std::unique_ptr<custom_flag_formatter> clone() const override {
-    return spdlog::details::make_unique<CorrelationIdFormatter>();
-  }
-};
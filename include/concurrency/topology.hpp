@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <optional>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../defs.hpp"
+
+namespace toad {
+
+/// @brief Parses the sysfs cpu list format, e.g. `0-3,8,10-11`.
+auto parse_cpu_list(std::string_view list) -> std::vector<u32> {
+  std::vector<u32> cpus;
+
+  while (!list.empty()) {
+    sz comma = list.find(',');
+    std::string_view range = list.substr(0, comma);
+    list = comma == std::string_view::npos ? "" : list.substr(comma + 1);
+
+    while (!range.empty() && std::isspace((unsigned char)range.back()))
+      range.remove_suffix(1);
+    if (range.empty())
+      continue;
+
+    u32 lo = 0, hi = 0;
+    sz dash = range.find('-');
+    auto lo_str = range.substr(0, dash);
+    if (std::from_chars(lo_str.begin(), lo_str.end(), lo).ec != std::errc{})
+      continue;
+
+    hi = lo;
+    if (dash != std::string_view::npos) {
+      auto hi_str = range.substr(dash + 1);
+      if (std::from_chars(hi_str.begin(), hi_str.end(), hi).ec != std::errc{})
+        continue;
+    }
+
+    for (u32 cpu = lo; cpu <= hi; cpu++)
+      cpus.push_back(cpu);
+  }
+
+  return cpus;
+}
+
+struct CpuCore {
+  u32 cpu;
+  u32 node;
+  u32 package;
+  u32 core;
+};
+
+/// @brief Snapshot of the CPU and NUMA layout of the machine as exposed
+/// through sysfs.
+struct Topology {
+  std::vector<CpuCore> cpus;
+  u32 num_nodes = 1;
+
+  /// @brief Reads the online CPUs and their NUMA nodes from sysfs. Falls back
+  /// to a single node with `hardware_concurrency` CPUs if sysfs is missing.
+  static auto discover(std::string_view sysfs_root = "/sys/devices/system")
+      -> Topology {
+    namespace fs = std::filesystem;
+    Topology topology;
+
+    auto read_file = [](const fs::path &path) -> std::optional<std::string> {
+      std::ifstream file(path);
+      if (!file)
+        return std::nullopt;
+      std::string contents;
+      std::getline(file, contents);
+      return contents;
+    };
+
+    auto read_u32 = [&](const fs::path &path) -> u32 {
+      auto contents = read_file(path);
+      u32 value = 0;
+      if (contents)
+        std::from_chars(contents->data(), contents->data() + contents->size(),
+                        value);
+      return value;
+    };
+
+    fs::path root(sysfs_root);
+    auto online = read_file(root / "cpu" / "online");
+    if (!online) {
+      u32 n = std::max(1u, std::thread::hardware_concurrency());
+      for (u32 cpu = 0; cpu < n; cpu++)
+        topology.cpus.push_back({cpu, 0, 0, cpu});
+      return topology;
+    }
+
+    for (u32 cpu : parse_cpu_list(*online)) {
+      auto cpu_path = root / "cpu" / ("cpu" + std::to_string(cpu));
+      topology.cpus.push_back(
+          {cpu, 0, read_u32(cpu_path / "topology" / "physical_package_id"),
+           read_u32(cpu_path / "topology" / "core_id")});
+    }
+
+    // NOTE: nodes may be sparse (e.g. node0 and node2), so the node count is
+    // the largest id seen rather than the number of directories.
+    std::error_code ec;
+    for (auto &entry : fs::directory_iterator(root / "node", ec)) {
+      auto name = entry.path().filename().string();
+      if (!name.starts_with("node"))
+        continue;
+
+      u32 node = 0;
+      if (std::from_chars(name.data() + 4, name.data() + name.size(), node)
+              .ec != std::errc{})
+        continue;
+
+      auto list = read_file(entry.path() / "cpulist");
+      if (!list)
+        continue;
+
+      for (u32 cpu : parse_cpu_list(*list))
+        for (auto &core : topology.cpus)
+          if (core.cpu == cpu)
+            core.node = node;
+
+      topology.num_nodes = std::max(topology.num_nodes, node + 1);
+    }
+
+    return topology;
+  }
+
+  auto cpus_on_node(u32 node) const -> std::vector<u32> {
+    std::vector<u32> ret;
+    for (auto &core : cpus)
+      if (core.node == node)
+        ret.push_back(core.cpu);
+    return ret;
+  }
+
+  auto node_of_cpu(u32 cpu) const -> u32 {
+    for (auto &core : cpus)
+      if (core.cpu == cpu)
+        return core.node;
+    return 0;
+  }
+};
+
+/// @brief NUMA node the current thread was pinned to, if any.
+thread_local std::optional<u32> _this_thread_node = std::nullopt;
+
+/// @brief Pins the calling thread to a single CPU.
+/// @return true if the affinity was applied
+bool pin_this_thread(u32 cpu, std::optional<u32> node = std::nullopt) {
+  // NOTE: sized for `cpu`, a plain `cpu_set_t` stops at `CPU_SETSIZE`
+  cpu_set_t *set = CPU_ALLOC(cpu + 1);
+  if (!set)
+    return false;
+  sz size = CPU_ALLOC_SIZE(cpu + 1);
+  CPU_ZERO_S(size, set);
+  CPU_SET_S(cpu, size, set);
+
+  int error = pthread_setaffinity_np(pthread_self(), size, set);
+  CPU_FREE(set);
+  if (error != 0) {
+    spdlog::warn("Failed to pin thread to cpu={}", cpu);
+    return false;
+  }
+
+  _this_thread_node = node;
+  return true;
+}
+
+/// @brief The NUMA node the thread is pinned to, or node 0 when unpinned.
+auto this_thread_node() -> u32 { return _this_thread_node.value_or(0); }
+
+/// @brief Describes which CPU every executor worker and the IO event loop
+/// should be pinned to. An empty layout means "let the scheduler decide".
+struct WorkerLayout {
+  sz num_workers = 1;
+  std::vector<u32> worker_cpus;
+  std::vector<u32> worker_nodes;
+  std::optional<u32> event_loop_cpu;
+  std::optional<u32> event_loop_node;
+
+  static auto unpinned(sz num_workers = std::thread::hardware_concurrency())
+      -> WorkerLayout {
+    return WorkerLayout{std::max<sz>(1, num_workers), {}, {}, {}, {}};
+  }
+
+  /// @brief Packs the event loop and the workers onto as few nodes as
+  /// possible, starting at `node`. The event loop takes the first CPU of the
+  /// node so completions are handed to workers sharing its last level cache.
+  /// Without `num_workers` every other CPU of that node gets a worker, only
+  /// more workers than it has spill over to the next nodes.
+  static auto compact(const Topology &topology, u32 node = 0,
+                      std::optional<sz> num_workers = std::nullopt)
+      -> WorkerLayout {
+    std::vector<u32> order, nodes;
+    for (u32 i = 0; i < topology.num_nodes; i++) {
+      u32 n = (node + i) % topology.num_nodes;
+      for (u32 cpu : topology.cpus_on_node(n)) {
+        order.push_back(cpu);
+        nodes.push_back(n);
+      }
+    }
+
+    WorkerLayout layout;
+    if (order.empty())
+      return unpinned(num_workers.value_or(1));
+
+    if (!num_workers) {
+      sz on_node = std::count(nodes.begin(), nodes.end(), nodes[0]);
+      order.resize(on_node);
+      nodes.resize(on_node);
+    }
+
+    layout.event_loop_cpu = order[0];
+    layout.event_loop_node = nodes[0];
+
+    // With a single CPU the event loop has to share it with the worker
+    sz first = order.size() > 1 ? 1 : 0;
+    layout.num_workers = num_workers.value_or(order.size() - first);
+    for (sz i = 0; i < layout.num_workers; i++) {
+      sz idx = first + i % (order.size() - first);
+      layout.worker_cpus.push_back(order[idx]);
+      layout.worker_nodes.push_back(nodes[idx]);
+    }
+
+    return layout;
+  }
+
+  /// @brief Round-robins workers across nodes. Mostly useful to measure the
+  /// cost of cross-node traffic against `compact`.
+  static auto spread(const Topology &topology,
+                     std::optional<sz> num_workers = std::nullopt)
+      -> WorkerLayout {
+    if (topology.cpus.empty())
+      return unpinned(num_workers.value_or(1));
+
+    std::vector<std::vector<u32>> per_node(topology.num_nodes);
+    for (u32 n = 0; n < topology.num_nodes; n++)
+      per_node[n] = topology.cpus_on_node(n);
+
+    WorkerLayout layout;
+    layout.num_workers = num_workers.value_or(topology.cpus.size());
+    std::vector<sz> next(topology.num_nodes, 0);
+    for (sz i = 0; layout.worker_cpus.size() < layout.num_workers; i++) {
+      u32 n = i % topology.num_nodes;
+      if (per_node[n].empty())
+        continue;
+      layout.worker_cpus.push_back(per_node[n][next[n]++ % per_node[n].size()]);
+      layout.worker_nodes.push_back(n);
+    }
+
+    return layout;
+  }
+
+  bool is_pinned() const { return !worker_cpus.empty(); }
+
+  /// @brief Applies the layout for worker `idx` to the calling thread.
+  void pin_worker(sz idx) const {
+    if (idx < worker_cpus.size())
+      pin_this_thread(worker_cpus[idx], worker_nodes[idx]);
+  }
+};
+
+/// @brief Allocates page-aligned memory bound to a NUMA node. The memory is
+/// not touched, so the binding takes effect on first write.
+/// @return `nullptr` on failure
+auto node_local_alloc(sz size, u32 node) -> void * {
+  void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return nullptr;
+
+  // NOTE: a failing mbind (no NUMA support compiled in, single node in a
+  // container) is harmless, the kernel's first-touch policy still applies.
+  constexpr sz MAX_NODES = 8 * sizeof(unsigned long);
+  if (node < MAX_NODES) {
+    unsigned long nodemask = 1ul << node;
+    // The kernel reads one bit less than `maxnode` says
+    syscall(SYS_mbind, ptr, size, MPOL_BIND, &nodemask, MAX_NODES + 1, 0);
+  }
+
+  return ptr;
+}
+
+void node_local_free(void *ptr, sz size) {
+  if (ptr)
+    munmap(ptr, size);
+}
+
+} // namespace toad
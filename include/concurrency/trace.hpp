@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "../defs.hpp"
+#include "../log.hpp"
+#include "spsc.hpp"
+
+namespace toad::tracing {
+
+/// @brief Monotonic timestamp used by every trace event.
+auto now_ns() -> u64 {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+auto this_thread_tid() -> u32 {
+  thread_local u32 tid = (u32)gettid();
+  return tid;
+}
+
+/// @brief Whether the coroutine currently running on this thread is traced.
+thread_local bool thread_traced_ = false;
+
+/// @brief The IO operation the current coroutine is about to suspend on.
+thread_local const char *thread_awaiting_ = nullptr;
+
+enum struct EventKind : u8 {
+  /// @brief A coroutine was resumed by a worker until it suspended again
+  Run,
+  /// @brief A coroutine was suspended waiting for an IO operation
+  IoWait,
+};
+
+struct Event {
+  u64 begin_ns, end_ns;
+  correlation_id corr_id, parent_corr_id;
+  u32 tid;
+  EventKind kind;
+  /// @brief Static string naming the awaited operation, if any
+  const char *name;
+};
+
+using EventRing = SpscRing<Event, 4096>;
+
+/// @brief Collects per-task run and IO wait spans into per-thread rings and
+/// dumps them as a Chrome trace, loadable by `chrome://tracing` and Perfetto.
+///
+/// Tracing is sampled per connection: a coroutine is traced if its
+/// correlation id is picked by `sample_every` or if it was spawned by a traced
+/// coroutine, so one sampled SOCKS5 client carries its whole tree of tasks.
+struct Tracer {
+  /// @brief Trace one in `sample_every` coroutines, 0 turns tracing off.
+  std::atomic<u32> sample_every = 0;
+  std::atomic<u64> dropped = 0;
+  std::atomic<bool> dump_requested = false;
+
+  PerThreadRings<EventRing> _rings;
+  std::vector<Event> _collected;
+
+  static auto instance() -> Tracer & {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  bool should_sample(correlation_id id) const {
+    u32 every = sample_every.load(std::memory_order_relaxed);
+    return every != 0 && id % every == 0;
+  }
+
+  void record(const Event &event) {
+    if (!_rings.local().try_push(event))
+      dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// @brief Moves everything recorded so far out of the rings.
+  void collect() {
+    _rings.for_each([this](EventRing &ring) {
+      for (Event *event; (event = ring.front()); ring.pop())
+        _collected.push_back(*event);
+    });
+  }
+
+  /// @brief Writes the events recorded since the previous dump as a Chrome
+  /// JSON trace. Run spans become complete events on the worker's track, IO
+  /// waits become async spans grouped by correlation id.
+  void dump_chrome_json(std::ostream &out) {
+    collect();
+
+    auto us = [](u64 ns) {
+      return fmt::format("{}.{:03}", ns / 1000, ns % 1000);
+    };
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&]() {
+      if (!first)
+        out << ",\n";
+      first = false;
+    };
+
+    for (auto &event : _collected) {
+      switch (event.kind) {
+      case EventKind::Run:
+        separator();
+        out << fmt::format(
+            "{{\"name\":\"task {:08X}\",\"cat\":\"task\",\"ph\":\"X\","
+            "\"ts\":{},\"dur\":{},\"pid\":1,\"tid\":{},\"args\":{{"
+            "\"corr_id\":\"{:08X}\",\"parent_corr_id\":\"{:08X}\","
+            "\"awaits\":\"{}\"}}}}",
+            event.corr_id, us(event.begin_ns),
+            us(event.end_ns - event.begin_ns), event.tid, event.corr_id,
+            event.parent_corr_id, event.name ? event.name : "executor");
+        break;
+      case EventKind::IoWait:
+        for (auto [phase, ts] :
+             {std::pair{'b', event.begin_ns}, std::pair{'e', event.end_ns}}) {
+          separator();
+          out << fmt::format(
+              "{{\"name\":\"{}\",\"cat\":\"io\",\"ph\":\"{}\","
+              "\"id\":\"0x{:X}\",\"ts\":{},\"pid\":1,\"tid\":{}}}",
+              event.name ? event.name : "io", phase, event.corr_id, us(ts),
+              event.tid);
+        }
+        break;
+      }
+    }
+
+    out << "]}\n";
+    _collected.clear();
+
+    u64 lost = dropped.exchange(0);
+    if (lost > 0)
+      TOAD_WARN("Trace rings overflowed, {} events were dropped", lost);
+  }
+
+  /// @brief Dumps to `toad-trace-<pid>-<n>.json` in the working directory.
+  void dump_to_file() {
+    static u32 n = 0;
+    auto path = fmt::format("toad-trace-{}-{}.json", getpid(), n++);
+    std::ofstream file(path);
+    dump_chrome_json(file);
+    TOAD_INFO("Trace written to {}", path);
+  }
+
+  /// @brief Cheap enough to call from the event loop on every iteration.
+  void dump_if_requested() {
+    if (dump_requested.load(std::memory_order_relaxed) &&
+        dump_requested.exchange(false))
+      dump_to_file();
+  }
+};
+
+auto tracer() -> Tracer & { return Tracer::instance(); }
+
+} // namespace toad::tracing
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <spdlog/details/os.h>
+#include <spdlog/pattern_formatter.h>
+#include <spdlog/spdlog.h>
+
+#include "concurrency/spsc.hpp"
+#include "defs.hpp"
+
+// NOTE: the numeric values match `spdlog::level::level_enum`.
+#define TOAD_LEVEL_TRACE 0
+#define TOAD_LEVEL_DEBUG 1
+#define TOAD_LEVEL_INFO 2
+#define TOAD_LEVEL_WARN 3
+#define TOAD_LEVEL_ERROR 4
+#define TOAD_LEVEL_CRITICAL 5
+#define TOAD_LEVEL_OFF 6
+
+/// Compile-time minimum level. Anything below it is discarded before the
+/// arguments are even evaluated, so hot paths can log freely.
+#ifndef TOAD_LOG_LEVEL
+#ifdef NDEBUG
+#define TOAD_LOG_LEVEL TOAD_LEVEL_INFO
+#else
+#define TOAD_LOG_LEVEL TOAD_LEVEL_TRACE
+#endif
+#endif
+
+#define TOAD_LOG(lvl, ...)                                                     \
+  do {                                                                         \
+    if constexpr ((lvl) >= TOAD_LOG_LEVEL)                                     \
+      ::toad::logging::emit((spdlog::level::level_enum)(lvl), __VA_ARGS__);    \
+  } while (0)
+
+#define TOAD_TRACE(...) TOAD_LOG(TOAD_LEVEL_TRACE, __VA_ARGS__)
+#define TOAD_DEBUG(...) TOAD_LOG(TOAD_LEVEL_DEBUG, __VA_ARGS__)
+#define TOAD_INFO(...) TOAD_LOG(TOAD_LEVEL_INFO, __VA_ARGS__)
+#define TOAD_WARN(...) TOAD_LOG(TOAD_LEVEL_WARN, __VA_ARGS__)
+#define TOAD_ERROR(...) TOAD_LOG(TOAD_LEVEL_ERROR, __VA_ARGS__)
+#define TOAD_CRITICAL(...) TOAD_LOG(TOAD_LEVEL_CRITICAL, __VA_ARGS__)
+
+namespace toad {
+
+using correlation_id = u64;
+
+thread_local correlation_id thread_parent_correlation_id_ = 0;
+thread_local correlation_id thread_correlation_id_ = 0;
+
+namespace logging {
+
+/// @brief A log call captured with its arguments in binary form. Formatting
+/// happens later on the drain thread through `render`.
+struct Record {
+  static constexpr sz ARGS_SIZE = 192;
+
+  spdlog::log_clock::time_point time;
+  correlation_id corr_id;
+  sz thread_id;
+  fmt::string_view format;
+  void (*render)(const Record &, spdlog::memory_buf_t &);
+  spdlog::level::level_enum level;
+  alignas(16) std::byte args[ARGS_SIZE];
+};
+
+template <typename T> struct is_string_like : std::false_type {};
+template <typename C>
+struct is_string_like<std::basic_string_view<C>> : std::true_type {};
+template <typename C>
+struct is_string_like<fmt::basic_string_view<C>> : std::true_type {};
+
+/// @brief Arguments that can be copied into a record and formatted later.
+/// Strings are excluded since they usually point into memory that will be
+/// gone by the time the record is drained.
+template <typename T>
+constexpr bool is_binary_encodable_v =
+    std::is_trivially_copyable_v<T> && !is_string_like<T>::value &&
+    !(std::is_pointer_v<T> &&
+      std::is_same_v<std::remove_cv_t<std::remove_pointer_t<T>>, char>);
+
+template <typename... Args>
+constexpr bool can_defer_v =
+    (is_binary_encodable_v<std::decay_t<Args>> && ...) &&
+    sizeof(std::tuple<std::decay_t<Args>...>) <= Record::ARGS_SIZE &&
+    alignof(std::tuple<std::decay_t<Args>...>) <= 16 &&
+    std::is_trivially_destructible_v<std::tuple<std::decay_t<Args>...>>;
+
+template <typename... Ts>
+void render(const Record &record, spdlog::memory_buf_t &out) {
+  auto &args =
+      *std::launder(reinterpret_cast<const std::tuple<Ts...> *>(record.args));
+  std::apply(
+      [&](const Ts &...unpacked) {
+        fmt::vformat_to(std::back_inserter(out), record.format,
+                        fmt::make_format_args(unpacked...));
+      },
+      args);
+}
+
+using RecordRing = SpscRing<Record, 1024>;
+
+/// @brief Drains the per-thread rings on a background thread and feeds the
+/// records to the sinks of the default spdlog logger. Until `start` is called
+/// every log call is synchronous.
+struct AsyncLogger {
+  PerThreadRings<RecordRing> _rings;
+
+  std::thread _drainer;
+  std::atomic<bool> _running = false;
+
+  std::atomic<u64> dropped = 0;
+  u64 _reported_dropped = 0;
+
+  static auto instance() -> AsyncLogger & {
+    static AsyncLogger logger;
+    return logger;
+  }
+
+  bool running() const { return _running.load(std::memory_order_relaxed); }
+
+  void start() {
+    if (_running.exchange(true))
+      return;
+    _drainer = std::thread([this]() { this->drain_loop(); });
+  }
+
+  /// @brief Stops the drain thread after flushing whatever is still queued.
+  void stop() {
+    if (!_running.exchange(false))
+      return;
+    _drainer.join();
+    drain();
+  }
+
+  void drain_loop() {
+    while (running())
+      if (drain() == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  /// @brief Emits everything currently queued.
+  /// @return The amount of records emitted
+  auto drain() -> sz {
+    // NOTE: records are ordered within a thread, but not across threads.
+    sz emitted = 0;
+    _rings.for_each([&](RecordRing &ring) {
+      for (Record *record; (record = ring.front()); ring.pop()) {
+        sink(*record);
+        emitted++;
+      }
+    });
+
+    u64 now_dropped = dropped.load(std::memory_order_relaxed);
+    if (now_dropped != _reported_dropped) {
+      spdlog::warn("Dropped {} log records, the log rings were full",
+                   now_dropped - _reported_dropped);
+      _reported_dropped = now_dropped;
+    }
+
+    return emitted;
+  }
+
+  void sink(const Record &record) {
+    auto *logger = spdlog::default_logger_raw();
+
+    spdlog::memory_buf_t buffer;
+    record.render(record, buffer);
+
+    spdlog::details::log_msg msg(record.time, spdlog::source_loc{},
+                                 logger->name(), record.level,
+                                 {buffer.data(), buffer.size()});
+    msg.thread_id = record.thread_id;
+
+    // NOTE: `CorrelationIdFormatter` reads the thread local, so the drain
+    // thread impersonates the coroutine that produced the record.
+    auto previous = thread_correlation_id_;
+    thread_correlation_id_ = record.corr_id;
+
+    for (auto &sink : logger->sinks())
+      if (sink->should_log(record.level)) {
+        sink->log(msg);
+        if (record.level >= logger->flush_level())
+          sink->flush();
+      }
+
+    thread_correlation_id_ = previous;
+  }
+
+  ~AsyncLogger() { stop(); }
+};
+
+/// @brief Backend of the `TOAD_*` macros. Captures the call into this
+/// thread's ring if the async logger runs and the arguments are plain data,
+/// otherwise logs synchronously.
+template <typename... Args>
+void emit(spdlog::level::level_enum level, fmt::format_string<Args...> format,
+          Args &&...args) {
+  auto *logger = spdlog::default_logger_raw();
+  if (!logger->should_log(level))
+    return;
+
+  if constexpr (can_defer_v<Args...>) {
+    auto &async = AsyncLogger::instance();
+    if (async.running()) {
+      auto &ring = async._rings.local();
+      Record *record = ring.claim();
+      if (!record) {
+        // Never block the hot path on the logger
+        async.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+
+      record->time = spdlog::log_clock::now();
+      record->corr_id = thread_correlation_id_;
+      record->thread_id = spdlog::details::os::thread_id();
+      record->format = fmt::string_view(format);
+      record->render = &render<std::decay_t<Args>...>;
+      record->level = level;
+      new (record->args)
+          std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...);
+
+      ring.commit();
+      return;
+    }
+  }
+
+  logger->log(level, format, std::forward<Args>(args)...);
+}
+
+} // namespace logging
+
+} // namespace toad
+
+class CorrelationIdFormatter : public spdlog::custom_flag_formatter {
+public:
+  void format(const spdlog::details::log_msg &msg, const std::tm &tm_time,
+              spdlog::memory_buf_t &dest) override {
+    fmt::format_to(std::back_inserter(dest), "{:08X}",
+                   toad::thread_correlation_id_);
+  }
+
+  std::unique_ptr<custom_flag_formatter> clone() const override {
+    return spdlog::details::make_unique<CorrelationIdFormatter>();
+  }
+};
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <unistd.h>
+
+#include "../log.hpp"
+
 namespace toad {
 
 struct Socket {
@@ -11,7 +15,6 @@ struct Socket {
   Socket &operator=(const Socket &) = delete;
 
   Socket(Socket &&other) {
-    spdlog::debug("AAAAAAA");
     if (this == &other)
       return;
     if (_sockfd != -1)
@@ -21,7 +24,6 @@ struct Socket {
   }
 
   Socket &operator=(Socket &&other) {
-    spdlog::debug("BBBBBB");
     if (this == &other)
       return *this;
     if (_sockfd != -1)
@@ -32,9 +34,9 @@ struct Socket {
   }
 
   ~Socket() {
-    spdlog::debug("Socket destructor called sockfd={}", _sockfd);
+    TOAD_TRACE("Socket destructor called sockfd={}", _sockfd);
     if (_sockfd != -1) {
-      spdlog::debug("Closing sockfd={}", _sockfd);
+      TOAD_TRACE("Closing sockfd={}", _sockfd);
       close(_sockfd);
     }
   }
@@ -10,18 +10,38 @@
 #include "defs.hpp"
 #include "ipv4.hpp"
 #include "mac.hpp"
+#include "schema.hpp"
 #include "typestate.hpp"
 
 namespace toad {
 
 constexpr u16 ETHERTYPE_ARP = 0x0806;
 
+/// @brief Layout of an ARP packet, RFC 826. The addresses follow the fixed
+/// part and their sizes depend on the hardware and protocol types.
+template <u8 hlen, u8 plen> struct ArpHeader {
+  static constexpr sz SIZE = 8 + 2 * hlen + 2 * plen;
+
+  using Htype = Field<0, 16>;
+  using Ptype = Field<16, 16>;
+  using Hlen = Field<32, 8>;
+  using Plen = Field<40, 8>;
+  using Oper = Field<48, 16>;
+  using Sha = BytesField<8, hlen>;
+  using Spa = BytesField<8 + hlen, plen>;
+  using Tha = BytesField<8 + hlen + plen, hlen>;
+  using Tpa = BytesField<8 + 2 * hlen + plen, plen>;
+
+  static_assert(
+      fields_fit_v<SIZE, Htype, Ptype, Hlen, Plen, Oper, Sha, Spa, Tha, Tpa>);
+};
+
 template <u16 htype, u16 ptype, u8 hlen, u8 plen, TypestateDirection direction>
 struct Arp {
-  u16 oper;
+  u16 oper = 0;
 
-  std::array<u8, hlen> sender_hardware_addr, target_hardware_addr;
-  std::array<u8, plen> sender_protocol_addr, target_protocol_addr;
+  std::array<u8, hlen> sender_hardware_addr = {}, target_hardware_addr = {};
+  std::array<u8, plen> sender_protocol_addr = {}, target_protocol_addr = {};
 
   static constexpr auto header_size() -> sz { return 28; }
   auto header_dynamic_size() -> sz { return 0; }
@@ -42,42 +62,48 @@ struct Arp {
       : sender_hardware_addr(sha), target_hardware_addr(tha),
         sender_protocol_addr(spa), target_protocol_addr(tpa), oper(oper) {}
 
-  template <ByteBuffer B>
-  static auto try_from_stream(ByteIStream<B> &bytes) -> Arp {
-    Arp ret;
-
-    u16 parsed_htype, parsed_ptype;
-    u8 parsed_hlen, parsed_plen;
-
-    // TODO: error check
+  /// @brief A short message sets `bytes.errc` to `NotEnoughData`, one for
+  /// other hardware or protocol addresses to `Malformed`. Either comes back
+  /// zeroed, check it before using the result.
+  template <ByteReader S> static auto try_from_stream(S &bytes) -> Arp {
+    using H = ArpHeader<hlen, plen>;
 
-    bytes.read_u16(&parsed_htype)
-        .read_u16(&parsed_ptype)
-        .read_u8(&parsed_hlen)
-        .read_u8(&parsed_plen)
-        .read_u16(&ret.oper);
-
-    bytes.read_array(&ret.sender_hardware_addr)
-        .read_array(&ret.sender_protocol_addr)
-        .read_array(&ret.target_hardware_addr)
-        .read_array(&ret.target_protocol_addr);
-
-    ASSERT(bytes.errc == ByteStreamErrorCode::Ok,
-           "Must have enough bytes to parse ARP");
+    Arp ret;
+    const u8 *header = bytes.read_header(H::SIZE);
+    if (!header)
+      return ret;
+    if (H::Htype::load(header) != htype || H::Ptype::load(header) != ptype ||
+        H::Hlen::load(header) != hlen || H::Plen::load(header) != plen) {
+      bytes.errc = ByteStreamErrorCode::Malformed;
+      return ret;
+    }
+
+    ret.oper = H::Oper::load(header);
+    ret.sender_hardware_addr = H::Sha::load(header);
+    ret.sender_protocol_addr = H::Spa::load(header);
+    ret.target_hardware_addr = H::Tha::load(header);
+    ret.target_protocol_addr = H::Tpa::load(header);
 
     return ret;
   }
 
+  void store_header(u8 *header) const {
+    using H = ArpHeader<hlen, plen>;
+
+    H::Htype::store(header, htype);
+    H::Ptype::store(header, ptype);
+    H::Hlen::store(header, hlen);
+    H::Plen::store(header, plen);
+    H::Oper::store(header, oper);
+    H::Sha::store(header, sender_hardware_addr);
+    H::Spa::store(header, sender_protocol_addr);
+    H::Tha::store(header, target_hardware_addr);
+    H::Tpa::store(header, target_protocol_addr);
+  }
+
   template <ByteBuffer B> void try_to_stream(ByteOStream<B> &bytes) {
-    bytes.write_u16(htype)
-        .write_u16(ptype)
-        .write_u8(hlen)
-        .write_u8(plen)
-        .write_u16(oper)
-        .write_array(sender_hardware_addr)
-        .write_array(sender_protocol_addr)
-        .write_array(target_hardware_addr)
-        .write_array(target_protocol_addr);
+    if (u8 *header = bytes.write_header(ArpHeader<hlen, plen>::SIZE))
+      store_header(header);
   }
 
   auto copy_as_response(std::array<u8, hlen> respond_with_hardware_addr) const
@@ -92,12 +118,85 @@ struct Arp {
   }
 };
 
+/// @brief An ARP packet read and patched in place, see `IpView`. Packets for
+/// other hardware or protocol types are rejected up front.
+template <u16 htype, u16 ptype, u8 hlen, u8 plen, TypestateDirection direction>
+struct ArpView {
+  using H = ArpHeader<hlen, plen>;
+
+  Buffer buffer;
+
+  static auto try_from(Buffer buffer) -> std::optional<ArpView> {
+    if (buffer.size() < H::SIZE)
+      return std::nullopt;
+
+    const u8 *header = buffer.data();
+    if (H::Htype::load(header) != htype || H::Ptype::load(header) != ptype ||
+        H::Hlen::load(header) != hlen || H::Plen::load(header) != plen)
+      return std::nullopt;
+
+    return ArpView(std::move(buffer).slice(H::SIZE));
+  }
+
+  /// @brief The same bytes, viewed as travelling the other way.
+  auto reverse() const -> ArpView<htype, ptype, hlen, plen, ~direction> {
+    return ArpView<htype, ptype, hlen, plen, ~direction>(buffer);
+  }
+
+  auto header() const -> u8 * { return buffer.data(); }
+
+  auto oper() const -> u16 { return H::Oper::load(header()); }
+  auto sender_hardware_addr() const -> std::array<u8, hlen> {
+    return H::Sha::load(header());
+  }
+  auto sender_protocol_addr() const -> std::array<u8, plen> {
+    return H::Spa::load(header());
+  }
+  auto target_hardware_addr() const -> std::array<u8, hlen> {
+    return H::Tha::load(header());
+  }
+  auto target_protocol_addr() const -> std::array<u8, plen> {
+    return H::Tpa::load(header());
+  }
+
+  void set_oper(u16 oper)
+    requires(direction == DirectionOut)
+  {
+    H::Oper::store(header(), oper);
+  }
+  void set_sender_hardware_addr(const std::array<u8, hlen> &addr)
+    requires(direction == DirectionOut)
+  {
+    H::Sha::store(header(), addr);
+  }
+  void set_sender_protocol_addr(const std::array<u8, plen> &addr)
+    requires(direction == DirectionOut)
+  {
+    H::Spa::store(header(), addr);
+  }
+  void set_target_hardware_addr(const std::array<u8, hlen> &addr)
+    requires(direction == DirectionOut)
+  {
+    H::Tha::store(header(), addr);
+  }
+  void set_target_protocol_addr(const std::array<u8, plen> &addr)
+    requires(direction == DirectionOut)
+  {
+    H::Tpa::store(header(), addr);
+  }
+
+  explicit ArpView(Buffer buffer) : buffer(std::move(buffer)) {}
+};
+
 constexpr u16 HTYPE_ETHERNET_1 = 0x0001;
 constexpr u16 PTYPE_IPV4 = 0x0800;
 
 template <TypestateDirection direction>
 using ArpIPv4 = Arp<HTYPE_ETHERNET_1, PTYPE_IPV4, 6, 4, direction>;
 
+template <TypestateDirection direction>
+using ArpIPv4View = ArpView<HTYPE_ETHERNET_1, PTYPE_IPV4, 6, 4, direction>;
+
 } // namespace toad
 
 namespace fmt {
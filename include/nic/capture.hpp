@@ -0,0 +1,488 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+#include "../bytes/chain.hpp"
+#include "../concurrency/spsc.hpp"
+#include "../log.hpp"
+#include "arp.hpp"
+#include "defs.hpp"
+#include "ethernet.hpp"
+#include "flow.hpp"
+#include "icmp.hpp"
+
+namespace toad::capture {
+
+/// @brief Most bytes of a frame a record holds, enough for a whole frame of
+/// the usual MTU. Longer frames are cut, their original length is kept.
+constexpr sz CAPTURE_MAX_SNAPLEN = 2048;
+/// @brief Bytes kept of every frame unless told otherwise, the headers and
+/// the start of the payload.
+constexpr sz CAPTURE_DEFAULT_SNAPLEN = 256;
+/// @brief Records a thread can have waiting for the writer, past them frames
+/// are dropped from the capture.
+constexpr sz CAPTURE_RING_RECORDS = 1024;
+/// @brief Most bytes the writer hands to the kernel at once.
+constexpr sz CAPTURE_BATCH_BYTES = 1 << 20;
+
+/// @brief Which way a frame went, as `epb_flags` has it.
+enum struct Direction : u8 {
+  Inbound = 1,
+  Outbound = 2,
+};
+
+/// @brief What a `Term` of a `Filter` looks at.
+enum struct Match : u8 {
+  Arp,
+  Ip,
+  Icmp,
+  Tcp,
+  Udp,
+  Host,
+  SrcHost,
+  DstHost,
+  Port,
+  SrcPort,
+  DstPort,
+};
+
+struct Term {
+  Match match;
+  bool negated = false;
+  u32 host = 0;
+  u16 port = 0;
+};
+
+/// @brief A small subset of the tcpdump filter language: `arp`, `ip`,
+/// `icmp`, `tcp`, `udp`, `[src|dst] host A.B.C.D` and `[src|dst] port N`,
+/// each optionally preceded by `not`, joined by `and`. Matching reads the
+/// headers where they lie, once for all the terms.
+struct Filter {
+  std::vector<Term> terms;
+
+  /// @return `std::nullopt` if the expression does not parse
+  static auto parse(std::string_view expression) -> std::optional<Filter> {
+    std::vector<std::string_view> words;
+    for (sz at = 0; at < expression.size();) {
+      sz end = expression.find(' ', at);
+      if (end == std::string_view::npos)
+        end = expression.size();
+      if (end > at)
+        words.push_back(expression.substr(at, end - at));
+      at = end + 1;
+    }
+
+    Filter filter;
+    for (sz i = 0; i < words.size();) {
+      Term term;
+      if (words[i] == "not") {
+        term.negated = true;
+        if (++i == words.size())
+          return std::nullopt;
+      }
+
+      // Only hosts and ports have a direction
+      int side = 0;
+      if (words[i] == "src" || words[i] == "dst") {
+        side = words[i] == "src" ? 1 : 2;
+        if (++i == words.size() ||
+            (words[i] != "host" && words[i] != "port"))
+          return std::nullopt;
+      }
+
+      std::string_view word = words[i++];
+      if (word == "arp") {
+        term.match = Match::Arp;
+      } else if (word == "ip") {
+        term.match = Match::Ip;
+      } else if (word == "icmp") {
+        term.match = Match::Icmp;
+      } else if (word == "tcp") {
+        term.match = Match::Tcp;
+      } else if (word == "udp") {
+        term.match = Match::Udp;
+      } else if (word == "host" && i < words.size()) {
+        in_addr addr;
+        std::string host(words[i++]);
+        if (inet_pton(AF_INET, host.c_str(), &addr) != 1)
+          return std::nullopt;
+        term.match = side == 0   ? Match::Host
+                     : side == 1 ? Match::SrcHost
+                                 : Match::DstHost;
+        term.host = ntohl(addr.s_addr);
+      } else if (word == "port" && i < words.size()) {
+        auto port = words[i++];
+        auto [end, error] =
+            std::from_chars(port.data(), port.data() + port.size(), term.port);
+        if (error != std::errc() || end != port.data() + port.size())
+          return std::nullopt;
+        term.match = side == 0   ? Match::Port
+                     : side == 1 ? Match::SrcPort
+                                 : Match::DstPort;
+      } else {
+        return std::nullopt;
+      }
+      filter.terms.push_back(term);
+
+      if (i < words.size() && (words[i++] != "and" || i == words.size()))
+        return std::nullopt;
+    }
+    return filter;
+  }
+
+  /// @param frame Starts at the Ethernet header
+  bool matches(std::span<const u8> frame) const {
+    if (terms.empty())
+      return true;
+    if (frame.size() < EthernetHeader::SIZE)
+      return false;
+
+    u16 ethertype = EthernetHeader::Ethertype::load(frame.data());
+    std::optional<FlowKey> key;
+    if (ethertype == ETHERTYPE_IPV4)
+      key = FlowKey::try_from(frame.subspan(EthernetHeader::SIZE));
+
+    for (const auto &term : terms)
+      if (_hit(term, ethertype, key) == term.negated)
+        return false;
+    return true;
+  }
+
+  static bool _hit(const Term &term, u16 ethertype,
+                   const std::optional<FlowKey> &key) {
+    if (term.match == Match::Arp)
+      return ethertype == ETHERTYPE_ARP;
+    if (!key)
+      return false;
+
+    bool ported =
+        key->protocol == PROTOCOL_TCP || key->protocol == PROTOCOL_UDP;
+    switch (term.match) {
+    case Match::Ip:
+      return true;
+    case Match::Icmp:
+      return key->protocol == PROTOCOL_ICMP;
+    case Match::Tcp:
+      return key->protocol == PROTOCOL_TCP;
+    case Match::Udp:
+      return key->protocol == PROTOCOL_UDP;
+    case Match::Host:
+      return key->src == term.host || key->dst == term.host;
+    case Match::SrcHost:
+      return key->src == term.host;
+    case Match::DstHost:
+      return key->dst == term.host;
+    case Match::Port:
+      return ported && (key->sport == term.port || key->dport == term.port);
+    case Match::SrcPort:
+      return ported && key->sport == term.port;
+    case Match::DstPort:
+      return ported && key->dport == term.port;
+    default:
+      return false;
+    }
+  }
+};
+
+/// @brief Parses a snaplen as given to `Capture::start`, a positive decimal
+/// number. Larger than `CAPTURE_MAX_SNAPLEN` is fine, it is capped there.
+/// @return `std::nullopt` if the text is not one
+inline auto parse_snaplen(std::string_view text) -> std::optional<sz> {
+  sz snaplen = 0;
+  auto [end, error] =
+      std::from_chars(text.data(), text.data() + text.size(), snaplen);
+  if (error != std::errc() || end != text.data() + text.size() || !snaplen)
+    return std::nullopt;
+  return snaplen;
+}
+
+/// @brief A frame copied off the packet path, waiting for the writer.
+struct Record {
+  /// @brief Since the Unix epoch
+  u64 time_ns;
+  u32 original_length;
+  u32 length;
+  Direction direction;
+  std::array<u8, CAPTURE_MAX_SNAPLEN> bytes;
+};
+
+using RecordRing = SpscRing<Record, CAPTURE_RING_RECORDS>;
+
+/// @brief pcapng blocks, native byte order, RFC draft
+/// `draft-ietf-opsawg-pcapng`.
+constexpr u32 PCAPNG_SECTION_HEADER = 0x0A0D0D0A;
+constexpr u32 PCAPNG_INTERFACE_DESCRIPTION = 1;
+constexpr u32 PCAPNG_ENHANCED_PACKET = 6;
+constexpr u32 PCAPNG_BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+constexpr u16 PCAPNG_LINKTYPE_ETHERNET = 1;
+/// @brief An enhanced packet block without the frame: the header, the
+/// `epb_flags` option, the end of the options and the trailing length.
+constexpr sz PCAPNG_PACKET_OVERHEAD = 28 + 8 + 4 + 4;
+
+/// @brief Sequential writer of pcapng blocks into a buffer sized up front.
+struct BlockWriter {
+  u8 *at;
+
+  void u16_(u16 value) { _put(&value, 2); }
+  void u32_(u32 value) { _put(&value, 4); }
+  void bytes(const u8 *data, sz length) {
+    _put(data, length);
+    sz pad = -length & 3;
+    std::memset(at, 0, pad);
+    at += pad;
+  }
+
+  void _put(const void *data, sz length) {
+    std::memcpy(at, data, length);
+    at += length;
+  }
+};
+
+/// @brief Set while a capture runs, kept apart from `Capture` so the check on
+/// the packet path is a plain load.
+inline std::atomic<bool> enabled_ = false;
+
+/// @brief Copies frames off the packet path and writes them to a pcapng
+/// file, for looking at a live system without distorting it.
+///
+/// Every thread copies the frames it sees into a ring of its own, no locks
+/// and no syscalls on the packet path. The event loops take turns draining
+/// the rings and hand the blocks to the kernel with an asynchronous write,
+/// see `take_batch`. A capture that can not keep up drops frames from the
+/// capture, never from the packet path. While nothing is captured,
+/// `capture::frame` is one load and one branch.
+///
+/// NOTE: `start` and `stop` are meant for a quiet moment. Restarting with
+/// another filter while frames are captured races with the threads reading
+/// the old one.
+struct Capture {
+  std::atomic<u64> captured = 0;
+  /// @brief Frames matched but lost to a full ring
+  std::atomic<u64> dropped = 0;
+
+  Filter filter;
+  sz snaplen = CAPTURE_DEFAULT_SNAPLEN;
+
+  PerThreadRings<RecordRing> _rings;
+  /// @brief Hands out the file offsets, so writes may finish in any order
+  std::mutex _mutex;
+  int _fd = -1;
+  u64 _offset = 0;
+
+  static auto instance() -> Capture & {
+    static Capture capture;
+    return capture;
+  }
+
+  /// @brief Truncates `path` and starts capturing the frames `filter`
+  /// matches, at most `snaplen` bytes of each.
+  bool start(const std::string &path, Filter filter = {},
+             sz snaplen = CAPTURE_DEFAULT_SNAPLEN) {
+    stop();
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      TOAD_ERROR("Failed to open capture file {}: {}", path, strerror(errno));
+      return false;
+    }
+
+    std::array<u8, 28 + 20 + 12> header;
+    BlockWriter out{header.data()};
+    out.u32_(PCAPNG_SECTION_HEADER);
+    out.u32_(28);
+    out.u32_(PCAPNG_BYTE_ORDER_MAGIC);
+    out.u16_(1);
+    out.u16_(0);
+    // Section length, unknown
+    out.u32_(0xFFFFFFFF);
+    out.u32_(0xFFFFFFFF);
+    out.u32_(28);
+
+    snaplen = std::min(snaplen, CAPTURE_MAX_SNAPLEN);
+    out.u32_(PCAPNG_INTERFACE_DESCRIPTION);
+    out.u32_(32);
+    out.u16_(PCAPNG_LINKTYPE_ETHERNET);
+    out.u16_(0);
+    out.u32_(snaplen);
+    // if_tsresol, nanoseconds
+    u8 resolution = 9;
+    out.u16_(9);
+    out.u16_(1);
+    out.bytes(&resolution, 1);
+    out.u32_(0);
+    out.u32_(32);
+
+    std::lock_guard guard(_mutex);
+    _fd = fd;
+    _offset = 0;
+    if (!_write(std::span(header))) {
+      close(std::exchange(_fd, -1));
+      return false;
+    }
+
+    this->filter = std::move(filter);
+    this->snaplen = snaplen;
+    enabled_.store(true, std::memory_order_release);
+    return true;
+  }
+
+  /// @brief Stops capturing and writes what is still queued, synchronously
+  /// since the event loops may be gone already.
+  /// NOTE: writes an event loop has submitted and not finished yet land after
+  /// the file is closed and fail, their frames are lost.
+  void stop() {
+    if (!enabled_.exchange(false, std::memory_order_acq_rel))
+      return;
+
+    std::lock_guard guard(_mutex);
+    for (Buffer blocks = _drain(); blocks.size(); blocks = _drain())
+      if (!_write(blocks.span()))
+        break;
+    close(std::exchange(_fd, -1));
+  }
+
+  /// @brief Blocking write at the end of the file, under `_mutex`.
+  bool _write(std::span<const u8> bytes) {
+    for (sz done = 0; done < bytes.size();) {
+      ssz written = pwrite(_fd, bytes.data() + done, bytes.size() - done,
+                           _offset + done);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0) {
+        TOAD_ERROR("Failed to write the capture: {}", strerror(errno));
+        return false;
+      }
+      done += written;
+    }
+    _offset += bytes.size();
+    return true;
+  }
+
+  /// @brief The slow half of `capture::frame`.
+  void _frame(std::span<const u8> frame, Direction direction) {
+    if (!filter.matches(frame))
+      return;
+
+    RecordRing &ring = _rings.local();
+    Record *record = ring.claim();
+    if (!record) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    record->time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+    record->original_length = frame.size();
+    record->length = std::min(frame.size(), snaplen);
+    record->direction = direction;
+    std::memcpy(record->bytes.data(), frame.data(), record->length);
+    ring.commit();
+    captured.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  struct Batch {
+    int fd;
+    /// @brief Where in the file the blocks go
+    u64 offset;
+    Buffer blocks;
+  };
+
+  /// @brief Drains the rings into pcapng blocks and reserves their place in
+  /// the file. Event loops call it every iteration and submit the write.
+  /// @return `std::nullopt` if nothing is captured or nothing is queued
+  auto take_batch() -> std::optional<Batch> {
+    if (!enabled_.load(std::memory_order_acquire))
+      return std::nullopt;
+
+    // Another loop is draining already, there is no point in waiting
+    std::unique_lock guard(_mutex, std::try_to_lock);
+    if (!guard || _fd < 0)
+      return std::nullopt;
+
+    Buffer blocks = _drain();
+    if (blocks.size() == 0)
+      return std::nullopt;
+
+    Batch batch{_fd, _offset, std::move(blocks)};
+    _offset += batch.blocks.size();
+    return batch;
+  }
+
+  /// @brief Size of the enhanced packet block of `record`.
+  static auto _block_length(const Record &record) -> u32 {
+    return PCAPNG_PACKET_OVERHEAD + ((record.length + 3) & ~3u);
+  }
+
+  /// @brief As many queued records as fit in one batch, as enhanced packet
+  /// blocks. The rest waits for the next call.
+  auto _drain() -> Buffer {
+    // Sized to what is queued, an idle capture allocates nothing
+    sz queued = 0;
+    _rings.for_each([&](RecordRing &ring) {
+      for (sz i = 0; Record *record = ring.peek(i); i++) {
+        if (queued + _block_length(*record) > CAPTURE_BATCH_BYTES)
+          return;
+        queued += _block_length(*record);
+      }
+    });
+    if (!queued)
+      return Buffer();
+
+    Buffer blocks(queued, uninitialized);
+    BlockWriter out{blocks.data()};
+    u8 *end = blocks.data() + blocks.size();
+
+    // Records queued since the count only go in while there is room left
+    _rings.for_each([&](RecordRing &ring) {
+      while (Record *record = ring.front()) {
+        u32 length = _block_length(*record);
+        if (out.at + length > end)
+          return;
+
+        out.u32_(PCAPNG_ENHANCED_PACKET);
+        out.u32_(length);
+        out.u32_(0);
+        out.u32_(record->time_ns >> 32);
+        out.u32_(record->time_ns);
+        out.u32_(record->length);
+        out.u32_(record->original_length);
+        out.bytes(record->bytes.data(), record->length);
+        // epb_flags, the direction in the lowest bits
+        out.u16_(2);
+        out.u16_(4);
+        out.u32_((u32)record->direction);
+        out.u32_(0);
+        out.u32_(length);
+        ring.pop();
+      }
+    });
+
+    sz used = out.at - blocks.data();
+    return std::move(blocks).slice(0, used);
+  }
+};
+
+inline auto tap() -> Capture & { return Capture::instance(); }
+
+/// @brief Offers a frame to the capture. Call it wherever frames enter or
+/// leave the process.
+/// @param frame Starts at the Ethernet header
+inline void frame(std::span<const u8> frame, Direction direction) {
+  if (enabled_.load(std::memory_order_acquire)) [[unlikely]]
+    tap()._frame(frame, direction);
+}
+
+} // namespace toad::capture
@@ -1,11 +1,176 @@
 #pragma once
 
+#include <array>
+#include <bit>
+#include <cstring>
 #include <span>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include "defs.hpp"
 
 namespace toad {
 
+/// @brief Folds a wide one's complement sum down to 16 bits.
+constexpr auto fold_sum(u64 sum) -> u16 {
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return sum;
+}
+
+/// NOTE: the sums below add native endian 32-bit words and only fix the byte
+/// order once at the end. One's complement addition commutes with swapping
+/// the bytes of every word (RFC 1071, section 2), so this is the same as
+/// summing big endian 16-bit words one by one. Words are paired up relative
+/// to the start of the span, how the span is aligned does not matter.
+
+/// NOTE: every loop optionally copies what it sums to `out`, so a payload can
+/// be serialized and checksummed in one pass over it.
+
+/// @brief Sums whatever is left after the wide loops, including an odd
+/// trailing byte, which counts as if padded with a zero byte.
+template <bool copy>
+inline auto _sum_tail(const u8 *bytes, sz length, u64 sum, u8 *out) -> u64 {
+  if constexpr (copy)
+    std::memcpy(out, bytes, length);
+
+  for (; length >= 4; bytes += 4, length -= 4) {
+    u32 word;
+    std::memcpy(&word, bytes, 4);
+    sum += word;
+  }
+  if (length >= 2) {
+    u16 word;
+    std::memcpy(&word, bytes, 2);
+    sum += word;
+    bytes += 2, length -= 2;
+  }
+  if (length == 1) {
+    u16 word = 0;
+    std::memcpy(&word, bytes, 1);
+    sum += word;
+  }
+  return sum;
+}
+
+/// @brief Adds 32-bit halves of 64-bit loads into a 64-bit accumulator, so
+/// there is no carry to handle until 2^32 words were summed.
+template <bool copy = false>
+inline auto _sum_scalar(const u8 *bytes, sz length, u8 *out = nullptr)
+    -> u64 {
+  u64 a = 0, b = 0;
+  for (; length >= 16; bytes += 16, length -= 16) {
+    u64 x, y;
+    std::memcpy(&x, bytes, 8);
+    std::memcpy(&y, bytes + 8, 8);
+    if constexpr (copy) {
+      std::memcpy(out, &x, 8);
+      std::memcpy(out + 8, &y, 8);
+      out += 16;
+    }
+    a += (x & 0xFFFFFFFF) + (x >> 32);
+    b += (y & 0xFFFFFFFF) + (y >> 32);
+  }
+  return _sum_tail<copy>(bytes, length, a + b, out);
+}
+
+#if defined(__x86_64__)
+
+/// @brief Every 32-bit word is widened into a 64-bit lane, the lanes never
+/// overflow.
+template <bool copy = false>
+__attribute__((target("sse2"))) inline auto
+_sum_sse2(const u8 *bytes, sz length, u8 *out = nullptr) -> u64 {
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, b = zero;
+  for (; length >= 32; bytes += 32, length -= 32) {
+    __m128i x = _mm_loadu_si128((const __m128i *)bytes);
+    __m128i y = _mm_loadu_si128((const __m128i *)(bytes + 16));
+    if constexpr (copy) {
+      _mm_storeu_si128((__m128i *)out, x);
+      _mm_storeu_si128((__m128i *)(out + 16), y);
+      out += 32;
+    }
+    a = _mm_add_epi64(a, _mm_unpacklo_epi32(x, zero));
+    a = _mm_add_epi64(a, _mm_unpackhi_epi32(x, zero));
+    b = _mm_add_epi64(b, _mm_unpacklo_epi32(y, zero));
+    b = _mm_add_epi64(b, _mm_unpackhi_epi32(y, zero));
+  }
+
+  alignas(16) std::array<u64, 2> lanes;
+  _mm_store_si128((__m128i *)lanes.data(), _mm_add_epi64(a, b));
+  return _sum_tail<copy>(bytes, length, lanes[0] + lanes[1], out);
+}
+
+template <bool copy = false>
+__attribute__((target("avx2"))) inline auto
+_sum_avx2(const u8 *bytes, sz length, u8 *out = nullptr) -> u64 {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i a = zero, b = zero;
+  for (; length >= 64; bytes += 64, length -= 64) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)bytes);
+    __m256i y = _mm256_loadu_si256((const __m256i *)(bytes + 32));
+    if constexpr (copy) {
+      _mm256_storeu_si256((__m256i *)out, x);
+      _mm256_storeu_si256((__m256i *)(out + 32), y);
+      out += 64;
+    }
+    a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(x, zero));
+    a = _mm256_add_epi64(a, _mm256_unpackhi_epi32(x, zero));
+    b = _mm256_add_epi64(b, _mm256_unpacklo_epi32(y, zero));
+    b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(y, zero));
+  }
+
+  alignas(32) std::array<u64, 4> lanes;
+  _mm256_store_si256((__m256i *)lanes.data(), _mm256_add_epi64(a, b));
+  u64 sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  return _sum_tail<copy>(bytes, length, sum, out);
+}
+
+#endif
+
+/// @brief Below this the vector loops never run, dispatching is not worth it.
+constexpr sz CHECKSUM_VECTOR_THRESHOLD = 64;
+
+template <bool copy>
+inline auto _sum_dispatch(const u8 *bytes, sz length, u8 *out) -> u16 {
+  u64 sum;
+#if defined(__x86_64__)
+  if (length >= CHECKSUM_VECTOR_THRESHOLD) {
+    static const auto wide = __builtin_cpu_supports("avx2")
+                                 ? &_sum_avx2<copy>
+                                 : &_sum_sse2<copy>;
+    sum = wide(bytes, length, out);
+  } else {
+    sum = _sum_scalar<copy>(bytes, length, out);
+  }
+#else
+  sum = _sum_scalar<copy>(bytes, length, out);
+#endif
+
+  u16 folded = fold_sum(sum);
+  if constexpr (std::endian::native == std::endian::little)
+    folded = std::byteswap(folded);
+  return folded;
+}
+
+/// @brief One's complement sum of `bytes` as big endian 16-bit words, folded
+/// to 16 bits and not yet negated. Partial sums of adjacent pieces can be
+/// added up with `fold_sum` as long as all but the last are of even length.
+inline auto ones_complement_sum(std::span<const u8> bytes) -> u16 {
+  return _sum_dispatch<false>(bytes.data(), bytes.size(), nullptr);
+}
+
+/// @brief Copies `from` to `to` and returns its `ones_complement_sum`, reading
+/// the bytes once.
+inline auto copy_and_sum(u8 *to, std::span<const u8> from) -> u16 {
+  return _sum_dispatch<true>(from.data(), from.size(), to);
+}
+
 /// @brief A wrapper for the  the [Internet
 /// Checksum](https://en.wikipedia.org/wiki/Internet_checksum) specified
 /// in [RFC791](https://www.rfc-editor.org/rfc/rfc791). Allows trivial
@@ -18,22 +183,23 @@ struct checksum {
   checksum(u16 checksum) : n(checksum) {}
 
   explicit checksum(std::span<u8> span) {
-    ASSERT(span.size() % 2 == 0, "The buffer must be a multiple of two.");
     ASSERT(span.size() > 0, "The buffer size must be positive");
+    n = ~ones_complement_sum(span) & 0xFFFF;
+  }
 
-    u32 acc = 0;
-    for (sz i = 0; i < span.size(); i += 2) {
-      // Assumed to be BE
-      u16 word = (span[i] << 8) | span[i + 1];
-      acc += word;
-
-      // Overflow carried into the LSB bit
-      if (acc > 0xFFFF)
-        acc = (acc & 0xFFFF) + 1;
-    }
+  /// @brief The checksum after a 16-bit word it covers changed from `from`
+  /// to `to`, RFC 1624 equation 3: HC' = ~(~HC + ~m + m').
+  auto update(u16 from, u16 to) const -> checksum {
+    u64 sum = (u16)~n + (u16)~from + to;
+    return (u16)~fold_sum(sum);
+  }
 
-    acc = (acc & 0xFFFF) + (acc >> 16);
-    n = ~acc & 0xFFFF;
+  /// @brief Same as `update` for a 32-bit field, such as an IPv4 address
+  /// rewritten by NAT. Both fields must start at an even offset.
+  auto update(std::array<u8, 4> from, std::array<u8, 4> to) const
+      -> checksum {
+    return update((from[0] << 8) | from[1], (to[0] << 8) | to[1])
+        .update((from[2] << 8) | from[3], (to[2] << 8) | to[3]);
   }
 
   checksum &operator+=(const checksum &rhs) {
@@ -66,4 +232,4 @@ template <> struct formatter<toad::checksum> {
   }
 };
 
-} // namespace fmt
\ No newline at end of file
+} // namespace fmt
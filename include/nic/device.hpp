@@ -11,40 +11,180 @@
 #include <linux/if_tun.h>
 #include <optional>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <thread>
 #include <unistd.h>
 
 #include <spdlog/spdlog.h>
 
+#include "../concurrency/channel.hpp"
+#include "../concurrency/iocontext.hpp"
 #include "defs.hpp"
 #include "ethernet.hpp"
 #include "ipv4.hpp"
 #include "mac.hpp"
+#include "virtio.hpp"
 
 namespace toad {
 
+/// @brief Reads kept in flight on a TAP device by default. Enough to absorb a
+/// burst while the consumer catches up, each one holds a pooled buffer.
+constexpr sz TAP_READS_IN_FLIGHT = 8;
+/// @brief Frames queued with `queue_eth` before they are flushed regardless.
+constexpr sz TAP_TX_BATCH = 32;
+/// @brief Largest super-frame a TAP device with offloads hands over or takes,
+/// the most the kernel coalesces into one GSO packet.
+constexpr sz TAP_GSO_FRAME_SIZE = 64 << 10;
+static_assert(VirtioNetHeader::SIZE + TAP_GSO_FRAME_SIZE <= BUFFER_MAX_CHUNK,
+              "Super-frames must fit into a pooled buffer");
+/// @brief Offloads asked of a TAP device opened with `offload`. Segmenting TCP
+/// requires the checksum offload.
+constexpr unsigned TAP_OFFLOADS =
+    TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+
+/// @brief One queue of a TAP device: its own fd, and the event loop that
+/// reads and writes it. The kernel hashes every flow onto one of the queues,
+/// so queues served by different event loops spread the traffic over cores.
+struct DeviceQueue {
+  int fd;
+  sz frame_size;
+  /// @brief `nullptr` for the default event loop
+  IOContext *io = nullptr;
+  /// @brief Runs the consumers of `io`, `nullptr` for the spawning thread's
+  Executor *executor = nullptr;
+  /// @brief Every frame read or written carries a `VirtioNetHeader`
+  bool vnet = false;
+
+  /// @brief Frames waiting for `flush`, and their offloads if `vnet`
+  std::vector<Buffer> _tx;
+  std::vector<VirtioNetHeader> _tx_offloads;
+
+  DeviceQueue(int fd, sz frame_size, bool vnet = false)
+      : fd(fd), frame_size(frame_size), vnet(vnet) {}
+
+  auto io_context() -> IOContext & { return io ? *io : this_io_context(); }
+
+  /// @brief Spawns a consumer of the queue next to its event loop.
+  void spawn(Task task) {
+    if (executor)
+      executor->spawn(std::move(task));
+    else
+      toad::spawn(std::move(task));
+  }
+
+  /// @brief Starts reading frames through the event loop, which keeps
+  /// `in_flight` reads submitted. Frames arriving while `backlog` of them
+  /// wait for the consumer are dropped. Close the channel to stop reading.
+  auto frames(sz in_flight = TAP_READS_IN_FLIGHT, sz backlog = 1024)
+      -> std::shared_ptr<FrameChannel> {
+    auto channel = std::make_shared<FrameChannel>(backlog);
+    io_context().submit_read_frames(fd, frame_size, in_flight, channel, vnet);
+    return channel;
+  }
+
+  /// @brief Wakes the consumer of `channel` from the event loop every
+  /// `interval_ns`, see `Channel::wake`, until the channel is closed.
+  void wake_every(std::shared_ptr<FrameChannel> channel, u64 interval_ns) {
+    io_context().submit_timer(interval_ns, [channel]() {
+      if (channel->closed())
+        return false;
+      channel->wake();
+      return true;
+    });
+  }
+
+  /// @brief Queues a finished frame for the event loop to write. The queue
+  /// is flushed once `TAP_TX_BATCH` frames are in it, or by `flush`. Only one
+  /// coroutine at a time may queue frames.
+  /// @param offload Work left to the kernel. Without `vnet` a partial
+  /// checksum is finished here and nothing may be left to segment. Frames up
+  /// to `TAP_GSO_FRAME_SIZE` may be queued with `VirtioNetHeader::segmented`
+  void queue_eth(const PacketBuffer &packet, VirtioNetHeader offload = {}) {
+    _queue(packet.view(), offload);
+  }
+
+  void queue_eth(const EthernetView<DirectionOut> &frame,
+                 VirtioNetHeader offload = {}) {
+    _queue(frame.buffer, offload);
+  }
+
+  void _queue(Buffer frame, const VirtioNetHeader &offload) {
+    if (!vnet)
+      offload.complete_checksum(frame.span());
+    capture::frame(frame.span(), capture::Direction::Outbound);
+    _tx.push_back(std::move(frame));
+    if (vnet)
+      _tx_offloads.push_back(offload);
+    if (_tx.size() >= TAP_TX_BATCH)
+      flush();
+  }
+
+  /// @brief Hands every queued frame to the event loop at once.
+  void flush() {
+    if (_tx.empty())
+      return;
+
+    io_context().submit_write_frames(fd, _tx, _tx_offloads);
+    _tx.clear();
+    _tx_offloads.clear();
+  }
+};
+
 struct Device {
   MAC own_mac;
   IPv4 own_ip;
 
+  /// @brief The fd of the first queue
   int fd;
   sz maximum_transmission_unit;
 
+  std::vector<DeviceQueue> queues;
+  /// @brief Event loops of every queue but the first, see `serve_queues`
+  std::vector<std::unique_ptr<QueueLoop>> _queue_loops;
+
+  /// @param queues More than one opens the device with `IFF_MULTI_QUEUE`,
+  /// with an fd per queue
+  /// @param offload Opens the device with `IFF_VNET_HDR` and `TAP_OFFLOADS`.
+  /// The kernel then hands over coalesced super-frames and frames with
+  /// unfinished checksums, see `EthernetFrame::offload`, and takes the same.
   static auto try_new(std::string_view device_name, std::string_view own_ip,
-                      std::string_view network_mask) -> std::optional<Device> {
+                      std::string_view network_mask, sz queues = 1,
+                      bool offload = false) -> std::optional<Device> {
     Device device;
 
-    device.fd = open("/dev/net/tun", O_RDWR);
-
-    ASSERT(device.fd > 0, "File descriptor of /dev/net/tun must be valid");
-
     ifreq ifr;
     std::memset(&ifr, 0, sizeof(ifr));
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if (queues > 1)
+      ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    if (offload)
+      ifr.ifr_flags |= IFF_VNET_HDR;
     std::strncpy(ifr.ifr_name, device_name.data(), IFNAMSIZ);
 
-    if (ioctl(device.fd, TUNSETIFF, (void *)&ifr) < 0) {
-      perror("ioctl(TUNSETIFF)");
-      close(device.fd);
+    // Every queue is attached by another TUNSETIFF with the same name
+    std::vector<int> fds;
+    for (sz i = 0; i < queues; i++) {
+      int fd = open("/dev/net/tun", O_RDWR);
+      if (fd < 0 || ioctl(fd, TUNSETIFF, (void *)&ifr) < 0) {
+        perror(fd < 0 ? "open(/dev/net/tun)" : "ioctl(TUNSETIFF)");
+        if (fd >= 0)
+          close(fd);
+        for (int opened : fds)
+          close(opened);
+        return {};
+      }
+      fds.push_back(fd);
+    }
+    device.fd = fds[0];
+
+    // The header size defaults to the legacy 10 bytes, set it anyway so the
+    // layout never depends on the kernel's defaults
+    int vnet_header_size = VirtioNetHeader::SIZE;
+    if (offload && (ioctl(device.fd, TUNSETVNETHDRSZ, &vnet_header_size) < 0 ||
+                    ioctl(device.fd, TUNSETOFFLOAD, TAP_OFFLOADS) < 0)) {
+      perror("ioctl(TUNSETOFFLOAD)");
+      for (int fd : fds)
+        close(fd);
       return {};
     }
 
@@ -53,7 +193,8 @@ struct Device {
     int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock_fd < 0) {
       perror("socket");
-      close(device.fd);
+      for (int fd : fds)
+        close(fd);
       return {};
     }
 
@@ -97,53 +238,143 @@ struct Device {
     if (ioctl(sock_fd, SIOCGIFMTU, &mtu) < 0) {
       perror("ioctl(SIOCGIFMTU)");
       close(sock_fd);
+      for (int fd : fds)
+        close(fd);
       return {};
     }
     close(sock_fd);
 
     sz mtu_size = mtu.ifr_mtu;
     device.maximum_transmission_unit = mtu_size;
+    sz frame_size = offload ? VirtioNetHeader::SIZE + TAP_GSO_FRAME_SIZE
+                            : mtu_size + EthernetHeader::SIZE;
+    for (int fd : fds)
+      device.queues.emplace_back(fd, frame_size, offload);
 
     spdlog::info("TAP interface {} for device {} at {} with netmask {} created "
-                 "with MTU={}",
-                 device_name, device.own_mac, own_ip, network_mask, mtu_size);
+                 "with MTU={}, {} queue(s) and offloads {}",
+                 device_name, device.own_mac, own_ip, network_mask, mtu_size,
+                 queues, offload ? "on" : "off");
     return device;
   }
 
-  auto read_next_eth() -> EthernetFrame<DirectionIn> {
-    sz max_packet_size = maximum_transmission_unit + 14;
-    /// XXX(Artur): leaked
-    u8 *data = new u8[max_packet_size];
-    ssz n = read(fd, data, max_packet_size);
+  /// @brief Gives every queue but the first its own event loop and worker,
+  /// both pinned to the next CPU of `cpus`, the first queue stays on the
+  /// default event loop. Call once, before reading any frames, and start the
+  /// consumers through `DeviceQueue::spawn` so they run on their queue's CPU.
+  /// NOTE: the event loops run until the device is destroyed.
+  void serve_queues(std::span<const u32> cpus = {},
+                    std::span<const u32> nodes = {}) {
+    for (sz i = 1; i < queues.size(); i++) {
+      std::optional<u32> cpu, node;
+      if (!cpus.empty()) {
+        sz idx = (i - 1) % cpus.size();
+        cpu = cpus[idx];
+        if (idx < nodes.size())
+          node = nodes[idx];
+      }
 
-    if (n < 0) {
-      std::abort();
+      auto &loop =
+          *_queue_loops.emplace_back(std::make_unique<QueueLoop>(cpu, node));
+      queues[i].io = &loop.io;
+      queues[i].executor = &loop.executor;
+      loop.start();
     }
+  }
+
+  /// @brief Reads a single frame, blocking the calling thread. Use `frames`
+  /// on the event loop instead.
+  auto read_next_eth() -> std::optional<EthernetFrame<DirectionIn>> {
+    sz max_packet_size = queues[0].frame_size;
+    sz prefix = queues[0].vnet ? VirtioNetHeader::SIZE : 0;
+    Buffer buffer(max_packet_size, uninitialized);
+    ssz n = read(fd, buffer.data(), max_packet_size);
 
-    if (n < 14) {
-      spdlog::trace("Received a packet that is too small ({} bytes), skipping",
-                    n);
-      std::abort();
+    if (n < 0) {
+      TOAD_ERROR("Reading the TAP device failed, code={}", errno);
+      return std::nullopt;
     }
 
-    auto buffer = Buffer(data, n);
+    if (n < (ssz)(prefix + EthernetHeader::SIZE)) {
+      TOAD_TRACE("Received a packet that is too small ({} bytes), skipping",
+                 n);
+      return std::nullopt;
+    }
 
-    spdlog::warn("{}", buffer);
+    VirtioNetHeader offload;
+    if (prefix)
+      offload = VirtioNetHeader::load(buffer.data());
 
+    buffer = std::move(buffer).slice(prefix, n);
+    capture::frame(buffer.span(), capture::Direction::Inbound);
     auto stream = ByteIStream(buffer);
-    return EthernetFrame<DirectionIn>::try_from_stream(stream);
+    auto frame = EthernetFrame<DirectionIn>::try_from_stream(stream);
+    frame.offload = offload;
+    return frame;
+  }
+
+  /// @brief Frames of the first queue, see `DeviceQueue::frames`.
+  auto frames(sz in_flight = TAP_READS_IN_FLIGHT, sz backlog = 1024)
+      -> std::shared_ptr<FrameChannel> {
+    return queues[0].frames(in_flight, backlog);
+  }
+
+  void queue_eth(const PacketBuffer &packet, VirtioNetHeader offload = {}) {
+    queues[0].queue_eth(packet, offload);
   }
 
-  auto write_eth(EthernetFrame<DirectionOut> &frame) {
-    Buffer buffer(maximum_transmission_unit);
-    auto ostream = ByteOStream<Buffer>(buffer);
-    frame.try_to_stream(ostream);
-    sz packet_length = ostream.cursor;
-    ssz n = write(fd, buffer.data(), packet_length);
-    spdlog::info("Written {}", n);
+  void queue_eth(const EthernetView<DirectionOut> &frame,
+                 VirtioNetHeader offload = {}) {
+    queues[0].queue_eth(frame, offload);
   }
 
-  ~Device() {}
+  void flush() { queues[0].flush(); }
+
+  /// @brief Writes a fully built packet as is, blocking the calling thread.
+  void write_eth(const PacketBuffer &packet) {
+    if (_write_frame(packet.data(), packet.size()) < 0)
+      TOAD_ERROR("Writing a frame to the TAP device failed, code={}", errno);
+  }
+
+  /// @brief Writes a frame that was patched in place.
+  void write_eth(const EthernetView<DirectionOut> &frame) {
+    if (_write_frame(frame.buffer.data(), frame.buffer.size()) < 0)
+      TOAD_ERROR("Writing a frame to the TAP device failed, code={}", errno);
+  }
+
+  /// @brief A finished frame goes behind an all zero `VirtioNetHeader` if the
+  /// device expects one.
+  auto _write_frame(const u8 *frame, sz size) -> ssz {
+    capture::frame({frame, size}, capture::Direction::Outbound);
+    if (!queues[0].vnet)
+      return write(fd, frame, size);
+
+    std::array<u8, VirtioNetHeader::SIZE> header;
+    VirtioNetHeader().store(header.data());
+    std::array<iovec, 2> iov = {iovec{header.data(), header.size()},
+                                iovec{(void *)frame, size}};
+    return writev(fd, iov.data(), iov.size());
+  }
+
+  /// @brief Prepends the Ethernet header in front of the payload, in place if
+  /// the payload has headroom.
+  void write_eth(EthernetFrame<DirectionOut> &frame) {
+    PacketBuffer packet(frame.payload);
+    frame.push_onto(packet);
+    write_eth(packet);
+  }
+
+  Device(const Device &) = delete;
+  Device &operator=(const Device &) = delete;
+  Device(Device &&) = default;
+  Device &operator=(Device &&) = default;
+
+  ~Device() {
+    // The event loops go first, they still read from the queues
+    _queue_loops.clear();
+    for (auto &queue : queues)
+      close(queue.fd);
+  }
 
 protected:
   Device() {}
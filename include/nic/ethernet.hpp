@@ -3,23 +3,41 @@
 #include <cstdint>
 #include <fmt/core.h>
 #include <fmt/format.h>
+#include <optional>
 #include <span>
 
 #include "../bytes/bytestream.hpp"
+#include "../bytes/packet_buffer.hpp"
 #include "defs.hpp"
 #include "mac.hpp"
 #include "packet.hpp"
+#include "schema.hpp"
 
 #include "typestate.hpp"
+#include "virtio.hpp"
 
 namespace toad {
 
+/// @brief Layout of an Ethernet II header, without the preamble and the FCS.
+struct EthernetHeader {
+  static constexpr sz SIZE = 14;
+
+  using Dst = BytesField<0, 6>;
+  using Src = BytesField<6, 6>;
+  using Ethertype = Field<96, 16>;
+
+  static_assert(fields_fit_v<SIZE, Dst, Src, Ethertype>);
+};
+
 template <TypestateDirection direction> struct EthernetFrame {
-  MAC dst;
-  MAC src;
-  u16 ethertype;
+  MAC dst = std::array<u8, 6>{};
+  MAC src = std::array<u8, 6>{};
+  u16 ethertype = 0;
 
   Buffer payload;
+  /// @brief What the device left undone, all zero unless it was opened with
+  /// offloads
+  VirtioNetHeader offload;
 
   static constexpr auto header_size() -> sz { return 14; }
   auto header_dynamic_size() -> sz { return 0; }
@@ -36,17 +54,21 @@ template <TypestateDirection direction> struct EthernetFrame {
 
   static const sz DST_SRC_ETHETYPE_SZ = 6 + 6 + 2;
 
-  template <ByteBuffer B>
-  static auto try_from_stream(ByteIStream<B> &bytes) -> EthernetFrame {
-    EthernetFrame frame;
-
-    bytes.read_array(&frame.dst)
-        .read_array(&frame.src)
-        .read_u16(&frame.ethertype)
-        .read_buffer(&frame.payload);
-
-    // TODO: error check
+  /// @brief A short frame sets `bytes.errc` and comes back zeroed, check it
+  /// before using the result.
+  template <ByteReader S>
+  static auto try_from_stream(S &bytes) -> EthernetFrame {
+    using H = EthernetHeader;
 
+    EthernetFrame frame;
+    const u8 *header = bytes.read_header(H::SIZE);
+    if (!header)
+      return frame;
+
+    frame.dst = H::Dst::load(header);
+    frame.src = H::Src::load(header);
+    frame.ethertype = H::Ethertype::load(header);
+    bytes.read_buffer(&frame.payload);
     return frame;
   }
 
@@ -54,9 +76,24 @@ template <TypestateDirection direction> struct EthernetFrame {
     return 2 * sizeof(MAC) + 2 + payload._size;
   }
 
+  void store_header(u8 *header) const {
+    using H = EthernetHeader;
+
+    H::Dst::store(header, dst);
+    H::Src::store(header, src);
+    H::Ethertype::store(header, ethertype);
+  }
+
   template <ByteBuffer B> void try_to_stream(ByteOStream<B> &stream) {
-    stream.write_array(dst).write_array(src).write_u16(ethertype).write_buffer(
-        payload);
+    if (u8 *header = stream.write_header(EthernetHeader::SIZE))
+      store_header(header);
+    stream.write_buffer(payload);
+  }
+
+  /// @brief Prepends the header to a packet that already holds the payload,
+  /// `payload` itself is ignored.
+  void push_onto(PacketBuffer &packet) const {
+    store_header(packet.push(header_size()));
   }
 
   auto clone_as_response(u16 ethertype, sz payload_size,
@@ -74,6 +111,55 @@ template <TypestateDirection direction> struct EthernetFrame {
 
 static_assert(Packet<EthernetFrame<DirectionIn>, Buffer>);
 
+/// @brief An Ethernet frame read and patched in place, see `IpView`.
+template <TypestateDirection direction> struct EthernetView {
+  Buffer buffer;
+
+  static auto try_from(Buffer buffer) -> std::optional<EthernetView> {
+    if (buffer.size() < EthernetHeader::SIZE)
+      return std::nullopt;
+    return EthernetView(std::move(buffer));
+  }
+
+  /// @brief The same bytes, viewed as travelling the other way.
+  auto reverse() const -> EthernetView<~direction> {
+    return EthernetView<~direction>(buffer);
+  }
+
+  // NOTE: a view always wraps at least a whole header, so the chunk is never
+  // null and `Buffer::data`'s check for it is skipped.
+  auto header() const -> u8 * {
+    return buffer._header->data + buffer._offset;
+  }
+  auto payload() const -> Buffer {
+    return buffer.slice(EthernetHeader::SIZE, buffer.size());
+  }
+
+  auto dst() const -> MAC { return EthernetHeader::Dst::load(header()); }
+  auto src() const -> MAC { return EthernetHeader::Src::load(header()); }
+  auto ethertype() const -> u16 {
+    return EthernetHeader::Ethertype::load(header());
+  }
+
+  void set_dst(const MAC &dst)
+    requires(direction == DirectionOut)
+  {
+    EthernetHeader::Dst::store(header(), dst);
+  }
+  void set_src(const MAC &src)
+    requires(direction == DirectionOut)
+  {
+    EthernetHeader::Src::store(header(), src);
+  }
+  void set_ethertype(u16 ethertype)
+    requires(direction == DirectionOut)
+  {
+    EthernetHeader::Ethertype::store(header(), ethertype);
+  }
+
+  explicit EthernetView(Buffer buffer) : buffer(std::move(buffer)) {}
+};
+
 } // namespace toad
 
 namespace fmt {
@@ -86,7 +172,7 @@ struct formatter<toad::EthernetFrame<direction>> {
   auto format(const toad::EthernetFrame<direction> &f, FormatContext &ctx) {
     auto out = ctx.out();
     out = format_to(out, "<Eth {} -> {} ethertype=0x{:04X} payload_size={}>",
-                    f.src, f.dst, f.ethertype, f.payload.size);
+                    f.src, f.dst, f.ethertype, f.payload.size());
     return out;
   }
 };
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "defs.hpp"
+#include "ipv4.hpp"
+
+namespace toad {
+
+constexpr u8 PROTOCOL_TCP = 6;
+constexpr u8 PROTOCOL_UDP = 17;
+
+/// @brief Slots whose control bytes are matched at once, one SSE2 register.
+constexpr sz FLOW_GROUP_SIZE = 16;
+/// @brief Flows a table holds unless told otherwise.
+constexpr sz FLOW_TABLE_CAPACITY = 1 << 16;
+/// @brief How long a flow may go without a packet before it expires.
+constexpr u64 FLOW_IDLE_NS = 60'000'000'000;
+/// @brief How many keys ahead a batched lookup prefetches.
+constexpr sz FLOW_PREFETCH = 8;
+
+/// @brief The 5-tuple a flow is known by. Protocols without ports have
+/// them zeroed.
+struct FlowKey {
+  u32 src = 0;
+  u32 dst = 0;
+  u16 sport = 0;
+  u16 dport = 0;
+  u8 protocol = 0;
+
+  FlowKey() = default;
+  FlowKey(const IPv4 &src, const IPv4 &dst, u16 sport, u16 dport,
+          u8 protocol)
+      : src(_bits(src)), dst(_bits(dst)), sport(sport), dport(dport),
+        protocol(protocol) {}
+
+  static auto _bits(const IPv4 &ip) -> u32 {
+    return ((u32)ip[0] << 24) | ((u32)ip[1] << 16) | ((u32)ip[2] << 8) | ip[3];
+  }
+
+  /// @brief Reads the key of an IPv4 packet. Only the first fragment has the
+  /// ports, the others are keyed without them.
+  /// @return `std::nullopt` if the header is cut short
+  static auto try_from(std::span<const u8> packet) -> std::optional<FlowKey> {
+    if (packet.size() < IP_HEADER_SIZE)
+      return std::nullopt;
+
+    const u8 *header = packet.data();
+    sz header_length = IpHeader::Ihl::load(header) * 4;
+    if (header_length < IP_HEADER_SIZE || header_length > packet.size())
+      return std::nullopt;
+
+    FlowKey key(IpHeader::Src::load(header), IpHeader::Dst::load(header), 0,
+                0, IpHeader::Protocol::load(header));
+    bool ported = key.protocol == PROTOCOL_TCP || key.protocol == PROTOCOL_UDP;
+    if (ported && IpHeader::FragmentOffset::load(header) == 0 &&
+        packet.size() >= header_length + 4) {
+      const u8 *l4 = header + header_length;
+      key.sport = (l4[0] << 8) | l4[1];
+      key.dport = (l4[2] << 8) | l4[3];
+    }
+    return key;
+  }
+
+  /// @brief The key of the packets going the other way.
+  auto reversed() const -> FlowKey {
+    FlowKey ret = *this;
+    std::swap(ret.src, ret.dst);
+    std::swap(ret.sport, ret.dport);
+    return ret;
+  }
+
+  /// @brief Multiplies the two halves of the key together and folds the
+  /// product, which mixes every bit of the key into the middle bits.
+  auto hash() const -> u64 {
+    u64 a = ((u64)src << 32 | dst) ^ 0x9E3779B97F4A7C15;
+    u64 b = ((u64)sport << 32 | (u64)dport << 16 | protocol) ^
+            0xC2B2AE3D27D4EB4F;
+    __uint128_t product = (__uint128_t)a * b;
+    return (u64)product ^ (u64)(product >> 64);
+  }
+
+  bool operator==(const FlowKey &) const = default;
+};
+
+/// @brief Control bytes of the slots. A full slot keeps the low seven bits
+/// of its key's hash, an empty or deleted one has the high bit set.
+constexpr u8 FLOW_EMPTY = 0x80;
+constexpr u8 FLOW_DELETED = 0xFE;
+
+/// @brief A bit per control byte of `group` equal to `byte`.
+inline auto flow_match_portable(const u8 *group, u8 byte) -> u16 {
+  u16 mask = 0;
+  for (sz i = 0; i < FLOW_GROUP_SIZE; i++)
+    mask |= (u16)(group[i] == byte) << i;
+  return mask;
+}
+
+inline auto flow_match(const u8 *group, u8 byte) -> u16 {
+#if defined(__x86_64__)
+  __m128i control = _mm_loadu_si128((const __m128i *)group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+#else
+  return flow_match_portable(group, byte);
+#endif
+}
+
+/// @brief Connection tracking, an open addressed hash table in the style of
+/// Abseil's Swiss tables.
+///
+/// Next to the slots lies an array of control bytes, one per slot, holding
+/// seven bits of the slot's hash. A lookup compares the control bytes of a
+/// whole group of 16 slots to its own seven bits with one SSE2 compare, and
+/// only looks at the keys of the slots that matched, one in 128 of the
+/// others on average. Groups are probed quadratically until one has an
+/// empty slot.
+///
+/// A table is not synchronized, it is meant to be one shard per core: every
+/// queue of a device is served by one thread, and the kernel keeps the
+/// packets of a flow on the same queue. The table never grows, a resize of a
+/// million flows is not something to do between two packets.
+///
+/// Flows record when they last saw a packet. `expire` is meant to be called
+/// from a timer, it sweeps a bounded number of slots per call and hands the
+/// idle flows to a callback before they are removed.
+template <typename T> struct FlowTable {
+  struct Flow {
+    FlowKey key;
+    u64 last_seen;
+    T value;
+  };
+
+  std::unique_ptr<u8[]> _control;
+  std::unique_ptr<std::optional<Flow>[]> _slots;
+  sz _group_mask;
+  sz _size = 0, _deleted = 0, _cursor = 0;
+
+  u64 idle_ns;
+
+  /// @param capacity Flows the table holds at least. Slots are 8/7 of that
+  /// or more, rounded up to a power of two.
+  explicit FlowTable(sz capacity = FLOW_TABLE_CAPACITY,
+                     u64 idle_ns = FLOW_IDLE_NS)
+      : idle_ns(idle_ns) {
+    sz slots = std::bit_ceil(std::max(capacity + capacity / 7,
+                                      FLOW_GROUP_SIZE));
+    _control = std::make_unique<u8[]>(slots);
+    std::memset(_control.get(), FLOW_EMPTY, slots);
+    _slots = std::make_unique<std::optional<Flow>[]>(slots);
+    _group_mask = slots / FLOW_GROUP_SIZE - 1;
+  }
+
+  FlowTable(const FlowTable &) = delete;
+  FlowTable &operator=(const FlowTable &) = delete;
+
+  auto size() const -> sz { return _size; }
+  auto slots() const -> sz { return (_group_mask + 1) * FLOW_GROUP_SIZE; }
+  /// @brief Flows that fit before inserts fail, 7/8 of the slots.
+  auto capacity() const -> sz { return slots() - slots() / 8; }
+
+  static auto _tag(u64 hash) -> u8 { return hash & 0x7F; }
+  auto _group(u64 hash) const -> sz { return (hash >> 7) & _group_mask; }
+
+  void _prefetch(u64 hash) const {
+    sz group = _group(hash);
+    __builtin_prefetch(&_control[group * FLOW_GROUP_SIZE]);
+    __builtin_prefetch(&_slots[group * FLOW_GROUP_SIZE]);
+  }
+
+  /// @brief The slot holding `key`, probing from the group of `hash`.
+  auto _find(const FlowKey &key, u64 hash) const -> std::optional<sz> {
+    sz group = _group(hash);
+    for (sz step = 0; step <= _group_mask; step++) {
+      const u8 *control = &_control[group * FLOW_GROUP_SIZE];
+      for (u16 match = flow_match(control, _tag(hash)); match;
+           match &= match - 1) {
+        sz slot = group * FLOW_GROUP_SIZE + std::countr_zero(match);
+        if (_slots[slot]->key == key)
+          return slot;
+      }
+      if (flow_match(control, FLOW_EMPTY))
+        return std::nullopt;
+      group = (group + step + 1) & _group_mask;
+    }
+    return std::nullopt;
+  }
+
+  bool contains(const FlowKey &key) const {
+    return _find(key, key.hash()).has_value();
+  }
+
+  /// @brief The flow of `key`, and marks it as seen at `now`.
+  auto find(const FlowKey &key, u64 now) -> T * {
+    auto slot = _find(key, key.hash());
+    if (!slot)
+      return nullptr;
+    _slots[*slot]->last_seen = now;
+    return &_slots[*slot]->value;
+  }
+
+  /// @brief Looks up a vector of keys. They are all hashed first and their
+  /// groups prefetched a few keys ahead of the probing, so the cache misses
+  /// overlap. Flows that are found are marked as seen.
+  void find_batch(std::span<const FlowKey> keys, std::span<T *> values,
+                  u64 now) {
+    ASSERT(values.size() >= keys.size(), "{} values for {} keys",
+           values.size(), keys.size());
+    constexpr sz BATCH = 256;
+    std::array<u64, BATCH> hashes;
+
+    for (sz start = 0; start < keys.size(); start += BATCH) {
+      sz count = std::min(BATCH, keys.size() - start);
+      for (sz i = 0; i < count; i++) {
+        hashes[i] = keys[start + i].hash();
+        if (i < FLOW_PREFETCH)
+          _prefetch(hashes[i]);
+      }
+
+      for (sz i = 0; i < count; i++) {
+        if (i + FLOW_PREFETCH < count)
+          _prefetch(hashes[i + FLOW_PREFETCH]);
+        auto slot = _find(keys[start + i], hashes[i]);
+        values[start + i] = slot ? &_slots[*slot]->value : nullptr;
+        if (slot)
+          _slots[*slot]->last_seen = now;
+      }
+    }
+  }
+
+  /// @brief Adds a flow, or finds the one already there.
+  /// @return The flow's value and whether it was added, `nullptr` if the
+  /// table is full
+  auto insert(const FlowKey &key, T value, u64 now) -> std::pair<T *, bool> {
+    u64 hash = key.hash();
+    if (auto slot = _find(key, hash))
+      return {&_slots[*slot]->value, false};
+    if (_size == capacity())
+      return {nullptr, false};
+    if (_size + _deleted >= capacity())
+      _rehash();
+
+    sz group = _group(hash);
+    for (sz step = 0;; step++) {
+      u8 *control = &_control[group * FLOW_GROUP_SIZE];
+      u16 free = flow_match(control, FLOW_EMPTY) |
+                 flow_match(control, FLOW_DELETED);
+      if (free) {
+        sz slot = group * FLOW_GROUP_SIZE + std::countr_zero(free);
+        if (_control[slot] == FLOW_DELETED)
+          _deleted--;
+        _control[slot] = _tag(hash);
+        _slots[slot].emplace(key, now, std::move(value));
+        _size++;
+        return {&_slots[slot]->value, true};
+      }
+      group = (group + step + 1) & _group_mask;
+    }
+  }
+
+  /// @return `false` if there was no such flow
+  bool erase(const FlowKey &key) {
+    auto slot = _find(key, key.hash());
+    if (!slot)
+      return false;
+    _erase_slot(*slot);
+    return true;
+  }
+
+  /// @brief Empties a slot. A group that still has an empty slot never sent
+  /// a probe on to the next group, so the slot can simply be empty again.
+  /// Otherwise probes may have passed through it, and it stays deleted.
+  void _erase_slot(sz slot) {
+    const u8 *group = &_control[slot / FLOW_GROUP_SIZE * FLOW_GROUP_SIZE];
+    bool ends_probes = flow_match(group, FLOW_EMPTY);
+    _control[slot] = ends_probes ? FLOW_EMPTY : FLOW_DELETED;
+    _deleted += !ends_probes;
+    _slots[slot].reset();
+    _size--;
+  }
+
+  /// @brief Reinserts every flow to get rid of the deleted slots.
+  void _rehash() {
+    std::vector<Flow> flows;
+    flows.reserve(_size);
+    for (sz i = 0; i < slots(); i++)
+      if (_slots[i]) {
+        flows.push_back(std::move(*_slots[i]));
+        _slots[i].reset();
+      }
+
+    std::memset(_control.get(), FLOW_EMPTY, slots());
+    _size = _deleted = 0;
+    for (auto &flow : flows)
+      insert(flow.key, std::move(flow.value), flow.last_seen);
+  }
+
+  /// @brief Sweeps up to `budget` slots, carrying on where the last call
+  /// stopped, and removes the flows idle for `idle_ns` or longer. Each is
+  /// handed to `on_expire` before it goes.
+  /// @return How many flows expired
+  template <typename F> auto expire(u64 now, sz budget, F &&on_expire) -> sz {
+    sz expired = 0;
+    budget = std::min(budget, slots());
+    for (sz i = 0; i < budget; i++, _cursor = (_cursor + 1) & (slots() - 1)) {
+      auto &flow = _slots[_cursor];
+      if (!flow || now - flow->last_seen < idle_ns)
+        continue;
+
+      on_expire(flow->key, flow->value);
+      _erase_slot(_cursor);
+      expired++;
+    }
+    return expired;
+  }
+
+  template <typename F> auto expire(u64 now, F &&on_expire) -> sz {
+    return expire(now, slots(), std::forward<F>(on_expire));
+  }
+
+  /// @brief Hands every flow's key and value to `f`, in no particular order.
+  /// The table must not change meanwhile.
+  template <typename F> void for_each(F &&f) {
+    for (sz i = 0; i < slots(); i++)
+      if (_slots[i])
+        f(_slots[i]->key, _slots[i]->value);
+  }
+};
+
+} // namespace toad
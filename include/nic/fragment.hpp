@@ -0,0 +1,323 @@
+#pragma once
+
+#include <algorithm>
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "../bytes/chain.hpp"
+#include "../bytes/packet_buffer.hpp"
+#include "checksum.hpp"
+#include "defs.hpp"
+#include "ipv4.hpp"
+
+namespace toad {
+
+/// @brief Memory the datagrams waiting for their fragments may pin, Linux's
+/// `ipfrag_high_thresh`.
+constexpr sz FRAGMENT_MEMORY_LIMIT = 4 << 20;
+/// @brief How long a datagram may take to arrive in full, Linux's
+/// `ipfrag_time`.
+constexpr u64 FRAGMENT_TIMEOUT_NS = 30'000'000'000;
+/// @brief Fragments a datagram may arrive in, more only makes it costlier.
+constexpr sz FRAGMENT_MAX_PER_DATAGRAM = 64;
+/// @brief What a fragment is charged for its bookkeeping, on top of the
+/// chunk it pins.
+constexpr sz FRAGMENT_OVERHEAD = 64;
+/// @brief Largest IPv4 packet, header included.
+constexpr sz IP_MAX_PACKET_SIZE = 65535;
+
+/// @brief Fragments belong to the same datagram if these match, RFC 791
+/// section 3.2.
+struct FragmentKey {
+  u32 src;
+  u32 dst;
+  u16 identification;
+  u8 protocol;
+
+  bool operator==(const FragmentKey &) const = default;
+};
+
+struct FragmentKeyHash {
+  auto operator()(const FragmentKey &key) const -> sz {
+    u64 a = (u64)key.src << 32 | key.dst;
+    u64 b = (u64)key.identification << 8 | key.protocol;
+    return (a ^ (b * 0x9E3779B97F4A7C15)) * 0xC2B2AE3D27D4EB4F;
+  }
+};
+
+/// @brief Puts fragmented IPv4 datagrams back together.
+///
+/// Fragments are kept as slices of the frames they came in, the datagram
+/// is handed out as a chain of them behind the first fragment's header,
+/// nothing is copied. The price is that a small fragment pins its whole
+/// chunk, so every fragment is charged for the chunk's capacity.
+///
+/// A flood of fragments that never complete can not take more than
+/// `memory_limit`: past it the datagrams that saw a fragment least recently
+/// are dropped. Datagrams not complete after `timeout_ns` are dropped as
+/// well. Overlapping fragments drop the whole datagram, like Linux does
+/// since 4.19, there is no telling which of the copies is the real one.
+///
+/// A reassembler is not synchronized, it belongs to the thread of one queue.
+/// Fragments carry no ports, the kernel hashes all of a datagram's fragments
+/// onto the same queue.
+struct Reassembler {
+  struct Fragment {
+    sz offset;
+    Buffer payload;
+  };
+
+  struct Datagram {
+    FragmentKey key;
+    u64 created;
+    /// @brief Sorted by offset, never overlapping
+    std::vector<Fragment> fragments = {};
+    /// @brief Of the fragment at offset zero, once it arrived
+    Buffer header = {};
+    sz received = 0;
+    /// @brief Known once the last fragment arrived
+    std::optional<sz> length = std::nullopt;
+    sz charged = 0;
+  };
+
+  /// @brief Least recently added to first
+  std::list<Datagram> _datagrams;
+  std::unordered_map<FragmentKey, std::list<Datagram>::iterator,
+                     FragmentKeyHash>
+      _index;
+  sz _memory = 0;
+
+  sz memory_limit;
+  u64 timeout_ns;
+
+  u64 reassembled = 0;
+  /// @brief Datagrams dropped to stay under `memory_limit`
+  u64 evicted = 0;
+  u64 timed_out = 0;
+  /// @brief Datagrams dropped for overlapping, oversized or otherwise
+  /// impossible fragments
+  u64 malformed = 0;
+
+  explicit Reassembler(sz memory_limit = FRAGMENT_MEMORY_LIMIT,
+                       u64 timeout_ns = FRAGMENT_TIMEOUT_NS)
+      : memory_limit(memory_limit), timeout_ns(timeout_ns) {}
+
+  Reassembler(const Reassembler &) = delete;
+  Reassembler &operator=(const Reassembler &) = delete;
+
+  /// @brief Memory pinned by the fragments held.
+  auto memory() const -> sz { return _memory; }
+  /// @brief Datagrams waiting for fragments.
+  auto size() const -> sz { return _datagrams.size(); }
+
+  static bool is_fragment(const u8 *header) {
+    return (IpHeader::Flags::load(header) & IP_FLAG_MORE_FRAGMENTS) ||
+           IpHeader::FragmentOffset::load(header) != 0;
+  }
+
+  /// @brief Takes a packet, starting at its IP header and ending where its
+  /// total length says. A packet that is no fragment is handed back as is.
+  /// @return The datagram, if this fragment completed it
+  auto push(Buffer packet, u64 now) -> std::optional<BufferChain> {
+    const u8 *header = packet.data();
+    if (!is_fragment(header))
+      return BufferChain(std::move(packet));
+
+    sz header_length = IpHeader::Ihl::load(header) * 4;
+    sz offset = IpHeader::FragmentOffset::load(header) * 8;
+    bool more = IpHeader::Flags::load(header) & IP_FLAG_MORE_FRAGMENTS;
+    FragmentKey key = {
+        _bits(IpHeader::Src::load(header)),
+        _bits(IpHeader::Dst::load(header)),
+        IpHeader::Identification::load(header),
+        IpHeader::Protocol::load(header),
+    };
+
+    auto found = _index.find(key);
+    auto it = found == _index.end() ? _open(key, now) : found->second;
+    _datagrams.splice(_datagrams.end(), _datagrams, it);
+
+    if (!_add(*it, offset, more, std::move(packet), header_length)) {
+      malformed++;
+      _drop(it);
+      return std::nullopt;
+    }
+
+    if (it->length && it->received == *it->length)
+      return _complete(it);
+
+    while (_memory > memory_limit) {
+      bool last = _datagrams.begin() == it;
+      _drop(_datagrams.begin());
+      evicted++;
+      if (last)
+        return std::nullopt;
+    }
+    return std::nullopt;
+  }
+
+  /// @brief Drops the datagrams older than `timeout_ns`.
+  /// @return How many were dropped
+  auto expire(u64 now) -> sz {
+    sz expired = 0;
+    for (auto it = _datagrams.begin(); it != _datagrams.end();) {
+      auto next = std::next(it);
+      if (now - it->created >= timeout_ns) {
+        _drop(it);
+        expired++;
+      }
+      it = next;
+    }
+    timed_out += expired;
+    return expired;
+  }
+
+  static auto _bits(const IPv4 &ip) -> u32 {
+    return ((u32)ip[0] << 24) | ((u32)ip[1] << 16) | ((u32)ip[2] << 8) | ip[3];
+  }
+
+  auto _open(const FragmentKey &key, u64 now)
+      -> std::list<Datagram>::iterator {
+    _datagrams.push_back(Datagram{key, now});
+    auto it = std::prev(_datagrams.end());
+    _index.emplace(key, it);
+    return it;
+  }
+
+  void _drop(std::list<Datagram>::iterator it) {
+    _memory -= it->charged;
+    _index.erase(it->key);
+    _datagrams.erase(it);
+  }
+
+  /// @brief Files a fragment in its place.
+  /// @return `false` if it can not be part of the datagram
+  bool _add(Datagram &datagram, sz offset, bool more, Buffer packet,
+            sz header_length) {
+    sz length = packet.size() - header_length;
+    sz end = offset + length;
+    if (length == 0 || end + header_length > IP_MAX_PACKET_SIZE ||
+        (more && length % 8 != 0) ||
+        datagram.fragments.size() == FRAGMENT_MAX_PER_DATAGRAM)
+      return false;
+
+    // Only the last fragment says how long the datagram is, nothing may
+    // reach past it
+    if (datagram.length && end > *datagram.length)
+      return false;
+    if (!more) {
+      if (datagram.length && end != *datagram.length)
+        return false;
+      if (!datagram.fragments.empty() &&
+          datagram.fragments.back().offset +
+                  datagram.fragments.back().payload.size() >
+              end)
+        return false;
+      datagram.length = end;
+    }
+
+    auto &fragments = datagram.fragments;
+    auto next = std::lower_bound(
+        fragments.begin(), fragments.end(), offset,
+        [](const Fragment &fragment, sz offset) {
+          return fragment.offset < offset;
+        });
+    if (next != fragments.end() && next->offset < end)
+      return false;
+    if (next != fragments.begin()) {
+      auto &previous = *std::prev(next);
+      if (previous.offset + previous.payload.size() > offset)
+        return false;
+    }
+
+    sz charge = packet.capacity() + FRAGMENT_OVERHEAD;
+    datagram.charged += charge;
+    _memory += charge;
+    datagram.received += length;
+    if (offset == 0)
+      datagram.header = packet.slice(header_length);
+    Buffer payload = std::move(packet).slice(header_length, packet.size());
+    fragments.insert(next, Fragment{offset, std::move(payload)});
+    return true;
+  }
+
+  /// @brief Patches the first fragment's header to describe the whole
+  /// datagram and chains the payloads behind it.
+  auto _complete(std::list<Datagram>::iterator it)
+      -> std::optional<BufferChain> {
+    Buffer header = std::move(it->header);
+    sz total = header.size() + *it->length;
+    if (total > IP_MAX_PACKET_SIZE) {
+      malformed++;
+      _drop(it);
+      return std::nullopt;
+    }
+
+    u8 *bytes = header.data();
+    IpHeader::TotalLength::store(bytes, total);
+    IpHeader::Flags::store(
+        bytes, IpHeader::Flags::load(bytes) & ~IP_FLAG_MORE_FRAGMENTS);
+    IpHeader::FragmentOffset::store(bytes, 0);
+    IpHeader::Checksum::store(bytes, 0);
+    IpHeader::Checksum::store(bytes, checksum({bytes, header.size()}));
+
+    BufferChain datagram(std::move(header));
+    for (auto &fragment : it->fragments)
+      datagram.append(std::move(fragment.payload));
+
+    reassembled++;
+    _drop(it);
+    return datagram;
+  }
+};
+
+/// @brief Cuts an IPv4 packet into fragments that fit into `mtu`, RFC 791
+/// section 3.2. Every fragment repeats the header and has `headroom` in
+/// front of it for the link layer. The payload is copied, a frame has to be
+/// contiguous to be written.
+/// NOTE: options are repeated in every fragment, even those that should
+/// only be in the first one.
+/// @return `std::nullopt` if the packet does not fit and must not be
+/// fragmented, the sender should learn about it with ICMP
+inline auto fragment_ipv4(std::span<const u8> packet, sz mtu,
+                          sz headroom = PACKET_DEFAULT_HEADROOM)
+    -> std::optional<std::vector<PacketBuffer>> {
+  const u8 *header = packet.data();
+  sz header_length = IpHeader::Ihl::load(header) * 4;
+  u8 flags = IpHeader::Flags::load(header);
+  sz first_offset = IpHeader::FragmentOffset::load(header) * 8;
+
+  sz per_fragment = (mtu - std::min(mtu, header_length)) & ~(sz)7;
+  bool fits = packet.size() <= mtu;
+  if (!fits && ((flags & IP_FLAG_DONT_FRAGMENT) || per_fragment == 0))
+    return std::nullopt;
+
+  auto payload = packet.subspan(header_length);
+  if (fits)
+    per_fragment = payload.size();
+
+  std::vector<PacketBuffer> fragments;
+  for (sz offset = 0; offset < payload.size() || fragments.empty();
+       offset += per_fragment) {
+    sz length = std::min(per_fragment, payload.size() - offset);
+    bool last = offset + length == payload.size();
+
+    PacketBuffer fragment(header_length + length, headroom);
+    u8 *bytes = fragment.put(header_length + length);
+    std::memcpy(bytes, header, header_length);
+    std::memcpy(bytes + header_length, payload.data() + offset, length);
+
+    IpHeader::TotalLength::store(bytes, header_length + length);
+    IpHeader::Flags::store(
+        bytes, last ? flags : flags | IP_FLAG_MORE_FRAGMENTS);
+    IpHeader::FragmentOffset::store(bytes, (first_offset + offset) / 8);
+    IpHeader::Checksum::store(bytes, 0);
+    IpHeader::Checksum::store(bytes, checksum({bytes, header_length}));
+    fragments.push_back(std::move(fragment));
+  }
+  return fragments;
+}
+
+} // namespace toad
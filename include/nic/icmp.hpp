@@ -1,9 +1,14 @@
 #pragma once
 
+#include "../bytes/packet_buffer.hpp"
 #include "checksum.hpp"
+#include "ethernet.hpp"
+#include "ipv4.hpp"
 #include "packet.hpp"
+#include "schema.hpp"
 #include "typestate.hpp"
 
+#include <optional>
 #include <vector>
 
 namespace toad {
@@ -15,12 +20,25 @@ enum struct IcmpType : u8 {
   EchoRequest = 8,
 };
 
+/// @brief Layout of the ICMP header, RFC 792. The meaning of the last four
+/// bytes depends on the type.
+struct IcmpHeader {
+  static constexpr sz SIZE = 8;
+
+  using Type = Field<0, 8>;
+  using Code = Field<8, 8>;
+  using Checksum = Field<16, 16>;
+  using Rest = BytesField<4, 4>;
+
+  static_assert(fields_fit_v<SIZE, Type, Code, Checksum, Rest>);
+};
+
 template <TypestateDirection direction> struct Icmp {
-  IcmpType type;
-  u8 code;
-  toad::checksum checksum;
+  IcmpType type = IcmpType::EchoReply;
+  u8 code = 0;
+  toad::checksum checksum = 0;
   // TODO: maybe use a union instead?
-  std::array<u8, 4> rest;
+  std::array<u8, 4> rest = {};
   Buffer payload;
 
   static constexpr auto header_size() -> sz { return 8; }
@@ -38,14 +56,21 @@ template <TypestateDirection direction> struct Icmp {
       : type(icmp.type), code(icmp.code), checksum(icmp.checksum),
         rest(icmp.rest), payload(icmp.payload) {}
 
-  template <ByteBuffer B> static Icmp try_from_stream(ByteIStream<B> &stream) {
+  /// @brief A short message sets `stream.errc` and comes back zeroed, check
+  /// it before using the result.
+  template <ByteReader S> static Icmp try_from_stream(S &stream) {
+    using H = IcmpHeader;
+
     Icmp ret;
+    const u8 *header = stream.read_header(H::SIZE);
+    if (!header)
+      return ret;
 
-    stream.read_u8((u8 *)&ret.type)
-        .read_u8(&ret.code)
-        .read_u16(&ret.checksum.n)
-        .read_array(&ret.rest)
-        .read_buffer(&ret.payload);
+    ret.type = (IcmpType)H::Type::load(header);
+    ret.code = H::Code::load(header);
+    ret.checksum = H::Checksum::load(header);
+    ret.rest = H::Rest::load(header);
+    stream.read_buffer(&ret.payload);
 
     // NOTE(Artur): If we are sending a malformed packet its a logical error,
     // but if we receive it from the user the checksum mismatch might be
@@ -58,29 +83,70 @@ template <TypestateDirection direction> struct Icmp {
     return ret;
   }
 
+  void store_header(u8 *header) const {
+    using H = IcmpHeader;
+
+    H::Type::store(header, (u8)type);
+    H::Code::store(header, code);
+    H::Checksum::store(header, checksum);
+    H::Rest::store(header, rest);
+  }
+
   template <ByteBuffer B> void try_to_stream(ByteOStream<B> &bytes) const {
-    bytes.write_u8((u8)type)
-        .write_u8(code)
-        .write_u16(checksum)
-        .write_array(rest)
-        .write_buffer(payload);
+    if (u8 *header = bytes.write_header(IcmpHeader::SIZE))
+      store_header(header);
+    bytes.write_buffer(payload);
+  }
+
+  /// @brief Serializes the message and fills in its checksum, summing the
+  /// payload while it is being copied so it is only read once.
+  template <ByteBuffer B>
+  void try_to_stream_with_checksum(ByteOStream<B> &bytes) {
+    u8 *header = bytes.write_header(IcmpHeader::SIZE + payload.size());
+    if (!header)
+      return;
+
+    checksum = 0;
+    store_header(header);
+    u16 payload_sum =
+        copy_and_sum(header + IcmpHeader::SIZE, payload.span());
+    u16 header_sum = ones_complement_sum({header, IcmpHeader::SIZE});
+
+    checksum = (u16)~fold_sum(header_sum + payload_sum);
+    IcmpHeader::Checksum::store(header, checksum);
+  }
+
+  /// @brief Prepends the header to a packet that already holds the payload
+  /// and checksums the whole message in place, `payload` itself is ignored.
+  void push_onto(PacketBuffer &packet) {
+    checksum = 0;
+
+    u8 *header = packet.push(header_size());
+    store_header(header);
+
+    checksum = toad::checksum(packet.span());
+    IcmpHeader::Checksum::store(header, checksum);
+  }
+
+  /// @brief Same as `push_onto`, but the checksum is left zero for a device
+  /// to fill in, see `VirtioNetHeader::partial_checksum`.
+  void push_onto_unchecksummed(PacketBuffer &packet) {
+    checksum = 0;
+    store_header(packet.push(header_size()));
   }
 
   sz buffer_size() const { return 1 + 1 + 2 + rest.size() + payload._size; }
 
+  /// @brief Sums the header and the payload where they are, nothing is
+  /// serialized.
   toad::checksum calculate_checksum() const {
-    // NOTE(Artur): Round up to a multiple of two, required by the spec
-    sz padded_buffer_size = (buffer_size() + 1) & ~1;
-    Buffer buffer(padded_buffer_size);
-    auto ostream = ByteOStream<Buffer>(buffer);
-    try_to_stream(ostream);
+    std::array<u8, IcmpHeader::SIZE> header;
+    store_header(header.data());
+    IcmpHeader::Checksum::store(header.data(), 0);
 
-    // Zero out the place where the checksum would be
-    // equivalent to skipping the checksum field
-    buffer.data()[2] = 0;
-    buffer.data()[3] = 0;
-
-    return toad::checksum({buffer.data(), buffer._size});
+    u16 sum = fold_sum(ones_complement_sum(header) +
+                       ones_complement_sum(payload.span()));
+    return (u16)~sum;
   }
 
   auto clone_as_echo_response() const -> Icmp<~direction> {
@@ -97,6 +163,124 @@ template <TypestateDirection direction> struct Icmp {
 
 static_assert(Packet<Icmp<DirectionIn>, Buffer>);
 
+/// @brief An ICMP message read and patched in place, see `IpView`. The view
+/// spans the whole message, the checksum covers all of it.
+template <TypestateDirection direction> struct IcmpView {
+  Buffer buffer;
+
+  static auto try_from(Buffer buffer) -> std::optional<IcmpView> {
+    if (buffer.size() < IcmpHeader::SIZE)
+      return std::nullopt;
+    return IcmpView(std::move(buffer));
+  }
+
+  /// @brief The same bytes, viewed as travelling the other way.
+  auto reverse() const -> IcmpView<~direction> {
+    return IcmpView<~direction>(buffer);
+  }
+
+  auto header() const -> u8 * { return buffer.data(); }
+  auto payload() const -> Buffer {
+    return buffer.slice(IcmpHeader::SIZE, buffer.size());
+  }
+
+  auto type() const -> IcmpType {
+    return (IcmpType)IcmpHeader::Type::load(header());
+  }
+  auto code() const -> u8 { return IcmpHeader::Code::load(header()); }
+  auto checksum() const -> toad::checksum {
+    return IcmpHeader::Checksum::load(header());
+  }
+  auto rest() const -> std::array<u8, 4> {
+    return IcmpHeader::Rest::load(header());
+  }
+
+  void set_type(IcmpType type)
+    requires(direction == DirectionOut)
+  {
+    IcmpHeader::Type::store(header(), (u8)type);
+  }
+  void set_code(u8 code)
+    requires(direction == DirectionOut)
+  {
+    IcmpHeader::Code::store(header(), code);
+  }
+  void set_checksum(toad::checksum checksum)
+    requires(direction == DirectionOut)
+  {
+    IcmpHeader::Checksum::store(header(), checksum);
+  }
+  void set_rest(const std::array<u8, 4> &rest)
+    requires(direction == DirectionOut)
+  {
+    IcmpHeader::Rest::store(header(), rest);
+  }
+
+  /// @brief Sets the type and patches the checksum for the one word that
+  /// changed instead of summing the whole message again.
+  void rewrite_type(IcmpType type)
+    requires(direction == DirectionOut)
+  {
+    u16 from = ((u8)this->type() << 8) | code();
+    set_type(type);
+    set_checksum(checksum().update(from, ((u8)type << 8) | code()));
+  }
+
+  /// @brief Recomputes the checksum over the whole message.
+  void update_checksum()
+    requires(direction == DirectionOut)
+  {
+    set_checksum(0);
+    set_checksum(toad::checksum(buffer.span()));
+  }
+
+  bool checksum_ok() const { return toad::checksum(buffer.span()) == 0; }
+
+  explicit IcmpView(Buffer buffer) : buffer(std::move(buffer)) {}
+};
+
+/// @brief Turns an echo request into its reply where it lies, a handful of
+/// stores instead of parsing and serializing the packet. The addresses swap
+/// places, the TTL starts over at `IP_DEFAULT_TTL` and the type flips to
+/// `EchoReply`. Both checksums are patched for the words that changed,
+/// RFC 1624. The reply is addressed to the requester's MAC, the source MAC
+/// is left to whoever sends it.
+/// @param frame Starts at the Ethernet header of an IPv4 packet whose header
+/// was checked
+/// @param l4 Where the ICMP header starts in `frame`
+/// @return `false` if it is no echo request, the frame is left as it was
+inline bool echo_reply_in_place(std::span<u8> frame, sz l4) {
+  if (frame.size() < l4 + IcmpHeader::SIZE)
+    return false;
+  u8 *bytes = frame.data();
+  u8 *ip = bytes + EthernetHeader::SIZE;
+  u8 *icmp = bytes + l4;
+  if ((IcmpType)IcmpHeader::Type::load(icmp) != IcmpType::EchoRequest)
+    return false;
+
+  u8 code = IcmpHeader::Code::load(icmp);
+  u16 from = ((u8)IcmpType::EchoRequest << 8) | code;
+  u16 to = ((u8)IcmpType::EchoReply << 8) | code;
+  IcmpHeader::Type::store(icmp, (u8)IcmpType::EchoReply);
+  checksum icmp_sum = IcmpHeader::Checksum::load(icmp);
+  IcmpHeader::Checksum::store(icmp, icmp_sum.update(from, to));
+
+  u8 protocol = IpHeader::Protocol::load(ip);
+  from = (IpHeader::Ttl::load(ip) << 8) | protocol;
+  to = (IP_DEFAULT_TTL << 8) | protocol;
+  IpHeader::Ttl::store(ip, IP_DEFAULT_TTL);
+  checksum ip_sum = IpHeader::Checksum::load(ip);
+  IpHeader::Checksum::store(ip, ip_sum.update(from, to));
+
+  // The sum does not depend on the order of the words, swapping leaves it
+  IPv4 src = IpHeader::Src::load(ip);
+  IpHeader::Src::store(ip, IpHeader::Dst::load(ip));
+  IpHeader::Dst::store(ip, src);
+
+  EthernetHeader::Dst::store(bytes, EthernetHeader::Src::load(bytes));
+  return true;
+}
+
 } // namespace toad
 
 namespace fmt {
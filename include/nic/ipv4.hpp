@@ -1,13 +1,17 @@
 #pragma once
 
 #include <array>
+#include <cstring>
+#include <optional>
 #include <span>
 #include <vector>
 
 #include "../bytes/bytestream.hpp"
+#include "../bytes/packet_buffer.hpp"
 #include "checksum.hpp"
 #include "defs.hpp"
 #include "packet.hpp"
+#include "schema.hpp"
 #include "typestate.hpp"
 
 namespace toad {
@@ -22,20 +26,49 @@ struct IPv4 : std::array<u8, 4> {
 
 constexpr sz IP_HEADER_SIZE = 20;
 
+/// @brief Layout of the fixed part of the IPv4 header, RFC 791 section 3.1.
+struct IpHeader {
+  using Version = Field<0, 4>;
+  using Ihl = Field<4, 4>;
+  using Dscp = Field<8, 6>;
+  using Ecn = Field<14, 2>;
+  using TotalLength = Field<16, 16>;
+  using Identification = Field<32, 16>;
+  using Flags = Field<48, 3>;
+  using FragmentOffset = Field<51, 13>;
+  using Ttl = Field<64, 8>;
+  using Protocol = Field<72, 8>;
+  using Checksum = Field<80, 16>;
+  using Src = BytesField<12, 4>;
+  using Dst = BytesField<16, 4>;
+
+  static_assert(fields_fit_v<IP_HEADER_SIZE, Version, Ihl, Dscp, Ecn,
+                             TotalLength, Identification, Flags,
+                             FragmentOffset, Ttl, Protocol, Checksum, Src,
+                             Dst>);
+};
+
+/// @brief Bits of `IpHeader::Flags`, the first one is reserved.
+constexpr u8 IP_FLAG_DONT_FRAGMENT = 0b010;
+constexpr u8 IP_FLAG_MORE_FRAGMENTS = 0b001;
+
+/// @brief TTL of the packets we originate, Linux's `ip_default_ttl`.
+constexpr u8 IP_DEFAULT_TTL = 64;
+
 template <TypestateDirection direction> struct Ip {
-  u8 version;
-  u8 ihl;
-  u8 dscp;
-  u8 ecn;
-  u16 total_length;
-  u16 identification;
-  u8 flags;
-  u16 fragment_offset;
-  u8 ttl;
-  u8 protocol;
-  checksum header_checksum;
-  IPv4 src;
-  IPv4 dst;
+  u8 version = 0;
+  u8 ihl = 0;
+  u8 dscp = 0;
+  u8 ecn = 0;
+  u16 total_length = 0;
+  u16 identification = 0;
+  u8 flags = 0;
+  u16 fragment_offset = 0;
+  u8 ttl = 0;
+  u8 protocol = 0;
+  checksum header_checksum = 0;
+  IPv4 src = std::array<u8, 4>{};
+  IPv4 dst = std::array<u8, 4>{};
   /// NOTE(Artur): Options would go here, but I'm not sure how to parse them yet
   Buffer payload;
 
@@ -60,64 +93,92 @@ template <TypestateDirection direction> struct Ip {
         protocol(ip.protocol), header_checksum(ip.header_checksum), src(ip.src),
         dst(ip.dst) {}
 
-  template <ByteBuffer B> static Ip try_from_stream(ByteIStream<B> &stream) {
-    Ip ret;
+  /// @brief Decodes the fixed part of a header that is known to be there.
+  static auto load_header(const u8 *header) -> Ip {
+    using H = IpHeader;
 
-    u8 version_ihl;
-    u8 dscp_ecn;
-    u16 flags_fragment_offset;
+    Ip ret;
+    ret.version = H::Version::load(header);
+    ret.ihl = H::Ihl::load(header);
+    ret.dscp = H::Dscp::load(header);
+    ret.ecn = H::Ecn::load(header);
+    ret.total_length = H::TotalLength::load(header);
+    ret.identification = H::Identification::load(header);
+    ret.flags = H::Flags::load(header);
+    ret.fragment_offset = H::FragmentOffset::load(header);
+    ret.ttl = H::Ttl::load(header);
+    ret.protocol = H::Protocol::load(header);
+    ret.header_checksum = H::Checksum::load(header);
+    ret.src = H::Src::load(header);
+    ret.dst = H::Dst::load(header);
+    return ret;
+  }
 
-    stream.read_u8(&version_ihl)
-        .read_u8(&dscp_ecn)
-        .read_u16(&ret.total_length)
-        .read_u16(&ret.identification)
-        .read_u16(&flags_fragment_offset)
-        .read_u8(&ret.ttl)
-        .read_u8(&ret.protocol)
-        .read_u16(&ret.header_checksum.n)
-        .read_array(&ret.src)
-        .read_array(&ret.dst)
-        .read_buffer(&ret.payload);
+  void store_header(u8 *header) const {
+    using H = IpHeader;
+
+    H::Version::store(header, version);
+    H::Ihl::store(header, ihl);
+    H::Dscp::store(header, dscp);
+    H::Ecn::store(header, ecn);
+    H::TotalLength::store(header, total_length);
+    H::Identification::store(header, identification);
+    H::Flags::store(header, flags);
+    H::FragmentOffset::store(header, fragment_offset);
+    H::Ttl::store(header, ttl);
+    H::Protocol::store(header, protocol);
+    H::Checksum::store(header, header_checksum);
+    H::Src::store(header, src);
+    H::Dst::store(header, dst);
+  }
 
-    // TODO: return result
-    ASSERT(stream.errc == ByteStreamErrorCode::Ok,
-           "Failed to read {} bytes, IP packet at cursor={}: {}",
-           (int)stream.errc, stream.last_size, stream.cursor, stream.buffer);
+  /// @brief Parses a packet off the wire. A short or malformed packet sets
+  /// `stream.errc` and comes back without a payload, check it before using
+  /// the result.
+  template <ByteReader S> static Ip try_from_stream(S &stream) {
+    const u8 *header = stream.read_header(IP_HEADER_SIZE);
+    if (!header)
+      return Ip();
+
+    Ip ret = load_header(header);
+
+    // NOTE: the link layer may pad short packets, so the payload is bounded by
+    // the total length and not by whatever is left in the frame.
+    sz header_length = ret.ihl * 4;
+    if (header_length < IP_HEADER_SIZE || ret.total_length < header_length) {
+      stream.errc = ByteStreamErrorCode::Malformed;
+      return ret;
+    }
+
+    // TODO: parse the options instead of skipping them
+    stream.skip(header_length - IP_HEADER_SIZE)
+        .read_buffer(&ret.payload, ret.total_length - header_length);
+    return ret;
+  }
 
-    ret.version = (version_ihl >> 4) & 0xF;
-    ret.ihl = version_ihl & 0xF;
+  template <ByteBuffer B> void try_to_stream(ByteOStream<B> &stream) const {
+    if (u8 *header = stream.write_header(IP_HEADER_SIZE))
+      store_header(header);
+    stream.write_buffer(payload);
+  }
 
-    ret.dscp = (dscp_ecn >> 2) & 0b111111;
-    ret.ecn = dscp_ecn & 0b11;
+  /// @brief Prepends the header to a packet that already holds the payload,
+  /// filling in the total length and the header checksum. Options are not
+  /// written, `payload` itself is ignored.
+  void push_onto(PacketBuffer &packet) {
+    ihl = header_size() / 4;
+    total_length = header_size() + packet.size();
+    header_checksum = 0;
 
-    ret.flags = (flags_fragment_offset >> 13) & 0b111;
-    ret.fragment_offset = (flags_fragment_offset & 0x1FFF);
+    u8 *header = packet.push(header_size());
+    store_header(header);
 
-    return ret;
+    header_checksum = checksum({header, header_size()});
+    IpHeader::Checksum::store(header, header_checksum);
   }
 
-  template <ByteBuffer B> void try_to_stream(ByteOStream<B> &stream) const {
-    stream.write_u8((version << 4) | ihl)
-        .write_u8((dscp << 2) | ecn)
-        .write_u16(total_length)
-        .write_u16(identification);
-
-    // NOTE(Artur): Some additional bytes
-    // swizzling needs to be done since
-    // this is technically a 2-byte word
-    u8 hi_byte = (flags << 5) | ((fragment_offset >> 8) & 0x1F);
-    u8 lo_byte = fragment_offset & 0xFF;
-    stream.write_u8(hi_byte).write_u8(lo_byte);
-
-    stream.write_u8(ttl)
-        .write_u8(protocol)
-        .write_u16(header_checksum)
-        .write_array(src)
-        .write_array(dst)
-        .write_buffer(payload);
-  }
-
-  auto clone_as_response(Buffer payload, u8 ttl = 64) const -> Ip<~direction> {
+  auto clone_as_response(Buffer payload, u8 ttl = IP_DEFAULT_TTL) const
+      -> Ip<~direction> {
     auto response = Ip<~direction>(*this);
 
     response.payload = payload;
@@ -133,24 +194,181 @@ template <TypestateDirection direction> struct Ip {
     return IP_HEADER_SIZE + payload._size;
   }
 
+  /// @brief The header checksum covers the header alone, so only the header
+  /// is serialized, onto the stack, with the checksum field zeroed.
   checksum calculate_checksum() const {
-    // NOTE(Artur): Round up to a multiple of two, required by the spec
-    sz padded_buffer_size = (buffer_size() + 1) & ~1;
-    Buffer buffer(padded_buffer_size);
-    auto ostream = ByteOStream<Buffer>(buffer);
-    try_to_stream(ostream);
-
-    // Zero out the place where the checksum would be
-    // equivalent to skipping the checksum field
-    buffer.data()[10] = 0;
-    buffer.data()[11] = 0;
-
-    return checksum({buffer.data(), buffer._size});
+    std::array<u8, IP_HEADER_SIZE> header;
+    store_header(header.data());
+    IpHeader::Checksum::store(header.data(), 0);
+    return checksum(header);
   }
 };
 
 static_assert(Packet<Ip<DirectionIn>, Buffer>);
 
+/// @brief An IP packet read and patched where it lies instead of being
+/// decoded into an `Ip`. Holds a slice of the buffer starting at the header,
+/// so it keeps the bytes alive but never copies them. Only outgoing packets
+/// can be written to, a received one is turned around with `reverse` first.
+template <TypestateDirection direction> struct IpView {
+  Buffer buffer;
+
+  /// @brief Checks the header once, every accessor after that is in bounds.
+  /// Padding past the total length is cut off.
+  static auto try_from(Buffer buffer) -> std::optional<IpView> {
+    if (buffer.size() < IP_HEADER_SIZE)
+      return std::nullopt;
+
+    const u8 *header = buffer.data();
+    sz header_length = IpHeader::Ihl::load(header) * 4;
+    sz total_length = IpHeader::TotalLength::load(header);
+    if (IpHeader::Version::load(header) != 4 ||
+        header_length < IP_HEADER_SIZE || total_length < header_length ||
+        total_length > buffer.size())
+      return std::nullopt;
+
+    return IpView(std::move(buffer).slice(total_length));
+  }
+
+  /// @brief The same bytes, viewed as travelling the other way.
+  auto reverse() const -> IpView<~direction> {
+    return IpView<~direction>(buffer);
+  }
+
+  auto header() const -> u8 * { return buffer.data(); }
+  auto header_length() const -> sz { return ihl() * 4; }
+  /// @brief Everything after the header and its options.
+  auto payload() const -> Buffer {
+    return buffer.slice(header_length(), buffer.size());
+  }
+
+  auto version() const -> u8 { return IpHeader::Version::load(header()); }
+  auto ihl() const -> u8 { return IpHeader::Ihl::load(header()); }
+  auto dscp() const -> u8 { return IpHeader::Dscp::load(header()); }
+  auto ecn() const -> u8 { return IpHeader::Ecn::load(header()); }
+  auto total_length() const -> u16 {
+    return IpHeader::TotalLength::load(header());
+  }
+  auto identification() const -> u16 {
+    return IpHeader::Identification::load(header());
+  }
+  auto flags() const -> u8 { return IpHeader::Flags::load(header()); }
+  auto fragment_offset() const -> u16 {
+    return IpHeader::FragmentOffset::load(header());
+  }
+  auto ttl() const -> u8 { return IpHeader::Ttl::load(header()); }
+  auto protocol() const -> u8 { return IpHeader::Protocol::load(header()); }
+  auto header_checksum() const -> checksum {
+    return IpHeader::Checksum::load(header());
+  }
+  auto src() const -> IPv4 { return IpHeader::Src::load(header()); }
+  auto dst() const -> IPv4 { return IpHeader::Dst::load(header()); }
+
+  void set_dscp(u8 dscp)
+    requires(direction == DirectionOut)
+  {
+    IpHeader::Dscp::store(header(), dscp);
+  }
+  void set_ecn(u8 ecn)
+    requires(direction == DirectionOut)
+  {
+    IpHeader::Ecn::store(header(), ecn);
+  }
+  void set_identification(u16 identification)
+    requires(direction == DirectionOut)
+  {
+    IpHeader::Identification::store(header(), identification);
+  }
+  void set_ttl(u8 ttl)
+    requires(direction == DirectionOut)
+  {
+    IpHeader::Ttl::store(header(), ttl);
+  }
+  void set_header_checksum(checksum header_checksum)
+    requires(direction == DirectionOut)
+  {
+    IpHeader::Checksum::store(header(), header_checksum);
+  }
+  void set_src(const IPv4 &src)
+    requires(direction == DirectionOut)
+  {
+    IpHeader::Src::store(header(), src);
+  }
+  void set_dst(const IPv4 &dst)
+    requires(direction == DirectionOut)
+  {
+    IpHeader::Dst::store(header(), dst);
+  }
+
+  /// @brief Sets the TTL and patches the checksum for the one word that
+  /// changed instead of summing the header again.
+  void rewrite_ttl(u8 ttl)
+    requires(direction == DirectionOut)
+  {
+    u16 from = (this->ttl() << 8) | protocol();
+    set_ttl(ttl);
+    set_header_checksum(
+        header_checksum().update(from, (ttl << 8) | protocol()));
+  }
+
+  void decrement_ttl()
+    requires(direction == DirectionOut)
+  {
+    rewrite_ttl(ttl() - 1);
+  }
+
+  /// @brief Swaps the addresses, for a reply. The checksum stays as it is,
+  /// the sum does not depend on the order of the words.
+  void swap_addresses()
+    requires(direction == DirectionOut)
+  {
+    IPv4 src = this->src();
+    set_src(dst());
+    set_dst(src);
+  }
+
+  /// @brief Rewrites the source address and patches the checksum, for NAT.
+  /// NOTE: TCP and UDP checksums cover the addresses too, through the pseudo
+  /// header, and need the same `checksum::update`.
+  void rewrite_src(const IPv4 &src)
+    requires(direction == DirectionOut)
+  {
+    set_header_checksum(header_checksum().update(this->src(), src));
+    set_src(src);
+  }
+
+  void rewrite_dst(const IPv4 &dst)
+    requires(direction == DirectionOut)
+  {
+    set_header_checksum(header_checksum().update(this->dst(), dst));
+    set_dst(dst);
+  }
+
+  /// @brief Checksum of the header and its options, with the checksum field
+  /// counted as zero.
+  auto calculate_checksum() const -> checksum {
+    std::array<u8, 60> copy;
+    std::memcpy(copy.data(), header(), header_length());
+    IpHeader::Checksum::store(copy.data(), 0);
+    return checksum({copy.data(), header_length()});
+  }
+
+  /// @brief Recomputes the header checksum after the fields were patched.
+  void update_checksum()
+    requires(direction == DirectionOut)
+  {
+    set_header_checksum(0);
+    set_header_checksum(checksum({header(), header_length()}));
+  }
+
+  /// @brief A received packet verifies to zero when summed with its checksum.
+  bool checksum_ok() const {
+    return checksum({header(), header_length()}) == 0;
+  }
+
+  explicit IpView(Buffer buffer) : buffer(std::move(buffer)) {}
+};
+
 } // namespace toad
 
 namespace fmt {
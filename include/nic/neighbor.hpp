@@ -0,0 +1,446 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "../bytes/packet_buffer.hpp"
+#include "arp.hpp"
+#include "defs.hpp"
+#include "ethernet.hpp"
+#include "ipv4.hpp"
+#include "mac.hpp"
+
+namespace toad {
+
+/// @brief Monotonic time the neighbor cache runs on, in nanoseconds.
+auto neighbor_now() -> u64 {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/// @brief How long a confirmed neighbor is used without asking again.
+constexpr u64 NEIGHBOR_REACHABLE_NS = 30'000'000'000;
+/// @brief How long a stale neighbor is still used while it is re-probed,
+/// before it is forgotten.
+constexpr u64 NEIGHBOR_STALE_NS = 60'000'000'000;
+/// @brief Time between two ARP requests for an unresolved neighbor.
+constexpr u64 NEIGHBOR_RETRANSMIT_NS = 1'000'000'000;
+/// @brief ARP requests sent before a neighbor is given up on.
+constexpr u8 NEIGHBOR_MAX_PROBES = 3;
+/// @brief Packets held per unresolved neighbor, the oldest go first.
+constexpr sz NEIGHBOR_PENDING_MAX = 8;
+
+/// @brief States of a neighbor, after RFC 4861 section 7.3.2 without the
+/// DELAY and PROBE refinements.
+enum struct NeighborState : u8 {
+  Empty = 0,
+  /// @brief Was in use and got removed, probing continues past it
+  Removed,
+  /// @brief Asked for, with packets waiting on the answer
+  Incomplete,
+  Reachable,
+  /// @brief Not confirmed lately, still used while it is asked for again
+  Stale,
+};
+
+/// @brief What `NeighborCache::resolve` did with a packet.
+enum struct NeighborResolution : u8 {
+  /// @brief The MAC is known, send right away
+  Resolved,
+  /// @brief A request is in flight already, the packet waits for it
+  Queued,
+  /// @brief The packet waits, and an ARP request has to be sent for it
+  RequestNeeded,
+  /// @brief The table is full, the packet is dropped
+  Full,
+};
+
+/// @brief Maps IPv4 addresses to MACs for the forwarding path.
+///
+/// Lookups never lock and never write, so any amount of threads may look up
+/// while the table changes. Every slot is guarded by a sequence lock: writers
+/// make the sequence odd, change the slot and make it even again, a reader
+/// retries if the sequence was odd or moved while it read. Writers are rare,
+/// they come from ARP traffic and timers, and take a mutex.
+///
+/// The table is open addressed with linear probing and never grows, readers
+/// could not follow it. Removed neighbors leave a marker behind so probing
+/// continues past them, the table is rebuilt in place once the markers pile
+/// up. A lookup racing with the rebuild may miss, which only sends it down
+/// the slow path of `resolve`, which locks.
+///
+/// Packets waiting for a neighbor are held next to its slot, one ARP request
+/// is in flight per neighbor no matter how many packets miss at once.
+struct NeighborCache {
+  /// @brief 16 bytes, four slots share a cache line. Everything a lookup
+  /// needs is in here, the rest lives in the arrays of the writers.
+  struct alignas(16) Slot {
+    std::atomic<u32> sequence = 0;
+    std::atomic<u32> ip = 0;
+    /// @brief The MAC in the high 48 bits, the probes sent and the state in
+    /// the low 16
+    std::atomic<u64> value = 0;
+  };
+
+  /// @brief What a slot holds.
+  struct Entry {
+    u32 ip;
+    NeighborState state;
+    u8 probes;
+    u64 mac;
+    /// @brief When the neighbor was last confirmed, or last asked for. Only
+    /// known to writers
+    u64 updated = 0;
+  };
+
+  std::unique_ptr<Slot[]> _slots;
+  sz _mask;
+
+  std::mutex _mutex;
+  /// @brief Packets waiting and the `Entry::updated` of every slot, only
+  /// touched under `_mutex`
+  std::vector<std::deque<Buffer>> _pending;
+  std::vector<u64> _updated;
+  sz _used = 0, _removed = 0;
+
+  u64 reachable_ns = NEIGHBOR_REACHABLE_NS;
+  u64 stale_ns = NEIGHBOR_STALE_NS;
+  u64 retransmit_ns = NEIGHBOR_RETRANSMIT_NS;
+
+  /// @brief Packets dropped because their neighbor never answered, was
+  /// asked for too many packets at once or did not fit
+  std::atomic<u64> dropped = 0;
+
+  /// @param capacity Neighbors the table holds at least. Slots are twice
+  /// that, rounded up to a power of two, to keep probing short.
+  explicit NeighborCache(sz capacity = 1024) {
+    sz slots = std::bit_ceil(std::max<sz>(capacity * 2, 16));
+    _slots = std::make_unique<Slot[]>(slots);
+    _mask = slots - 1;
+    _pending.resize(slots);
+    _updated.resize(slots);
+  }
+
+  NeighborCache(const NeighborCache &) = delete;
+  NeighborCache &operator=(const NeighborCache &) = delete;
+
+  auto capacity() const -> sz { return (_mask + 1) / 2; }
+
+  static auto _ip_bits(const IPv4 &ip) -> u32 {
+    return ((u32)ip[0] << 24) | ((u32)ip[1] << 16) | ((u32)ip[2] << 8) | ip[3];
+  }
+
+  // The MAC is kept in the order it has in memory, so copying it in and out
+  // is a single move rather than six dependent byte stores
+  static constexpr sz _MAC_OFFSET =
+      std::endian::native == std::endian::little ? 0 : 2;
+
+  static auto _mac_bits(const MAC &mac) -> u64 {
+    u64 bits = 0;
+    std::memcpy((u8 *)&bits + _MAC_OFFSET, mac.data(), 6);
+    return bits;
+  }
+
+  static auto _bits_mac(u64 bits) -> MAC {
+    MAC mac;
+    std::memcpy(mac.data(), (const u8 *)&bits + _MAC_OFFSET, 6);
+    return mac;
+  }
+
+  static auto _pack(const Entry &entry) -> u64 {
+    return (entry.mac << 16) | ((u64)entry.probes << 8) | (u8)entry.state;
+  }
+
+  auto _home(u32 ip) const -> sz {
+    // Fibonacci hashing, addresses in a subnet differ in the low bits only
+    return (ip * 0x9E3779B97F4A7C15ull) >> 32 & _mask;
+  }
+
+  static auto _unpack(u32 ip, u64 value) -> Entry {
+    return Entry{ip, (NeighborState)(value & 0xFF), (u8)(value >> 8),
+                 value >> 16};
+  }
+
+  /// @brief Copies a slot out, retrying while a writer is inside it.
+  static auto _read(const Slot &slot) -> Entry {
+    while (true) {
+      u32 before = slot.sequence.load(std::memory_order_acquire);
+      if (before & 1)
+        continue;
+
+      u32 ip = slot.ip.load(std::memory_order_relaxed);
+      u64 value = slot.value.load(std::memory_order_relaxed);
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) == before)
+        return _unpack(ip, value);
+    }
+  }
+
+  /// @brief A slot as the writer sees it. Under `_mutex`, nothing else
+  /// changes the slot, so there is no need to retry.
+  auto _get_locked(sz i) const -> Entry {
+    Entry entry = _unpack(_slots[i].ip.load(std::memory_order_relaxed),
+                          _slots[i].value.load(std::memory_order_relaxed));
+    entry.updated = _updated[i];
+    return entry;
+  }
+
+  auto _state_locked(sz i) const -> NeighborState {
+    return (NeighborState)(_slots[i].value.load(std::memory_order_relaxed) &
+                           0xFF);
+  }
+
+  /// @brief Overwrites a slot. Under `_mutex`.
+  void _set_locked(sz i, const Entry &entry) {
+    Slot &slot = _slots[i];
+    u32 sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.ip.store(entry.ip, std::memory_order_relaxed);
+    slot.value.store(_pack(entry), std::memory_order_relaxed);
+
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+    _updated[i] = entry.updated;
+  }
+
+  /// @brief The MAC of a neighbor that answered, lock-free. Stale neighbors
+  /// are still returned, `tick` asks them again.
+  auto lookup(const IPv4 &ip) const -> std::optional<MAC> {
+    u32 bits = _ip_bits(ip);
+    for (sz i = _home(bits), probes = 0; probes <= _mask;
+         i = (i + 1) & _mask, probes++) {
+      Entry entry = _read(_slots[i]);
+      if (entry.state == NeighborState::Empty)
+        return std::nullopt;
+      if (entry.ip != bits || entry.state == NeighborState::Removed)
+        continue;
+
+      if (entry.state == NeighborState::Reachable ||
+          entry.state == NeighborState::Stale)
+        return _bits_mac(entry.mac);
+      return std::nullopt;
+    }
+    return std::nullopt;
+  }
+
+  /// @brief Slot of `ip`, or `std::nullopt`. Under `_mutex`.
+  auto _find_locked(u32 ip) const -> std::optional<sz> {
+    for (sz i = _home(ip), probes = 0; probes <= _mask;
+         i = (i + 1) & _mask, probes++) {
+      auto state = _state_locked(i);
+      if (state == NeighborState::Empty)
+        return std::nullopt;
+      if (state != NeighborState::Removed &&
+          _slots[i].ip.load(std::memory_order_relaxed) == ip)
+        return i;
+    }
+    return std::nullopt;
+  }
+
+  /// @brief A free slot for `ip`, reusing removed ones. Under `_mutex`.
+  auto _claim_locked(u32 ip) -> std::optional<sz> {
+    if (_used >= capacity())
+      return std::nullopt;
+    if (_used + _removed >= capacity())
+      _rebuild_locked();
+
+    for (sz i = _home(ip);; i = (i + 1) & _mask) {
+      auto state = _state_locked(i);
+      if (state == NeighborState::Removed)
+        _removed--;
+      if (state == NeighborState::Empty || state == NeighborState::Removed) {
+        _used++;
+        return i;
+      }
+    }
+  }
+
+  void _remove_locked(sz slot) {
+    Entry entry = _get_locked(slot);
+    entry.state = NeighborState::Removed;
+    _set_locked(slot, entry);
+    dropped.fetch_add(_pending[slot].size(), std::memory_order_relaxed);
+    _pending[slot].clear();
+    _used--;
+    _removed++;
+  }
+
+  /// @brief Reinserts every neighbor to get rid of the removed markers.
+  void _rebuild_locked() {
+    std::vector<std::pair<Entry, std::deque<Buffer>>> live;
+    for (sz i = 0; i <= _mask; i++) {
+      Entry entry = _get_locked(i);
+      if (entry.state != NeighborState::Empty &&
+          entry.state != NeighborState::Removed)
+        live.emplace_back(entry, std::move(_pending[i]));
+      if (entry.state != NeighborState::Empty)
+        _set_locked(i, Entry{0, NeighborState::Empty, 0, 0});
+      _pending[i].clear();
+    }
+
+    _removed = 0;
+    for (auto &[entry, pending] : live) {
+      sz i = _home(entry.ip);
+      while (_state_locked(i) != NeighborState::Empty)
+        i = (i + 1) & _mask;
+      _set_locked(i, entry);
+      _pending[i] = std::move(pending);
+    }
+  }
+
+  struct Resolved {
+    NeighborResolution resolution;
+    /// @brief Set if `Resolved`
+    std::optional<MAC> mac = std::nullopt;
+  };
+
+  /// @brief Finds the MAC for a packet to `ip`, or takes the packet and
+  /// holds on to it until the MAC is known. Only the first packet to miss
+  /// asks for an ARP request, the ones after it wait for the same answer.
+  /// The packet is left alone if it was resolved.
+  auto resolve(const IPv4 &ip, Buffer &packet, u64 now = neighbor_now())
+      -> Resolved {
+    if (auto mac = lookup(ip))
+      return {NeighborResolution::Resolved, mac};
+
+    std::lock_guard guard(_mutex);
+    u32 bits = _ip_bits(ip);
+    auto slot = _find_locked(bits);
+    if (slot) {
+      Entry entry = _get_locked(*slot);
+      if (entry.state != NeighborState::Incomplete)
+        return {NeighborResolution::Resolved, _bits_mac(entry.mac)};
+
+      _hold_locked(*slot, std::move(packet));
+      return {NeighborResolution::Queued};
+    }
+
+    slot = _claim_locked(bits);
+    if (!slot) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      packet = Buffer();
+      return {NeighborResolution::Full};
+    }
+
+    _set_locked(*slot, Entry{bits, NeighborState::Incomplete, 1, 0, now});
+    _hold_locked(*slot, std::move(packet));
+    return {NeighborResolution::RequestNeeded};
+  }
+
+  void _hold_locked(sz slot, Buffer packet) {
+    auto &pending = _pending[slot];
+    if (pending.size() >= NEIGHBOR_PENDING_MAX) {
+      pending.pop_front();
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    pending.push_back(std::move(packet));
+  }
+
+  /// @brief Learns that `ip` is at `mac`, from a reply or from the sender of
+  /// any ARP packet. Unless `create` is set only neighbors already known or
+  /// asked for are updated, so a flood of requests cannot fill the table.
+  /// @return The packets that were waiting for this neighbor
+  auto confirm(const IPv4 &ip, const MAC &mac, u64 now = neighbor_now(),
+               bool create = false) -> std::deque<Buffer> {
+    std::lock_guard guard(_mutex);
+    u32 bits = _ip_bits(ip);
+    auto slot = _find_locked(bits);
+    if (!slot && create)
+      slot = _claim_locked(bits);
+    if (!slot)
+      return {};
+
+    _set_locked(*slot,
+                Entry{bits, NeighborState::Reachable, 0, _mac_bits(mac), now});
+    return std::exchange(_pending[*slot], {});
+  }
+
+  /// @brief Forgets a neighbor, dropping whatever waits for it.
+  void remove(const IPv4 &ip) {
+    std::lock_guard guard(_mutex);
+    if (auto slot = _find_locked(_ip_bits(ip)))
+      _remove_locked(*slot);
+  }
+
+  /// @brief Ages the table, call it about once a second. Reachable neighbors
+  /// past `reachable_ns` go stale and stale ones past `stale_ns` are
+  /// forgotten. Unresolved ones are asked again every `retransmit_ns` and
+  /// given up on after `NEIGHBOR_MAX_PROBES`.
+  /// @return Addresses to send an ARP request for
+  auto tick(u64 now = neighbor_now()) -> std::vector<IPv4> {
+    std::lock_guard guard(_mutex);
+    std::vector<IPv4> requests;
+
+    for (sz i = 0; i <= _mask; i++) {
+      Entry entry = _get_locked(i);
+      u64 age = now - entry.updated;
+
+      switch (entry.state) {
+      case NeighborState::Reachable:
+        if (age < reachable_ns)
+          break;
+        entry.state = NeighborState::Stale;
+        _set_locked(i, entry);
+        requests.push_back(_bits_ip(entry.ip));
+        break;
+      case NeighborState::Stale:
+        if (age >= reachable_ns + stale_ns)
+          _remove_locked(i);
+        break;
+      case NeighborState::Incomplete:
+        if (age < retransmit_ns)
+          break;
+        if (entry.probes >= NEIGHBOR_MAX_PROBES) {
+          _remove_locked(i);
+          break;
+        }
+        entry.probes++;
+        entry.updated = now;
+        _set_locked(i, entry);
+        requests.push_back(_bits_ip(entry.ip));
+        break;
+      default:
+        break;
+      }
+    }
+
+    return requests;
+  }
+
+  static auto _bits_ip(u32 bits) -> IPv4 {
+    return IPv4({(u8)(bits >> 24), (u8)(bits >> 16), (u8)(bits >> 8),
+                 (u8)bits});
+  }
+
+  /// @brief Neighbors in the table, including unresolved ones.
+  auto size() -> sz {
+    std::lock_guard guard(_mutex);
+    return _used;
+  }
+};
+
+/// @brief A broadcast who-has for `target`, ready to be queued on a device.
+auto build_arp_request(const MAC &own_mac, const IPv4 &own_ip,
+                       const IPv4 &target) -> PacketBuffer {
+  using H = ArpHeader<6, 4>;
+  ArpIPv4<DirectionOut> request(1, own_mac, own_ip, std::array<u8, 6>{},
+                                target);
+
+  PacketBuffer packet(H::SIZE);
+  request.store_header(packet.put(H::SIZE));
+  EthernetFrame<DirectionOut>(MAC({0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}),
+                              own_mac, ETHERTYPE_ARP)
+      .push_onto(packet);
+  return packet;
+}
+
+} // namespace toad
@@ -0,0 +1,500 @@
+#pragma once
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <linux/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <memory>
+#include <optional>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "device.hpp"
+
+namespace toad {
+
+/// @brief Bytes of a receive block. The kernel hands frames over a block at
+/// a time, so this is how many a single wakeup can deliver.
+constexpr sz PACKET_RING_BLOCK_SIZE = 1 << 18;
+/// @brief Receive blocks per queue.
+constexpr sz PACKET_RING_BLOCKS = 64;
+/// @brief How long the kernel fills a block before it hands it over half
+/// empty. Bounds the latency a quiet link adds.
+constexpr u32 PACKET_RING_RETIRE_MS = 1;
+/// @brief Bytes of the transmit ring per queue, at least a block of it.
+constexpr sz PACKET_RING_TX_SIZE = 4 << 20;
+/// @brief Bytes of a transmit block, the frames of a block never straddle
+/// two.
+constexpr sz PACKET_RING_TX_BLOCK_SIZE = 1 << 16;
+/// @brief Where a frame starts in its transmit slot, behind the slot's header.
+constexpr sz PACKET_RING_TX_OFFSET = TPACKET_ALIGN(sizeof(tpacket3_hdr));
+
+/// @brief A receive block of the ring, with the reference count of the
+/// frames that point into it.
+struct RingBlock {
+  /// @brief First, so the release callback finds the block
+  BufferHeader header;
+  tpacket_block_desc *desc = nullptr;
+  /// @brief Walked, but not yet handed back to the kernel
+  std::atomic<bool> held = false;
+
+  /// @brief Hands the block back to the kernel once the walk and every frame
+  /// in it are gone.
+  static void _release(BufferHeader *header) {
+    auto *block = (RingBlock *)header;
+    header->shared.store(BufferHeader::SHARED_ONE | BufferHeader::MERGED,
+                         std::memory_order_relaxed);
+    __atomic_store_n(&block->desc->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+    // SAFETY: cleared only after the status, a reader that sees the block
+    // not held never sees the status of the walk that held it
+    block->held.store(false, std::memory_order_release);
+  }
+};
+
+/// @brief One queue of a packet socket: the socket, its receive and
+/// transmit rings mapped into memory, and the event loop that serves them.
+///
+/// Frames are read straight out of the receive ring, a frame is a `Buffer`
+/// pointing into its block and the block goes back to the kernel once every
+/// frame of it is dropped. Frames are written by copying them into the next
+/// free slot of the transmit ring, `flush` hands every slot filled since to
+/// the kernel with one syscall.
+///
+/// NOTE: the kernel fills blocks in order and never skips one that is not
+/// back yet. A frame that is held on to, by a TCP receive queue or a
+/// reassembler, pins its whole block, and once the ring comes around to it
+/// the kernel drops whatever arrives.
+struct PacketRingQueue {
+  int fd;
+  /// @brief `nullptr` for the default event loop
+  IOContext *io = nullptr;
+  /// @brief Runs the consumers of `io`, `nullptr` for the spawning thread's
+  Executor *executor = nullptr;
+
+  /// @brief Both rings, the receive ring first
+  std::span<u8> _map;
+
+  std::unique_ptr<RingBlock[]> _blocks;
+  sz _block_count;
+  sz _next_block = 0;
+
+  u8 *_tx;
+  sz _tx_frame_size;
+  sz _tx_frame_count;
+  sz _next_tx = 0;
+  /// @brief Slots filled since the last `flush`
+  sz _tx_queued = 0;
+
+  /// @param map The receive ring of `block_count` blocks of `block_size`,
+  /// followed by the transmit ring of `tx_frame_size` slots
+  PacketRingQueue(int fd, std::span<u8> map, sz block_size, sz block_count,
+                  sz tx_frame_size)
+      : fd(fd), _map(map), _blocks(new RingBlock[block_count]),
+        _block_count(block_count), _tx(map.data() + block_size * block_count),
+        _tx_frame_size(tx_frame_size),
+        _tx_frame_count((map.size() - block_size * block_count) /
+                        tx_frame_size) {
+    for (sz i = 0; i < block_count; i++) {
+      auto &block = _blocks[i];
+      block.header.data = map.data() + i * block_size;
+      block.header.capacity = block_size;
+      block.header.release = RingBlock::_release;
+      block.desc = (tpacket_block_desc *)block.header.data;
+    }
+  }
+
+  auto io_context() -> IOContext & { return io ? *io : this_io_context(); }
+
+  /// @brief Spawns a consumer of the queue next to its event loop.
+  void spawn(Task task) {
+    if (executor)
+      executor->spawn(std::move(task));
+    else
+      toad::spawn(std::move(task));
+  }
+
+  /// @brief Hands every frame of the blocks the kernel is done with to
+  /// `on_frame`, without a syscall. Busy pollers call this directly.
+  /// @return How many frames were handed over
+  template <typename F> auto receive(F &&on_frame) -> sz {
+    sz received = 0;
+    while (true) {
+      auto &block = _blocks[_next_block];
+      // NOTE: held first, see `RingBlock::_release`
+      if (block.held.load(std::memory_order_acquire))
+        break;
+      u32 status = __atomic_load_n(&block.desc->hdr.bh1.block_status,
+                                   __ATOMIC_ACQUIRE);
+      if (!(status & TP_STATUS_USER))
+        break;
+
+      block.held.store(true, std::memory_order_relaxed);
+      received += _walk(block, on_frame);
+      _next_block = (_next_block + 1) % _block_count;
+    }
+    return received;
+  }
+
+  template <typename F> auto _walk(RingBlock &block, F &on_frame) -> sz {
+    // The walk holds a reference of its own, the block can not go back to
+    // the kernel before it is done
+    Buffer walk;
+    walk._header = &block.header;
+    walk._size = block.header.capacity;
+
+    const auto &desc = block.desc->hdr.bh1;
+    sz offset = desc.offset_to_first_pkt, received = 0;
+    for (u32 i = 0; i < desc.num_pkts; i++) {
+      auto *packet = (tpacket3_hdr *)(walk.data() + offset);
+      auto *address =
+          (sockaddr_ll *)((u8 *)packet + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+      offset += packet->tp_next_offset;
+
+      // Our own frames come back on some devices, and truncated ones did
+      // not fit into a block
+      if (address->sll_pkttype == PACKET_OUTGOING ||
+          packet->tp_snaplen != packet->tp_len ||
+          packet->tp_snaplen < EthernetHeader::SIZE) {
+        metrics::local().frames_dropped.add();
+        continue;
+      }
+
+      sz start = (u8 *)packet - walk.data() + packet->tp_mac;
+      Buffer buffer = walk.slice(start, start + packet->tp_snaplen);
+      capture::frame(buffer.span(), capture::Direction::Inbound);
+      ByteIStream stream(buffer);
+      auto frame = EthernetFrame<DirectionIn>::try_from_stream(stream);
+      // Frames that never left the host have no checksum yet, the kernel
+      // trusts them all the same
+      if (packet->tp_status & (TP_STATUS_CSUM_VALID | TP_STATUS_CSUMNOTREADY))
+        frame.offload.flags = VirtioNetHeader::DATA_VALID;
+      on_frame(std::move(frame));
+      received++;
+    }
+    return received;
+  }
+
+  /// @brief Starts receiving frames through the event loop, which polls the
+  /// socket and walks every block the kernel hands over. Frames arriving
+  /// while `backlog` of them wait for the consumer are dropped. Close the
+  /// channel to stop receiving.
+  /// NOTE: the event loop holds on to the queue until the channel is closed.
+  auto frames(sz backlog = 1024) -> std::shared_ptr<FrameChannel> {
+    auto channel = std::make_shared<FrameChannel>(backlog);
+    _poll_frames(channel);
+    return channel;
+  }
+
+  void _poll_frames(std::shared_ptr<FrameChannel> channel) {
+    io_context().submit_poll(fd, POLLIN, [this, channel](u32) {
+      if (_deliver(*channel))
+        return true;
+      if (!channel->closed())
+        _wait_for_block(channel);
+      return false;
+    });
+  }
+
+  /// @brief Hands the frames of every ready block to `channel`.
+  /// @return `false` if the poll should stop: the channel is closed, or
+  /// nothing was walked because the next block is still held. The socket
+  /// stays readable while a ready block waits behind a held one, so polling
+  /// on would only spin.
+  auto _deliver(FrameChannel &channel) -> bool {
+    if (channel.closed())
+      return false;
+
+    sz received = receive([&](EthernetFrame<DirectionIn> frame) {
+      if (!channel.try_send(std::move(frame)))
+        metrics::local().frames_dropped.add();
+    });
+    if (received)
+      return true;
+    return !_blocks[_next_block].held.load(std::memory_order_acquire);
+  }
+
+  /// @brief Looks every `PACKET_RING_RETIRE_MS` whether the next block was
+  /// handed back, and polls the socket again once it was.
+  void _wait_for_block(std::shared_ptr<FrameChannel> channel) {
+    io_context().submit_timer(
+        PACKET_RING_RETIRE_MS * 1'000'000, [this, channel]() {
+          if (channel->closed())
+            return false;
+          if (_blocks[_next_block].held.load(std::memory_order_acquire))
+            return true;
+          _poll_frames(channel);
+          return false;
+        });
+  }
+
+  /// @brief Wakes the consumer of `channel` from the event loop every
+  /// `interval_ns`, see `Channel::wake`, until the channel is closed.
+  void wake_every(std::shared_ptr<FrameChannel> channel, u64 interval_ns) {
+    io_context().submit_timer(interval_ns, [channel]() {
+      if (channel->closed())
+        return false;
+      channel->wake();
+      return true;
+    });
+  }
+
+  /// @brief Copies a finished frame into the transmit ring. The ring is
+  /// flushed once `TAP_TX_BATCH` frames are in it, or by `flush`. Frames
+  /// that find the ring full are dropped. Only one coroutine at a time may
+  /// queue frames.
+  void queue_eth(const PacketBuffer &packet) { _queue(packet.span()); }
+
+  void queue_eth(const EthernetView<DirectionOut> &frame) {
+    _queue(frame.buffer.span());
+  }
+
+  void _queue(std::span<const u8> frame) {
+    auto *slot = (tpacket3_hdr *)(_tx + _next_tx * _tx_frame_size);
+    u32 status = __atomic_load_n(&slot->tp_status, __ATOMIC_ACQUIRE);
+    // The kernel did not get to the frame queued in the slot a whole ring
+    // ago, drop like a full TX queue would
+    if (frame.size() > _tx_frame_size - PACKET_RING_TX_OFFSET ||
+        (status != TP_STATUS_AVAILABLE && status != TP_STATUS_WRONG_FORMAT)) {
+      metrics::local().frames_dropped.add();
+      return;
+    }
+
+    capture::frame(frame, capture::Direction::Outbound);
+    std::memcpy((u8 *)slot + PACKET_RING_TX_OFFSET, frame.data(),
+                frame.size());
+    slot->tp_len = frame.size();
+    slot->tp_next_offset = 0;
+    __atomic_store_n(&slot->tp_status, TP_STATUS_SEND_REQUEST,
+                     __ATOMIC_RELEASE);
+
+    _next_tx = (_next_tx + 1) % _tx_frame_count;
+    if (++_tx_queued >= TAP_TX_BATCH)
+      flush();
+  }
+
+  /// @brief Has the kernel send every frame queued since the last flush.
+  void flush() {
+    if (_tx_queued == 0)
+      return;
+
+    _tx_queued = 0;
+    if (send(fd, nullptr, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN &&
+        errno != ENOBUFS)
+      TOAD_ERROR("Flushing the TX ring failed, code={}", errno);
+  }
+};
+
+/// @brief Attaches to an interface that already exists, a veth or a dummy,
+/// with a `PacketRingQueue` per queue. Serves the same pipeline a `Device`
+/// does, the interface keeps its addresses and `own_ip` is ours alone.
+struct PacketRingDevice {
+  MAC own_mac;
+  IPv4 own_ip;
+  sz maximum_transmission_unit;
+
+  std::vector<PacketRingQueue> queues;
+  /// @brief Event loops of every queue but the first, see `serve_queues`
+  std::vector<std::unique_ptr<QueueLoop>> _queue_loops;
+
+  /// @param queues More than one joins the sockets into a fanout group,
+  /// the kernel hashes every flow onto one of them
+  static auto try_new(std::string_view interface_name,
+                      std::string_view own_ip, sz queues = 1)
+      -> std::optional<PacketRingDevice> {
+    PacketRingDevice device;
+
+    ifreq ifr;
+    std::memset(&ifr, 0, sizeof(ifr));
+    std::strncpy(ifr.ifr_name, interface_name.data(), IFNAMSIZ - 1);
+
+    int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd < 0) {
+      perror("socket");
+      return {};
+    }
+    if (ioctl(sock_fd, SIOCGIFINDEX, &ifr) < 0) {
+      perror("ioctl(SIOCGIFINDEX)");
+      close(sock_fd);
+      return {};
+    }
+    int index = ifr.ifr_ifindex;
+    if (ioctl(sock_fd, SIOCGIFMTU, &ifr) < 0) {
+      perror("ioctl(SIOCGIFMTU)");
+      close(sock_fd);
+      return {};
+    }
+    close(sock_fd);
+    device.maximum_transmission_unit = ifr.ifr_mtu;
+    device.own_mac = MAC::system_addr(interface_name);
+
+    in_addr addr;
+    if (inet_pton(AF_INET, own_ip.data(), &addr) != 1) {
+      TOAD_ERROR("Not an IPv4 address: {}", own_ip);
+      return {};
+    }
+    const u8 *bytes = (u8 *)&addr.s_addr;
+    device.own_ip = IPv4({bytes[0], bytes[1], bytes[2], bytes[3]});
+
+    // Sockets of one process share a group, told apart from other processes
+    u16 group = getpid() & 0xFFFF;
+    for (sz i = 0; i < queues; i++) {
+      auto queue =
+          _open(index, device.maximum_transmission_unit, queues > 1, group);
+      if (!queue)
+        return {};
+      device.queues.push_back(std::move(*queue));
+    }
+
+    spdlog::info("Packet rings on interface {} for device {} at {} attached "
+                 "with MTU={} and {} queue(s)",
+                 interface_name, device.own_mac, own_ip,
+                 device.maximum_transmission_unit, queues);
+    return device;
+  }
+
+  static auto _open(int index, sz mtu, bool fanout, u16 group)
+      -> std::optional<PacketRingQueue> {
+    int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd < 0) {
+      perror("socket(AF_PACKET)");
+      return {};
+    }
+    auto fail = [fd](const char *what) -> std::optional<PacketRingQueue> {
+      perror(what);
+      close(fd);
+      return {};
+    };
+
+    int version = TPACKET_V3, on = 1;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) < 0)
+      return fail("setsockopt(PACKET_VERSION)");
+    // A malformed frame is skipped instead of stalling the transmit ring
+    if (setsockopt(fd, SOL_PACKET, PACKET_LOSS, &on, sizeof(on)) < 0)
+      return fail("setsockopt(PACKET_LOSS)");
+
+    tpacket_req3 rx;
+    std::memset(&rx, 0, sizeof(rx));
+    rx.tp_block_size = PACKET_RING_BLOCK_SIZE;
+    rx.tp_block_nr = PACKET_RING_BLOCKS;
+    rx.tp_frame_size = PACKET_RING_BLOCK_SIZE;
+    rx.tp_frame_nr = PACKET_RING_BLOCKS;
+    rx.tp_retire_blk_tov = PACKET_RING_RETIRE_MS;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx)) < 0)
+      return fail("setsockopt(PACKET_RX_RING)");
+
+    // Slots are a power of two so they tile the blocks
+    sz frame_size = std::max<sz>(
+        2048,
+        std::bit_ceil(PACKET_RING_TX_OFFSET + EthernetHeader::SIZE + mtu));
+    sz block_size = std::max(PACKET_RING_TX_BLOCK_SIZE, frame_size);
+    sz blocks = std::max<sz>(1, PACKET_RING_TX_SIZE / block_size);
+    tpacket_req3 tx;
+    std::memset(&tx, 0, sizeof(tx));
+    tx.tp_block_size = block_size;
+    tx.tp_block_nr = blocks;
+    tx.tp_frame_size = frame_size;
+    tx.tp_frame_nr = blocks * (block_size / frame_size);
+    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &tx, sizeof(tx)) < 0)
+      return fail("setsockopt(PACKET_TX_RING)");
+
+    sz size = PACKET_RING_BLOCK_SIZE * PACKET_RING_BLOCKS + block_size * blocks;
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED)
+      return fail("mmap(PACKET_RX_RING)");
+    PacketRingQueue queue(fd, {(u8 *)map, size}, PACKET_RING_BLOCK_SIZE,
+                          PACKET_RING_BLOCKS, frame_size);
+    auto unmap = [&](const char *what) {
+      munmap(map, size);
+      return fail(what);
+    };
+
+    sockaddr_ll address;
+    std::memset(&address, 0, sizeof(address));
+    address.sll_family = AF_PACKET;
+    address.sll_protocol = htons(ETH_P_ALL);
+    address.sll_ifindex = index;
+    if (bind(fd, (sockaddr *)&address, sizeof(address)) < 0)
+      return unmap("bind(AF_PACKET)");
+
+    // Saves the ring the copies of our own frames, older kernels still hand
+    // them over and the walk skips them
+    setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+
+    // Defragmenting keeps every fragment of a datagram on the same queue,
+    // only the first one carries the ports the flow is hashed by
+    int fanout_arg = group | (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG)
+                                 << 16;
+    if (fanout && setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg,
+                             sizeof(fanout_arg)) < 0)
+      return unmap("setsockopt(PACKET_FANOUT)");
+
+    return queue;
+  }
+
+  /// @brief Gives every queue but the first its own event loop and worker,
+  /// pinned to the next CPU of `cpus`, see `Device::serve_queues`.
+  /// NOTE: the event loops run until the device is destroyed.
+  void serve_queues(std::span<const u32> cpus = {},
+                    std::span<const u32> nodes = {}) {
+    for (sz i = 1; i < queues.size(); i++) {
+      std::optional<u32> cpu, node;
+      if (!cpus.empty()) {
+        sz idx = (i - 1) % cpus.size();
+        cpu = cpus[idx];
+        if (idx < nodes.size())
+          node = nodes[idx];
+      }
+
+      auto &loop =
+          *_queue_loops.emplace_back(std::make_unique<QueueLoop>(cpu, node));
+      queues[i].io = &loop.io;
+      queues[i].executor = &loop.executor;
+      loop.start();
+    }
+  }
+
+  /// @brief Frames of the first queue, see `PacketRingQueue::frames`.
+  auto frames(sz backlog = 1024) -> std::shared_ptr<FrameChannel> {
+    return queues[0].frames(backlog);
+  }
+
+  void queue_eth(const PacketBuffer &packet) { queues[0].queue_eth(packet); }
+
+  void queue_eth(const EthernetView<DirectionOut> &frame) {
+    queues[0].queue_eth(frame);
+  }
+
+  void flush() { queues[0].flush(); }
+
+  PacketRingDevice(const PacketRingDevice &) = delete;
+  PacketRingDevice &operator=(const PacketRingDevice &) = delete;
+  PacketRingDevice(PacketRingDevice &&) = default;
+  PacketRingDevice &operator=(PacketRingDevice &&) = default;
+
+  /// NOTE: frames still held point into the unmapped rings.
+  ~PacketRingDevice() {
+    // The event loops go first, they still read from the queues
+    _queue_loops.clear();
+    for (auto &queue : queues) {
+      munmap(queue._map.data(), queue._map.size());
+      close(queue.fd);
+    }
+  }
+
+protected:
+  PacketRingDevice() {}
+};
+
+} // namespace toad
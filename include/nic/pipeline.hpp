@@ -0,0 +1,660 @@
+#pragma once
+
+#include <array>
+#include <concepts>
+#include <optional>
+#include <span>
+#include <utility>
+
+#include "../concurrency/executor.hpp"
+#include "arp.hpp"
+#include "device.hpp"
+#include "ethernet.hpp"
+#include "fragment.hpp"
+#include "icmp.hpp"
+#include "ipv4.hpp"
+#include "neighbor.hpp"
+#include "route.hpp"
+#include "tcp.hpp"
+#include "virtio.hpp"
+
+namespace toad {
+
+/// @brief Most frames a node handles at once, VPP's frame size.
+constexpr sz PIPELINE_VECTOR_SIZE = 256;
+/// @brief How many frames ahead the data is prefetched. Chunk headers are
+/// prefetched twice as far ahead, since finding the data needs them first.
+constexpr sz PIPELINE_PREFETCH = 4;
+/// @brief How often `serve_pipeline` runs the graph without frames, for the
+/// timers. Finer than any TCP timer, the delayed ACK being the shortest.
+constexpr u64 PIPELINE_TICK_NS = 10'000'000;
+
+/// @brief Anything frames can leave through, a `DeviceQueue` or a `Device`.
+template <typename D>
+concept NetDevice =
+    requires(D device, const EthernetView<DirectionOut> &frame) {
+      device.queue_eth(frame);
+      device.flush();
+    };
+
+/// @brief Nodes of the graph, in the order they run. Every node only hands
+/// frames to the nodes after it, so a single pass over them in this order
+/// empties the graph.
+enum struct PipelineNode : u8 {
+  EthernetInput,
+  ArpInput,
+  Ipv4Input,
+  IcmpInput,
+  TcpInput,
+  Ipv4Forward,
+  EthernetOutput,
+  Drop,
+};
+
+constexpr sz PIPELINE_NODES = (sz)PipelineNode::Drop + 1;
+
+constexpr std::array<const char *, PIPELINE_NODES> PIPELINE_NODE_NAMES = {
+    "ethernet-input", "arp-input",    "ipv4-input",      "icmp-input",
+    "tcp-input",      "ipv4-forward", "ethernet-output", "drop"};
+
+/// @brief The frames waiting for a node. Frames are whole, starting at the
+/// Ethernet header, and carry the offset of their transport header once
+/// `ipv4-input` found it, like the metadata of a `vlib_buffer_t`. Frames off
+/// a TAP device with offloads also carry the work the kernel left undone.
+struct FrameVector {
+  std::array<Buffer, PIPELINE_VECTOR_SIZE> frames;
+  std::array<u16, PIPELINE_VECTOR_SIZE> l4;
+  std::array<VirtioNetHeader, PIPELINE_VECTOR_SIZE> offloads;
+  sz size = 0;
+
+  void push(Buffer &&frame, u16 l4_offset = 0,
+            const VirtioNetHeader &offload = {}) {
+    ASSERT(size < PIPELINE_VECTOR_SIZE, "A vector holds at most {} frames",
+           PIPELINE_VECTOR_SIZE);
+    frames[size] = std::move(frame);
+    l4[size] = l4_offset;
+    offloads[size] = offload;
+    size++;
+  }
+
+  /// @brief Starts loading the bytes of frames coming up soon. A pooled
+  /// chunk's header sits right in front of its bytes, but the pointer to the
+  /// bytes lives in the header, so the header is fetched earlier.
+  void prefetch(sz i) const {
+    if (i + 2 * PIPELINE_PREFETCH < size)
+      __builtin_prefetch(frames[i + 2 * PIPELINE_PREFETCH]._header);
+    if (i + PIPELINE_PREFETCH < size)
+      __builtin_prefetch(frames[i + PIPELINE_PREFETCH].data());
+  }
+
+  void clear() {
+    for (sz i = 0; i < size; i++)
+      frames[i] = Buffer();
+    size = 0;
+  }
+};
+
+/// @brief Frames move through the graph a vector at a time, the way VPP
+/// does it: every node handles all of its frames before the next node runs.
+/// The node's code and tables stay in the caches for the whole vector, and
+/// the headers of the next frames are prefetched while the current ones are
+/// handled.
+///
+///   ethernet-input -> arp-input ----------------> ethernet-output
+///                  -> ipv4-input -> icmp-input -> ethernet-output
+///                                -> tcp-input     (tcp)
+///                                -> ipv4-forward -> ethernet-output
+///   (tcp) ----------------------------------------> ethernet-output
+///
+/// Replies are built in the frame they answer, nothing is copied on the way.
+/// Whatever is not for us and cannot be forwarded ends up in `drop`. TCP
+/// segments for us are handed to `tcp` a vector at a time, and whatever it
+/// has to send is polled after every vector.
+struct Pipeline {
+  MAC own_mac;
+  IPv4 own_ip;
+  /// @brief Length of the prefix of the subnet `own_ip` is in, packets for
+  /// its broadcast address are not forwarded
+  u8 prefix_length = 32;
+  /// @brief Where frames that are not for us are sent
+  std::optional<MAC> next_hop;
+  /// @brief Learns from ARP, and finds where forwarded packets go when
+  /// `next_hop` is unset. May be shared between the pipelines of several
+  /// queues.
+  NeighborCache *neighbors = nullptr;
+  /// @brief Picks the neighbor a forwarded packet goes to. Without it every
+  /// destination is taken to be on the link. May be shared as well.
+  RouteTable *routes = nullptr;
+  /// @brief Holds the fragments of datagrams for us
+  Reassembler reassembler;
+  /// @brief Terminates TCP for `own_ip`. Without it TCP segments for us are
+  /// dropped.
+  TcpStack *tcp = nullptr;
+  /// @brief Largest IP packet a frame leaving may carry, bigger ones are
+  /// fragmented. Should be the device's `maximum_transmission_unit`.
+  sz mtu = 1500;
+  u64 _last_tick = 0;
+
+  std::array<FrameVector, PIPELINE_NODES> _vectors;
+  /// @brief Frames that join `ethernet-output` from outside the graph: ARP
+  /// requests, packets that waited for their neighbor, and TCP segments
+  std::vector<std::pair<Buffer, VirtioNetHeader>> _released;
+
+  /// @brief Frames and vectors handled by every node since the start
+  std::array<u64, PIPELINE_NODES> node_frames = {};
+  std::array<u64, PIPELINE_NODES> node_vectors = {};
+
+  Pipeline(MAC own_mac, IPv4 own_ip) : own_mac(own_mac), own_ip(own_ip) {}
+
+  Pipeline(const Pipeline &) = delete;
+  Pipeline &operator=(const Pipeline &) = delete;
+
+  /// @brief Runs frames through the graph, a vector at a time, and queues
+  /// everything that comes out on `device`, which is flushed once at the end.
+  /// The graph runs even without frames, so that `tcp` gets polled for its
+  /// timers on a quiet link.
+  /// @param offloads What the device said about every frame, if anything.
+  /// Forwarded frames leave with it, or finished if `device` takes none.
+  template <NetDevice D>
+  void process(std::span<Buffer> frames, D &device,
+               std::span<const VirtioNetHeader> offloads = {}) {
+    ASSERT(offloads.empty() || offloads.size() == frames.size(),
+           "Every frame needs its offloads");
+
+    for (sz start = 0; start < frames.size(); start += PIPELINE_VECTOR_SIZE) {
+      sz end = std::min(frames.size(), start + PIPELINE_VECTOR_SIZE);
+      auto &input = _vector(PipelineNode::EthernetInput);
+      for (sz i = start; i < end; i++)
+        input.push(std::move(frames[i]), 0,
+                   offloads.empty() ? VirtioNetHeader() : offloads[i]);
+
+      _run(device);
+    }
+    if (frames.empty())
+      _run(device);
+
+    _tick(device);
+    device.flush();
+  }
+
+  /// @brief About once a second, drops the datagrams that did not arrive in
+  /// time, ages the neighbors and asks for the ones that are due.
+  template <NetDevice D> void _tick(D &device) {
+    u64 now = neighbor_now();
+    if (now - _last_tick < 1'000'000'000)
+      return;
+
+    _last_tick = now;
+    reassembler.expire(now);
+    if (!neighbors)
+      return;
+
+    for (auto &ip : neighbors->tick(now))
+      _released.emplace_back(build_arp_request(own_mac, own_ip, ip).view(),
+                             VirtioNetHeader());
+    _ethernet_output(device);
+  }
+
+  template <NetDevice D> void _run(D &device) {
+    _ethernet_input();
+    _arp_input();
+    _ipv4_input();
+    _icmp_input();
+    _tcp_input();
+    _ipv4_forward();
+    _tcp_output();
+    _ethernet_output(device);
+    _drop();
+  }
+
+  auto _vector(PipelineNode node) -> FrameVector & {
+    return _vectors[(sz)node];
+  }
+
+  /// @brief Counts the vector a node is about to handle.
+  auto _take(PipelineNode node) -> FrameVector & {
+    auto &vector = _vector(node);
+    if (vector.size) {
+      node_frames[(sz)node] += vector.size;
+      node_vectors[(sz)node]++;
+    }
+    return vector;
+  }
+
+  void _ethernet_input() {
+    auto &in = _take(PipelineNode::EthernetInput);
+    auto &arp = _vector(PipelineNode::ArpInput);
+    auto &ipv4 = _vector(PipelineNode::Ipv4Input);
+    auto &drop = _vector(PipelineNode::Drop);
+
+    for (sz i = 0; i < in.size; i++) {
+      in.prefetch(i);
+      Buffer &frame = in.frames[i];
+      if (frame.size() < EthernetHeader::SIZE) {
+        drop.push(std::move(frame));
+        continue;
+      }
+
+      switch (EthernetHeader::Ethertype::load(frame.data())) {
+      case ETHERTYPE_ARP:
+        arp.push(std::move(frame));
+        break;
+      case ETHERTYPE_IPV4:
+        ipv4.push(std::move(frame), 0, in.offloads[i]);
+        break;
+      default:
+        drop.push(std::move(frame));
+      }
+    }
+    in.size = 0;
+  }
+
+  /// @brief Answers requests for our address in place, the request's sender
+  /// becomes the target. Senders are learned as neighbors, the packets that
+  /// waited for them are released.
+  void _arp_input() {
+    using H = ArpHeader<6, 4>;
+    auto &in = _take(PipelineNode::ArpInput);
+    auto &out = _vector(PipelineNode::EthernetOutput);
+    auto &drop = _vector(PipelineNode::Drop);
+    u64 now = neighbors && in.size ? neighbor_now() : 0;
+
+    for (sz i = 0; i < in.size; i++) {
+      auto arp = ArpIPv4View<DirectionIn>::try_from(
+          in.frames[i].slice(EthernetHeader::SIZE, in.frames[i].size()));
+      if (!arp) {
+        drop.push(std::move(in.frames[i]));
+        continue;
+      }
+
+      bool request_for_us = arp->oper() == 1 &&
+                            IPv4(arp->target_protocol_addr()) == own_ip;
+      if (neighbors)
+        _learn(*arp, request_for_us, now);
+
+      if (!request_for_us) {
+        drop.push(std::move(in.frames[i]));
+        continue;
+      }
+
+      auto reply = arp->reverse();
+      reply.set_oper(2);
+      reply.set_target_hardware_addr(arp->sender_hardware_addr());
+      reply.set_target_protocol_addr(arp->sender_protocol_addr());
+      reply.set_sender_hardware_addr(own_mac);
+      reply.set_sender_protocol_addr(own_ip);
+      // The reply goes straight back to the sender, not to the broadcast
+      u8 *frame = in.frames[i].data();
+      EthernetHeader::Dst::store(frame, EthernetHeader::Src::load(frame));
+
+      // Only the ARP body travels, padding past it is cut off
+      out.push(std::move(in.frames[i]).slice(EthernetHeader::SIZE + H::SIZE));
+    }
+    in.size = 0;
+  }
+
+  /// @brief Like Linux, only a request for us creates a neighbor, any other
+  /// ARP packet only refreshes one already known.
+  void _learn(const ArpIPv4View<DirectionIn> &arp, bool create, u64 now) {
+    MAC mac(arp.sender_hardware_addr());
+    auto held =
+        neighbors->confirm(arp.sender_protocol_addr(), mac, now, create);
+    for (auto &packet : held) {
+      EthernetHeader::Dst::store(packet.data(), mac);
+      _released.emplace_back(std::move(packet), VirtioNetHeader());
+    }
+  }
+
+  /// @brief Checks the header and decides whether the packet is ours.
+  /// Fragments for us wait in the reassembler for the rest of their datagram.
+  void _ipv4_input() {
+    auto &in = _take(PipelineNode::Ipv4Input);
+    auto &forward = _vector(PipelineNode::Ipv4Forward);
+    auto &drop = _vector(PipelineNode::Drop);
+
+    for (sz i = 0; i < in.size; i++) {
+      in.prefetch(i);
+      Buffer &frame = in.frames[i];
+      sz available = frame.size() - EthernetHeader::SIZE;
+      const u8 *header = frame.data() + EthernetHeader::SIZE;
+
+      sz header_length =
+          available >= IP_HEADER_SIZE ? IpHeader::Ihl::load(header) * 4 : 0;
+      sz total_length = header_length ? IpHeader::TotalLength::load(header) : 0;
+      if (header_length < IP_HEADER_SIZE ||
+          IpHeader::Version::load(header) != 4 ||
+          total_length < header_length || total_length > available ||
+          checksum({(u8 *)header, header_length}) != 0) {
+        drop.push(std::move(frame));
+        continue;
+      }
+
+      // Ethernet pads short frames, the padding is not part of the packet
+      frame = std::move(frame).slice(EthernetHeader::SIZE + total_length);
+
+      if (IPv4(IpHeader::Dst::load(header)) != own_ip) {
+        if (_group_addressed(frame.data(), header))
+          drop.push(std::move(frame));
+        else
+          forward.push(std::move(frame), 0, in.offloads[i]);
+        continue;
+      }
+
+      if (Reassembler::is_fragment(header))
+        _reassemble(std::move(frame));
+      else
+        _deliver(std::move(frame), in.offloads[i]);
+    }
+    in.size = 0;
+  }
+
+  /// @brief Whether a packet was sent to everyone on the link, which a
+  /// router keeps there: a broadcast or multicast frame, or a packet for the
+  /// limited or the subnet broadcast address or a multicast group.
+  bool _group_addressed(const u8 *frame, const u8 *header) const {
+    // The I/G bit of the destination
+    if (frame[0] & 1)
+      return true;
+
+    u32 dst = RouteTable::_bits(IpHeader::Dst::load(header));
+    if (dst == 0xFFFFFFFF || (dst >> 28) == 0xE)
+      return true;
+
+    u32 host = prefix_length >= 32 ? 0 : 0xFFFFFFFF >> prefix_length;
+    u32 subnet = RouteTable::_bits(own_ip) & ~host;
+    return host && dst == (subnet | host);
+  }
+
+  /// @brief Hands a whole packet for us to the node of its protocol.
+  void _deliver(Buffer frame, const VirtioNetHeader &offload = {}) {
+    const u8 *header = frame.data() + EthernetHeader::SIZE;
+    u16 l4 = EthernetHeader::SIZE + IpHeader::Ihl::load(header) * 4;
+    switch (IpHeader::Protocol::load(header)) {
+    case PROTOCOL_ICMP:
+      _vector(PipelineNode::IcmpInput).push(std::move(frame), l4);
+      return;
+    case PROTOCOL_TCP:
+      if (tcp) {
+        _vector(PipelineNode::TcpInput).push(std::move(frame), l4, offload);
+        return;
+      }
+      break;
+    }
+    _vector(PipelineNode::Drop).push(std::move(frame));
+  }
+
+  /// @brief Files a fragment away. Once its datagram is complete, the
+  /// datagram is copied into one frame behind the Ethernet header of the
+  /// fragment that completed it, the nodes after this one need contiguous
+  /// frames.
+  void _reassemble(Buffer frame) {
+    auto datagram = reassembler.push(
+        frame.slice(EthernetHeader::SIZE, frame.size()), neighbor_now());
+    if (!datagram)
+      return;
+
+    Buffer whole(EthernetHeader::SIZE + datagram->size(), uninitialized);
+    u8 *bytes = whole.data();
+    std::memcpy(bytes, frame.data(), EthernetHeader::SIZE);
+    sz offset = EthernetHeader::SIZE;
+    for (auto &chunk : datagram->chunks()) {
+      std::memcpy(bytes + offset, chunk.data(), chunk.size());
+      offset += chunk.size();
+    }
+    _deliver(std::move(whole));
+  }
+
+  /// @brief Turns echo requests into replies where they lie, see
+  /// `echo_reply_in_place`.
+  void _icmp_input() {
+    auto &in = _take(PipelineNode::IcmpInput);
+    auto &out = _vector(PipelineNode::EthernetOutput);
+    auto &drop = _vector(PipelineNode::Drop);
+
+    for (sz i = 0; i < in.size; i++) {
+      in.prefetch(i);
+      if (!echo_reply_in_place(in.frames[i].span(), in.l4[i])) {
+        drop.push(std::move(in.frames[i]));
+        continue;
+      }
+      out.push(std::move(in.frames[i]));
+    }
+    in.size = 0;
+  }
+
+  /// @brief Hands the vector's segments to `tcp`, as packets starting at
+  /// their IP header. The stack keeps slices of them for the data it holds.
+  void _tcp_input() {
+    auto &in = _take(PipelineNode::TcpInput);
+    if (!in.size)
+      return;
+
+    std::array<Buffer, PIPELINE_VECTOR_SIZE> packets;
+    for (sz i = 0; i < in.size; i++)
+      packets[i] = std::move(in.frames[i])
+                       .slice(EthernetHeader::SIZE, in.frames[i].size());
+    tcp->input(std::span(packets).first(in.size), neighbor_now(),
+               std::span(in.offloads).first(in.size));
+    in.size = 0;
+  }
+
+  /// @brief Hands packets for others to `next_hop` or to their neighbor,
+  /// one hop older. The neighbor is the gateway of the packet's route, the
+  /// routes of the whole vector are looked up at once. Packets for a
+  /// neighbor not known yet wait in the cache, the first of them sends the
+  /// ARP request.
+  /// NOTE: an expired TTL or a missing route should be answered with an
+  /// ICMP error, for now they are only dropped.
+  void _ipv4_forward() {
+    auto &in = _take(PipelineNode::Ipv4Forward);
+    auto &out = _vector(PipelineNode::EthernetOutput);
+    auto &drop = _vector(PipelineNode::Drop);
+    u64 now = neighbors && in.size ? neighbor_now() : 0;
+
+    bool routed = !next_hop && neighbors && routes;
+    std::array<u32, PIPELINE_VECTOR_SIZE> destinations, hops;
+    if (routed) {
+      for (sz i = 0; i < in.size; i++)
+        destinations[i] = RouteTable::_bits(IpHeader::Dst::load(
+            in.frames[i].data() + EthernetHeader::SIZE));
+      routes->lookup_bulk(std::span(destinations).first(in.size), hops);
+    }
+
+    for (sz i = 0; i < in.size; i++) {
+      in.prefetch(i);
+      auto ip = IpView<DirectionOut>(
+          in.frames[i].slice(EthernetHeader::SIZE, in.frames[i].size()));
+      if ((!next_hop && !neighbors) || (routed && hops[i] == ROUTE_MISS) ||
+          ip.ttl() <= 1) {
+        drop.push(std::move(in.frames[i]));
+        continue;
+      }
+
+      ip.decrement_ttl();
+      MAC dst;
+      if (next_hop) {
+        dst = *next_hop;
+      } else {
+        IPv4 neighbor = ip.dst();
+        if (routed)
+          if (IPv4 gateway = routes->gateway(hops[i]); gateway != IPv4())
+            neighbor = gateway;
+        auto mac = _resolve(neighbor, in.frames[i], now);
+        if (!mac)
+          continue;
+        dst = *mac;
+      }
+
+      EthernetHeader::Dst::store(in.frames[i].data(), dst);
+      out.push(std::move(in.frames[i]), 0, in.offloads[i]);
+    }
+    in.size = 0;
+  }
+
+  /// @brief The MAC of a neighbor, or `std::nullopt` if the frame waits for
+  /// it. The first frame waiting sends the ARP request.
+  auto _resolve(const IPv4 &neighbor, Buffer &frame, u64 now)
+      -> std::optional<MAC> {
+    auto resolved = neighbors->resolve(neighbor, frame, now);
+    if (resolved.resolution == NeighborResolution::RequestNeeded)
+      _released.emplace_back(
+          build_arp_request(own_mac, own_ip, neighbor).view(),
+          VirtioNetHeader());
+    return resolved.mac;
+  }
+
+  /// @brief Sends whatever `tcp` has to, the same way forwarded packets go.
+  /// NOTE: a super-segment held for its neighbor loses its offload and is
+  /// dropped once released, TCP sends the data again in plain segments.
+  void _tcp_output() {
+    if (!tcp)
+      return;
+
+    u64 now = neighbor_now();
+    for (auto &packet : tcp->poll(now)) {
+      u8 *header = packet.push(EthernetHeader::SIZE);
+      EthernetHeader::Ethertype::store(header, ETHERTYPE_IPV4);
+      Buffer frame = packet.view();
+      // The offsets counted from the IP header, now they count from ours
+      VirtioNetHeader offload = packet.offload;
+      if (offload.needs_checksum())
+        offload.csum_start += EthernetHeader::SIZE;
+      if (offload.gso_type != VirtioNetHeader::GSO_NONE)
+        offload.hdr_len += EthernetHeader::SIZE;
+
+      if (next_hop) {
+        EthernetHeader::Dst::store(frame.data(), *next_hop);
+        _released.emplace_back(std::move(frame), offload);
+        continue;
+      }
+      if (!neighbors) {
+        node_frames[(sz)PipelineNode::Drop]++;
+        continue;
+      }
+
+      IPv4 neighbor = IpHeader::Dst::load(header + EthernetHeader::SIZE);
+      if (routes) {
+        u32 hop = routes->lookup(RouteTable::_bits(neighbor));
+        if (hop == ROUTE_MISS) {
+          node_frames[(sz)PipelineNode::Drop]++;
+          continue;
+        }
+        if (IPv4 gateway = routes->gateway(hop); gateway != IPv4())
+          neighbor = gateway;
+      }
+      if (auto mac = _resolve(neighbor, frame, now)) {
+        EthernetHeader::Dst::store(frame.data(), *mac);
+        _released.emplace_back(std::move(frame), offload);
+      }
+    }
+  }
+
+  /// @brief Every frame leaving is sent from our address.
+  template <NetDevice D> void _ethernet_output(D &device) {
+    auto &in = _take(PipelineNode::EthernetOutput);
+
+    for (sz i = 0; i < in.size; i++) {
+      in.prefetch(i);
+      _send(device, std::move(in.frames[i]), in.offloads[i]);
+    }
+    in.clear();
+
+    for (auto &[frame, offload] : _released)
+      _send(device, std::move(frame), offload);
+    _released.clear();
+  }
+
+  /// @brief IPv4 packets too large for `mtu` leave in fragments, unless
+  /// `offload` has the device cut them into segments. A partial checksum is
+  /// finished here when the device takes no offloads or the packet is
+  /// fragmented.
+  /// NOTE: a packet that must not be fragmented should be answered with an
+  /// ICMP Fragmentation Needed, for now it is only dropped.
+  template <NetDevice D>
+  void _send(D &device, Buffer frame, VirtioNetHeader offload = {}) {
+    constexpr bool offloading =
+        requires(EthernetView<DirectionOut> view) {
+          device.queue_eth(view, offload);
+        };
+
+    bool fits = frame.size() <= EthernetHeader::SIZE + mtu ||
+                EthernetHeader::Ethertype::load(frame.data()) !=
+                    ETHERTYPE_IPV4 ||
+                (offloading && offload.gso_type != VirtioNetHeader::GSO_NONE);
+    if (!offloading || !fits) {
+      if (!offload.complete_checksum(frame.span())) {
+        node_frames[(sz)PipelineNode::Drop]++;
+        return;
+      }
+      offload = {};
+    }
+
+    if (fits) {
+      auto view = EthernetView<DirectionOut>(std::move(frame));
+      view.set_src(own_mac);
+      if constexpr (offloading)
+        device.queue_eth(view, offload);
+      else
+        device.queue_eth(view);
+      return;
+    }
+
+    auto fragments = fragment_ipv4(
+        frame.span().subspan(EthernetHeader::SIZE), mtu, EthernetHeader::SIZE);
+    if (!fragments) {
+      node_frames[(sz)PipelineNode::Drop]++;
+      return;
+    }
+
+    for (auto &fragment : *fragments) {
+      u8 *header = fragment.push(EthernetHeader::SIZE);
+      std::memcpy(header, frame.data(), EthernetHeader::SIZE);
+      auto view = EthernetView<DirectionOut>(fragment.view());
+      view.set_src(own_mac);
+      device.queue_eth(view);
+    }
+  }
+
+  void _drop() { _take(PipelineNode::Drop).clear(); }
+};
+
+/// @brief Serves a queue of a TAP device or a packet socket through
+/// `pipeline`, with vectors of whatever frames arrived since the last one was
+/// handled. The queue's event loop also wakes it every `PIPELINE_TICK_NS`,
+/// and the graph then runs without frames, so neighbors age and TCP timers
+/// fire on a quiet link too. Sockets of `pipeline.tcp` with something to send
+/// wake it right away.
+template <NetDevice Q> Task serve_pipeline(Pipeline &pipeline, Q &queue) {
+  auto frames = queue.frames();
+  queue.wake_every(frames, PIPELINE_TICK_NS);
+  if (pipeline.tcp)
+    pipeline.tcp->wake_on_output([frames]() { frames->wake(); });
+  std::vector<Buffer> vector;
+  std::vector<VirtioNetHeader> offloads;
+  vector.reserve(PIPELINE_VECTOR_SIZE);
+  offloads.reserve(PIPELINE_VECTOR_SIZE);
+
+  while (true) {
+    auto frame = co_await frames->recv();
+    if (!frame && frames->closed() && frames->size() == 0)
+      break;
+
+    while (frame) {
+      // The frame's header still sits in front of its payload, taking it
+      // back as headroom restores the frame as it was read
+      PacketBuffer packet(frame->payload);
+      packet.push(EthernetHeader::SIZE);
+      vector.push_back(packet.view());
+      offloads.push_back(frame->offload);
+      if (vector.size() == PIPELINE_VECTOR_SIZE)
+        break;
+      frame = frames->try_recv();
+    }
+
+    pipeline.process(vector, queue, offloads);
+    vector.clear();
+    offloads.clear();
+  }
+}
+
+} // namespace toad
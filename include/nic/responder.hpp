@@ -0,0 +1,87 @@
+#pragma once
+
+#include "../concurrency/task.hpp"
+#include "arp.hpp"
+#include "device.hpp"
+#include "ethernet.hpp"
+#include "icmp.hpp"
+#include "ipv4.hpp"
+
+namespace toad {
+
+/// @brief Answers an ARP request for the device's own address.
+void respond_to_arp(Device &device, DeviceQueue &queue,
+                    EthernetFrame<DirectionIn> &frame) {
+  ByteIStream stream(frame.payload);
+  auto arp = ArpIPv4<DirectionIn>::try_from_stream(stream);
+  if (stream.errc != ByteStreamErrorCode::Ok) {
+    metrics::local().frames_dropped.add();
+    return;
+  }
+  if (arp.oper != 1 || IPv4(arp.target_protocol_addr) != device.own_ip)
+    return;
+
+  auto reply = arp.copy_as_response(device.own_mac);
+  PacketBuffer packet(ArpHeader<6, 4>::SIZE);
+  reply.store_header(packet.put(ArpHeader<6, 4>::SIZE));
+
+  EthernetFrame<DirectionOut>(frame.src, device.own_mac, ETHERTYPE_ARP)
+      .push_onto(packet);
+  queue.queue_eth(packet);
+}
+
+/// @brief Answers a ping to the device's own address by turning the request
+/// into the reply where it lies, see `echo_reply_in_place`. The reply joins
+/// the queue's batch in the request's own buffer, nothing is parsed into
+/// structs or serialized again.
+void respond_to_ip(Device &device, DeviceQueue &queue,
+                   EthernetFrame<DirectionIn> &frame) {
+  auto ip = IpView<DirectionIn>::try_from(frame.payload);
+  if (!ip || ip->protocol() != PROTOCOL_ICMP || ip->dst() != device.own_ip ||
+      (ip->flags() & IP_FLAG_MORE_FRAGMENTS) || ip->fragment_offset() != 0 ||
+      !ip->checksum_ok())
+    return;
+
+  // The frame's header still sits in front of its payload
+  PacketBuffer packet(ip->buffer);
+  packet.push(EthernetHeader::SIZE);
+
+  // A checksum the local stack left unfinished has to be finished before it
+  // can be patched
+  if (!frame.offload.complete_checksum(packet.span()))
+    return;
+  if (!echo_reply_in_place(packet.span(),
+                           EthernetHeader::SIZE + ip->header_length()))
+    return;
+
+  auto reply = EthernetView<DirectionOut>(packet.view());
+  reply.set_src(device.own_mac);
+  queue.queue_eth(reply);
+}
+
+/// @brief Serves a queue of a TAP device on its event loop: answers ARP and
+/// pings for the device's own address and drops everything else. Replies to
+/// a burst of frames are written together once the burst is handled. Replies
+/// leave through the queue the request came in on.
+Task respond(Device &device, sz queue_index = 0) {
+  DeviceQueue &queue = device.queues[queue_index];
+  auto frames = queue.frames();
+
+  while (auto frame = co_await frames->recv()) {
+    TOAD_TRACE("Received {} on queue {}", *frame, queue_index);
+
+    switch (frame->ethertype) {
+    case ETHERTYPE_ARP:
+      respond_to_arp(device, queue, *frame);
+      break;
+    case ETHERTYPE_IPV4:
+      respond_to_ip(device, queue, *frame);
+      break;
+    }
+
+    if (frames->size() == 0)
+      queue.flush();
+  }
+}
+
+} // namespace toad
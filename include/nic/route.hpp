@@ -0,0 +1,275 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <unordered_map>
+
+#include "../concurrency/topology.hpp"
+#include "defs.hpp"
+#include "ipv4.hpp"
+
+namespace toad {
+
+/// @brief What a lookup returns when no route covers the address.
+constexpr u32 ROUTE_MISS = ~0u;
+/// @brief Groups of 256 entries for the addresses under prefixes longer than
+/// /24, one per /24 that has any.
+constexpr sz ROUTE_GROUPS = 4096;
+/// @brief Distinct gateways the table can point to.
+constexpr sz ROUTE_NEXT_HOPS = 1 << 16;
+/// @brief How many addresses ahead a bulk lookup prefetches.
+constexpr sz ROUTE_PREFETCH = 8;
+
+/// @brief Longest prefix match over IPv4, laid out as DIR-24-8 (Gupta,
+/// Lin, McKeown, "Routing Lookups in Hardware at Memory Access Speeds").
+///
+/// The first table has an entry for every /24, indexed by the top 24 bits
+/// of the address. An entry either holds the route for its whole /24 or
+/// points to a group of 256 entries, one per address of the /24, for /24s
+/// that have longer prefixes in them. A lookup is one load, two at most.
+///
+/// Every entry also remembers the length of the prefix it came from, so an
+/// update only overwrites the entries a longer prefix does not cover. The
+/// prefixes themselves are kept on the side to find what takes over when
+/// one is removed.
+///
+/// Entries are single words, readers load them without locking while
+/// writers, which take a mutex, store them one at a time. A reader sees
+/// every address routed either the old or the new way. A new group is
+/// filled before it is linked in.
+///
+/// NOTE: groups and gateways are never given back while the table lives.
+/// Nothing tracks the readers, one might still be inside a group or holding
+/// a gateway's index when it would be reused.
+struct RouteTable {
+  /// @brief The entry points to a group instead of holding a route
+  static constexpr u32 _GROUP = 1u << 31;
+  /// @brief Prefix length plus one lives above the index, zero means no route
+  static constexpr u32 _LENGTH_SHIFT = 24;
+  static constexpr u32 _INDEX = (1u << _LENGTH_SHIFT) - 1;
+  static constexpr sz _TBL24_SIZE = 1 << 24;
+  static constexpr sz _GROUP_SIZE = 256;
+
+  u32 *_tbl24;
+  u32 *_tbl8;
+  u32 *_gateways;
+  sz _groups, _groups_used = 0;
+
+  std::mutex _mutex;
+  /// @brief Every route, by prefix and length, and the gateways in use. Only
+  /// touched under `_mutex`
+  std::map<std::pair<u32, u8>, u32> _routes;
+  std::unordered_map<u32, u32> _hops;
+
+  /// @param groups How many /24s may hold prefixes longer than /24
+  /// @param node NUMA node the tables live on
+  explicit RouteTable(sz groups = ROUTE_GROUPS, u32 node = this_thread_node())
+      : _groups(groups) {
+    // The tables are large and mostly empty, untouched pages cost nothing
+    _tbl24 = (u32 *)node_local_alloc(_TBL24_SIZE * sizeof(u32), node);
+    _tbl8 = (u32 *)node_local_alloc(groups * _GROUP_SIZE * sizeof(u32), node);
+    _gateways = (u32 *)node_local_alloc(ROUTE_NEXT_HOPS * sizeof(u32), node);
+    ASSERT(_tbl24 && _tbl8 && _gateways, "Failed to allocate a route table");
+  }
+
+  RouteTable(const RouteTable &) = delete;
+  RouteTable &operator=(const RouteTable &) = delete;
+
+  ~RouteTable() {
+    node_local_free(_tbl24, _TBL24_SIZE * sizeof(u32));
+    node_local_free(_tbl8, _groups * _GROUP_SIZE * sizeof(u32));
+    node_local_free(_gateways, ROUTE_NEXT_HOPS * sizeof(u32));
+  }
+
+  static auto _bits(const IPv4 &ip) -> u32 {
+    return ((u32)ip[0] << 24) | ((u32)ip[1] << 16) | ((u32)ip[2] << 8) | ip[3];
+  }
+
+  static auto _ip(u32 bits) -> IPv4 {
+    return IPv4({(u8)(bits >> 24), (u8)(bits >> 16), (u8)(bits >> 8),
+                 (u8)bits});
+  }
+
+  static auto _netmask(u8 length) -> u32 {
+    return length ? ~0u << (32 - length) : 0;
+  }
+
+  static auto _entry(u8 length, u32 hop) -> u32 {
+    return ((u32)(length + 1) << _LENGTH_SHIFT) | hop;
+  }
+
+  static auto _length_of(u32 entry) -> u32 {
+    return (entry >> _LENGTH_SHIFT) & 0x3F;
+  }
+
+  static auto _load(const u32 *entry) -> u32 {
+    return std::atomic_ref<u32>(*(u32 *)entry).load(std::memory_order_acquire);
+  }
+
+  static void _store(u32 *entry, u32 value) {
+    std::atomic_ref<u32>(*entry).store(value, std::memory_order_release);
+  }
+
+  /// @brief Turns a group entry or a route entry into what a lookup returns.
+  static auto _hop_of(u32 entry) -> u32 {
+    return _length_of(entry) ? entry & _INDEX : ROUTE_MISS;
+  }
+
+  /// @brief The index of the gateway packets to `address` leave through, or
+  /// `ROUTE_MISS`. Lock-free.
+  auto lookup(u32 address) const -> u32 {
+    u32 entry = _load(&_tbl24[address >> 8]);
+    if (entry & _GROUP)
+      entry = _load(&_tbl8[(entry & _INDEX) * _GROUP_SIZE + (address & 0xFF)]);
+    return _hop_of(entry);
+  }
+
+  /// @brief Looks up a vector of addresses at once. All the first level
+  /// entries are loaded before any group is, with the entries of the next
+  /// addresses prefetched, so the cache misses of a vector overlap instead of
+  /// queueing up one after the other.
+  void lookup_bulk(std::span<const u32> addresses, std::span<u32> hops) const {
+    ASSERT(hops.size() >= addresses.size(), "{} hops for {} addresses",
+           hops.size(), addresses.size());
+
+    for (sz i = 0; i < addresses.size(); i++) {
+      if (i + ROUTE_PREFETCH < addresses.size())
+        __builtin_prefetch(&_tbl24[addresses[i + ROUTE_PREFETCH] >> 8]);
+      hops[i] = _load(&_tbl24[addresses[i] >> 8]);
+    }
+
+    for (sz i = 0; i < addresses.size(); i++) {
+      if (hops[i] & _GROUP)
+        hops[i] = _load(&_tbl8[(hops[i] & _INDEX) * _GROUP_SIZE +
+                               (addresses[i] & 0xFF)]);
+      hops[i] = _hop_of(hops[i]);
+    }
+  }
+
+  /// @brief The gateway behind a hop, the unspecified address for
+  /// destinations on the link.
+  auto gateway(u32 hop) const -> IPv4 { return _ip(_load(&_gateways[hop])); }
+
+  /// @brief Where a packet to `destination` goes next: the gateway of its
+  /// route, or the destination itself if it is on the link.
+  auto next_hop(const IPv4 &destination) const -> std::optional<IPv4> {
+    u32 hop = lookup(_bits(destination));
+    if (hop == ROUTE_MISS)
+      return std::nullopt;
+
+    u32 gateway = _load(&_gateways[hop]);
+    return gateway ? _ip(gateway) : destination;
+  }
+
+  /// @brief Routes `prefix/length` through `gateway`, or straight to the
+  /// destination if the gateway is unspecified. Replaces the route of the
+  /// same prefix, if there was one.
+  /// @return `false` if the table ran out of groups or gateways
+  bool add(const IPv4 &prefix, u8 length, const IPv4 &gateway = {}) {
+    ASSERT(length <= 32, "A /{} is not an IPv4 prefix", length);
+    std::lock_guard guard(_mutex);
+
+    u32 address = _bits(prefix) & _netmask(length);
+    auto hop = _hop_locked(_bits(gateway));
+    if (!hop || (length > 24 && !_group_locked(address)))
+      return false;
+
+    _routes[{address, length}] = *hop;
+    _fill_locked(address, length, _entry(length, *hop),
+                 [&](u32 entry) { return _length_of(entry) <= length + 1u; });
+    return true;
+  }
+
+  /// @brief Removes the route of exactly `prefix/length`, the next shorter
+  /// prefix covering it takes over its addresses.
+  /// @return `false` if there was no such route
+  bool remove(const IPv4 &prefix, u8 length) {
+    ASSERT(length <= 32, "A /{} is not an IPv4 prefix", length);
+    std::lock_guard guard(_mutex);
+
+    u32 address = _bits(prefix) & _netmask(length);
+    if (!_routes.erase({address, length}))
+      return false;
+
+    u32 replacement = 0;
+    for (u8 shorter = length; shorter-- > 0;) {
+      auto it = _routes.find({address & _netmask(shorter), shorter});
+      if (it != _routes.end()) {
+        replacement = _entry(shorter, it->second);
+        break;
+      }
+    }
+
+    _fill_locked(address, length, replacement,
+                 [&](u32 entry) { return _length_of(entry) == length + 1u; });
+    return true;
+  }
+
+  auto size() -> sz {
+    std::lock_guard guard(_mutex);
+    return _routes.size();
+  }
+
+  /// @brief Finds the index of a gateway, or gives it one.
+  auto _hop_locked(u32 gateway) -> std::optional<u32> {
+    auto it = _hops.find(gateway);
+    if (it != _hops.end())
+      return it->second;
+    if (_hops.size() == ROUTE_NEXT_HOPS)
+      return std::nullopt;
+
+    u32 hop = _hops.size();
+    _store(&_gateways[hop], gateway);
+    _hops[gateway] = hop;
+    return hop;
+  }
+
+  /// @brief Makes sure the /24 of `address` has a group. A new group starts
+  /// as copies of the /24's entry, and is linked in only once it is full.
+  bool _group_locked(u32 address) {
+    u32 &slot = _tbl24[address >> 8];
+    u32 entry = _load(&slot);
+    if (entry & _GROUP)
+      return true;
+    if (_groups_used == _groups)
+      return false;
+
+    u32 group = _groups_used++;
+    for (sz i = 0; i < _GROUP_SIZE; i++)
+      _store(&_tbl8[group * _GROUP_SIZE + i], entry);
+    _store(&slot, _GROUP | group);
+    return true;
+  }
+
+  /// @brief Stores `value` in every entry for `address/length` that
+  /// `replaces` agrees to, which leaves the entries of longer prefixes be.
+  template <typename F>
+  void _fill_locked(u32 address, u8 length, u32 value, F &&replaces) {
+    auto fill = [&](u32 *entries, sz count) {
+      for (sz i = 0; i < count; i++)
+        if (replaces(_load(&entries[i])))
+          _store(&entries[i], value);
+    };
+
+    if (length > 24) {
+      u32 group = _load(&_tbl24[address >> 8]) & _INDEX;
+      fill(&_tbl8[group * _GROUP_SIZE + (address & 0xFF)],
+           (sz)1 << (32 - length));
+      return;
+    }
+
+    u32 first = address >> 8;
+    for (u32 i = first; i < first + ((u32)1 << (24 - length)); i++) {
+      u32 entry = _load(&_tbl24[i]);
+      if (entry & _GROUP)
+        fill(&_tbl8[(entry & _INDEX) * _GROUP_SIZE], _GROUP_SIZE);
+      else if (replaces(entry))
+        _store(&_tbl24[i], value);
+    }
+  }
+};
+
+} // namespace toad
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstring>
+#include <type_traits>
+
+#include "defs.hpp"
+
+namespace toad {
+
+template <typename T> constexpr auto from_big_endian(T value) -> T {
+  if constexpr (std::endian::native == std::endian::little && sizeof(T) > 1)
+    return std::byteswap(value);
+  else
+    return value;
+}
+
+template <typename T> constexpr auto to_big_endian(T value) -> T {
+  return from_big_endian(value);
+}
+
+/// @brief Unsigned integer of exactly `bytes` bytes.
+template <sz bytes>
+using uint_of_size = std::conditional_t<
+    bytes == 1, u8,
+    std::conditional_t<bytes == 2, u16,
+                       std::conditional_t<bytes == 4, u32, u64>>>;
+
+/// @brief A big endian integer field of a header, `BitWidth` bits wide and
+/// starting `BitOffset` bits into it, numbered the way RFC diagrams are.
+/// Reading is one unaligned load of the bytes the field touches, a byte swap,
+/// a shift and a mask. The bytes touched must form a naturally sized word,
+/// which holds for every field of the protocols we speak.
+template <sz BitOffset, sz BitWidth> struct Field {
+  static constexpr sz FIRST_BYTE = BitOffset / 8;
+  static constexpr sz LEADING_BITS = BitOffset % 8;
+  static constexpr sz BYTES = (LEADING_BITS + BitWidth + 7) / 8;
+
+  static_assert(BitWidth > 0 && BitWidth <= 64);
+  static_assert(BYTES == 1 || BYTES == 2 || BYTES == 4 || BYTES == 8,
+                "A field must be loadable with a single 1, 2, 4 or 8 byte "
+                "word");
+
+  using word_type = uint_of_size<BYTES>;
+  using value_type = word_type;
+
+  static constexpr sz SHIFT = BYTES * 8 - LEADING_BITS - BitWidth;
+  static constexpr word_type MASK =
+      BitWidth == BYTES * 8 ? (word_type)~word_type(0)
+                            : (word_type)((word_type(1) << BitWidth) - 1);
+  /// @brief End of the field in bytes, for bounds checks of whole headers
+  static constexpr sz END = FIRST_BYTE + BYTES;
+
+  static auto load(const u8 *header) -> value_type {
+    word_type word;
+    std::memcpy(&word, header + FIRST_BYTE, BYTES);
+    return (from_big_endian(word) >> SHIFT) & MASK;
+  }
+
+  static void store(u8 *header, value_type value) {
+    word_type word;
+    if constexpr (MASK == (word_type)~word_type(0)) {
+      word = to_big_endian(value);
+    } else {
+      // Keep the bits of the neighbouring fields
+      std::memcpy(&word, header + FIRST_BYTE, BYTES);
+      word = from_big_endian(word);
+      word = (word & ~(word_type)(MASK << SHIFT)) |
+             (word_type)((value & MASK) << SHIFT);
+      word = to_big_endian(word);
+    }
+    std::memcpy(header + FIRST_BYTE, &word, BYTES);
+  }
+};
+
+/// @brief A run of bytes copied as is, like addresses.
+template <sz ByteOffset, sz Length> struct BytesField {
+  using value_type = std::array<u8, Length>;
+
+  static constexpr sz END = ByteOffset + Length;
+
+  static auto load(const u8 *header) -> value_type {
+    value_type value;
+    std::memcpy(value.data(), header + ByteOffset, Length);
+    return value;
+  }
+
+  static void store(u8 *header, const value_type &value) {
+    std::memcpy(header + ByteOffset, value.data(), Length);
+  }
+};
+
+/// @brief Checks at compile time that every field lies inside a header of
+/// `Size` bytes, so a single bounds check per header covers all of them.
+template <sz Size, typename... Fields>
+constexpr bool fields_fit_v = ((Fields::END <= Size) && ...);
+
+} // namespace toad
@@ -0,0 +1,1792 @@
+#pragma once
+
+#include <algorithm>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "../bytes/chain.hpp"
+#include "../bytes/packet_buffer.hpp"
+#include "../concurrency/executor.hpp"
+#include "../prng.hpp"
+#include "checksum.hpp"
+#include "defs.hpp"
+#include "flow.hpp"
+#include "fragment.hpp"
+#include "ipv4.hpp"
+#include "schema.hpp"
+#include "virtio.hpp"
+
+namespace toad {
+
+constexpr sz TCP_HEADER_SIZE = 20;
+
+/// @brief Layout of the fixed part of the TCP header, RFC 9293 section 3.1.
+struct TcpHeader {
+  using SrcPort = Field<0, 16>;
+  using DstPort = Field<16, 16>;
+  using Seq = Field<32, 32>;
+  using Ack = Field<64, 32>;
+  using DataOffset = Field<96, 4>;
+  using Flags = Field<104, 8>;
+  using Window = Field<112, 16>;
+  using Checksum = Field<128, 16>;
+  using Urgent = Field<144, 16>;
+
+  static_assert(fields_fit_v<TCP_HEADER_SIZE, SrcPort, DstPort, Seq, Ack,
+                             DataOffset, Flags, Window, Checksum, Urgent>);
+};
+
+/// @brief Bits of `TcpHeader::Flags`.
+constexpr u8 TCP_FIN = 0x01;
+constexpr u8 TCP_SYN = 0x02;
+constexpr u8 TCP_RST = 0x04;
+constexpr u8 TCP_PSH = 0x08;
+constexpr u8 TCP_ACK = 0x10;
+
+/// @brief Option kinds, RFC 9293, RFC 7323 and RFC 2018.
+constexpr u8 TCP_OPTION_END = 0;
+constexpr u8 TCP_OPTION_NOP = 1;
+constexpr u8 TCP_OPTION_MSS = 2;
+constexpr u8 TCP_OPTION_WINDOW_SCALE = 3;
+constexpr u8 TCP_OPTION_SACK_PERMITTED = 4;
+constexpr u8 TCP_OPTION_SACK = 5;
+constexpr sz TCP_MAX_OPTIONS = 40;
+
+/// @brief MSS of a peer that does not announce one, RFC 9293 section 3.7.1.
+constexpr u16 TCP_DEFAULT_MSS = 536;
+/// @brief Shift of the windows we announce, enough for `TCP_RECEIVE_BUFFER`.
+constexpr u8 TCP_WINDOW_SHIFT = 7;
+/// @brief Largest shift RFC 7323 allows.
+constexpr u8 TCP_MAX_WINDOW_SHIFT = 14;
+/// @brief SACK blocks a segment carries at most, 4 fit without timestamps.
+constexpr sz TCP_SACK_BLOCKS = 4;
+/// @brief Bytes received but not read yet a connection holds at most, the
+/// window it announces.
+constexpr sz TCP_RECEIVE_BUFFER = 1 << 20;
+/// @brief Bytes written but not acknowledged yet a connection holds at most.
+constexpr sz TCP_SEND_BUFFER = 1 << 20;
+/// @brief Segments in the first flight, RFC 6928.
+constexpr sz TCP_INITIAL_WINDOW = 10;
+/// @brief Duplicate ACKs, or segments worth of SACKed bytes, that mean a
+/// segment was lost, RFC 5681 and RFC 6675.
+constexpr u32 TCP_DUPLICATE_THRESHOLD = 3;
+/// @brief How long an ACK may wait for a second segment, Linux's minimum.
+constexpr u64 TCP_DELAYED_ACK_NS = 40'000'000;
+/// @brief Retransmission timeouts, RFC 6298 with Linux's minimum.
+constexpr u64 TCP_RTO_INITIAL_NS = 1'000'000'000;
+constexpr u64 TCP_RTO_MIN_NS = 200'000'000;
+constexpr u64 TCP_RTO_MAX_NS = 60'000'000'000;
+/// @brief Timeouts in a row after which a connection is given up.
+constexpr u32 TCP_MAX_RETRANSMITS = 8;
+/// @brief How long a closed connection lingers in TIME-WAIT, or waits in
+/// FIN-WAIT-2 for the peer to close, Linux's `tcp_fin_timeout`.
+constexpr u64 TCP_TIME_WAIT_NS = 60'000'000'000;
+/// @brief Connections a stack holds at most.
+constexpr sz TCP_CONNECTIONS = 1 << 14;
+/// @brief Handshakes a listener has in progress or waiting to be accepted.
+constexpr sz TCP_BACKLOG = 128;
+/// @brief First port of the range `connect` picks local ports from.
+constexpr u16 TCP_EPHEMERAL_FIRST = 49152;
+
+/// @brief Sequence numbers wrap, `a` comes before `b` if it is less than
+/// half the space behind it.
+inline bool seq_lt(u32 a, u32 b) { return (int32_t)(a - b) < 0; }
+inline bool seq_le(u32 a, u32 b) { return (int32_t)(a - b) <= 0; }
+
+/// @brief RFC 9293 section 3.3.2, without LISTEN, which lives in listeners.
+enum struct TcpState : u8 {
+  Closed,
+  SynSent,
+  SynReceived,
+  Established,
+  FinWait1,
+  FinWait2,
+  CloseWait,
+  Closing,
+  LastAck,
+  TimeWait,
+};
+
+/// @brief A segment that arrived, with its options parsed. Its key is as
+/// seen from the sender: the source is the remote end.
+struct TcpSegment {
+  FlowKey key;
+  u32 seq = 0, ack = 0;
+  u8 flags = 0;
+  u16 window = 0;
+  std::optional<u16> mss;
+  std::optional<u8> window_shift;
+  bool sack_permitted = false;
+  std::array<std::pair<u32, u32>, TCP_SACK_BLOCKS> sack;
+  sz sack_blocks = 0;
+  /// @brief A slice of the packet, nothing is copied
+  Buffer payload;
+
+  /// @brief Sequence numbers the segment takes up, SYN and FIN take one.
+  auto length() const -> u32 {
+    return payload.size() + !!(flags & TCP_SYN) + !!(flags & TCP_FIN);
+  }
+
+  /// @brief Sum of the pseudo header of RFC 9293 section 3.1.
+  static auto pseudo_sum(u32 src, u32 dst, sz length) -> u64 {
+    return (src >> 16) + (src & 0xFFFF) + (dst >> 16) + (dst & 0xFFFF) +
+           PROTOCOL_TCP + length;
+  }
+
+  /// @brief Reads a segment out of an IPv4 packet, starting at its header
+  /// and ending where its total length says.
+  /// @param verify Whether to check the checksum, a frame the kernel
+  /// handed over with a partial checksum would fail it
+  /// @return `std::nullopt` if it is no well formed TCP segment
+  static auto try_from(const Buffer &packet, bool verify = true)
+      -> std::optional<TcpSegment> {
+    auto key = FlowKey::try_from(packet.span());
+    if (!key || key->protocol != PROTOCOL_TCP ||
+        Reassembler::is_fragment(packet.data()))
+      return std::nullopt;
+
+    sz ip_length = IpHeader::Ihl::load(packet.data()) * 4;
+    if (packet.size() < ip_length + TCP_HEADER_SIZE)
+      return std::nullopt;
+    const u8 *header = packet.data() + ip_length;
+    sz header_length = TcpHeader::DataOffset::load(header) * 4;
+    if (header_length < TCP_HEADER_SIZE ||
+        ip_length + header_length > packet.size())
+      return std::nullopt;
+
+    sz length = packet.size() - ip_length;
+    if (verify) {
+      u64 sum = pseudo_sum(key->src, key->dst, length) +
+                ones_complement_sum({header, length});
+      if (fold_sum(sum) != 0xFFFF)
+        return std::nullopt;
+    }
+
+    TcpSegment segment;
+    segment.key = *key;
+    segment.seq = TcpHeader::Seq::load(header);
+    segment.ack = TcpHeader::Ack::load(header);
+    segment.flags = TcpHeader::Flags::load(header);
+    segment.window = TcpHeader::Window::load(header);
+    segment._parse_options(header + TCP_HEADER_SIZE,
+                           header_length - TCP_HEADER_SIZE);
+    segment.payload = packet.slice(ip_length + header_length, packet.size());
+    return segment;
+  }
+
+  /// @brief Options that are malformed or unknown are skipped, RFC 9293
+  /// section 3.1 asks to be liberal here.
+  void _parse_options(const u8 *options, sz length) {
+    for (sz i = 0; i < length;) {
+      u8 kind = options[i];
+      if (kind == TCP_OPTION_END)
+        break;
+      if (kind == TCP_OPTION_NOP) {
+        i++;
+        continue;
+      }
+
+      if (i + 1 >= length)
+        break;
+      u8 size = options[i + 1];
+      if (size < 2 || i + size > length)
+        break;
+
+      const u8 *value = options + i + 2;
+      switch (kind) {
+      case TCP_OPTION_MSS:
+        if (size == 4)
+          mss = (value[0] << 8) | value[1];
+        break;
+      case TCP_OPTION_WINDOW_SCALE:
+        if (size == 3)
+          window_shift = std::min(value[0], TCP_MAX_WINDOW_SHIFT);
+        break;
+      case TCP_OPTION_SACK_PERMITTED:
+        sack_permitted = size == 2;
+        break;
+      case TCP_OPTION_SACK:
+        for (sz block = 0; block + 8 <= (sz)size - 2 &&
+                           sack_blocks < TCP_SACK_BLOCKS;
+             block += 8)
+          sack[sack_blocks++] = {Field<0, 32>::load(value + block),
+                                 Field<0, 32>::load(value + block + 4)};
+        break;
+      }
+      i += size;
+    }
+  }
+};
+
+/// @brief A packet `TcpStack::poll` built, with the work it leaves to the
+/// device. The offsets in `offload` count from the IP header.
+struct TcpPacket : PacketBuffer {
+  VirtioNetHeader offload;
+
+  TcpPacket(PacketBuffer packet, const VirtioNetHeader &offload = {})
+      : PacketBuffer(std::move(packet)), offload(offload) {}
+};
+
+struct TcpListen;
+
+/// @brief The state of one connection, the transmission control block of
+/// RFC 9293. Names follow the RFC's variables. Only touched under the
+/// stack's mutex.
+struct TcpConnection {
+  /// @brief As seen in the segments arriving: the source is the remote end
+  FlowKey key;
+  TcpState state = TcpState::Closed;
+
+  u32 iss = 0, snd_una = 0, snd_nxt = 0;
+  /// @brief Highest sequence number sent so far, `snd_nxt` goes back to
+  /// `snd_una` after a timeout
+  u32 snd_max = 0;
+  u32 snd_wl1 = 0, snd_wl2 = 0;
+  /// @brief In bytes, already scaled
+  sz snd_wnd = 0;
+  u8 snd_shift = 0;
+  /// @brief Largest payload a segment to the peer carries
+  u16 mss = TCP_DEFAULT_MSS;
+  bool scaling = false;
+  bool sack_permitted = false;
+  /// @brief Every byte from `snd_una` on, sent or not, as written
+  BufferChain send;
+  /// @brief The chain of the writer waiting for room in `send`
+  BufferChain *writing = nullptr;
+  /// @brief Closed by us, a FIN follows the last byte of `send`
+  bool fin_queued = false;
+  bool fin_acked = false;
+
+  sz cwnd = 0;
+  sz ssthresh = ~(sz)0;
+  /// @brief Bytes acknowledged towards the next increment of `cwnd` in
+  /// congestion avoidance
+  sz _avoidance = 0;
+  u32 duplicate_acks = 0;
+  bool recovering = false;
+  /// @brief Recovery ends once everything sent before it was acknowledged
+  u32 recover = 0;
+  /// @brief Holes below it were retransmitted in this recovery
+  u32 high_rxt = 0;
+  /// @brief Ranges above `snd_una` the peer holds, sorted and disjoint
+  std::vector<std::pair<u32, u32>> sacked;
+
+  u64 rto_ns = TCP_RTO_INITIAL_NS;
+  u64 srtt_ns = 0, rttvar_ns = 0;
+  /// @brief Zero when not armed, as are the other deadlines
+  u64 rto_deadline = 0;
+  u32 retransmits = 0;
+  /// @brief The peer's window is closed, the next timeout sends a probe
+  bool probe = false;
+  /// @brief The sequence number that acknowledges the segment timed for an
+  /// RTT sample, and when the segment was sent
+  std::optional<std::pair<u32, u64>> timed;
+
+  u32 irs = 0, rcv_nxt = 0;
+  /// @brief Right edge of the window we announced last
+  u32 rcv_adv = 0;
+  u8 rcv_shift = 0;
+  /// @brief In order bytes not read yet, slices of the packets they came in
+  BufferChain received;
+  /// @brief Segments past a hole, by sequence number
+  std::map<u32, Buffer, decltype(&seq_lt)> out_of_order{&seq_lt};
+  /// @brief Start of the out of order segment that arrived last, its block
+  /// comes first in the SACK option
+  u32 last_out_of_order = 0;
+  /// @brief Sequence number of the peer's FIN, once it arrived
+  std::optional<u32> fin_seq;
+  bool fin_received = false;
+
+  bool ack_now = false;
+  /// @brief Bytes received since the last ACK
+  sz unacked = 0;
+  u64 ack_deadline = 0;
+  u64 close_deadline = 0;
+  /// @brief Reset by the peer, refused, or given up on
+  bool reset = false;
+  bool dirty = false;
+  /// @brief The listener a passive open counts against until accepted
+  std::shared_ptr<TcpListen> listen;
+
+  std::coroutine_handle<> reader = nullptr, writer = nullptr,
+                          opener = nullptr;
+
+  auto sacked_bytes() const -> sz {
+    sz bytes = 0;
+    for (auto [start, end] : sacked)
+      bytes += end - start;
+    return bytes;
+  }
+
+  /// @brief Moves `seq` past the SACKed range it lies in, if any.
+  auto skip_sacked(u32 seq) const -> u32 {
+    for (auto [start, end] : sacked)
+      if (seq_le(start, seq) && seq_lt(seq, end))
+        seq = end;
+    return seq;
+  }
+
+  /// @brief How far from `seq` the next SACKed range starts, `limit` if
+  /// none does before that.
+  auto until_sacked(u32 seq, sz limit) const -> sz {
+    for (auto [start, end] : sacked)
+      if (seq_lt(seq, start))
+        return std::min<sz>(limit, start - seq);
+    return limit;
+  }
+
+  bool synchronized() const {
+    return state != TcpState::Closed && state != TcpState::SynSent &&
+           state != TcpState::SynReceived;
+  }
+
+  /// @brief Whether sending data or a FIN is still allowed, or retransmitting
+  /// it is still needed.
+  bool sending() const {
+    return state == TcpState::Established || state == TcpState::CloseWait ||
+           state == TcpState::FinWait1 || state == TcpState::Closing ||
+           state == TcpState::LastAck;
+  }
+};
+
+/// @brief A port being listened on.
+struct TcpListen {
+  u16 port;
+  sz backlog;
+  /// @brief Handshakes in progress, and connections not accepted yet
+  sz pending = 0;
+  std::deque<std::shared_ptr<TcpConnection>> ready;
+  std::coroutine_handle<> acceptor = nullptr;
+  bool closed = false;
+};
+
+struct TcpStack;
+
+/// @brief A connection as handed to its user, closed when it goes away like
+/// a `Socket`.
+struct TcpSocket {
+  TcpStack *_stack = nullptr;
+  std::shared_ptr<TcpConnection> _connection;
+
+  TcpSocket(TcpStack *stack, std::shared_ptr<TcpConnection> connection)
+      : _stack(stack), _connection(std::move(connection)) {}
+
+  TcpSocket(const TcpSocket &) = delete;
+  TcpSocket &operator=(const TcpSocket &) = delete;
+
+  TcpSocket(TcpSocket &&other)
+      : _stack(other._stack), _connection(std::move(other._connection)) {}
+
+  TcpSocket &operator=(TcpSocket &&other) {
+    if (this == &other)
+      return *this;
+    _close();
+    _stack = other._stack;
+    _connection = std::move(other._connection);
+    return *this;
+  }
+
+  ~TcpSocket() { _close(); }
+
+  auto remote_ip() const -> IPv4 { return _ip(_connection->key.src); }
+  auto remote_port() const -> u16 { return _connection->key.sport; }
+  auto local_port() const -> u16 { return _connection->key.dport; }
+
+  static auto _ip(u32 bits) -> IPv4 {
+    return IPv4({(u8)(bits >> 24), (u8)(bits >> 16), (u8)(bits >> 8),
+                 (u8)bits});
+  }
+
+  void _close();
+};
+
+/// @brief A port listened on, closed when it goes away like a `Listener`.
+struct TcpListener {
+  TcpStack *_stack = nullptr;
+  std::shared_ptr<TcpListen> _listen;
+
+  TcpListener(TcpStack *stack, std::shared_ptr<TcpListen> listen)
+      : _stack(stack), _listen(std::move(listen)) {}
+
+  TcpListener(const TcpListener &) = delete;
+  TcpListener &operator=(const TcpListener &) = delete;
+
+  TcpListener(TcpListener &&other)
+      : _stack(other._stack), _listen(std::move(other._listen)) {}
+
+  ~TcpListener() { _close(); }
+
+  auto port() const -> u16 { return _listen->port; }
+
+  void _close();
+};
+
+/// @brief TCP terminated in userspace, for the connections of a virtual
+/// network. Sockets are awaited the way `IOContext`'s are: connect, accept,
+/// read some, write.
+///
+/// The stack never sends on its own. Segments arrive in vectors through
+/// `input`, which only updates the connections, and everything there is to
+/// send, ACKs included, comes out of `poll`, which also runs the timers.
+/// ACKs are generated once per connection and poll, so a vector of segments
+/// is answered with one ACK instead of one per segment, and a delayed ACK
+/// waits at most `TCP_DELAYED_ACK_NS` for the next poll after it. Whoever
+/// carries the packets, a `Pipeline` or a loopback, polls after every
+/// vector, and now and then on a quiet link. A socket with something new to
+/// send calls the waker set by `wake_on_output`, so that it is polled
+/// without waiting for either.
+///
+/// Received data stays in the packets it came in, reads hand out slices of
+/// them. Written data is copied once, into the segments. Windows are scaled
+/// (RFC 7323). Losses are found by three duplicate ACKs or three segments
+/// worth of SACKed bytes above a hole (RFC 2018, RFC 6675), and the holes
+/// are retransmitted in one go, with NewReno congestion control (RFC 5681,
+/// RFC 6582) and retransmission timeouts after RFC 6298.
+///
+/// The stack takes a mutex, sockets may be used from any thread.
+/// NOTE: no timestamps, urgent data, keepalives or Nagle. A connection
+/// closed with data left to read does not reset it.
+struct TcpStack {
+  IPv4 own_ip;
+  /// @brief Largest payload we take, announced in our SYNs
+  u16 mss;
+  /// @brief Largest IP packet handed to a device that cuts TCP segments
+  /// itself, see `VirtioNetHeader::segmented`. New data then leaves in
+  /// super-segments of up to this many bytes with their checksums partial.
+  /// 0 keeps every segment within the peer's MSS.
+  sz gso_max_size = 0;
+
+  std::mutex _mutex;
+  FlowTable<std::shared_ptr<TcpConnection>> _connections;
+  std::unordered_map<u16, std::shared_ptr<TcpListen>> _listeners;
+  /// @brief Connections with something to send since the last poll
+  std::vector<std::shared_ptr<TcpConnection>> _dirty;
+  /// @brief Connections to forget once the current batch is done
+  std::vector<FlowKey> _closed;
+  /// @brief Resets for segments no connection wanted
+  std::vector<TcpPacket> _control;
+  /// @brief Coroutines to resume once the mutex is released
+  std::vector<std::coroutine_handle<>> _woken;
+  /// @brief The earliest deadline of any connection
+  u64 _next_timer = ~(u64)0;
+  /// @brief See `wake_on_output`
+  std::function<void()> _output_waker;
+  /// @brief Set while `input` or `poll` run, what they make dirty leaves
+  /// with the poll of the same caller
+  bool _polling = false;
+  u16 _next_port = TCP_EPHEMERAL_FIRST;
+  u16 _identification = 0;
+
+  u64 segments_received = 0;
+  u64 segments_sent = 0;
+  /// @brief Segments sent with no payload and no SYN or FIN
+  u64 acks_sent = 0;
+  u64 retransmitted = 0;
+  u64 fast_retransmits = 0;
+  u64 timeouts = 0;
+  u64 resets_sent = 0;
+  /// @brief Segments with a bad checksum or header, or not for us
+  u64 malformed = 0;
+
+  /// @param mtu Of the link, the MSS we announce is what fits into it
+  explicit TcpStack(IPv4 own_ip, sz mtu = 1500,
+                    sz connections = TCP_CONNECTIONS)
+      : own_ip(own_ip), mss(mtu - IP_HEADER_SIZE - TCP_HEADER_SIZE),
+        _connections(connections, ~(u64)0) {}
+
+  TcpStack(const TcpStack &) = delete;
+  TcpStack &operator=(const TcpStack &) = delete;
+
+  /// @brief Connections, including those closing.
+  auto size() -> sz {
+    std::lock_guard guard(_mutex);
+    return _connections.size();
+  }
+
+  /// @brief Has `waker` called whenever a socket makes a connection dirty
+  /// while none was. It is called with the stack's mutex held, so it should
+  /// only schedule a poll, like `Channel::wake`. Only the last waker set is
+  /// called, whoever polls sends for every connection.
+  void wake_on_output(std::function<void()> waker) {
+    std::lock_guard guard(_mutex);
+    _output_waker = std::move(waker);
+  }
+
+  /// @brief Starts listening on `port`.
+  auto new_listener(u16 port, sz backlog = TCP_BACKLOG) -> TcpListener {
+    std::lock_guard guard(_mutex);
+    ASSERT(!_listeners.contains(port), "Port {} is listened on already",
+           port);
+    auto listen = std::make_shared<TcpListen>(port, backlog);
+    _listeners[port] = listen;
+    return TcpListener(this, listen);
+  }
+
+  struct AcceptAwaiter {
+    TcpStack &stack;
+    std::shared_ptr<TcpListen> listen;
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      std::lock_guard guard(stack._mutex);
+      if (!listen->ready.empty() || listen->closed)
+        return false;
+      ASSERT(!listen->acceptor, "A listener is accepted from one at a time");
+      listen->acceptor = handle;
+      return true;
+    }
+
+    auto await_resume() -> std::optional<TcpSocket> {
+      std::lock_guard guard(stack._mutex);
+      if (listen->ready.empty())
+        return std::nullopt;
+
+      auto connection = std::move(listen->ready.front());
+      listen->ready.pop_front();
+      listen->pending--;
+      return TcpSocket(&stack, std::move(connection));
+    }
+  };
+
+  /// @brief Waits for a connection to `listener` to be established.
+  /// @return `std::nullopt` once the listener is closed
+  auto submit_accept_ipv4(const TcpListener &listener) -> AcceptAwaiter {
+    return AcceptAwaiter{*this, listener._listen};
+  }
+
+  struct ConnectAwaiter {
+    TcpStack &stack;
+    std::shared_ptr<TcpConnection> connection;
+
+    bool await_ready() { return !connection; }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      std::lock_guard guard(stack._mutex);
+      if (connection->state != TcpState::SynSent)
+        return false;
+      connection->opener = handle;
+      return true;
+    }
+
+    auto await_resume() -> std::optional<TcpSocket> {
+      std::lock_guard guard(stack._mutex);
+      if (!connection || connection->state == TcpState::Closed)
+        return std::nullopt;
+      return TcpSocket(&stack, std::move(connection));
+    }
+  };
+
+  /// @brief Opens a connection from a free local port. The SYN leaves with
+  /// the next poll.
+  /// @return `std::nullopt` if it was refused or timed out, or no port was
+  /// free
+  auto submit_connect_ipv4(const IPv4 &ip, u16 port) -> ConnectAwaiter {
+    std::lock_guard guard(_mutex);
+    FlowKey key(ip, own_ip, port, 0, PROTOCOL_TCP);
+    for (sz tries = 0; tries < 65536 - TCP_EPHEMERAL_FIRST; tries++) {
+      key.dport = _next_port;
+      _next_port = _next_port == 0xFFFF ? TCP_EPHEMERAL_FIRST : _next_port + 1;
+      if (!_connections.contains(key))
+        break;
+      key.dport = 0;
+    }
+
+    auto connection = std::make_shared<TcpConnection>();
+    connection->key = key;
+    connection->state = TcpState::SynSent;
+    connection->scaling = true;
+    connection->sack_permitted = true;
+    connection->rcv_shift = TCP_WINDOW_SHIFT;
+    _open(*connection);
+    if (!key.dport || !_connections.insert(key, connection, 0).first)
+      return ConnectAwaiter{*this, nullptr};
+
+    _touch(connection);
+    return ConnectAwaiter{*this, std::move(connection)};
+  }
+
+  struct ReadAwaiter {
+    TcpStack &stack;
+    std::shared_ptr<TcpConnection> connection;
+    sz max_size;
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      std::lock_guard guard(stack._mutex);
+      if (!connection->received.empty() || connection->fin_received ||
+          connection->reset)
+        return false;
+      ASSERT(!connection->reader, "A connection is read by one at a time");
+      connection->reader = handle;
+      return true;
+    }
+
+    auto await_resume() -> std::optional<Buffer> {
+      std::lock_guard guard(stack._mutex);
+      return stack._read_locked(connection, max_size);
+    }
+  };
+
+  /// @return At most `max_size` bytes as soon as there are any, a slice of
+  /// the packet they came in. `std::nullopt` once the peer closed its side
+  /// and everything was read, or the connection was reset.
+  auto submit_read_some(const TcpSocket &socket, sz max_size) -> ReadAwaiter {
+    return ReadAwaiter{*this, socket._connection, max_size};
+  }
+
+  struct WriteAwaiter {
+    TcpStack &stack;
+    std::shared_ptr<TcpConnection> connection;
+    BufferChain data;
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      std::lock_guard guard(stack._mutex);
+      stack._take_locked(connection, data);
+      if (data.empty() || !connection->sending() || connection->fin_queued)
+        return false;
+      ASSERT(!connection->writer, "A connection is written by one at a time");
+      connection->writer = handle;
+      connection->writing = &data;
+      return true;
+    }
+
+    /// @return `false` if the connection went away before all of it was
+    /// taken
+    bool await_resume() {
+      std::lock_guard guard(stack._mutex);
+      connection->writing = nullptr;
+      return data.empty();
+    }
+  };
+
+  /// @brief Hands `data` to the connection, waiting while the send buffer
+  /// is full. The slices are kept, not copied, until they are sent.
+  auto submit_write(const TcpSocket &socket, BufferChain data)
+      -> WriteAwaiter {
+    return WriteAwaiter{*this, socket._connection, std::move(data)};
+  }
+
+  /// @brief Takes a vector of IPv4 packets, each starting at its header. The
+  /// connections of the whole vector are looked up at once.
+  /// @param offloads What the device said about every packet, if anything.
+  /// Checksums it vouches for are not checked again, see
+  /// `VirtioNetHeader::checksum_trusted`.
+  void input(std::span<Buffer> packets, u64 now,
+             std::span<const VirtioNetHeader> offloads = {}) {
+    ASSERT(offloads.empty() || offloads.size() == packets.size(),
+           "Every packet needs its offloads");
+
+    std::vector<TcpSegment> segments;
+    segments.reserve(packets.size());
+    for (sz i = 0; i < packets.size(); i++) {
+      Buffer &packet = packets[i];
+      bool verify = offloads.empty() || !offloads[i].checksum_trusted();
+      auto segment = TcpSegment::try_from(packet, verify);
+      if (!segment || segment->key.dst != FlowKey::_bits(own_ip)) {
+        malformed++;
+        continue;
+      }
+      segments.push_back(std::move(*segment));
+    }
+
+    std::vector<FlowKey> keys(segments.size());
+    for (sz i = 0; i < segments.size(); i++)
+      keys[i] = segments[i].key;
+    std::vector<std::shared_ptr<TcpConnection> *> found(segments.size());
+
+    std::vector<std::coroutine_handle<>> woken;
+    {
+      std::lock_guard guard(_mutex);
+      _polling = true;
+      segments_received += segments.size();
+      _connections.find_batch(keys, found, now);
+      // Segments may open or close connections, which moves the table's
+      // slots around, so the connections are taken out first
+      std::vector<std::shared_ptr<TcpConnection>> connections(segments.size());
+      for (sz i = 0; i < segments.size(); i++)
+        if (found[i])
+          connections[i] = *found[i];
+
+      for (sz i = 0; i < segments.size(); i++) {
+        auto &connection = connections[i];
+        if (connection && connection->state != TcpState::Closed)
+          _segment_locked(connection, segments[i], now);
+        else
+          _unconnected_locked(segments[i], now);
+      }
+      _forget_closed_locked();
+      _polling = false;
+      woken.swap(_woken);
+    }
+    _resume(woken);
+  }
+
+  /// @brief Runs the timers due at `now` and builds every segment there is
+  /// to send, IPv4 packets with room for a link layer header in front. With
+  /// `gso_max_size` some of them are super-segments, see `TcpPacket`.
+  auto poll(u64 now) -> std::vector<TcpPacket> {
+    std::vector<TcpPacket> out;
+    std::vector<std::coroutine_handle<>> woken;
+    {
+      std::lock_guard guard(_mutex);
+      _polling = true;
+      if (now >= _next_timer)
+        _timers_locked(now);
+      out.swap(_control);
+
+      for (auto &connection : _dirty) {
+        connection->dirty = false;
+        _transmit_locked(*connection, now, out);
+      }
+      _dirty.clear();
+      _forget_closed_locked();
+      _polling = false;
+      woken.swap(_woken);
+    }
+    _resume(woken);
+    return out;
+  }
+
+  static void _resume(std::span<const std::coroutine_handle<>> woken) {
+    if (!woken.empty())
+      spawn_batch(woken);
+  }
+
+  void _wake(std::coroutine_handle<> &handle) {
+    if (handle)
+      _woken.push_back(std::exchange(handle, nullptr));
+  }
+
+  void _touch(const std::shared_ptr<TcpConnection> &connection) {
+    if (connection->dirty)
+      return;
+    if (_dirty.empty() && !_polling && _output_waker)
+      _output_waker();
+    connection->dirty = true;
+    _dirty.push_back(connection);
+  }
+
+  void _arm(u64 &deadline, u64 at) {
+    deadline = at;
+    _next_timer = std::min(_next_timer, at);
+  }
+
+  /// @brief Picks the initial sequence number, RFC 6528 asks for it to be
+  /// hard to guess.
+  void _open(TcpConnection &connection) {
+    connection.iss = thread_safe_random_u32();
+    connection.snd_una = connection.snd_nxt = connection.snd_max =
+        connection.iss;
+  }
+
+  /// @brief Congestion state once the handshake is done, RFC 6928.
+  static void _established(TcpConnection &connection) {
+    connection.state = TcpState::Established;
+    connection.cwnd = TCP_INITIAL_WINDOW * connection.mss;
+  }
+
+  /// @brief Closes our side, the FIN follows whatever is still to be sent.
+  void _close(const std::shared_ptr<TcpConnection> &connection) {
+    std::lock_guard guard(_mutex);
+    auto &c = *connection;
+    switch (c.state) {
+    case TcpState::SynSent:
+      _drop_locked(c);
+      return;
+    case TcpState::Established:
+      c.state = TcpState::FinWait1;
+      break;
+    case TcpState::CloseWait:
+      c.state = TcpState::LastAck;
+      break;
+    default:
+      return;
+    }
+    c.fin_queued = true;
+    _touch(connection);
+  }
+
+  void _unlisten(const std::shared_ptr<TcpListen> &listen) {
+    std::vector<std::coroutine_handle<>> woken;
+    {
+      std::lock_guard guard(_mutex);
+      listen->closed = true;
+      _listeners.erase(listen->port);
+      for (auto &connection : listen->ready)
+        _abort_locked(*connection);
+      listen->ready.clear();
+      _wake(listen->acceptor);
+      _forget_closed_locked();
+      woken.swap(_woken);
+    }
+    _resume(woken);
+  }
+
+  auto _read_locked(const std::shared_ptr<TcpConnection> &connection,
+                    sz max_size) -> std::optional<Buffer> {
+    auto &c = *connection;
+    if (c.received.empty())
+      return std::nullopt;
+
+    // Only the first chunk, it is handed out as is
+    sz length = std::min(max_size, c.received.chunks().front().size());
+    Buffer data = c.received.split(length).linearize();
+
+    // Tell the peer about the room made once it is worth a segment
+    u32 edge = c.rcv_nxt + (u32)(TCP_RECEIVE_BUFFER - c.received.size());
+    u32 opened = edge - c.rcv_adv;
+    if (c.synchronized() && seq_lt(c.rcv_adv, edge) &&
+        (opened >= TCP_RECEIVE_BUFFER / 2 ||
+         (c.rcv_adv - c.rcv_nxt < mss && opened >= mss))) {
+      c.ack_now = true;
+      _touch(connection);
+    }
+    return data;
+  }
+
+  /// @brief Moves as much of `data` into the send buffer as fits.
+  void _take_locked(const std::shared_ptr<TcpConnection> &connection,
+                    BufferChain &data) {
+    auto &c = *connection;
+    if (c.reset || c.fin_queued || !c.sending())
+      return;
+    sz room = TCP_SEND_BUFFER - std::min(TCP_SEND_BUFFER, c.send.size());
+    sz taken = std::min(room, data.size());
+    if (!taken)
+      return;
+    c.send.append(data.split(taken));
+    _touch(connection);
+  }
+
+  /// @brief Forgets a connection without telling the peer, and lets its
+  /// users know.
+  void _drop_locked(TcpConnection &c) {
+    if (c.state != TcpState::Closed)
+      _closed.push_back(c.key);
+    c.state = TcpState::Closed;
+    c.rto_deadline = c.ack_deadline = c.close_deadline = 0;
+    if (c.listen) {
+      c.listen->pending--;
+      c.listen = nullptr;
+    }
+    _wake(c.reader);
+    _wake(c.writer);
+    _wake(c.opener);
+  }
+
+  /// @brief Resets the connection, telling the peer.
+  void _abort_locked(TcpConnection &c) {
+    if (c.state != TcpState::SynSent && c.state != TcpState::Closed) {
+      _control.push_back(_build(c.key, TCP_RST, c.snd_nxt, 0, 0, {}));
+      resets_sent++;
+    }
+    c.reset = true;
+    _drop_locked(c);
+  }
+
+  void _forget_closed_locked() {
+    for (auto &key : _closed)
+      _connections.erase(key);
+    _closed.clear();
+  }
+
+  /// @brief A segment for no connection either opens one on a listener or
+  /// is answered with a reset, RFC 9293 section 3.10.7.1.
+  void _unconnected_locked(const TcpSegment &segment, u64 now) {
+    if (segment.flags & TCP_RST)
+      return;
+
+    auto it = _listeners.find(segment.key.dport);
+    if ((segment.flags & (TCP_SYN | TCP_ACK | TCP_FIN)) != TCP_SYN ||
+        it == _listeners.end()) {
+      _refuse_locked(segment);
+      return;
+    }
+
+    auto &listen = it->second;
+    if (listen->pending >= listen->backlog)
+      // The peer retries, maybe there is room by then
+      return;
+
+    auto connection = std::make_shared<TcpConnection>();
+    auto &c = *connection;
+    c.key = segment.key;
+    c.state = TcpState::SynReceived;
+    c.irs = segment.seq;
+    c.rcv_nxt = segment.seq + 1;
+    c.rcv_adv = c.rcv_nxt;
+    _negotiate(c, segment);
+    _open(c);
+    c.snd_wnd = segment.window;
+    c.snd_wl1 = segment.seq;
+    c.snd_wl2 = c.iss;
+
+    auto [slot, added] = _connections.insert(c.key, connection, now);
+    if (!slot || !added)
+      return;
+    c.listen = listen;
+    listen->pending++;
+    _touch(connection);
+  }
+
+  /// @brief Takes on what the peer's SYN offers.
+  void _negotiate(TcpConnection &c, const TcpSegment &segment) {
+    c.mss = std::min<u16>(segment.mss.value_or(TCP_DEFAULT_MSS), mss);
+    c.scaling = segment.window_shift.has_value();
+    c.snd_shift = c.scaling ? *segment.window_shift : 0;
+    c.rcv_shift = c.scaling ? TCP_WINDOW_SHIFT : 0;
+    c.sack_permitted = segment.sack_permitted;
+  }
+
+  void _refuse_locked(const TcpSegment &segment) {
+    if (segment.flags & TCP_ACK)
+      _control.push_back(_build(segment.key, TCP_RST, segment.ack, 0, 0, {}));
+    else
+      _control.push_back(_build(segment.key, TCP_RST | TCP_ACK, 0,
+                                segment.seq + segment.length(), 0, {}));
+    resets_sent++;
+  }
+
+  /// @brief RFC 9293 section 3.10.7.4, for every state but LISTEN.
+  void _segment_locked(const std::shared_ptr<TcpConnection> &connection,
+                       TcpSegment &segment, u64 now) {
+    auto &c = *connection;
+    if (c.state == TcpState::SynSent) {
+      _syn_sent_locked(connection, segment, now);
+      return;
+    }
+
+    if (c.state == TcpState::SynReceived &&
+        (segment.flags & (TCP_SYN | TCP_ACK)) == TCP_SYN &&
+        segment.seq == c.irs) {
+      // Our SYN-ACK was lost, send it again
+      c.snd_nxt = c.iss;
+      _touch(connection);
+      return;
+    }
+
+    if (!_acceptable(c, segment)) {
+      if (!(segment.flags & TCP_RST)) {
+        c.ack_now = true;
+        _touch(connection);
+      }
+      return;
+    }
+
+    if (segment.flags & TCP_RST) {
+      // RFC 5961: only an exact match resets, anything else in the window
+      // may be forged and is challenged instead
+      if (segment.seq == c.rcv_nxt) {
+        c.reset = true;
+        _drop_locked(c);
+      } else {
+        c.ack_now = true;
+        _touch(connection);
+      }
+      return;
+    }
+
+    if (segment.flags & TCP_SYN) {
+      // RFC 5961 section 4, a SYN in the window is challenged as well
+      c.ack_now = true;
+      _touch(connection);
+      return;
+    }
+
+    if (!(segment.flags & TCP_ACK))
+      return;
+
+    if (c.state == TcpState::SynReceived) {
+      if (!seq_lt(c.snd_una, segment.ack) ||
+          !seq_le(segment.ack, c.snd_max)) {
+        _refuse_locked(segment);
+        return;
+      }
+      _handshake_done_locked(connection, segment, now);
+    }
+
+    if (!_ack_locked(connection, segment, now))
+      return;
+    _data_locked(connection, segment, now);
+    _fin_locked(connection, segment, now);
+  }
+
+  /// @brief RFC 9293 section 3.10.7.4, the table of the first check.
+  bool _acceptable(const TcpConnection &c, const TcpSegment &segment) const {
+    u32 window = c.rcv_adv - c.rcv_nxt;
+    u32 length = segment.length();
+    auto inside = [&](u32 seq) {
+      return seq_le(c.rcv_nxt, seq) && seq_lt(seq, c.rcv_nxt + window);
+    };
+
+    if (length == 0)
+      return window == 0 ? segment.seq == c.rcv_nxt : inside(segment.seq);
+    return window != 0 &&
+           (inside(segment.seq) || inside(segment.seq + length - 1));
+  }
+
+  void _syn_sent_locked(const std::shared_ptr<TcpConnection> &connection,
+                        TcpSegment &segment, u64 now) {
+    auto &c = *connection;
+    bool acceptable = (segment.flags & TCP_ACK) && segment.ack == c.iss + 1;
+    if ((segment.flags & TCP_ACK) && !acceptable) {
+      if (!(segment.flags & TCP_RST))
+        _refuse_locked(segment);
+      return;
+    }
+
+    if (segment.flags & TCP_RST) {
+      if (acceptable) {
+        c.reset = true;
+        _drop_locked(c);
+      }
+      return;
+    }
+
+    // A SYN without an ACK would be a simultaneous open, which nobody does
+    if (!(segment.flags & TCP_SYN) || !acceptable)
+      return;
+
+    c.irs = segment.seq;
+    c.rcv_nxt = segment.seq + 1;
+    c.rcv_adv = c.rcv_nxt;
+    _negotiate(c, segment);
+    _established(c);
+    c.snd_una = segment.ack;
+    c.snd_wnd = segment.window;
+    c.snd_wl1 = segment.seq;
+    c.snd_wl2 = segment.ack;
+    c.rto_deadline = 0;
+    c.retransmits = 0;
+    if (c.timed)
+      _sample_rtt(c, now - c.timed->second);
+    c.timed.reset();
+    c.ack_now = true;
+    _touch(connection);
+    _wake(c.opener);
+  }
+
+  void _handshake_done_locked(const std::shared_ptr<TcpConnection> &connection,
+                              const TcpSegment &segment, u64 now) {
+    auto &c = *connection;
+    _established(c);
+    c.snd_wnd = (sz)segment.window << c.snd_shift;
+    c.snd_wl1 = segment.seq;
+    c.snd_wl2 = segment.ack;
+    if (c.timed && c.retransmits == 0)
+      _sample_rtt(c, now - c.timed->second);
+    c.timed.reset();
+    c.retransmits = 0;
+
+    auto listen = std::exchange(c.listen, nullptr);
+    if (listen->closed) {
+      listen->pending--;
+      _abort_locked(c);
+      return;
+    }
+    listen->ready.push_back(connection);
+    _wake(listen->acceptor);
+  }
+
+  /// @brief Processes the acknowledgment, the window and the SACK blocks.
+  /// @return `false` if the rest of the segment is to be ignored
+  bool _ack_locked(const std::shared_ptr<TcpConnection> &connection,
+                   const TcpSegment &segment, u64 now) {
+    auto &c = *connection;
+    if (c.state == TcpState::Closed)
+      return false;
+    if (seq_lt(c.snd_max, segment.ack)) {
+      // Acknowledges something never sent
+      c.ack_now = true;
+      _touch(connection);
+      return false;
+    }
+
+    sz window = (sz)segment.window << c.snd_shift;
+    if (seq_lt(c.snd_una, segment.ack)) {
+      _acked_locked(connection, segment.ack - c.snd_una, now);
+    } else if (segment.ack == c.snd_una && segment.payload.size() == 0 &&
+               !(segment.flags & TCP_FIN) && window == c.snd_wnd &&
+               c.snd_una != c.snd_max) {
+      c.duplicate_acks++;
+    }
+    if (c.state == TcpState::Closed)
+      return false;
+
+    if (seq_lt(c.snd_wl1, segment.seq) ||
+        (c.snd_wl1 == segment.seq && seq_le(c.snd_wl2, segment.ack))) {
+      if (window > c.snd_wnd)
+        _touch(connection);
+      if (window == 0 && c.snd_wnd == 0)
+        // Our probes are answered, the peer is alive
+        c.retransmits = 0;
+      c.snd_wnd = window;
+      c.snd_wl1 = segment.seq;
+      c.snd_wl2 = segment.ack;
+    }
+
+    if (c.sack_permitted)
+      for (sz i = 0; i < segment.sack_blocks; i++)
+        _sacked_locked(c, segment.sack[i].first, segment.sack[i].second);
+
+    if (!c.recovering && c.snd_una != c.snd_max &&
+        (c.duplicate_acks >= TCP_DUPLICATE_THRESHOLD ||
+         c.sacked_bytes() >= TCP_DUPLICATE_THRESHOLD * c.mss)) {
+      // RFC 6675 section 5, fast retransmit and recovery
+      sz flight = c.snd_max - c.snd_una;
+      c.ssthresh = std::max<sz>(flight / 2, 2 * c.mss);
+      c.cwnd = c.ssthresh;
+      c.recovering = true;
+      c.recover = c.snd_max;
+      c.high_rxt = c.snd_una;
+      c.timed.reset();
+      fast_retransmits++;
+      _touch(connection);
+    }
+    return true;
+  }
+
+  void _acked_locked(const std::shared_ptr<TcpConnection> &connection,
+                     u32 acked, u64 now) {
+    auto &c = *connection;
+    sz data = std::min<sz>(acked, c.send.size());
+    if (acked > c.send.size() && c.fin_queued)
+      c.fin_acked = true;
+    c.send.trim_front(data);
+    c.snd_una += acked;
+    if (seq_lt(c.snd_nxt, c.snd_una))
+      c.snd_nxt = c.snd_una;
+    while (!c.sacked.empty() && seq_le(c.sacked.front().second, c.snd_una))
+      c.sacked.erase(c.sacked.begin());
+    if (!c.sacked.empty() && seq_lt(c.sacked.front().first, c.snd_una))
+      c.sacked.front().first = c.snd_una;
+
+    if (c.timed && seq_le(c.timed->first, c.snd_una)) {
+      _sample_rtt(c, now - c.timed->second);
+      c.timed.reset();
+    }
+    c.retransmits = 0;
+    c.duplicate_acks = 0;
+    c.probe = false;
+
+    if (c.recovering) {
+      if (seq_le(c.recover, c.snd_una)) {
+        c.recovering = false;
+        c.cwnd = c.ssthresh;
+      }
+    } else if (c.cwnd < c.ssthresh) {
+      c.cwnd += std::min<sz>(acked, c.mss);
+    } else if ((c._avoidance += acked) >= c.cwnd) {
+      c._avoidance -= c.cwnd;
+      c.cwnd += c.mss;
+    }
+
+    if (c.snd_una == c.snd_max)
+      c.rto_deadline = 0;
+    else
+      _arm(c.rto_deadline, now + c.rto_ns);
+
+    if (c.writing)
+      _take_locked(connection, *c.writing);
+    if (c.writing && c.writing->empty())
+      _wake(c.writer);
+    _touch(connection);
+
+    if (!c.fin_acked)
+      return;
+    switch (c.state) {
+    case TcpState::FinWait1:
+      c.state = TcpState::FinWait2;
+      _arm(c.close_deadline, now + TCP_TIME_WAIT_NS);
+      break;
+    case TcpState::Closing:
+      c.state = TcpState::TimeWait;
+      _arm(c.close_deadline, now + TCP_TIME_WAIT_NS);
+      break;
+    case TcpState::LastAck:
+      _drop_locked(c);
+      break;
+    default:
+      break;
+    }
+  }
+
+  /// @brief Adds a SACK block to the scoreboard, merging it with the ranges
+  /// it touches. Blocks outside of what is in flight are ignored.
+  void _sacked_locked(TcpConnection &c, u32 start, u32 end) {
+    if (!seq_lt(start, end) || !seq_lt(c.snd_una, end) ||
+        seq_lt(c.snd_max, end))
+      return;
+    if (seq_lt(start, c.snd_una))
+      start = c.snd_una;
+
+    auto &sacked = c.sacked;
+    auto it = std::find_if(sacked.begin(), sacked.end(), [&](auto &range) {
+      return seq_le(start, range.second);
+    });
+    while (it != sacked.end() && seq_le(it->first, end)) {
+      start = seq_lt(it->first, start) ? it->first : start;
+      end = seq_lt(end, it->second) ? it->second : end;
+      it = sacked.erase(it);
+    }
+    sacked.insert(it, {start, end});
+  }
+
+  /// @brief RFC 6298 section 2.
+  void _sample_rtt(TcpConnection &c, u64 rtt) {
+    if (!c.srtt_ns) {
+      c.srtt_ns = rtt;
+      c.rttvar_ns = rtt / 2;
+    } else {
+      u64 delta = c.srtt_ns > rtt ? c.srtt_ns - rtt : rtt - c.srtt_ns;
+      c.rttvar_ns = (3 * c.rttvar_ns + delta) / 4;
+      c.srtt_ns = (7 * c.srtt_ns + rtt) / 8;
+    }
+    c.rto_ns = std::clamp(c.srtt_ns + 4 * c.rttvar_ns, TCP_RTO_MIN_NS,
+                          TCP_RTO_MAX_NS);
+  }
+
+  /// @brief Files the payload away, in order or past a hole.
+  void _data_locked(const std::shared_ptr<TcpConnection> &connection,
+                    TcpSegment &segment, u64 now) {
+    auto &c = *connection;
+    if (segment.payload.size() == 0)
+      return;
+    if (c.state != TcpState::Established && c.state != TcpState::FinWait1 &&
+        c.state != TcpState::FinWait2)
+      return;
+
+    u32 seq = segment.seq;
+    Buffer data = std::move(segment.payload);
+    if (seq_lt(seq, c.rcv_nxt)) {
+      sz old = c.rcv_nxt - seq;
+      data = std::move(data).slice(std::min(old, data.size()), data.size());
+      seq = c.rcv_nxt;
+    }
+    sz room = seq_lt(seq, c.rcv_adv) ? c.rcv_adv - seq : 0;
+    if (data.size() > room)
+      data = std::move(data).slice(room);
+    if (data.size() == 0) {
+      // A duplicate, the peer missed our ACK
+      c.ack_now = true;
+      _touch(connection);
+      return;
+    }
+
+    if (seq != c.rcv_nxt) {
+      _out_of_order_locked(c, seq, std::move(data));
+      // Duplicate ACKs with SACK blocks go out right away, RFC 5681
+      c.ack_now = true;
+      _touch(connection);
+      return;
+    }
+
+    c.unacked += data.size();
+    c.rcv_nxt += data.size();
+    c.received.append(std::move(data));
+    bool filled = _reassemble_locked(c);
+    if (filled || c.unacked >= 2 * (sz)mss)
+      c.ack_now = true;
+    else if (!c.ack_deadline)
+      _arm(c.ack_deadline, now + TCP_DELAYED_ACK_NS);
+    _touch(connection);
+    _wake(c.reader);
+  }
+
+  void _out_of_order_locked(TcpConnection &c, u32 seq, Buffer data) {
+    auto &segments = c.out_of_order;
+    // Cut whatever is there already off the new segment
+    auto next = segments.upper_bound(seq);
+    if (next != segments.begin()) {
+      auto &[start, previous] = *std::prev(next);
+      u32 end = start + previous.size();
+      if (seq_lt(seq, end)) {
+        sz overlap = std::min<sz>(end - seq, data.size());
+        data = std::move(data).slice(overlap, data.size());
+        seq = end;
+      }
+    }
+    if (next != segments.end() && seq_lt(next->first, seq + data.size()))
+      data = std::move(data).slice(next->first - seq);
+    if (data.size() == 0)
+      return;
+
+    c.last_out_of_order = seq;
+    segments.emplace(seq, std::move(data));
+  }
+
+  /// @brief Moves the segments the hole was in front of to the in order
+  /// bytes, once it is filled.
+  /// @return Whether any were moved
+  bool _reassemble_locked(TcpConnection &c) {
+    bool moved = false;
+    while (!c.out_of_order.empty()) {
+      auto it = c.out_of_order.begin();
+      if (seq_lt(c.rcv_nxt, it->first))
+        break;
+
+      u32 end = it->first + it->second.size();
+      if (seq_lt(c.rcv_nxt, end)) {
+        c.received.append(
+            it->second.slice(c.rcv_nxt - it->first, it->second.size()));
+        c.unacked += end - c.rcv_nxt;
+        c.rcv_nxt = end;
+      }
+      c.out_of_order.erase(it);
+      moved = true;
+    }
+    return moved;
+  }
+
+  void _fin_locked(const std::shared_ptr<TcpConnection> &connection,
+                   const TcpSegment &segment, u64 now) {
+    auto &c = *connection;
+    if ((segment.flags & TCP_FIN) && !c.fin_seq)
+      c.fin_seq = segment.seq + segment.payload.size();
+    if (!c.fin_seq || c.fin_received || *c.fin_seq != c.rcv_nxt)
+      return;
+
+    c.fin_received = true;
+    c.rcv_nxt++;
+    c.ack_now = true;
+    _touch(connection);
+    _wake(c.reader);
+
+    switch (c.state) {
+    case TcpState::SynReceived:
+    case TcpState::Established:
+      c.state = TcpState::CloseWait;
+      break;
+    case TcpState::FinWait1:
+      c.state = c.fin_acked ? TcpState::TimeWait : TcpState::Closing;
+      if (c.fin_acked)
+        _arm(c.close_deadline, now + TCP_TIME_WAIT_NS);
+      break;
+    case TcpState::FinWait2:
+      c.state = TcpState::TimeWait;
+      _arm(c.close_deadline, now + TCP_TIME_WAIT_NS);
+      break;
+    default:
+      break;
+    }
+  }
+
+  /// @brief Fires every deadline that passed, and finds the next one.
+  void _timers_locked(u64 now) {
+    std::vector<std::shared_ptr<TcpConnection>> due;
+    _next_timer = ~(u64)0;
+    _connections.for_each([&](const FlowKey &, auto &connection) {
+      auto &c = *connection;
+      for (u64 deadline : {c.rto_deadline, c.ack_deadline, c.close_deadline}) {
+        if (!deadline)
+          continue;
+        if (deadline <= now) {
+          due.push_back(connection);
+          break;
+        }
+        _next_timer = std::min(_next_timer, deadline);
+      }
+    });
+
+    for (auto &connection : due) {
+      auto &c = *connection;
+      if (c.close_deadline && c.close_deadline <= now) {
+        _drop_locked(c);
+        continue;
+      }
+      if (c.ack_deadline && c.ack_deadline <= now) {
+        c.ack_deadline = 0;
+        c.ack_now = true;
+        _touch(connection);
+      }
+      if (c.rto_deadline && c.rto_deadline <= now)
+        _timeout_locked(connection);
+
+      for (u64 deadline : {c.rto_deadline, c.ack_deadline, c.close_deadline})
+        if (deadline)
+          _next_timer = std::min(_next_timer, deadline);
+    }
+  }
+
+  /// @brief RFC 6298 section 5 and RFC 5681 section 3.1: back off, collapse
+  /// the window and send everything not SACKed again, or probe a window
+  /// that stayed closed.
+  void _timeout_locked(const std::shared_ptr<TcpConnection> &connection) {
+    auto &c = *connection;
+    c.rto_deadline = 0;
+    if (++c.retransmits > TCP_MAX_RETRANSMITS) {
+      _abort_locked(c);
+      return;
+    }
+
+    timeouts++;
+    c.rto_ns = std::min(c.rto_ns * 2, TCP_RTO_MAX_NS);
+    if (c.synchronized()) {
+      sz flight = c.snd_max - c.snd_una;
+      c.ssthresh = std::max<sz>(flight / 2, 2 * c.mss);
+      c.cwnd = c.mss;
+      c._avoidance = 0;
+      c.recovering = false;
+      c.duplicate_acks = 0;
+      c.probe = c.snd_wnd == 0;
+    }
+    c.snd_nxt = c.snd_una;
+    c.timed.reset();
+    _touch(connection);
+  }
+
+  /// @brief Sends whatever the connection has to, and an ACK if one is due
+  /// and nothing else carried it.
+  void _transmit_locked(TcpConnection &c, u64 now,
+                        std::vector<TcpPacket> &out) {
+    if (c.state == TcpState::Closed)
+      return;
+
+    if (c.state == TcpState::SynSent || c.state == TcpState::SynReceived) {
+      if (c.snd_nxt != c.iss)
+        return;
+      u8 flags = c.state == TcpState::SynSent ? TCP_SYN : TCP_SYN | TCP_ACK;
+      _emit_locked(c, flags, c.iss, 0, out);
+      c.snd_nxt = c.iss + 1;
+      c.snd_max = c.snd_nxt;
+      if (c.retransmits == 0)
+        c.timed = {{c.snd_nxt, now}};
+      _arm(c.rto_deadline, now + c.rto_ns);
+      return;
+    }
+
+    bool sent = false;
+    if (c.sending()) {
+      sent |= _retransmit_holes_locked(c, out);
+      sent |= _send_locked(c, now, out);
+    }
+
+    if (!sent && c.ack_now) {
+      _emit_locked(c, TCP_ACK, c.snd_nxt, 0, out);
+      acks_sent++;
+    }
+  }
+
+  /// @brief In recovery, sends the holes below the highest SACKed byte once
+  /// each, a window's worth per poll. Without SACK only the first segment
+  /// is lost as far as we know.
+  bool _retransmit_holes_locked(TcpConnection &c,
+                                std::vector<TcpPacket> &out) {
+    if (!c.recovering)
+      return false;
+
+    if (c.sacked.empty()) {
+      if (!seq_le(c.high_rxt, c.snd_una) || c.snd_una == c.snd_max)
+        return false;
+      sz length = std::min<sz>(c.mss, c.send.size());
+      _emit_locked(c, TCP_ACK, c.snd_una, length, out);
+      c.high_rxt = c.snd_una + length;
+      retransmitted++;
+      return true;
+    }
+
+    bool sent = false;
+    sz budget = std::max<sz>(c.cwnd, c.mss);
+    u32 seq = seq_lt(c.high_rxt, c.snd_una) ? c.snd_una : c.high_rxt;
+    u32 high = c.sacked.back().second;
+    while (budget > 0) {
+      seq = c.skip_sacked(seq);
+      if (!seq_lt(seq, high))
+        break;
+
+      sz offset = seq - c.snd_una;
+      sz length = std::min<sz>({c.mss - _sack_length(c), budget,
+                                c.send.size() - offset});
+      length = c.until_sacked(seq, length);
+      if (length == 0)
+        break;
+
+      _emit_locked(c, TCP_ACK, seq, length, out);
+      retransmitted++;
+      seq += length;
+      c.high_rxt = seq;
+      budget -= std::min(budget, length);
+      sent = true;
+    }
+    return sent;
+  }
+
+  /// @brief Sends new data, or everything not SACKed again after a timeout,
+  /// as far as the windows allow. The FIN rides on the last segment. SACKed
+  /// bytes left the network, they do not count against the window.
+  bool _send_locked(TcpConnection &c, u64 now,
+                    std::vector<TcpPacket> &out) {
+    bool sent = false;
+    sz allowed = std::min(c.snd_wnd, c.cwnd + c.sacked_bytes());
+    u32 edge = c.snd_una + (u32)std::min<sz>(allowed, 1u << 30);
+    u32 fin_seq = c.snd_una + (u32)c.send.size();
+
+    while (true) {
+      if (seq_lt(c.snd_nxt, c.snd_max))
+        c.snd_nxt = c.skip_sacked(c.snd_nxt);
+      sz offset = c.snd_nxt - c.snd_una;
+      sz available = offset < c.send.size() ? c.send.size() - offset : 0;
+      sz room = seq_lt(c.snd_nxt, edge) ? edge - c.snd_nxt : 0;
+      if (c.probe && room == 0 && available > 0)
+        room = 1;
+
+      sz segment = c.mss - _sack_length(c);
+      bool fresh = !seq_lt(c.snd_nxt, c.snd_max);
+      sz length = std::min({available, fresh ? _super_segment(c) : segment,
+                            room});
+      if (!fresh)
+        length = c.until_sacked(c.snd_nxt, length);
+      bool fin = c.fin_queued && !c.fin_acked && c.snd_nxt + length == fin_seq;
+      if (length == 0 && !fin)
+        break;
+
+      if (seq_lt(c.snd_nxt, c.snd_max))
+        retransmitted++;
+      else if (!c.timed)
+        c.timed = {{c.snd_nxt + (u32)length + fin, now}};
+
+      u8 flags = TCP_ACK | (fin ? TCP_FIN : 0) |
+                 (length > 0 && length == available ? TCP_PSH : 0);
+      _emit_locked(c, flags, c.snd_nxt, length, out,
+                   length > segment ? segment : 0);
+      c.snd_nxt += length + fin;
+      if (seq_lt(c.snd_max, c.snd_nxt))
+        c.snd_max = c.snd_nxt;
+      c.probe = false;
+      if (!c.rto_deadline)
+        _arm(c.rto_deadline, now + c.rto_ns);
+      sent = true;
+      if (fin)
+        break;
+    }
+
+    // A closed window is probed once the timer fires
+    if (!sent && !c.rto_deadline && c.snd_wnd == 0 && !c.send.empty())
+      _arm(c.rto_deadline, now + c.rto_ns);
+    return sent;
+  }
+
+  /// @brief Bytes of the SACK option the next segment carries.
+  /// @brief Most new data one segment may carry, a multiple of the peer's
+  /// MSS when the device cuts it into segments.
+  auto _super_segment(const TcpConnection &c) const -> sz {
+    sz options = _sack_length(c);
+    sz segment = c.mss - options;
+    sz headers = IP_HEADER_SIZE + TCP_HEADER_SIZE + options;
+    if (gso_max_size < headers + 2 * segment)
+      return segment;
+    return (gso_max_size - headers) / segment * segment;
+  }
+
+  static auto _sack_length(const TcpConnection &c) -> sz {
+    if (!c.sack_permitted || c.out_of_order.empty())
+      return 0;
+    sz blocks = 0;
+    u32 end = 0;
+    for (auto &[start, data] : c.out_of_order) {
+      if (blocks == 0 || start != end)
+        blocks++;
+      end = start + data.size();
+    }
+    return 4 + 8 * std::min(blocks, TCP_SACK_BLOCKS);
+  }
+
+  /// @brief Options of a SYN, or the SACK blocks of anything else: the block
+  /// of the segment that arrived last comes first, RFC 2018 section 4.
+  static auto _options(const TcpConnection &c, u8 flags, u16 mss,
+                       std::array<u8, TCP_MAX_OPTIONS> &options) -> sz {
+    sz n = 0;
+    if (flags & TCP_SYN) {
+      options[n++] = TCP_OPTION_MSS;
+      options[n++] = 4;
+      options[n++] = mss >> 8;
+      options[n++] = mss & 0xFF;
+      if (c.scaling) {
+        options[n++] = TCP_OPTION_NOP;
+        options[n++] = TCP_OPTION_WINDOW_SCALE;
+        options[n++] = 3;
+        options[n++] = c.rcv_shift;
+      }
+      if (c.sack_permitted) {
+        options[n++] = TCP_OPTION_NOP;
+        options[n++] = TCP_OPTION_NOP;
+        options[n++] = TCP_OPTION_SACK_PERMITTED;
+        options[n++] = 2;
+      }
+      return n;
+    }
+
+    if (!c.sack_permitted || c.out_of_order.empty())
+      return 0;
+
+    std::vector<std::pair<u32, u32>> blocks;
+    for (auto &[start, data] : c.out_of_order) {
+      if (blocks.empty() || start != blocks.back().second)
+        blocks.push_back({start, start});
+      blocks.back().second = start + data.size();
+    }
+    auto latest = std::find_if(blocks.begin(), blocks.end(), [&](auto &b) {
+      return seq_le(b.first, c.last_out_of_order) &&
+             seq_lt(c.last_out_of_order, b.second);
+    });
+    if (latest != blocks.end())
+      std::rotate(blocks.begin(), latest, latest + 1);
+    blocks.resize(std::min(blocks.size(), TCP_SACK_BLOCKS));
+
+    options[n++] = TCP_OPTION_NOP;
+    options[n++] = TCP_OPTION_NOP;
+    options[n++] = TCP_OPTION_SACK;
+    options[n++] = 2 + 8 * blocks.size();
+    for (auto [start, end] : blocks) {
+      Field<0, 32>::store(&options[n], start);
+      Field<0, 32>::store(&options[n + 4], end);
+      n += 8;
+    }
+    return n;
+  }
+
+  /// @brief The window to announce. Its right edge only moves on by a
+  /// worthwhile step and never back, RFC 9293 section 3.8.6.2.2 and RFC 7323
+  /// section 2.4. SYNs carry it unscaled.
+  auto _announce(TcpConnection &c, bool syn) -> u16 {
+    sz free = TCP_RECEIVE_BUFFER - std::min(TCP_RECEIVE_BUFFER,
+                                            c.received.size());
+    u32 edge = c.rcv_nxt + (u32)free;
+    u32 announced = seq_lt(c.rcv_adv, c.rcv_nxt) ? c.rcv_nxt : c.rcv_adv;
+    if (seq_lt(edge, announced) ||
+        edge - announced < std::min<sz>(TCP_RECEIVE_BUFFER / 2, mss))
+      edge = announced;
+
+    u8 shift = syn ? 0 : c.rcv_shift;
+    u32 window = std::min<u32>((edge - c.rcv_nxt) >> shift, 0xFFFF);
+    c.rcv_adv = c.rcv_nxt + (window << shift);
+    return window;
+  }
+
+  /// @brief Builds a segment of the connection. Any segment but the first
+  /// SYN acknowledges everything received, so the ACK owed is paid.
+  /// @param gso_size Has the device cut the segment into ones of this many
+  /// bytes, 0 if it is sent as is
+  void _emit_locked(TcpConnection &c, u8 flags, u32 seq, sz length,
+                    std::vector<TcpPacket> &out, sz gso_size = 0) {
+    if (c.state != TcpState::SynSent)
+      flags |= TCP_ACK;
+
+    std::array<u8, TCP_MAX_OPTIONS> options;
+    sz options_length = _options(c, flags, mss, options);
+    u16 window = _announce(c, flags & TCP_SYN);
+    PacketBuffer packet = _build(
+        c.key, flags, seq, c.rcv_nxt, window,
+        std::span(options).first(options_length), &c.send, seq - c.snd_una,
+        length, gso_size != 0);
+    if (gso_size)
+      out.emplace_back(std::move(packet),
+                       VirtioNetHeader::segmented(
+                           VirtioNetHeader::GSO_TCPV4,
+                           IP_HEADER_SIZE + TCP_HEADER_SIZE + options_length,
+                           gso_size, IP_HEADER_SIZE,
+                           TcpHeader::Checksum::FIRST_BYTE));
+    else
+      out.emplace_back(std::move(packet));
+    segments_sent++;
+
+    if (flags & TCP_ACK) {
+      c.ack_now = false;
+      c.unacked = 0;
+      c.ack_deadline = 0;
+    }
+  }
+
+  /// @brief Builds an IPv4 packet with a segment from the local end of `key`
+  /// to its remote end. The payload is copied out of `payload` and summed
+  /// for the checksum in the same pass.
+  /// @param partial Leaves only the pseudo header in the checksum, for the
+  /// device to finish
+  auto _build(const FlowKey &key, u8 flags, u32 seq, u32 ack, u16 window,
+              std::span<const u8> options, const BufferChain *payload = nullptr,
+              sz offset = 0, sz length = 0, bool partial = false)
+      -> PacketBuffer {
+    sz header_length = TCP_HEADER_SIZE + options.size();
+    PacketBuffer packet(header_length + length);
+    u8 *header = packet.put(header_length + length);
+
+    TcpHeader::SrcPort::store(header, key.dport);
+    TcpHeader::DstPort::store(header, key.sport);
+    TcpHeader::Seq::store(header, seq);
+    TcpHeader::Ack::store(header, flags & TCP_ACK ? ack : 0);
+    TcpHeader::DataOffset::store(header, header_length / 4);
+    header[12] &= 0xF0;
+    TcpHeader::Flags::store(header, flags);
+    TcpHeader::Window::store(header, window);
+    TcpHeader::Checksum::store(header, 0);
+    TcpHeader::Urgent::store(header, 0);
+    if (!options.empty())
+      std::memcpy(header + TCP_HEADER_SIZE, options.data(), options.size());
+
+    u64 pseudo =
+        TcpSegment::pseudo_sum(key.dst, key.src, header_length + length);
+    u64 sum = pseudo + ones_complement_sum({header, header_length});
+    u8 *out = header + header_length;
+    sz copied = 0;
+    if (payload)
+      for (auto &chunk : payload->chunks()) {
+        if (copied == length)
+          break;
+        if (offset >= chunk.size()) {
+          offset -= chunk.size();
+          continue;
+        }
+
+        sz piece = std::min(chunk.size() - offset, length - copied);
+        u16 part = copy_and_sum(out + copied, {chunk.data() + offset, piece});
+        // A piece starting at an odd offset has its bytes in the other
+        // halves of the words, RFC 1071 section 2
+        sum += copied % 2 ? std::byteswap(part) : part;
+        copied += piece;
+        offset = 0;
+      }
+    ASSERT(copied == length, "Copied {} of {} bytes", copied, length);
+    TcpHeader::Checksum::store(header,
+                               partial ? fold_sum(pseudo) : ~fold_sum(sum));
+
+    Ip<DirectionOut> ip;
+    ip.version = 4;
+    ip.dscp = 0;
+    ip.ecn = 0;
+    ip.identification = _identification++;
+    ip.flags = IP_FLAG_DONT_FRAGMENT;
+    ip.fragment_offset = 0;
+    ip.ttl = 64;
+    ip.protocol = PROTOCOL_TCP;
+    ip.src = TcpSocket::_ip(key.dst);
+    ip.dst = TcpSocket::_ip(key.src);
+    ip.push_onto(packet);
+    return packet;
+  }
+};
+
+inline void TcpSocket::_close() {
+  if (_stack && _connection)
+    _stack->_close(_connection);
+  _connection = nullptr;
+}
+
+inline void TcpListener::_close() {
+  if (_stack && _listen)
+    _stack->_unlisten(_listen);
+  _listen = nullptr;
+}
+
+} // namespace toad
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <bit>
+#include <cstring>
+#include <span>
+
+#include "checksum.hpp"
+#include "defs.hpp"
+
+namespace toad {
+
+/// @brief The `virtio_net_hdr` in front of every frame of a TAP device opened
+/// with `IFF_VNET_HDR`. It tells the other side which work was left undone:
+/// a checksum to fill in, or a super-frame to cut into segments.
+///
+/// NOTE: unlike the headers on the wire the fields are little endian, the
+/// byte order of virtio 1.0 devices. The kernel uses it on little endian
+/// hosts unless told otherwise with `TUNSETVNETBE`.
+struct VirtioNetHeader {
+  static constexpr sz SIZE = 10;
+
+  /// @brief The checksum at `csum_start + csum_offset` only covers the
+  /// pseudo header, the rest of the sum from `csum_start` on is missing
+  static constexpr u8 NEEDS_CSUM = 1;
+  /// @brief The checksums were verified already
+  static constexpr u8 DATA_VALID = 2;
+
+  static constexpr u8 GSO_NONE = 0;
+  static constexpr u8 GSO_TCPV4 = 1;
+  static constexpr u8 GSO_UDP = 3;
+  static constexpr u8 GSO_TCPV6 = 4;
+  static constexpr u8 GSO_ECN = 0x80;
+
+  u8 flags = 0;
+  u8 gso_type = GSO_NONE;
+  /// @brief Length of the headers repeated in front of every segment
+  u16 hdr_len = 0;
+  /// @brief Payload bytes per segment
+  u16 gso_size = 0;
+  u16 csum_start = 0;
+  u16 csum_offset = 0;
+
+  static auto load(const u8 *header) -> VirtioNetHeader {
+    VirtioNetHeader ret;
+    ret.flags = header[0];
+    ret.gso_type = header[1];
+    ret.hdr_len = _load_le(header + 2);
+    ret.gso_size = _load_le(header + 4);
+    ret.csum_start = _load_le(header + 6);
+    ret.csum_offset = _load_le(header + 8);
+    return ret;
+  }
+
+  void store(u8 *header) const {
+    header[0] = flags;
+    header[1] = gso_type;
+    _store_le(header + 2, hdr_len);
+    _store_le(header + 4, gso_size);
+    _store_le(header + 6, csum_start);
+    _store_le(header + 8, csum_offset);
+  }
+
+  /// @brief Leaves the checksum at `offset` bytes past `start` for the kernel.
+  /// The checksum field must hold the sum of the pseudo header, or zero if
+  /// the protocol has none.
+  static auto partial_checksum(u16 start, u16 offset) -> VirtioNetHeader {
+    VirtioNetHeader ret;
+    ret.flags = NEEDS_CSUM;
+    ret.csum_start = start;
+    ret.csum_offset = offset;
+    return ret;
+  }
+
+  /// @brief Has the kernel cut a super-frame into segments of `segment_size`
+  /// payload bytes, each behind a copy of the first `headers` bytes. Segments
+  /// always need their checksums filled in, so this implies
+  /// `partial_checksum`.
+  static auto segmented(u8 gso_type, u16 headers, u16 segment_size,
+                        u16 csum_start, u16 csum_offset) -> VirtioNetHeader {
+    VirtioNetHeader ret = partial_checksum(csum_start, csum_offset);
+    ret.gso_type = gso_type;
+    ret.hdr_len = headers;
+    ret.gso_size = segment_size;
+    return ret;
+  }
+
+  bool needs_checksum() const { return flags & NEEDS_CSUM; }
+
+  /// @brief Whether the transport checksum can be taken as correct without
+  /// summing the payload. A frame from the local stack with `NEEDS_CSUM` was
+  /// never corrupted on a wire, its checksum just was not finished.
+  bool checksum_trusted() const { return flags & (NEEDS_CSUM | DATA_VALID); }
+
+  /// @brief Finishes a partial checksum in software, for frames that leave
+  /// through something that cannot. `frame` starts at the Ethernet header.
+  /// @return `false` if the offsets point outside of `frame`
+  bool complete_checksum(std::span<u8> frame) const {
+    if (!needs_checksum())
+      return true;
+    if ((sz)csum_start + csum_offset + 2 > frame.size())
+      return false;
+
+    // The field holds the pseudo header sum, so summing over it adds it in
+    u8 *field = frame.data() + csum_start + csum_offset;
+    u16 sum = ones_complement_sum(frame.subspan(csum_start));
+    u16 result = ~sum;
+    field[0] = result >> 8;
+    field[1] = result & 0xFF;
+    return true;
+  }
+
+  static auto _load_le(const u8 *bytes) -> u16 {
+    u16 value;
+    std::memcpy(&value, bytes, 2);
+    if constexpr (std::endian::native == std::endian::big)
+      value = std::byteswap(value);
+    return value;
+  }
+
+  static void _store_le(u8 *bytes, u16 value) {
+    if constexpr (std::endian::native == std::endian::big)
+      value = std::byteswap(value);
+    std::memcpy(bytes, &value, 2);
+  }
+};
+
+} // namespace toad
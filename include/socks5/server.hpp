@@ -10,11 +10,11 @@ struct Socks5Server {
     IOContext &io = this_io_context();
 
     auto listener = io.new_listener(1080);
-    spdlog::info("Expecting SOCKS5 connections on 0.0.0.0:1080");
+    TOAD_INFO("Expecting SOCKS5 connections on 0.0.0.0:1080");
 
     while (true) {
       auto client = co_await io.submit_accept_ipv4(listener);
-      spdlog::info("Got client sockfd={}", client._sockfd);
+      TOAD_INFO("Got client sockfd={}", client._sockfd);
       spawn(handle_client_handshake(std::move(client)));
     }
   }
@@ -33,18 +33,17 @@ struct Socks5Server {
     istream.read_u8(&version).read_u8(&nmethods);
 
     if (version != 5) {
-      spdlog::warn(
-          "Attempt to connect with version {}, but only 5 is supported",
-          version);
+      TOAD_WARN("Attempt to connect with version {}, but only 5 is supported",
+                version);
       co_return;
     }
 
-    spdlog::info("Connection using V{} with {} authentication methods", version,
-                 nmethods);
+    TOAD_INFO("Connection using V{} with {} authentication methods", version,
+              nmethods);
 
     auto methods = co_await io.submit_read_some(client, buffer, nmethods);
     if (methods < nmethods) {
-      spdlog::error("Not enough Auth methods provided");
+      TOAD_ERROR("Not enough Auth methods provided");
       co_return;
     }
 
@@ -57,7 +56,7 @@ struct Socks5Server {
     }
 
     if (!is_ok) {
-      spdlog::warn("Authentication failed. Pity.");
+      TOAD_WARN("Authentication failed. Pity.");
       co_return;
     }
 
@@ -66,7 +65,7 @@ struct Socks5Server {
 
     // Client accepted! Can do some real processing now.
     // the connection is trusted
-    spdlog::info("Trusted connection established, can do some real work now");
+    TOAD_INFO("Trusted connection established, can do some real work now");
 
     read = co_await io.submit_read_some(client, buffer, 4);
     if (read < 4)
@@ -89,17 +88,17 @@ struct Socks5Server {
         co_return;
       IPv4 addr;
       istream.read_array(&addr);
-      spdlog::critical("{}", addr);
+      TOAD_DEBUG("Target address {}", addr);
       address = addr;
     } break;
     case 0x03: { // Domain Name
-      spdlog::info("Domain Names not supported yet :c");
+      TOAD_INFO("Domain Names not supported yet :c");
     } break;
     case 0x04: // IPv6
-      spdlog::error("IPv6 not supported, sorry");
+      TOAD_ERROR("IPv6 not supported, sorry");
       co_return;
     default:
-      spdlog::error("Unknown address type 0x{:02X}", atype);
+      TOAD_ERROR("Unknown address type 0x{:02X}", atype);
       co_return;
     }
 
@@ -108,19 +107,19 @@ struct Socks5Server {
     u16 port;
     istream.read_u16(&port);
 
-    spdlog::debug("{}", buffer);
+    TOAD_DEBUG("{}", buffer);
 
     auto ipv4 = std::get<IPv4>(address);
     auto maybe_remote_connection = co_await handle_connection(ipv4, port);
     if (!maybe_remote_connection) {
-      spdlog::error("Failed to establish a connection with the remote {}:{}",
-                    ipv4, port);
+      TOAD_ERROR("Failed to establish a connection with the remote {}:{}",
+                 ipv4, port);
       co_return;
     }
 
     auto remote = std::move(maybe_remote_connection.value());
 
-    spdlog::info("Connection established!");
+    TOAD_INFO("Connection established!");
 
     std::array<u8, 10> last_response = {0x05, 0x00, 0x00, 0x01, 127,
                                         0,    0,    1,    0xB8, 22};
@@ -135,14 +134,14 @@ struct Socks5Server {
       co_await join_set_;
     }
 
-    spdlog::info("Transmission over!");
+    TOAD_INFO("Transmission over!");
   }
 
   Future<std::optional<Socket>> handle_connection(const IPv4 &target,
                                                   u16 port) {
     IOContext &io = this_io_context();
 
-    spdlog::info("Connecting to {}:{}", target, port);
+    TOAD_INFO("Connecting to {}:{}", target, port);
 
     return io.submit_connect_ipv4(target, port);
   }
@@ -1,11 +1,27 @@
 #include "concurrency.hpp"
+#include "nic/packet_ring.hpp"
+#include "nic/pipeline.hpp"
+#include "nic/responder.hpp"
 #include "socks5/server.hpp"
 
+#include <csignal>
 #include <spdlog/sinks/stdout_color_sinks.h>
 
 using namespace toad;
 using namespace toad::socks5;
 
+/// @brief Sends back whatever the peer sends, until it closes.
+Task echo_tcp(TcpStack &stack, TcpSocket socket) {
+  while (auto data = co_await stack.submit_read_some(socket, 1 << 16))
+    if (!co_await stack.submit_write(socket, BufferChain(std::move(*data))))
+      break;
+}
+
+Task serve_tcp_echo(TcpStack &stack, TcpListener &listener) {
+  while (auto socket = co_await stack.submit_accept_ipv4(listener))
+    spawn(echo_tcp(stack, std::move(*socket)));
+}
+
 int main(void) {
   auto formatter = std::make_unique<spdlog::pattern_formatter>();
   formatter->add_flag<CorrelationIdFormatter>('Z');
@@ -15,13 +31,109 @@ int main(void) {
   logger->set_formatter(std::move(formatter));
   logger->set_level(spdlog::level::trace);
   spdlog::set_default_logger(logger);
+  logging::AsyncLogger::instance().start();
+
+  // TOAD_TRACE_SAMPLE=N traces one in N connections, SIGUSR1 dumps the trace
+  if (const char *sample = std::getenv("TOAD_TRACE_SAMPLE"))
+    tracing::tracer().sample_every = std::atoi(sample);
+  std::signal(SIGUSR1, [](int) { tracing::tracer().dump_requested = true; });
+  // SIGUSR2 logs the runtime metrics
+  std::signal(SIGUSR2, [](int) {
+    metrics::Metrics::instance().report_requested = true;
+  });
 
-  Executor executor;
+  // TOAD_CAPTURE=path writes the frames on the packet path to a pcapng file,
+  // TOAD_CAPTURE_FILTER and TOAD_CAPTURE_SNAPLEN narrow down what is kept
+  if (const char *path = std::getenv("TOAD_CAPTURE")) {
+    const char *expression = std::getenv("TOAD_CAPTURE_FILTER");
+    const char *snaplen_text = std::getenv("TOAD_CAPTURE_SNAPLEN");
+    auto filter = capture::Filter::parse(expression ? expression : "");
+    auto snaplen = snaplen_text
+                       ? capture::parse_snaplen(snaplen_text)
+                       : std::optional(capture::CAPTURE_DEFAULT_SNAPLEN);
+    if (!filter)
+      TOAD_ERROR("Invalid capture filter '{}'", expression);
+    else if (!snaplen)
+      TOAD_ERROR("Invalid capture snaplen '{}'", snaplen_text);
+    else
+      capture::tap().start(path, std::move(*filter), *snaplen);
+  }
+
+  auto layout = WorkerLayout::compact(Topology::discover());
+
+  Executor executor(layout);
   IOContext io_context;
+  io_context.pin_event_loop(layout);
 
   Socks5Server server;
   executor.spawn(server.serve_socks5());
 
+  // TOAD_TAP=name serves a TAP device on the same event loop. With
+  // TOAD_TAP_QUEUES=N it gets N queues, every queue past the first on an
+  // event loop and worker of its own. TOAD_TAP_OFFLOAD=1 opens it with
+  // offloads.
+  std::optional<Device> device;
+  if (const char *tap = std::getenv("TOAD_TAP")) {
+    const char *queues = std::getenv("TOAD_TAP_QUEUES");
+    const char *offload = std::getenv("TOAD_TAP_OFFLOAD");
+    device = Device::try_new(tap, "10.0.0.1", "255.255.255.0",
+                             queues ? std::max(1, std::atoi(queues)) : 1,
+                             offload && std::atoi(offload) != 0);
+  }
+  // TOAD_TAP_PIPELINE=1 answers through a vector pipeline per queue instead,
+  // and echoes TCP on port 7 with a stack the queues share. The queues also
+  // share what they learn about their neighbors.
+  std::optional<TcpStack> tcp;
+  std::optional<TcpListener> echo;
+  NeighborCache neighbors;
+  std::vector<std::unique_ptr<Pipeline>> pipelines;
+  // The stack hands super-segments only to a TAP device that cuts them
+  // itself, the packet rings take none
+  bool gso = device && device->queues[0].vnet && !std::getenv("TOAD_PACKET");
+  auto serve = [&](auto &device, auto &queue) {
+    auto &pipeline = *pipelines.emplace_back(
+        std::make_unique<Pipeline>(device.own_mac, device.own_ip));
+    pipeline.mtu = device.maximum_transmission_unit;
+    // Both kinds of devices sit in 10.0.0.0/24
+    pipeline.prefix_length = 24;
+    pipeline.neighbors = &neighbors;
+    if (!tcp) {
+      tcp.emplace(device.own_ip, device.maximum_transmission_unit);
+      if (gso)
+        tcp->gso_max_size = TAP_GSO_FRAME_SIZE - EthernetHeader::SIZE;
+      echo.emplace(tcp->new_listener(7));
+      executor.spawn(serve_tcp_echo(*tcp, *echo));
+    }
+    pipeline.tcp = &*tcp;
+    queue.spawn(serve_pipeline(pipeline, queue));
+  };
+  const char *use_pipeline = std::getenv("TOAD_TAP_PIPELINE");
+  if (device) {
+    device->serve_queues(layout.worker_cpus, layout.worker_nodes);
+    for (sz i = 0; i < device->queues.size(); i++) {
+      if (use_pipeline && std::atoi(use_pipeline) != 0)
+        serve(*device, device->queues[i]);
+      else
+        device->queues[i].spawn(respond(*device, i));
+    }
+  }
+
+  // TOAD_PACKET=name attaches to an existing interface through packet rings
+  // instead, at 10.0.0.1 and with as many queues as TOAD_TAP_QUEUES says,
+  // and always answers through the pipeline
+  std::optional<PacketRingDevice> rings;
+  if (const char *interface_name = std::getenv("TOAD_PACKET")) {
+    const char *queues = std::getenv("TOAD_TAP_QUEUES");
+    rings = PacketRingDevice::try_new(interface_name, "10.0.0.1",
+                                      queues ? std::max(1, std::atoi(queues))
+                                             : 1);
+  }
+  if (rings) {
+    rings->serve_queues(layout.worker_cpus, layout.worker_nodes);
+    for (auto &queue : rings->queues)
+      serve(*rings, queue);
+  }
+
   io_context.event_loop();
 
   return 0;
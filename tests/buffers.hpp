@@ -0,0 +1,191 @@
+#include <gtest/gtest.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "bytes/buffer.hpp"
+
+using namespace toad;
+
+TEST(BufferPoolTest, SizeClassesCoverTheRequest) {
+  for (sz size : {0, 1, 64, 65, 1500, 4096, 9000, (int)BUFFER_MAX_CHUNK}) {
+    u8 size_class = buffer_size_class(size);
+    ASSERT_LT(size_class, BUFFER_SIZE_CLASSES);
+    EXPECT_GE(buffer_class_size(size_class), size);
+    if (size_class > 0) {
+      EXPECT_LT(buffer_class_size(size_class - 1), size);
+    }
+  }
+}
+
+TEST(BufferPoolTest, FreedChunkIsReusedAndZeroed) {
+  u8 *first;
+  {
+    Buffer buffer(1500);
+    first = buffer.data();
+    std::memset(buffer.data(), 0xFF, buffer.size());
+  }
+
+  Buffer buffer(1500);
+  EXPECT_EQ(buffer.data(), first);
+  for (sz i = 0; i < buffer.size(); i++)
+    ASSERT_EQ(buffer[i], 0);
+}
+
+TEST(BufferPoolTest, SlicesKeepTheChunkAlive) {
+  Buffer slice;
+  BufferHeader *header;
+  {
+    Buffer buffer(std::vector<u8>{1, 2, 3, 4});
+    header = buffer._header;
+    slice = buffer.slice(1, 3);
+    EXPECT_EQ(header->references(), 2);
+  }
+
+  EXPECT_EQ(header->references(), 1);
+  EXPECT_EQ(slice.size(), 2);
+  EXPECT_EQ(slice[0], 2);
+
+  // Narrowing a temporary moves the reference instead of copying it
+  Buffer narrowed = std::move(slice).slice(1);
+  EXPECT_EQ(header->references(), 1);
+  EXPECT_EQ(narrowed[0], 2);
+}
+
+TEST(BufferPoolTest, ReferencesFromOtherThreadsAreMerged) {
+  Buffer buffer(100, uninitialized);
+  BufferHeader *header = buffer._header;
+  u8 *data = buffer.data();
+
+  // The other thread takes and drops more references than it received
+  std::thread([slice = buffer.slice(1)]() mutable {
+    Buffer copy = slice;
+    slice = Buffer();
+  }).join();
+  EXPECT_EQ(header->shared.load() & BufferHeader::QUEUED,
+            BufferHeader::QUEUED);
+
+  // Merged on the next allocation, the owner's reference keeps it alive
+  Buffer other(100, uninitialized);
+  EXPECT_EQ(header->references(), 1);
+  EXPECT_EQ(buffer.data(), data);
+
+  buffer = Buffer();
+  Buffer reused(100, uninitialized);
+  EXPECT_EQ(reused.data(), data);
+}
+
+TEST(BufferPoolTest, OwnerMergesOnItsOwnDrops) {
+  Buffer buffer(100, uninitialized), other(100, uninitialized);
+  BufferHeader *header = buffer._header;
+
+  std::thread([slice = buffer.slice(1)]() mutable {
+    Buffer copy = slice;
+    slice = Buffer();
+  }).join();
+  ASSERT_EQ(header->shared.load() & BufferHeader::QUEUED,
+            BufferHeader::QUEUED);
+
+  // An owner that never allocates again still takes the chunk back
+  other = Buffer();
+  EXPECT_EQ(header->shared.load() & BufferHeader::QUEUED, 0);
+  EXPECT_EQ(header->references(), 1);
+}
+
+TEST(BufferPoolTest, ExitingOwnerMergesWhatItCounts) {
+  Buffer buffer;
+  std::thread([&]() { buffer = Buffer(100, uninitialized); }).join();
+
+  // The reference the thread counted in `biased` is a shared one now
+  BufferHeader *header = buffer._header;
+  EXPECT_EQ(header->biased_to.load(), nullptr);
+  EXPECT_EQ(header->biased, 0);
+  EXPECT_EQ(header->shared.load(),
+            BufferHeader::SHARED_ONE | BufferHeader::MERGED);
+
+  Buffer slice = buffer.slice(1);
+  buffer = Buffer();
+  EXPECT_EQ(header->references(), 1);
+}
+
+TEST(BufferPoolTest, DropQueuedAcrossOwnerExitIsMerged) {
+  std::mutex step;
+  std::condition_variable stepped;
+  int stage = 0;
+  auto advance = [&](int to) {
+    std::unique_lock lock(step);
+    stage = to;
+    stepped.notify_all();
+    stepped.wait(lock, [&] { return stage != to; });
+  };
+
+  BufferHeader *header = nullptr;
+  std::thread owner([&]() {
+    Buffer buffer(100, uninitialized);
+    // The copy handed to the remote thread, it drops it by hand below
+    Buffer handed = buffer;
+    handed._header = nullptr;
+    header = buffer._header;
+    advance(1);
+    // Exits with the remote drop marked `QUEUED` but not pushed yet
+  });
+
+  {
+    std::unique_lock lock(step);
+    stepped.wait(lock, [&] { return stage == 1; });
+  }
+
+  // The first half of a remote drop, stalled before `queue_merge`
+  ssz now = header->shared.fetch_sub(BufferHeader::SHARED_ONE) -
+            BufferHeader::SHARED_ONE;
+  ASSERT_LT(now >> 2, 0);
+  header->shared.fetch_or(BufferHeader::QUEUED);
+
+  {
+    std::lock_guard lock(step);
+    stage = 2;
+    stepped.notify_all();
+  }
+  owner.join();
+
+  BufferArena *arena = header->arena;
+  arena->queue_merge(header);
+  EXPECT_EQ(arena->_merge_queue.load(), nullptr);
+  EXPECT_EQ(header->biased_to.load(), nullptr);
+  EXPECT_EQ(header->references(), 0);
+}
+
+TEST(BufferPoolTest, RemoteFreeReturnsToOwner) {
+  Buffer buffer(100, uninitialized);
+  u8 *data = buffer.data();
+
+  std::thread([buffer = std::move(buffer)]() mutable {
+    buffer = Buffer();
+  }).join();
+
+  // Drain the local free list of the class until the remote one is taken over
+  std::vector<Buffer> held;
+  bool reused = false;
+  for (sz i = 0; i < BUFFER_SLAB_SIZE / 128 + 1 && !reused; i++) {
+    held.emplace_back(100, uninitialized);
+    reused = held.back().data() == data;
+  }
+  EXPECT_TRUE(reused);
+}
+
+TEST(BufferPoolTest, ExitedThreadArenaIsAdopted) {
+  BufferArena *arena = nullptr;
+  Buffer survivor;
+  std::thread([&]() {
+    survivor = Buffer(64);
+    arena = &this_buffer_arena();
+  }).join();
+
+  EXPECT_TRUE(arena->orphaned.load());
+  survivor = Buffer();
+
+  auto &registry = BufferArenaRegistry::instance();
+  sz arenas = registry._arenas.size();
+  std::thread([&]() { this_buffer_arena(); }).join();
+  EXPECT_EQ(registry._arenas.size(), arenas);
+}
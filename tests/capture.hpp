@@ -0,0 +1,159 @@
+#include <fstream>
+#include <gtest/gtest.h>
+#include <iterator>
+
+#include "nic/capture.hpp"
+
+using namespace toad;
+
+/// @brief An Ethernet frame carrying the start of an IPv4 packet, enough for
+/// the filter. `length` pads it with zeros.
+static auto capture_frame(u8 protocol, IPv4 src, IPv4 dst, u16 sport,
+                          u16 dport, sz length = 64) -> std::vector<u8> {
+  std::vector<u8> frame(length);
+  EthernetHeader::Ethertype::store(frame.data(), ETHERTYPE_IPV4);
+  u8 *ip = frame.data() + EthernetHeader::SIZE;
+  IpHeader::Version::store(ip, 4);
+  IpHeader::Ihl::store(ip, 5);
+  IpHeader::Protocol::store(ip, protocol);
+  IpHeader::Src::store(ip, src);
+  IpHeader::Dst::store(ip, dst);
+  u8 *l4 = ip + IP_HEADER_SIZE;
+  l4[0] = sport >> 8, l4[1] = sport;
+  l4[2] = dport >> 8, l4[3] = dport;
+  return frame;
+}
+
+static auto arp_frame() -> std::vector<u8> {
+  std::vector<u8> frame(42);
+  EthernetHeader::Ethertype::store(frame.data(), ETHERTYPE_ARP);
+  return frame;
+}
+
+static auto read_u32(const std::vector<u8> &file, sz at) -> u32 {
+  u32 value;
+  std::memcpy(&value, file.data() + at, 4);
+  return value;
+}
+
+TEST(CaptureTest, ParsesFilters) {
+  EXPECT_TRUE(capture::Filter::parse(""));
+  EXPECT_TRUE(capture::Filter::parse("tcp and not port 22"));
+  EXPECT_TRUE(capture::Filter::parse("src host 10.0.0.1 and dst port 53"));
+  EXPECT_TRUE(capture::Filter::parse("  arp  "));
+
+  EXPECT_FALSE(capture::Filter::parse("tcp or udp"));
+  EXPECT_FALSE(capture::Filter::parse("tcp and"));
+  EXPECT_FALSE(capture::Filter::parse("not"));
+  EXPECT_FALSE(capture::Filter::parse("host 10.0.0"));
+  EXPECT_FALSE(capture::Filter::parse("port 70000"));
+  EXPECT_FALSE(capture::Filter::parse("src tcp"));
+}
+
+TEST(CaptureTest, ParsesSnaplens) {
+  EXPECT_EQ(capture::parse_snaplen("96"), 96);
+  EXPECT_EQ(capture::parse_snaplen("65535"), 65535);
+
+  EXPECT_FALSE(capture::parse_snaplen(""));
+  EXPECT_FALSE(capture::parse_snaplen("0"));
+  EXPECT_FALSE(capture::parse_snaplen("-1"));
+  EXPECT_FALSE(capture::parse_snaplen("128k"));
+  EXPECT_FALSE(capture::parse_snaplen("lots"));
+}
+
+TEST(CaptureTest, MatchesFrames) {
+  IPv4 a({10, 0, 0, 1}), b({10, 0, 0, 2});
+  auto ssh = capture_frame(PROTOCOL_TCP, a, b, 40000, 22);
+  auto dns = capture_frame(PROTOCOL_UDP, b, a, 53, 40000);
+  auto arp = arp_frame();
+
+  auto match = [](std::string_view expression, const std::vector<u8> &frame) {
+    return capture::Filter::parse(expression)->matches(frame);
+  };
+
+  EXPECT_TRUE(match("", arp));
+  EXPECT_TRUE(match("tcp", ssh));
+  EXPECT_FALSE(match("tcp", dns));
+  EXPECT_TRUE(match("arp", arp));
+  EXPECT_FALSE(match("ip", arp));
+  EXPECT_TRUE(match("not arp", ssh));
+  EXPECT_TRUE(match("port 22", ssh));
+  EXPECT_TRUE(match("dst port 22", ssh));
+  EXPECT_FALSE(match("src port 22", ssh));
+  EXPECT_TRUE(match("udp and src host 10.0.0.2", dns));
+  EXPECT_FALSE(match("udp and not host 10.0.0.1", dns));
+  EXPECT_FALSE(match("port 22", arp));
+}
+
+TEST(CaptureTest, WritesMatchedFramesAsPcapng) {
+  auto path = testing::TempDir() + "toad-capture-test.pcapng";
+  auto &tap = capture::tap();
+  u64 captured = tap.captured;
+
+  ASSERT_TRUE(tap.start(path, *capture::Filter::parse("not arp"), 100));
+  auto big = capture_frame(PROTOCOL_UDP, IPv4({10, 0, 0, 1}),
+                           IPv4({10, 0, 0, 2}), 1, 2, 300);
+  auto small = capture_frame(PROTOCOL_TCP, IPv4({10, 0, 0, 2}),
+                             IPv4({10, 0, 0, 1}), 2, 1, 61);
+  capture::frame(big, capture::Direction::Inbound);
+  capture::frame(arp_frame(), capture::Direction::Inbound);
+  capture::frame(small, capture::Direction::Outbound);
+
+  // What an event loop would do, written synchronously
+  auto batch = tap.take_batch();
+  ASSERT_TRUE(batch);
+  EXPECT_EQ(batch->offset, 28 + 32);
+  // Sized to the two blocks queued, not to a whole batch
+  EXPECT_EQ(batch->blocks.size(), (44 + 100) + (44 + 64));
+  EXPECT_LT(batch->blocks._header->capacity, capture::CAPTURE_BATCH_BYTES);
+  EXPECT_EQ(pwrite(batch->fd, batch->blocks.data(), batch->blocks.size(),
+                   batch->offset),
+            (ssz)batch->blocks.size());
+  EXPECT_FALSE(tap.take_batch());
+
+  // Whatever is left is written on the way out
+  capture::frame(big, capture::Direction::Outbound);
+  tap.stop();
+  capture::frame(big, capture::Direction::Outbound);
+  EXPECT_EQ(tap.captured, captured + 3);
+
+  std::ifstream in(path, std::ios::binary);
+  std::vector<u8> file{std::istreambuf_iterator<char>(in), {}};
+  ASSERT_EQ(file.size(), 28 + 32 + (44 + 100) + (44 + 64) + (44 + 100));
+
+  EXPECT_EQ(read_u32(file, 0), capture::PCAPNG_SECTION_HEADER);
+  EXPECT_EQ(read_u32(file, 8), capture::PCAPNG_BYTE_ORDER_MAGIC);
+  EXPECT_EQ(read_u32(file, 28), capture::PCAPNG_INTERFACE_DESCRIPTION);
+  // The snaplen
+  EXPECT_EQ(read_u32(file, 28 + 12), 100);
+
+  struct Expected {
+    u32 length, original_length, direction;
+  };
+  std::array<Expected, 3> packets = {Expected{100, 300, 1},
+                                     Expected{61, 61, 2},
+                                     Expected{100, 300, 2}};
+  sz at = 28 + 32;
+  for (const auto &expected : packets) {
+    u32 block_length = read_u32(file, at + 4);
+    EXPECT_EQ(read_u32(file, at), capture::PCAPNG_ENHANCED_PACKET);
+    EXPECT_EQ(read_u32(file, at + 20), expected.length);
+    EXPECT_EQ(read_u32(file, at + 24), expected.original_length);
+    EXPECT_EQ(std::memcmp(file.data() + at + 28, big.data(), 14), 0);
+    // The padded frame is followed by the flags option
+    sz options = at + 28 + ((expected.length + 3) & ~3u);
+    EXPECT_EQ(read_u32(file, options + 4), expected.direction);
+    EXPECT_EQ(read_u32(file, at + block_length - 4), block_length);
+    at += block_length;
+  }
+  EXPECT_EQ(at, file.size());
+  std::remove(path.c_str());
+}
+
+TEST(CaptureTest, RecordsNothingWhileStopped) {
+  auto &tap = capture::tap();
+  u64 captured = tap.captured;
+  capture::frame(arp_frame(), capture::Direction::Inbound);
+  EXPECT_EQ(tap.captured, captured);
+  EXPECT_FALSE(tap.take_batch());
+}
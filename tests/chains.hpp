@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+
+#include "bytes/chain.hpp"
+#include "nic/ethernet.hpp"
+#include "nic/ipv4.hpp"
+
+using namespace toad;
+
+static auto chain_of(std::initializer_list<std::vector<u8>> parts)
+    -> BufferChain {
+  BufferChain chain;
+  for (auto &part : parts)
+    chain.append(Buffer(part));
+  return chain;
+}
+
+TEST(BufferChainTest, ReadsAcrossChunkBoundaries) {
+  auto chain = chain_of({{0x12}, {0x34, 0x56}, {0x78, 0x9A, 0xBC}});
+  ChainIStream stream(chain);
+
+  u16 first, second;
+  std::array<u8, 2> rest;
+  stream.read_u16(&first).read_u16(&second).read_array(&rest);
+
+  EXPECT_EQ(stream.errc, ByteStreamErrorCode::Ok);
+  EXPECT_EQ(first, 0x1234);
+  EXPECT_EQ(second, 0x5678);
+  EXPECT_EQ(rest, (std::array<u8, 2>{0x9A, 0xBC}));
+
+  u8 past_the_end;
+  stream.read_u8(&past_the_end);
+  EXPECT_EQ(stream.errc, ByteStreamErrorCode::NotEnoughData);
+}
+
+TEST(BufferChainTest, ReadBufferSlicesWithinAChunk) {
+  auto chain = chain_of({{1, 2, 3, 4}, {5, 6}});
+  ChainIStream stream(chain);
+
+  Buffer inner, across;
+  stream.skip(1).read_buffer(&inner, 2).read_buffer(&across, 3);
+
+  EXPECT_EQ(inner.data(), chain.chunks()[0].data() + 1);
+  EXPECT_EQ(across.size(), 3);
+  EXPECT_EQ(across[0], 4);
+  EXPECT_EQ(across[2], 6);
+
+  BufferChain rest;
+  ChainIStream again(chain);
+  again.skip(3).read_chain(&rest);
+  EXPECT_EQ(rest.size(), 3);
+  EXPECT_EQ(rest.chunks().size(), 2);
+  EXPECT_EQ(rest.chunks()[1].data(), chain.chunks()[1].data());
+}
+
+TEST(BufferChainTest, SplitSlicesTheStraddlingChunk) {
+  auto chain = chain_of({{1, 2, 3}, {4, 5, 6}});
+  u8 *second = chain.chunks()[1].data();
+
+  auto front = chain.split(4);
+  EXPECT_EQ(front.size(), 4);
+  EXPECT_EQ(chain.size(), 2);
+  EXPECT_EQ(front.chunks()[1].data(), second);
+  EXPECT_EQ(chain.chunks()[0].data(), second + 1);
+
+  chain.prepend(std::move(front));
+  EXPECT_EQ(chain.size(), 6);
+  EXPECT_EQ(chain.linearize()[3], 4);
+}
+
+TEST(BufferChainTest, ParsesHeadersStraddlingChunks) {
+  // An Ethernet header split after the addresses and an IPv4 header split
+  // in the middle of the checksum
+  auto chain = chain_of({
+      {0x5a, 0x3c, 0x1e, 0x9d, 0x0b, 0x42, 0xf6, 0xa1, 0xc2, 0xd3, 0xe4, 0xf5},
+      {0x08, 0x00, 0x45, 0x00, 0x00, 0x18, 0x00, 0x01, 0x00, 0x00, 0x40, 0x11,
+       0x66},
+      {0xe2, 0x0a, 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x02, 0xde, 0xad, 0xbe,
+       0xef},
+  });
+
+  ChainIStream stream(chain);
+  auto frame = EthernetFrame<DirectionIn>::try_from_stream(stream);
+  ASSERT_EQ(stream.errc, ByteStreamErrorCode::Ok);
+  EXPECT_EQ(frame.ethertype, ETHERTYPE_IPV4);
+  EXPECT_EQ(frame.src, MAC({0xf6, 0xa1, 0xc2, 0xd3, 0xe4, 0xf5}));
+
+  ChainIStream ip_stream(chain);
+  auto ip = Ip<DirectionIn>::try_from_stream(ip_stream.skip(14));
+  ASSERT_EQ(ip_stream.errc, ByteStreamErrorCode::Ok);
+  EXPECT_EQ(ip.header_checksum, 0x66e2);
+  EXPECT_EQ(ip.src, IPv4({10, 0, 0, 1}));
+  EXPECT_EQ(ip.dst, IPv4({10, 0, 0, 2}));
+  ASSERT_EQ(ip.payload.size(), 4);
+  EXPECT_EQ(ip.payload[0], 0xde);
+  EXPECT_EQ(ip.payload.data(), chain.chunks()[2].data() + 9);
+
+  ChainIStream short_stream(chain);
+  short_stream.skip(chain.size() - 10);
+  EXPECT_EQ(short_stream.read_header(IP_HEADER_SIZE), nullptr);
+  EXPECT_EQ(short_stream.errc, ByteStreamErrorCode::NotEnoughData);
+}
+
+TEST(BufferChainTest, IovecPointsIntoTheChunks) {
+  auto chain = chain_of({{1, 2}, {3}});
+  auto iov = chain.to_iovec();
+
+  ASSERT_EQ(iov.size(), 2);
+  EXPECT_EQ(iov[0].iov_base, chain.chunks()[0].data());
+  EXPECT_EQ(iov[1].iov_len, 1);
+}
+
+TEST(BufferChainTest, IovecStopsAtTheLimit) {
+  BufferChain chain;
+  for (sz i = 0; i < IOV_MAX + 3; i++)
+    chain.append(Buffer(1));
+
+  EXPECT_EQ(chain.to_iovec().size(), IOV_MAX);
+  EXPECT_EQ(chain.to_iovec(2).size(), 2);
+
+  // The rest goes out once the described chunks are written
+  chain.trim_front(IOV_MAX);
+  EXPECT_EQ(chain.to_iovec().size(), 3);
+}
@@ -0,0 +1,91 @@
+#include <atomic>
+#include <gtest/gtest.h>
+#include <thread>
+
+#include "concurrency/channel.hpp"
+#include "concurrency/executor.hpp"
+
+using namespace toad;
+
+Task drain(Channel<int> &channel, std::atomic<int> &sum,
+           std::atomic<bool> &done) {
+  while (auto value = co_await channel.recv())
+    sum.fetch_add(*value);
+  done.store(true);
+}
+
+TEST(ChannelTest, ConsumerSuspendsUntilValuesArrive) {
+  Executor executor(2);
+  Channel<int> channel;
+  std::atomic<int> sum = 0;
+  std::atomic<bool> done = false;
+
+  executor.spawn(drain(channel, sum, done));
+
+  // Wait for the consumer to park on the empty channel
+  while (true) {
+    std::lock_guard guard(channel._mutex);
+    if (channel._receiver)
+      break;
+  }
+
+  for (int i = 1; i <= 100; i++)
+    ASSERT_TRUE(channel.try_send(i));
+  channel.close();
+
+  while (!done.load())
+    std::this_thread::yield();
+  EXPECT_EQ(sum.load(), 5050);
+  EXPECT_FALSE(channel.try_send(1));
+}
+
+TEST(ChannelTest, FullChannelRefusesValues) {
+  Channel<int> channel(2);
+  EXPECT_TRUE(channel.try_send(1));
+  EXPECT_TRUE(channel.try_send(2));
+  EXPECT_FALSE(channel.try_send(3));
+
+  EXPECT_EQ(channel.try_recv(), 1);
+  EXPECT_TRUE(channel.try_send(3));
+  EXPECT_EQ(channel.size(), 2);
+}
+
+Task count_wakes(Channel<int> &channel, std::atomic<int> &wakes,
+                 std::atomic<bool> &done) {
+  while (true) {
+    auto value = co_await channel.recv();
+    if (!value && channel.closed())
+      break;
+    if (!value)
+      wakes.fetch_add(1);
+  }
+  done.store(true);
+}
+
+TEST(ChannelTest, WakeResumesTheConsumerWithoutAValue) {
+  Executor executor(1);
+  Channel<int> channel;
+  std::atomic<int> wakes = 0;
+  std::atomic<bool> done = false;
+
+  // A wake before the consumer waits is not lost
+  channel.wake();
+  executor.spawn(count_wakes(channel, wakes, done));
+  while (wakes.load() != 1)
+    std::this_thread::yield();
+
+  while (true) {
+    std::lock_guard guard(channel._mutex);
+    if (channel._receiver)
+      break;
+  }
+  channel.wake();
+  while (wakes.load() != 2)
+    std::this_thread::yield();
+
+  ASSERT_TRUE(channel.try_send(1));
+  channel.close();
+  while (!done.load())
+    std::this_thread::yield();
+  EXPECT_EQ(wakes.load(), 2);
+}
@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+#include <random>
+
+#include "nic/checksum.hpp"
+#include "nic/ipv4.hpp"
+
+using namespace toad;
+
+/// @brief The word at a time loop the checksum started out as.
+static auto reference_sum(std::span<const u8> bytes) -> u16 {
+  u32 acc = 0;
+  for (sz i = 0; i < bytes.size(); i += 2) {
+    u16 word = bytes[i] << 8;
+    if (i + 1 < bytes.size())
+      word |= bytes[i + 1];
+    acc += word;
+    if (acc > 0xFFFF)
+      acc = (acc & 0xFFFF) + 1;
+  }
+  return acc;
+}
+
+TEST(ChecksumTest, MatchesTheRfc1071Example) {
+  std::vector<u8> bytes = {0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7};
+  EXPECT_EQ(ones_complement_sum(bytes), 0xddf2);
+  EXPECT_EQ(checksum(std::span(bytes)), 0x220d);
+}
+
+TEST(ChecksumTest, EveryImplementationAgreesOnOddAndUnalignedInputs) {
+  std::mt19937 rng(1071);
+  std::vector<u8> bytes(4096 + 3);
+  for (auto &byte : bytes)
+    byte = rng();
+
+  for (sz offset = 0; offset < 3; offset++) {
+    for (sz length : {0, 1, 2, 3, 7, 20, 63, 64, 65, 127, 1499, 4096}) {
+      std::span<const u8> span(bytes.data() + offset, length);
+      u16 expected = reference_sum(span);
+
+      EXPECT_EQ(ones_complement_sum(span), expected) << length;
+
+      auto native = [](u64 sum) {
+        u16 folded = fold_sum(sum);
+        return std::endian::native == std::endian::little
+                   ? std::byteswap(folded)
+                   : folded;
+      };
+      EXPECT_EQ(native(_sum_scalar(span.data(), length)), expected);
+#if defined(__x86_64__)
+      EXPECT_EQ(native(_sum_sse2(span.data(), length)), expected);
+      if (__builtin_cpu_supports("avx2")) {
+        EXPECT_EQ(native(_sum_avx2(span.data(), length)), expected);
+      }
+#endif
+    }
+  }
+}
+
+TEST(ChecksumTest, CopyAndSumCopiesWhatItSums) {
+  std::mt19937 rng(38);
+  std::vector<u8> bytes(1500);
+  for (auto &byte : bytes)
+    byte = rng();
+
+  for (sz length : {0, 1, 15, 63, 64, 99, 1500}) {
+    std::vector<u8> out(length + 1, 0xAA);
+    std::span<const u8> span(bytes.data(), length);
+
+    EXPECT_EQ(copy_and_sum(out.data(), span), reference_sum(span));
+    EXPECT_EQ(0, std::memcmp(out.data(), bytes.data(), length));
+    EXPECT_EQ(out[length], 0xAA);
+  }
+}
+
+TEST(ChecksumTest, AllOnesDoNotOverflow) {
+  std::vector<u8> bytes(64 << 10, 0xFF);
+  EXPECT_EQ(ones_complement_sum(bytes), 0xFFFF);
+  EXPECT_EQ(checksum(std::span(bytes)), 0);
+}
+
+TEST(ChecksumTest, IncrementalUpdatesMatchRecomputing) {
+  std::vector<u8> bytes = {0x45, 0x00, 0x00, 0x14, 0x6e, 0x1f, 0x40,
+                           0x00, 0x40, 0x01, 0x00, 0x00, 0x0a, 0x00,
+                           0x00, 0x01, 0x0a, 0x00, 0x00, 0x02};
+  IpHeader::Checksum::store(bytes.data(), checksum(std::span(bytes)));
+
+  auto ip = IpView<DirectionIn>::try_from(Buffer(bytes))->reverse();
+  for (u8 i = 0; i < 3; i++) {
+    ip.decrement_ttl();
+    EXPECT_TRUE(ip.checksum_ok());
+    EXPECT_EQ(ip.header_checksum(), ip.calculate_checksum());
+  }
+  EXPECT_EQ(ip.ttl(), 0x3d);
+
+  ip.rewrite_src(IPv4({192, 168, 255, 255}));
+  ip.rewrite_dst(IPv4({0, 0, 0, 0}));
+  EXPECT_TRUE(ip.checksum_ok());
+  EXPECT_EQ(ip.header_checksum(), ip.calculate_checksum());
+}
@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+
+#include "nic/flow.hpp"
+
+using namespace toad;
+
+static auto flow_key(u32 i) -> FlowKey {
+  return FlowKey(IPv4({10, (u8)(i >> 16), (u8)(i >> 8), (u8)i}),
+                 IPv4({10, 0, 0, 1}), 40000 + (i & 0xFF), 443, PROTOCOL_TCP);
+}
+
+TEST(FlowTableTest, InsertsFindsAndErases) {
+  FlowTable<int> flows;
+  FlowKey key = flow_key(1);
+  EXPECT_EQ(flows.find(key, 0), nullptr);
+
+  auto [value, added] = flows.insert(key, 7, 0);
+  EXPECT_TRUE(added);
+  EXPECT_EQ(*value, 7);
+
+  auto [again, added_again] = flows.insert(key, 8, 0);
+  EXPECT_FALSE(added_again);
+  EXPECT_EQ(again, value);
+  EXPECT_EQ(*flows.find(key, 0), 7);
+
+  // The other direction is another flow
+  EXPECT_EQ(flows.find(key.reversed(), 0), nullptr);
+
+  EXPECT_TRUE(flows.erase(key));
+  EXPECT_FALSE(flows.erase(key));
+  EXPECT_EQ(flows.find(key, 0), nullptr);
+  EXPECT_EQ(flows.size(), 0);
+}
+
+TEST(FlowTableTest, SimdMatchesThePortableMatch) {
+  std::array<u8, FLOW_GROUP_SIZE> group;
+  u64 state = 0x2545F4914F6CDD1D;
+  for (sz round = 0; round < 1000; round++) {
+    for (auto &byte : group) {
+      state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+      byte = state % 4 == 0 ? FLOW_EMPTY : state & 0x7;
+    }
+    for (u8 byte : {(u8)0, (u8)3, FLOW_EMPTY, FLOW_DELETED})
+      EXPECT_EQ(flow_match(group.data(), byte),
+                flow_match_portable(group.data(), byte));
+  }
+}
+
+TEST(FlowTableTest, ProbingSurvivesErasedFlows) {
+  FlowTable<u32> flows(1000);
+  for (u32 i = 0; i < flows.capacity(); i++)
+    ASSERT_TRUE(flows.insert(flow_key(i), i, 0).second);
+  EXPECT_EQ(flows.insert(flow_key(1 << 20), 0, 0).first, nullptr);
+
+  for (u32 i = 0; i < flows.capacity(); i += 2)
+    flows.erase(flow_key(i));
+  for (u32 i = 1; i < flows.capacity(); i += 2)
+    ASSERT_NE(flows.find(flow_key(i), 0), nullptr);
+
+  // Refilling the deleted slots rehashes at some point
+  for (u32 i = 0; i < flows.capacity(); i += 2)
+    ASSERT_TRUE(flows.insert(flow_key(i), i, 0).second);
+  for (u32 i = 0; i < flows.capacity(); i++)
+    ASSERT_EQ(*flows.find(flow_key(i), 0), i);
+}
+
+TEST(FlowTableTest, IdleFlowsExpire) {
+  FlowTable<int> flows(64, 100);
+  flows.insert(flow_key(1), 1, 0);
+  flows.insert(flow_key(2), 2, 0);
+  flows.find(flow_key(2), 50);
+
+  std::vector<int> expired;
+  auto collect = [&](const FlowKey &, int value) { expired.push_back(value); };
+  EXPECT_EQ(flows.expire(99, collect), 0);
+  EXPECT_EQ(flows.expire(100, collect), 1);
+  EXPECT_EQ(expired, std::vector<int>{1});
+
+  // A small budget picks up where the last sweep stopped
+  sz swept = 0;
+  for (sz i = 0; i < flows.slots() / 8; i++)
+    swept += flows.expire(150, 8, collect);
+  EXPECT_EQ(swept, 1);
+  EXPECT_EQ(flows.size(), 0);
+}
+
+TEST(FlowTableTest, BatchedLookupsMatchSingleOnes) {
+  FlowTable<u32> flows(4096);
+  std::vector<FlowKey> keys;
+  for (u32 i = 0; i < 1000; i++) {
+    if (i % 3)
+      flows.insert(flow_key(i), i, 0);
+    keys.push_back(flow_key(i));
+  }
+
+  std::vector<u32 *> values(keys.size());
+  flows.find_batch(keys, values, 0);
+  for (sz i = 0; i < keys.size(); i++)
+    EXPECT_EQ(values[i], flows.find(keys[i], 0));
+}
+
+TEST(FlowTableTest, KeysComeFromThePacket) {
+  // UDP from 10.0.0.1:5353 to 10.0.0.2:53
+  std::vector<u8> packet = {
+      0x45, 0x00, 0x00, 0x1c, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+      0x00, 0x00, 0x0a, 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x02,
+      0x14, 0xe9, 0x00, 0x35, 0x00, 0x08, 0x00, 0x00,
+  };
+  auto key = FlowKey::try_from(packet);
+  ASSERT_TRUE(key.has_value());
+  EXPECT_EQ(*key, FlowKey(IPv4({10, 0, 0, 1}), IPv4({10, 0, 0, 2}), 5353, 53,
+                          PROTOCOL_UDP));
+
+  EXPECT_FALSE(FlowKey::try_from(std::span(packet).first(12)).has_value());
+}
@@ -0,0 +1,145 @@
+#include <gtest/gtest.h>
+
+#include "nic/fragment.hpp"
+
+using namespace toad;
+
+/// @brief A UDP fragment from 10.0.0.1 to 10.0.0.2 carrying `payload`,
+/// which is `offset` bytes into its datagram.
+static auto make_fragment(u16 identification, sz offset, bool more,
+                          const std::vector<u8> &payload, u8 flags = 0)
+    -> Buffer {
+  Buffer packet(IP_HEADER_SIZE + payload.size());
+  u8 *header = packet.data();
+  IpHeader::Version::store(header, 4);
+  IpHeader::Ihl::store(header, 5);
+  IpHeader::TotalLength::store(header, packet.size());
+  IpHeader::Identification::store(header, identification);
+  IpHeader::Flags::store(header, flags | (more ? IP_FLAG_MORE_FRAGMENTS : 0));
+  IpHeader::FragmentOffset::store(header, offset / 8);
+  IpHeader::Ttl::store(header, 64);
+  IpHeader::Protocol::store(header, 17);
+  IpHeader::Src::store(header, IPv4({10, 0, 0, 1}));
+  IpHeader::Dst::store(header, IPv4({10, 0, 0, 2}));
+  IpHeader::Checksum::store(header, checksum({header, IP_HEADER_SIZE}));
+  std::memcpy(header + IP_HEADER_SIZE, payload.data(), payload.size());
+  return packet;
+}
+
+static auto counting_bytes(sz from, sz length) -> std::vector<u8> {
+  std::vector<u8> bytes(length);
+  for (sz i = 0; i < length; i++)
+    bytes[i] = (from + i) & 0xFF;
+  return bytes;
+}
+
+TEST(ReassemblerTest, ReassemblesOutOfOrderWithoutCopying) {
+  Reassembler reassembler;
+  Buffer first = make_fragment(7, 0, true, counting_bytes(0, 16));
+  Buffer middle = make_fragment(7, 16, true, counting_bytes(16, 16));
+  Buffer last = make_fragment(7, 32, false, counting_bytes(32, 5));
+
+  EXPECT_FALSE(reassembler.push(last, 0).has_value());
+  EXPECT_FALSE(reassembler.push(first, 0).has_value());
+  EXPECT_EQ(reassembler.size(), 1);
+  auto datagram = reassembler.push(middle, 0);
+  ASSERT_TRUE(datagram.has_value());
+  EXPECT_EQ(reassembler.size(), 0);
+  EXPECT_EQ(reassembler.memory(), 0);
+
+  // The header and the payloads are the fragments' own bytes
+  ASSERT_EQ(datagram->chunks().size(), 4);
+  EXPECT_EQ(datagram->chunks()[0].data(), first.data());
+  EXPECT_EQ(datagram->chunks()[1].data(), first.data() + IP_HEADER_SIZE);
+  EXPECT_EQ(datagram->chunks()[3].data(), last.data() + IP_HEADER_SIZE);
+
+  Buffer whole = datagram->linearize();
+  auto ip = IpView<DirectionIn>::try_from(whole);
+  ASSERT_TRUE(ip.has_value());
+  EXPECT_TRUE(ip->checksum_ok());
+  EXPECT_EQ(ip->total_length(), IP_HEADER_SIZE + 37);
+  EXPECT_EQ(ip->flags(), 0);
+  EXPECT_EQ(ip->fragment_offset(), 0);
+  auto payload = ip->payload();
+  EXPECT_EQ(std::vector<u8>(payload.data(), payload.data() + payload.size()),
+            counting_bytes(0, 37));
+}
+
+TEST(ReassemblerTest, PacketsThatAreNoFragmentsPassThrough) {
+  Reassembler reassembler;
+  Buffer packet = make_fragment(1, 0, false, counting_bytes(0, 8));
+  auto datagram = reassembler.push(packet, 0);
+  ASSERT_TRUE(datagram.has_value());
+  EXPECT_EQ(datagram->chunks()[0].data(), packet.data());
+  EXPECT_EQ(reassembler.size(), 0);
+}
+
+TEST(ReassemblerTest, OverlapsDropTheDatagram) {
+  Reassembler reassembler;
+  reassembler.push(make_fragment(3, 0, true, counting_bytes(0, 16)), 0);
+  reassembler.push(make_fragment(3, 8, true, counting_bytes(8, 16)), 0);
+  EXPECT_EQ(reassembler.malformed, 1);
+  EXPECT_EQ(reassembler.size(), 0);
+
+  // Neither may a fragment reach past the end
+  reassembler.push(make_fragment(4, 16, false, counting_bytes(16, 8)), 0);
+  reassembler.push(make_fragment(4, 24, true, counting_bytes(24, 8)), 0);
+  EXPECT_EQ(reassembler.malformed, 2);
+  EXPECT_EQ(reassembler.memory(), 0);
+}
+
+TEST(ReassemblerTest, FloodsStayUnderTheMemoryLimit) {
+  Reassembler reassembler(64 << 10);
+  for (u16 id = 0; id < 10000; id++) {
+    reassembler.push(make_fragment(id, 0, true, counting_bytes(0, 8)), 0);
+    ASSERT_LE(reassembler.memory(), reassembler.memory_limit);
+  }
+  EXPECT_GT(reassembler.evicted, 0);
+
+  // The most recent datagrams survive and still complete
+  EXPECT_TRUE(
+      reassembler.push(make_fragment(9999, 8, false, counting_bytes(8, 8)), 0)
+          .has_value());
+}
+
+TEST(ReassemblerTest, IncompleteDatagramsTimeOut) {
+  Reassembler reassembler(FRAGMENT_MEMORY_LIMIT, 100);
+  reassembler.push(make_fragment(1, 0, true, counting_bytes(0, 8)), 0);
+  reassembler.push(make_fragment(2, 0, true, counting_bytes(0, 8)), 50);
+
+  EXPECT_EQ(reassembler.expire(99), 0);
+  EXPECT_EQ(reassembler.expire(100), 1);
+  EXPECT_EQ(reassembler.expire(150), 1);
+  EXPECT_EQ(reassembler.timed_out, 2);
+  EXPECT_EQ(reassembler.memory(), 0);
+}
+
+TEST(ReassemblerTest, FragmentsFitTheMtuAndComeBackTogether) {
+  Buffer packet = make_fragment(9, 0, false, counting_bytes(0, 3000));
+  auto fragments = fragment_ipv4(packet.span(), 1500);
+  ASSERT_TRUE(fragments.has_value());
+  ASSERT_EQ(fragments->size(), 3);
+
+  Reassembler reassembler;
+  std::optional<BufferChain> datagram;
+  for (auto &fragment : *fragments) {
+    EXPECT_LE(fragment.size(), 1500);
+    auto ip = IpView<DirectionIn>::try_from(fragment.view());
+    EXPECT_TRUE(ip->checksum_ok());
+    if (ip->flags() & IP_FLAG_MORE_FRAGMENTS) {
+      EXPECT_EQ(ip->payload().size() % 8, 0);
+    }
+    datagram = reassembler.push(fragment.view(), 0);
+  }
+
+  ASSERT_TRUE(datagram.has_value());
+  Buffer whole = datagram->linearize();
+  EXPECT_EQ(std::vector<u8>(whole.data(), whole.data() + whole.size()),
+            std::vector<u8>(packet.data(), packet.data() + packet.size()));
+
+  EXPECT_FALSE(fragment_ipv4(make_fragment(9, 0, false, counting_bytes(0, 3000),
+                                           IP_FLAG_DONT_FRAGMENT)
+                                 .span(),
+                             1500)
+                   .has_value());
+}
@@ -1,6 +1,23 @@
 #include <gtest/gtest.h>
 
+#include "buffers.hpp"
+#include "capture.hpp"
+#include "chains.hpp"
+#include "channels.hpp"
+#include "checksum.hpp"
+#include "flows.hpp"
+#include "fragments.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "neighbors.hpp"
+#include "packets.hpp"
+#include "pipeline.hpp"
+#include "rings.hpp"
+#include "routes.hpp"
 #include "tasks.hpp"
+#include "tcp.hpp"
+#include "topology.hpp"
+#include "tracing.hpp"
 
 TEST(TestTest, TruthTest) { EXPECT_TRUE(true); }
 
@@ -0,0 +1,43 @@
+#include <gtest/gtest.h>
+#include <spdlog/sinks/ostream_sink.h>
+#include <sstream>
+
+#include "log.hpp"
+
+using namespace toad;
+
+TEST(LoggingTest, AsyncRecordsKeepCorrelationId) {
+  std::ostringstream out;
+  auto sink = std::make_shared<spdlog::sinks::ostream_sink_mt>(out);
+  auto formatter = std::make_unique<spdlog::pattern_formatter>();
+  formatter->add_flag<CorrelationIdFormatter>('Z');
+  formatter->set_pattern("[cid=%Z] %v");
+  sink->set_formatter(std::move(formatter));
+
+  auto previous = spdlog::default_logger();
+  auto logger = std::make_shared<spdlog::logger>("test", sink);
+  logger->set_level(spdlog::level::trace);
+  spdlog::set_default_logger(logger);
+
+  auto &async = logging::AsyncLogger::instance();
+  async.start();
+
+  std::thread producer([]() {
+    thread_correlation_id_ = 0xABCD;
+    TOAD_INFO("Read {} bytes from client_fd={}", 42, 7);
+    thread_correlation_id_ = 0;
+  });
+  producer.join();
+
+  async.stop();
+  spdlog::set_default_logger(previous);
+
+  EXPECT_EQ(out.str(), "[cid=0000ABCD] Read 42 bytes from client_fd=7\n");
+}
+
+TEST(LoggingTest, StringArgumentsAreNotDeferred) {
+  EXPECT_TRUE((logging::can_defer_v<int, void *, u64>));
+  EXPECT_FALSE((logging::can_defer_v<const char *>));
+  EXPECT_FALSE((logging::can_defer_v<std::string_view>));
+  EXPECT_FALSE((logging::can_defer_v<std::string>));
+}
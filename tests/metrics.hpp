@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+
+#include "concurrency/executor.hpp"
+#include "concurrency/metrics.hpp"
+
+using namespace toad;
+
+TEST(MetricsTest, HistogramBucketsRoundTrip) {
+  using metrics::Histogram;
+
+  for (u64 value : {0ull, 1ull, 7ull, 8ull, 15ull, 16ull, 1000ull, 1ull << 40,
+                    ~0ull}) {
+    u32 bucket = Histogram::bucket_of(value);
+    ASSERT_LT(bucket, Histogram::BUCKETS);
+    EXPECT_LE(Histogram::lower_bound(bucket), value);
+    if (bucket + 1 < Histogram::BUCKETS) {
+      EXPECT_GT(Histogram::lower_bound(bucket + 1), value);
+    }
+  }
+}
+
+TEST(MetricsTest, PercentilesStayWithinBucketError) {
+  metrics::Histogram histogram;
+  for (u64 i = 1; i <= 1000; i++)
+    histogram.record(i * 1000);
+
+  metrics::HistogramSnapshot snapshot;
+  snapshot.merge(histogram);
+
+  EXPECT_EQ(snapshot.count, 1000);
+  EXPECT_EQ(snapshot.max, 1000000);
+  for (auto [p, exact] :
+       {std::pair{0.5, 500000.0}, std::pair{0.99, 990000.0}}) {
+    double got = snapshot.percentile(p);
+    EXPECT_LE(got, exact);
+    EXPECT_GE(got, exact * (1.0 - 1.0 / metrics::Histogram::SUB_BUCKETS));
+  }
+}
+
+Task count_runs(std::atomic<int> &runs) {
+  co_await suspend();
+  runs++;
+}
+
+TEST(MetricsTest, SnapshotCountsExecutorWork) {
+  auto &registry = metrics::Metrics::instance();
+  auto before = registry.snapshot();
+
+  std::atomic<int> runs = 0;
+  {
+    Executor executor(2);
+    for (int i = 0; i < 16; i++)
+      executor.spawn(count_runs(runs));
+    while (runs.load() != 16)
+      std::this_thread::yield();
+  }
+
+  auto after = registry.snapshot();
+  // Every task is queued twice, once when spawned and once after suspending
+  EXPECT_GE(after.tasks_enqueued - before.tasks_enqueued, 32);
+  EXPECT_GE(after.tasks_run - before.tasks_run, 32);
+  EXPECT_GE(after.task_run_ns.count - before.task_run_ns.count, 32);
+  EXPECT_EQ(after.queue_depth, before.queue_depth);
+}
@@ -0,0 +1,137 @@
+#include <atomic>
+#include <gtest/gtest.h>
+#include <thread>
+
+#include "nic/neighbor.hpp"
+
+using namespace toad;
+
+static const IPv4 NEIGHBOR_IP({10, 0, 0, 7});
+static const MAC NEIGHBOR_MAC({0x02, 0, 0, 0, 0, 7});
+
+TEST(NeighborCacheTest, MissesShareOneRequest) {
+  NeighborCache cache;
+  EXPECT_FALSE(cache.lookup(NEIGHBOR_IP).has_value());
+
+  Buffer first(64), second(64);
+  auto resolved = cache.resolve(NEIGHBOR_IP, first, 0);
+  EXPECT_EQ(resolved.resolution, NeighborResolution::RequestNeeded);
+  resolved = cache.resolve(NEIGHBOR_IP, second, 0);
+  EXPECT_EQ(resolved.resolution, NeighborResolution::Queued);
+  EXPECT_FALSE(cache.lookup(NEIGHBOR_IP).has_value());
+
+  auto held = cache.confirm(NEIGHBOR_IP, NEIGHBOR_MAC, 0);
+  EXPECT_EQ(held.size(), 2);
+  EXPECT_EQ(cache.lookup(NEIGHBOR_IP), NEIGHBOR_MAC);
+
+  Buffer third(64);
+  resolved = cache.resolve(NEIGHBOR_IP, third, 0);
+  EXPECT_EQ(resolved.resolution, NeighborResolution::Resolved);
+  EXPECT_EQ(resolved.mac, NEIGHBOR_MAC);
+  EXPECT_EQ(third.size(), 64);
+}
+
+TEST(NeighborCacheTest, HoldsOnlySoManyPackets) {
+  NeighborCache cache;
+  for (sz i = 0; i < NEIGHBOR_PENDING_MAX + 3; i++) {
+    Buffer packet(64);
+    cache.resolve(NEIGHBOR_IP, packet, 0);
+  }
+
+  EXPECT_EQ(cache.dropped.load(), 3);
+  EXPECT_EQ(cache.confirm(NEIGHBOR_IP, NEIGHBOR_MAC, 0).size(),
+            NEIGHBOR_PENDING_MAX);
+}
+
+TEST(NeighborCacheTest, OnlyKnownNeighborsAreRefreshed) {
+  NeighborCache cache;
+  cache.confirm(NEIGHBOR_IP, NEIGHBOR_MAC, 0);
+  EXPECT_FALSE(cache.lookup(NEIGHBOR_IP).has_value());
+
+  cache.confirm(NEIGHBOR_IP, NEIGHBOR_MAC, 0, true);
+  EXPECT_EQ(cache.lookup(NEIGHBOR_IP), NEIGHBOR_MAC);
+  EXPECT_EQ(cache.size(), 1);
+}
+
+TEST(NeighborCacheTest, NeighborsAgeOut) {
+  NeighborCache cache;
+  cache.confirm(NEIGHBOR_IP, NEIGHBOR_MAC, 0, true);
+
+  EXPECT_TRUE(cache.tick(cache.reachable_ns - 1).empty());
+
+  // Stale neighbors are still used while they are asked again
+  auto requests = cache.tick(cache.reachable_ns);
+  ASSERT_EQ(requests.size(), 1);
+  EXPECT_EQ(requests[0], NEIGHBOR_IP);
+  EXPECT_EQ(cache.lookup(NEIGHBOR_IP), NEIGHBOR_MAC);
+
+  // An answer makes it reachable again, silence makes it go
+  cache.confirm(NEIGHBOR_IP, NEIGHBOR_MAC, cache.reachable_ns);
+  EXPECT_TRUE(cache.tick(2 * cache.reachable_ns - 1).empty());
+  cache.tick(2 * cache.reachable_ns);
+  cache.tick(3 * cache.reachable_ns + cache.stale_ns);
+  EXPECT_FALSE(cache.lookup(NEIGHBOR_IP).has_value());
+  EXPECT_EQ(cache.size(), 0);
+}
+
+TEST(NeighborCacheTest, UnansweredRequestsAreRetriedThenGivenUp) {
+  NeighborCache cache;
+  Buffer packet(64);
+  cache.resolve(NEIGHBOR_IP, packet, 0);
+
+  u64 now = 0;
+  for (u8 probe = 1; probe < NEIGHBOR_MAX_PROBES; probe++) {
+    now += cache.retransmit_ns;
+    EXPECT_EQ(cache.tick(now).size(), 1);
+  }
+
+  now += cache.retransmit_ns;
+  EXPECT_TRUE(cache.tick(now).empty());
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.dropped.load(), 1);
+}
+
+TEST(NeighborCacheTest, RemovedSlotsAreReused) {
+  NeighborCache cache(16);
+  for (u8 round = 0; round < 8; round++) {
+    for (u8 i = 0; i < 16; i++)
+      cache.confirm(IPv4({10, round, 0, i}), NEIGHBOR_MAC, 0, true);
+    EXPECT_EQ(cache.size(), 16);
+    for (u8 i = 0; i < 16; i++)
+      cache.remove(IPv4({10, round, 0, i}));
+  }
+
+  Buffer packet(64);
+  EXPECT_NE(cache.resolve(NEIGHBOR_IP, packet, 0).resolution,
+            NeighborResolution::Full);
+}
+
+TEST(NeighborCacheTest, ReadersNeverSeeATornSlot) {
+  NeighborCache cache(16);
+  IPv4 a({10, 0, 0, 1}), b({10, 0, 0, 2});
+  MAC mac_a({0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA});
+  MAC mac_b({0xBB, 0xBB, 0xBB, 0xBB, 0xBB, 0xBB});
+
+  std::atomic<bool> stop = false;
+  std::atomic<u64> torn = 0;
+  std::thread reader([&]() {
+    while (!stop.load(std::memory_order_relaxed)) {
+      if (auto mac = cache.lookup(a); mac && *mac != mac_a)
+        torn++;
+      if (auto mac = cache.lookup(b); mac && *mac != mac_b)
+        torn++;
+    }
+  });
+
+  // The two keep trading the same slots
+  for (sz i = 0; i < 20000; i++) {
+    cache.confirm(a, mac_a, 0, true);
+    cache.remove(a);
+    cache.confirm(b, mac_b, 0, true);
+    cache.remove(b);
+  }
+  stop = true;
+  reader.join();
+
+  EXPECT_EQ(torn.load(), 0);
+}
@@ -0,0 +1,446 @@
+#include <gtest/gtest.h>
+
+#include "bytes/packet_buffer.hpp"
+#include "nic/arp.hpp"
+#include "nic/ethernet.hpp"
+#include "nic/icmp.hpp"
+#include "nic/ipv4.hpp"
+#include "nic/virtio.hpp"
+
+using namespace toad;
+
+/// @brief `ping -c 1 10.0.0.2` as captured on a TAP device.
+static std::vector<u8> captured_echo_request() {
+  return {
+      0x5a, 0x3c, 0x1e, 0x9d, 0x0b, 0x42, 0xf6, 0xa1, 0xc2, 0xd3, 0xe4, 0xf5,
+      0x08, 0x00, 0x45, 0x00, 0x00, 0x54, 0x6e, 0x1f, 0x40, 0x00, 0x40, 0x01,
+      0xb8, 0x87, 0x0a, 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x02, 0x08, 0x00,
+      0x9c, 0xe5, 0x1c, 0x2b, 0x00, 0x01, 0xa1, 0xc3, 0xf1, 0x66, 0x00, 0x00,
+      0x00, 0x00, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+      0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25,
+      0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31,
+      0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d,
+      0x3e, 0x3f,
+  };
+}
+
+TEST(PacketsTest, ReadBufferSlicesWithoutCopying) {
+  Buffer buffer(std::vector<u8>{1, 2, 3, 4, 5});
+  ByteIStream stream(buffer);
+
+  u8 first;
+  Buffer rest;
+  stream.read_u8(&first).read_buffer(&rest);
+
+  EXPECT_EQ(stream.errc, ByteStreamErrorCode::Ok);
+  EXPECT_EQ(rest.size(), 4);
+  EXPECT_EQ(rest.data(), buffer.data() + 1);
+}
+
+TEST(PacketsTest, ReadBufferCopiesFromOtherBuffers) {
+  std::vector<u8> vec = {1, 2, 3};
+  ByteIStream stream(vec);
+
+  Buffer out;
+  stream.read_buffer(&out, 2);
+  EXPECT_EQ(out.size(), 2);
+  EXPECT_EQ(out[1], 2);
+
+  stream.read_buffer(&out, 2);
+  EXPECT_EQ(stream.errc, ByteStreamErrorCode::NotEnoughData);
+}
+
+TEST(PacketsTest, DecodesEchoRequestInOneAllocation) {
+  Buffer frame_buffer(captured_echo_request());
+  ByteIStream frame_stream(frame_buffer);
+  auto frame = EthernetFrame<DirectionIn>::try_from_stream(frame_stream);
+  ASSERT_EQ(frame.ethertype, ETHERTYPE_IPV4);
+
+  ByteIStream ip_stream(frame.payload);
+  auto ip = Ip<DirectionIn>::try_from_stream(ip_stream);
+  ASSERT_EQ(ip.protocol, PROTOCOL_ICMP);
+  EXPECT_EQ(ip.src, IPv4({10, 0, 0, 1}));
+  EXPECT_EQ(ip.payload.size(), 64);
+
+  ByteIStream icmp_stream(ip.payload);
+  auto icmp = Icmp<DirectionIn>::try_from_stream(icmp_stream);
+  EXPECT_EQ(icmp.type, IcmpType::EchoRequest);
+  EXPECT_EQ(icmp.payload.size(), 56);
+
+  EXPECT_EQ(icmp.payload._header, frame_buffer._header);
+  EXPECT_EQ(icmp.payload.data(), frame_buffer.data() + 14 + 20 + 8);
+}
+
+TEST(PacketsTest, IpPayloadIgnoresEthernetPadding) {
+  // An echo request without data is padded to the 60 byte Ethernet minimum
+  auto bytes = captured_echo_request();
+  bytes.resize(14 + 20 + 8);
+  bytes[16] = 0x00, bytes[17] = 28;
+  bytes.resize(60, 0);
+
+  Buffer buffer(bytes);
+  ByteIStream frame_stream(buffer);
+  auto frame = EthernetFrame<DirectionIn>::try_from_stream(frame_stream);
+  ByteIStream ip_stream(frame.payload);
+  auto ip = Ip<DirectionIn>::try_from_stream(ip_stream);
+
+  EXPECT_EQ(ip.payload.size(), 8);
+}
+
+TEST(PacketsTest, MalformedIpHeadersFailTheStream) {
+  auto parse = [](std::vector<u8> bytes) {
+    Buffer buffer(bytes);
+    ByteIStream stream(buffer);
+    auto ip = Ip<DirectionIn>::try_from_stream(stream);
+    if (stream.errc != ByteStreamErrorCode::Ok) {
+      EXPECT_EQ(ip.payload.size(), 0);
+    }
+    return stream.errc;
+  };
+
+  auto bytes = captured_echo_request();
+  bytes.erase(bytes.begin(), bytes.begin() + 14);
+  EXPECT_EQ(parse(bytes), ByteStreamErrorCode::Ok);
+
+  // IHL below the minimum header
+  auto short_ihl = bytes;
+  short_ihl[0] = 0x43;
+  EXPECT_EQ(parse(short_ihl), ByteStreamErrorCode::Malformed);
+
+  // Total length shorter than the header
+  auto short_total = bytes;
+  short_total[2] = 0x00, short_total[3] = 12;
+  EXPECT_EQ(parse(short_total), ByteStreamErrorCode::Malformed);
+
+  // Total length past the end of the frame
+  auto long_total = bytes;
+  long_total[2] = 0x05, long_total[3] = 0xDC;
+  EXPECT_EQ(parse(long_total), ByteStreamErrorCode::NotEnoughData);
+
+  EXPECT_EQ(parse({0x45, 0x00}), ByteStreamErrorCode::NotEnoughData);
+}
+
+TEST(PacketsTest, PacketBufferGrowsBothWays) {
+  PacketBuffer packet(8, 16);
+  EXPECT_EQ(packet.headroom(), 16);
+  EXPECT_EQ(packet.size(), 0);
+
+  std::memset(packet.put(4), 0xAB, 4);
+  u8 *payload = packet.data();
+  *packet.push(2) = 0x01;
+
+  EXPECT_EQ(packet.size(), 6);
+  EXPECT_EQ(packet.data() + 2, payload);
+  EXPECT_EQ(packet.headroom(), 14);
+
+  packet.pull(2);
+  packet.trim(3);
+  EXPECT_EQ(packet.data(), payload);
+  EXPECT_EQ(packet.size(), 3);
+
+  // Running out of headroom is the only case that copies
+  packet.push(32);
+  EXPECT_EQ(packet.size(), 35);
+  EXPECT_EQ(packet.data()[32], 0xAB);
+}
+
+TEST(PacketsTest, EchoReplyReusesTheRequestInPlace) {
+  Buffer frame_buffer(captured_echo_request());
+  auto original = captured_echo_request();
+
+  ByteIStream frame_stream(frame_buffer);
+  auto frame = EthernetFrame<DirectionIn>::try_from_stream(frame_stream);
+  ByteIStream ip_stream(frame.payload);
+  auto ip = Ip<DirectionIn>::try_from_stream(ip_stream);
+  ByteIStream icmp_stream(ip.payload);
+  auto icmp = Icmp<DirectionIn>::try_from_stream(icmp_stream);
+
+  Icmp<DirectionOut> icmp_reply(icmp);
+  icmp_reply.type = IcmpType::EchoReply;
+  Ip<DirectionOut> ip_reply(ip);
+  std::swap(ip_reply.src, ip_reply.dst);
+  EthernetFrame<DirectionOut> frame_reply(frame.src, frame.dst,
+                                          ETHERTYPE_IPV4);
+
+  PacketBuffer packet(icmp.payload);
+  icmp_reply.push_onto(packet);
+  ip_reply.push_onto(packet);
+  frame_reply.push_onto(packet);
+
+  // The headers landed exactly where the request's were
+  ASSERT_EQ(packet.data(), frame_buffer.data());
+  ASSERT_EQ(packet.size(), original.size());
+  EXPECT_EQ(0, std::memcmp(packet.data() + 42, original.data() + 42, 56));
+
+  std::span<u8> bytes = packet.span();
+  EXPECT_EQ(0, std::memcmp(bytes.data(), original.data() + 6, 6));
+  EXPECT_EQ(bytes[34], (u8)IcmpType::EchoReply);
+  EXPECT_EQ(0, std::memcmp(bytes.data() + 26, original.data() + 30, 4));
+  EXPECT_EQ(checksum(bytes.subspan(14, 20)), 0);
+  EXPECT_EQ(checksum(bytes.subspan(34)), 0);
+}
+
+TEST(PacketsTest, SchemaFieldsKeepTheirNeighbours) {
+  std::array<u8, 4> bytes = {0x45, 0x00, 0xFF, 0xFF};
+
+  EXPECT_EQ(IpHeader::Version::load(bytes.data()), 4);
+  EXPECT_EQ(IpHeader::Ihl::load(bytes.data()), 5);
+
+  IpHeader::Ihl::store(bytes.data(), 0xF);
+  EXPECT_EQ(bytes[0], 0x4F);
+
+  using Flags = Field<16, 3>;
+  using FragmentOffset = Field<19, 13>;
+  FragmentOffset::store(bytes.data(), 0);
+  EXPECT_EQ(Flags::load(bytes.data()), 0b111);
+  EXPECT_EQ(bytes[2], 0xE0);
+  EXPECT_EQ(bytes[3], 0x00);
+}
+
+TEST(PacketsTest, ShortHeadersFailTheStream) {
+  std::vector<u8> bytes(7, 0xFF);
+
+  ByteIStream frame_stream(bytes);
+  auto frame = EthernetFrame<DirectionIn>::try_from_stream(frame_stream);
+  EXPECT_EQ(frame_stream.errc, ByteStreamErrorCode::NotEnoughData);
+  EXPECT_EQ(frame.ethertype, 0);
+  EXPECT_EQ(frame.payload.size(), 0);
+
+  ByteIStream icmp_stream(bytes);
+  auto icmp = Icmp<DirectionIn>::try_from_stream(icmp_stream);
+  EXPECT_EQ(icmp_stream.errc, ByteStreamErrorCode::NotEnoughData);
+  EXPECT_EQ(icmp.type, IcmpType::EchoReply);
+  EXPECT_EQ(icmp.checksum, 0);
+
+  ByteIStream arp_stream(bytes);
+  auto arp = ArpIPv4<DirectionIn>::try_from_stream(arp_stream);
+  EXPECT_EQ(arp_stream.errc, ByteStreamErrorCode::NotEnoughData);
+  EXPECT_EQ(arp.oper, 0);
+
+  // Long enough, but for another hardware type
+  std::vector<u8> token_ring(28, 0);
+  token_ring[1] = 6;
+  ByteIStream token_ring_stream(token_ring);
+  ArpIPv4<DirectionIn>::try_from_stream(token_ring_stream);
+  EXPECT_EQ(token_ring_stream.errc, ByteStreamErrorCode::Malformed);
+}
+
+TEST(PacketsTest, HeadersRoundTrip) {
+  Buffer frame_buffer(captured_echo_request());
+  ByteIStream frame_stream(frame_buffer);
+  auto frame = EthernetFrame<DirectionIn>::try_from_stream(frame_stream);
+  ByteIStream ip_stream(frame.payload);
+  auto ip = Ip<DirectionIn>::try_from_stream(ip_stream);
+
+  Buffer out(frame_buffer.size());
+  ByteOStream out_stream(out);
+  frame.try_to_stream(out_stream);
+  EXPECT_EQ(0, std::memcmp(out.data(), frame_buffer.data(), out.size()));
+
+  std::array<u8, IP_HEADER_SIZE> header;
+  ip.store_header(header.data());
+  EXPECT_EQ(0, std::memcmp(header.data(), frame_buffer.data() + 14,
+                           IP_HEADER_SIZE));
+
+  ArpIPv4<DirectionIn> arp(1, {1, 2, 3, 4, 5, 6}, {10, 0, 0, 1}, {},
+                           {10, 0, 0, 2});
+  Buffer arp_buffer(28);
+  ByteOStream arp_out(arp_buffer);
+  arp.try_to_stream(arp_out);
+  EXPECT_EQ(arp_buffer[7], 1);
+
+  ByteIStream arp_in(arp_buffer);
+  auto parsed = ArpIPv4<DirectionIn>::try_from_stream(arp_in);
+  EXPECT_EQ(parsed.oper, 1);
+  EXPECT_EQ(parsed.sender_hardware_addr[5], 6);
+  EXPECT_EQ(parsed.target_protocol_addr[3], 2);
+}
+
+TEST(PacketsTest, ViewsReadFieldsInPlace) {
+  Buffer frame_buffer(captured_echo_request());
+
+  auto frame = EthernetView<DirectionIn>::try_from(frame_buffer);
+  ASSERT_TRUE(frame);
+  EXPECT_EQ(frame->ethertype(), ETHERTYPE_IPV4);
+  EXPECT_EQ(frame->src(), MAC({0xf6, 0xa1, 0xc2, 0xd3, 0xe4, 0xf5}));
+
+  auto ip = IpView<DirectionIn>::try_from(frame->payload());
+  ASSERT_TRUE(ip);
+  EXPECT_EQ(ip->header(), frame_buffer.data() + 14);
+  EXPECT_EQ(ip->protocol(), PROTOCOL_ICMP);
+  EXPECT_EQ(ip->ttl(), 64);
+  EXPECT_EQ(ip->dst(), IPv4({10, 0, 0, 2}));
+  EXPECT_TRUE(ip->checksum_ok());
+  EXPECT_EQ(ip->calculate_checksum(), ip->header_checksum());
+
+  auto icmp = IcmpView<DirectionIn>::try_from(ip->payload());
+  ASSERT_TRUE(icmp);
+  EXPECT_EQ(icmp->type(), IcmpType::EchoRequest);
+  EXPECT_EQ(icmp->payload().size(), 56);
+  EXPECT_TRUE(icmp->checksum_ok());
+
+  // Truncated or lying headers never make it into a view
+  EXPECT_FALSE(IpView<DirectionIn>::try_from(frame->payload().slice(19)));
+  frame_buffer[14 + 3] = 200;
+  EXPECT_FALSE(IpView<DirectionIn>::try_from(frame->payload()));
+  EXPECT_FALSE(ArpIPv4View<DirectionIn>::try_from(frame->payload()));
+}
+
+TEST(PacketsTest, ViewsAnswerAnEchoWithoutDecoding) {
+  Buffer frame_buffer(captured_echo_request());
+  auto original = captured_echo_request();
+
+  auto frame = EthernetView<DirectionIn>::try_from(frame_buffer)->reverse();
+  auto ip = IpView<DirectionIn>::try_from(frame.payload())->reverse();
+  auto icmp = IcmpView<DirectionIn>::try_from(ip.payload())->reverse();
+
+  MAC src = frame.src();
+  frame.set_src(frame.dst());
+  frame.set_dst(src);
+  IPv4 ip_src = ip.src();
+  ip.set_src(ip.dst());
+  ip.set_dst(ip_src);
+  ip.set_ttl(63);
+  ip.update_checksum();
+  icmp.set_type(IcmpType::EchoReply);
+  icmp.update_checksum();
+
+  std::span<u8> bytes = frame_buffer.span();
+  EXPECT_EQ(0, std::memcmp(bytes.data(), original.data() + 6, 6));
+  EXPECT_EQ(0, std::memcmp(bytes.data() + 26, original.data() + 30, 4));
+  EXPECT_EQ(bytes[22], 63);
+  EXPECT_EQ(bytes[34], (u8)IcmpType::EchoReply);
+  EXPECT_EQ(checksum(bytes.subspan(14, 20)), 0);
+  EXPECT_EQ(checksum(bytes.subspan(34)), 0);
+}
+
+TEST(PacketsTest, EchoIsAnsweredInPlaceWithPatchedChecksums) {
+  Buffer frame_buffer(captured_echo_request());
+  auto original = captured_echo_request();
+  // Came from a few hops away, the reply starts over at the default TTL
+  auto request = IpView<DirectionIn>::try_from(
+                     frame_buffer.slice(14, frame_buffer.size()))
+                     ->reverse();
+  request.set_ttl(57);
+  request.update_checksum();
+
+  ASSERT_TRUE(echo_reply_in_place(frame_buffer.span(), 14 + IP_HEADER_SIZE));
+  std::span<u8> bytes = frame_buffer.span();
+  EXPECT_EQ(0, std::memcmp(bytes.data(), original.data() + 6, 6));
+
+  auto ip = IpView<DirectionIn>::try_from(
+      frame_buffer.slice(14, frame_buffer.size()));
+  EXPECT_EQ(ip->ttl(), IP_DEFAULT_TTL);
+  EXPECT_EQ(ip->src(), (IPv4({10, 0, 0, 2})));
+  EXPECT_EQ(ip->dst(), (IPv4({10, 0, 0, 1})));
+  EXPECT_TRUE(ip->checksum_ok());
+
+  auto icmp = IcmpView<DirectionIn>::try_from(ip->payload());
+  EXPECT_EQ(icmp->type(), IcmpType::EchoReply);
+  EXPECT_TRUE(icmp->checksum_ok());
+
+  // A reply is no request, it is left alone
+  std::vector<u8> reply(bytes.begin(), bytes.end());
+  EXPECT_FALSE(echo_reply_in_place(frame_buffer.span(), 14 + IP_HEADER_SIZE));
+  EXPECT_EQ(0, std::memcmp(bytes.data(), reply.data(), reply.size()));
+}
+
+TEST(PacketsTest, ArpViewMatchesTheDecodedPacket) {
+  ArpIPv4<DirectionIn> arp(1, {1, 2, 3, 4, 5, 6}, {10, 0, 0, 1}, {},
+                           {10, 0, 0, 2});
+  Buffer buffer(28);
+  ByteOStream out(buffer);
+  arp.try_to_stream(out);
+
+  auto view = ArpIPv4View<DirectionIn>::try_from(buffer);
+  ASSERT_TRUE(view);
+  EXPECT_EQ(view->oper(), 1);
+  EXPECT_EQ(view->sender_hardware_addr(), arp.sender_hardware_addr);
+  EXPECT_EQ(view->target_protocol_addr(), arp.target_protocol_addr);
+
+  auto reply = view->reverse();
+  reply.set_oper(2);
+  EXPECT_EQ(buffer[7], 2);
+}
+
+TEST(PacketsTest, ChecksumsAreComputedWithoutReserializing) {
+  Buffer frame_buffer(captured_echo_request());
+  ByteIStream frame_stream(frame_buffer);
+  auto frame = EthernetFrame<DirectionIn>::try_from_stream(frame_stream);
+  ByteIStream ip_stream(frame.payload);
+  auto ip = Ip<DirectionIn>::try_from_stream(ip_stream);
+  ByteIStream icmp_stream(ip.payload);
+  auto icmp = Icmp<DirectionIn>::try_from_stream(icmp_stream);
+
+  EXPECT_EQ(ip.calculate_checksum(), ip.header_checksum);
+  EXPECT_EQ(icmp.calculate_checksum(), icmp.checksum);
+
+  // Odd payloads count as if padded with a zero byte
+  Icmp<DirectionOut> odd(icmp);
+  odd.payload = icmp.payload.slice(55);
+  std::vector<u8> padded(IcmpHeader::SIZE + 56, 0);
+  odd.store_header(padded.data());
+  IcmpHeader::Checksum::store(padded.data(), 0);
+  std::memcpy(padded.data() + IcmpHeader::SIZE, odd.payload.data(), 55);
+  EXPECT_EQ(odd.calculate_checksum(), checksum(std::span(padded)));
+}
+
+TEST(PacketsTest, EchoReplyIsChecksummedWhileWritten) {
+  Buffer frame_buffer(captured_echo_request());
+  ByteIStream frame_stream(frame_buffer);
+  auto frame = EthernetFrame<DirectionIn>::try_from_stream(frame_stream);
+  ByteIStream ip_stream(frame.payload);
+  auto ip = Ip<DirectionIn>::try_from_stream(ip_stream);
+  ByteIStream icmp_stream(ip.payload);
+  auto icmp = Icmp<DirectionIn>::try_from_stream(icmp_stream);
+
+  Icmp<DirectionOut> reply(icmp);
+  reply.type = IcmpType::EchoReply;
+
+  Buffer out(ip.payload.size(), uninitialized);
+  ByteOStream stream(out);
+  reply.try_to_stream_with_checksum(stream);
+
+  ASSERT_EQ(stream.errc, ByteStreamErrorCode::Ok);
+  EXPECT_EQ(checksum(out.span()), 0);
+  EXPECT_EQ(reply.checksum, reply.calculate_checksum());
+  EXPECT_EQ(0, std::memcmp(out.data() + 8, icmp.payload.data(), 56));
+}
+
+TEST(PacketsTest, VirtioHeaderIsLittleEndian) {
+  auto header = VirtioNetHeader::segmented(VirtioNetHeader::GSO_TCPV4, 54,
+                                           1448, 34, 16);
+  std::array<u8, VirtioNetHeader::SIZE> bytes;
+  header.store(bytes.data());
+
+  std::array<u8, VirtioNetHeader::SIZE> expected = {1,    1, 54, 0, 0xA8,
+                                                    0x05, 34, 0, 16, 0};
+  EXPECT_EQ(bytes, expected);
+
+  auto loaded = VirtioNetHeader::load(bytes.data());
+  EXPECT_TRUE(loaded.needs_checksum());
+  EXPECT_EQ(loaded.gso_type, VirtioNetHeader::GSO_TCPV4);
+  EXPECT_EQ(loaded.hdr_len, 54);
+  EXPECT_EQ(loaded.gso_size, 1448);
+  EXPECT_EQ(loaded.csum_start, 34);
+  EXPECT_EQ(loaded.csum_offset, 16);
+}
+
+TEST(PacketsTest, PartialChecksumIsFinishedInSoftware) {
+  auto captured = captured_echo_request();
+  Buffer frame(captured);
+
+  // What the kernel would have left for a device with checksum offload
+  u8 *field = frame.data() + 34 + IcmpHeader::Checksum::FIRST_BYTE;
+  field[0] = field[1] = 0;
+  auto offload =
+      VirtioNetHeader::partial_checksum(34, IcmpHeader::Checksum::FIRST_BYTE);
+  EXPECT_TRUE(offload.checksum_trusted());
+
+  ASSERT_TRUE(offload.complete_checksum(frame.span()));
+  EXPECT_EQ(0, std::memcmp(frame.data(), captured.data(), captured.size()));
+
+  // Offsets past the frame are refused rather than written through
+  offload.csum_start = frame.size();
+  EXPECT_FALSE(offload.complete_checksum(frame.span()));
+}
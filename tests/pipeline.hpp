@@ -0,0 +1,394 @@
+#include <gtest/gtest.h>
+
+#include "nic/pipeline.hpp"
+
+using namespace toad;
+
+/// @brief Keeps whatever leaves the pipeline.
+struct CollectingDevice {
+  std::vector<Buffer> sent;
+  sz flushes = 0;
+
+  void queue_eth(const EthernetView<DirectionOut> &frame) {
+    sent.push_back(frame.buffer);
+  }
+  void flush() { flushes++; }
+};
+
+/// @brief Keeps whatever leaves the pipeline along with its offloads, like a
+/// TAP device opened with them.
+struct OffloadingDevice {
+  std::vector<Buffer> sent;
+  std::vector<VirtioNetHeader> offloads;
+
+  void queue_eth(const EthernetView<DirectionOut> &frame,
+                 VirtioNetHeader offload = {}) {
+    sent.push_back(frame.buffer);
+    offloads.push_back(offload);
+  }
+  void flush() {}
+};
+
+static_assert(NetDevice<CollectingDevice>);
+static_assert(NetDevice<OffloadingDevice>);
+static_assert(NetDevice<DeviceQueue>);
+
+static const MAC PIPELINE_MAC({0x02, 0, 0, 0, 0, 1});
+static const MAC PEER_MAC({0xf6, 0xa1, 0xc2, 0xd3, 0xe4, 0xf5});
+
+/// @brief `ping 10.0.0.2` from 10.0.0.1, as captured on a TAP device.
+static auto pipeline_echo_request() -> Buffer {
+  return Buffer(std::vector<u8>{
+      0x5a, 0x3c, 0x1e, 0x9d, 0x0b, 0x42, 0xf6, 0xa1, 0xc2, 0xd3, 0xe4, 0xf5,
+      0x08, 0x00, 0x45, 0x00, 0x00, 0x54, 0x6e, 0x1f, 0x40, 0x00, 0x40, 0x01,
+      0xb8, 0x87, 0x0a, 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x02, 0x08, 0x00,
+      0x9c, 0xe5, 0x1c, 0x2b, 0x00, 0x01, 0xa1, 0xc3, 0xf1, 0x66, 0x00, 0x00,
+      0x00, 0x00, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+      0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25,
+      0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31,
+      0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d,
+      0x3e, 0x3f,
+  });
+}
+
+/// @brief Who has 10.0.0.2, with the padding of a minimum sized frame.
+static auto pipeline_arp_request() -> Buffer {
+  std::vector<u8> bytes = {
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf6, 0xa1, 0xc2, 0xd3, 0xe4, 0xf5,
+      0x08, 0x06, 0x00, 0x01, 0x08, 0x00, 0x06, 0x04, 0x00, 0x01, 0xf6, 0xa1,
+      0xc2, 0xd3, 0xe4, 0xf5, 0x0a, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x0a, 0x00, 0x00, 0x02,
+  };
+  bytes.resize(60, 0);
+  return Buffer(bytes);
+}
+
+TEST(PipelineTest, AnswersEchoRequestsInPlace) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 2}));
+  CollectingDevice device;
+
+  std::vector<Buffer> frames = {pipeline_echo_request()};
+  u8 *bytes = frames[0].data();
+  pipeline.process(frames, device);
+
+  ASSERT_EQ(device.sent.size(), 1);
+  EXPECT_EQ(device.flushes, 1);
+  EXPECT_EQ(device.sent[0].data(), bytes);
+
+  auto frame = EthernetView<DirectionIn>::try_from(device.sent[0]);
+  EXPECT_EQ(frame->dst(), PEER_MAC);
+  EXPECT_EQ(frame->src(), PIPELINE_MAC);
+
+  auto ip = IpView<DirectionIn>::try_from(frame->payload());
+  ASSERT_TRUE(ip.has_value());
+  EXPECT_TRUE(ip->checksum_ok());
+  EXPECT_EQ(ip->src(), (IPv4({10, 0, 0, 2})));
+  EXPECT_EQ(ip->dst(), (IPv4({10, 0, 0, 1})));
+
+  auto icmp = IcmpView<DirectionIn>::try_from(ip->payload());
+  EXPECT_EQ(icmp->type(), IcmpType::EchoReply);
+  EXPECT_TRUE(icmp->checksum_ok());
+}
+
+TEST(PipelineTest, AnswersArpForItsAddressOnly) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 2}));
+  CollectingDevice device;
+
+  std::vector<Buffer> frames = {pipeline_arp_request(),
+                                pipeline_arp_request()};
+  frames[1].data()[41] = 3;
+  pipeline.process(frames, device);
+
+  ASSERT_EQ(device.sent.size(), 1);
+  using H = ArpHeader<6, 4>;
+  EXPECT_EQ(device.sent[0].size(), EthernetHeader::SIZE + H::SIZE);
+
+  auto frame = EthernetView<DirectionIn>::try_from(device.sent[0]);
+  EXPECT_EQ(frame->dst(), PEER_MAC);
+  EXPECT_EQ(frame->src(), PIPELINE_MAC);
+  auto arp = ArpIPv4View<DirectionIn>::try_from(frame->payload());
+  EXPECT_EQ(arp->oper(), 2);
+  EXPECT_EQ(MAC(arp->sender_hardware_addr()), PIPELINE_MAC);
+  EXPECT_EQ(IPv4(arp->sender_protocol_addr()), (IPv4({10, 0, 0, 2})));
+  EXPECT_EQ(MAC(arp->target_hardware_addr()), PEER_MAC);
+  EXPECT_EQ(IPv4(arp->target_protocol_addr()), (IPv4({10, 0, 0, 1})));
+  EXPECT_EQ(pipeline.node_frames[(sz)PipelineNode::Drop], 1);
+}
+
+TEST(PipelineTest, ForwardsToTheNextHopOneHopOlder) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 3}));
+  CollectingDevice device;
+
+  // Dropped without a next hop
+  std::vector<Buffer> frames = {pipeline_echo_request()};
+  pipeline.process(frames, device);
+  EXPECT_TRUE(device.sent.empty());
+
+  MAC gateway({0x02, 0, 0, 0, 0, 0xFE});
+  pipeline.next_hop = gateway;
+  frames = {pipeline_echo_request()};
+  pipeline.process(frames, device);
+
+  ASSERT_EQ(device.sent.size(), 1);
+  auto frame = EthernetView<DirectionIn>::try_from(device.sent[0]);
+  EXPECT_EQ(frame->dst(), gateway);
+  auto ip = IpView<DirectionIn>::try_from(frame->payload());
+  EXPECT_EQ(ip->ttl(), 0x3F);
+  EXPECT_TRUE(ip->checksum_ok());
+  EXPECT_EQ(ip->dst(), (IPv4({10, 0, 0, 2})));
+}
+
+TEST(PipelineTest, KeepsBroadcastsAndMulticastOnTheLink) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 3}));
+  pipeline.prefix_length = 24;
+  pipeline.next_hop = MAC({0x02, 0, 0, 0, 0, 0xFE});
+  CollectingDevice device;
+
+  auto to = [](IPv4 dst) {
+    Buffer frame = pipeline_echo_request();
+    u8 *header = frame.data() + EthernetHeader::SIZE;
+    IpHeader::Dst::store(header, dst);
+    IpHeader::Checksum::store(header, 0);
+    IpHeader::Checksum::store(header, checksum({header, IP_HEADER_SIZE}));
+    return frame;
+  };
+  std::vector<Buffer> frames = {
+      to(IPv4({255, 255, 255, 255})), to(IPv4({10, 0, 0, 255})),
+      to(IPv4({224, 0, 0, 251})),     pipeline_echo_request(),
+      to(IPv4({10, 0, 1, 255}))};
+  EthernetHeader::Dst::store(frames[3].data(),
+                             MAC({0xff, 0xff, 0xff, 0xff, 0xff, 0xff}));
+  pipeline.process(frames, device);
+
+  // Only the broadcast of another subnet is forwarded
+  ASSERT_EQ(device.sent.size(), 1);
+  auto ip = IpView<DirectionIn>::try_from(
+      device.sent[0].slice(EthernetHeader::SIZE, device.sent[0].size()));
+  EXPECT_EQ(ip->dst(), (IPv4({10, 0, 1, 255})));
+  EXPECT_EQ(pipeline.node_frames[(sz)PipelineNode::Drop], 4);
+}
+
+TEST(PipelineTest, DropsWhatItCannotParse) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 2}));
+  CollectingDevice device;
+
+  std::vector<Buffer> frames = {Buffer(std::vector<u8>{1, 2, 3}),
+                                pipeline_echo_request(),
+                                pipeline_echo_request()};
+  // A bad IP header checksum and a truncated packet
+  frames[1].data()[24] ^= 0xFF;
+  frames[2] = frames[2].slice(40);
+  pipeline.process(frames, device);
+
+  EXPECT_TRUE(device.sent.empty());
+  EXPECT_EQ(pipeline.node_frames[(sz)PipelineNode::Drop], 3);
+}
+
+TEST(PipelineTest, LongBurstsAreSplitIntoVectors) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 2}));
+  CollectingDevice device;
+
+  std::vector<Buffer> frames;
+  for (sz i = 0; i < PIPELINE_VECTOR_SIZE + 10; i++)
+    frames.push_back(pipeline_echo_request());
+  pipeline.process(frames, device);
+
+  EXPECT_EQ(device.sent.size(), PIPELINE_VECTOR_SIZE + 10);
+  EXPECT_EQ(device.flushes, 1);
+  EXPECT_EQ(pipeline.node_vectors[(sz)PipelineNode::IcmpInput], 2);
+  EXPECT_EQ(pipeline.node_frames[(sz)PipelineNode::IcmpInput],
+            PIPELINE_VECTOR_SIZE + 10);
+}
+
+/// @brief A TCP packet of `length` bytes from 10.0.0.1 to 10.0.0.9 that must
+/// not be fragmented, with only the pseudo header summed into its checksum,
+/// the way a TAP device with offloads hands it over.
+static auto pipeline_partial_tcp(sz length) -> Buffer {
+  Buffer small = pipeline_echo_request();
+  PacketBuffer packet(length, EthernetHeader::SIZE);
+  u8 *bytes = packet.put(length);
+  std::memset(bytes, 0, length);
+  std::memcpy(bytes, small.data() + EthernetHeader::SIZE, IP_HEADER_SIZE);
+  IpHeader::TotalLength::store(bytes, length);
+  IpHeader::Protocol::store(bytes, PROTOCOL_TCP);
+  IpHeader::Dst::store(bytes, IPv4({10, 0, 0, 9}));
+  IpHeader::Checksum::store(bytes, 0);
+  IpHeader::Checksum::store(bytes, checksum({bytes, IP_HEADER_SIZE}));
+
+  u8 *tcp = bytes + IP_HEADER_SIZE;
+  TcpHeader::DataOffset::store(tcp, TCP_HEADER_SIZE / 4);
+  TcpHeader::Flags::store(tcp, TCP_ACK);
+  for (sz i = TCP_HEADER_SIZE; i < length - IP_HEADER_SIZE; i++)
+    tcp[i] = i;
+  TcpHeader::Checksum::store(
+      tcp, fold_sum(TcpSegment::pseudo_sum(
+               FlowKey::_bits(IPv4({10, 0, 0, 1})),
+               FlowKey::_bits(IPv4({10, 0, 0, 9})), length - IP_HEADER_SIZE)));
+
+  u8 *ethernet = packet.push(EthernetHeader::SIZE);
+  std::memcpy(ethernet, small.data(), EthernetHeader::SIZE);
+  return packet.view();
+}
+
+static constexpr u16 PIPELINE_CSUM_START = EthernetHeader::SIZE + 20;
+static constexpr u16 PIPELINE_CSUM_OFFSET = 16;
+
+TEST(PipelineTest, ForwardedFramesFinishTheirChecksums) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 3}));
+  pipeline.next_hop = MAC({0x02, 0, 0, 0, 0, 0xFE});
+  CollectingDevice device;
+
+  std::vector<Buffer> frames = {pipeline_partial_tcp(100)};
+  std::vector<VirtioNetHeader> offloads = {VirtioNetHeader::partial_checksum(
+      PIPELINE_CSUM_START, PIPELINE_CSUM_OFFSET)};
+  pipeline.process(frames, device, offloads);
+
+  // The device takes no offloads, so the checksum is finished on the way out
+  ASSERT_EQ(device.sent.size(), 1);
+  auto packet =
+      device.sent[0].slice(EthernetHeader::SIZE, device.sent[0].size());
+  EXPECT_TRUE(TcpSegment::try_from(packet).has_value());
+}
+
+TEST(PipelineTest, ForwardedSuperFramesKeepTheirOffloads) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 3}));
+  pipeline.next_hop = MAC({0x02, 0, 0, 0, 0, 0xFE});
+  auto offload = VirtioNetHeader::segmented(
+      VirtioNetHeader::GSO_TCPV4, PIPELINE_CSUM_START + TCP_HEADER_SIZE,
+      1460, PIPELINE_CSUM_START, PIPELINE_CSUM_OFFSET);
+
+  // A device with offloads cuts the super-frame into segments itself
+  OffloadingDevice offloading;
+  std::vector<Buffer> frames = {pipeline_partial_tcp(3000)};
+  std::vector<VirtioNetHeader> offloads = {offload};
+  pipeline.process(frames, offloading, offloads);
+
+  ASSERT_EQ(offloading.sent.size(), 1);
+  EXPECT_EQ(offloading.sent[0].size(), EthernetHeader::SIZE + 3000);
+  EXPECT_EQ(offloading.offloads[0].gso_size, 1460);
+  EXPECT_TRUE(offloading.offloads[0].needs_checksum());
+
+  // Any other device would need fragments, which the packet forbids
+  CollectingDevice device;
+  frames = {pipeline_partial_tcp(3000)};
+  pipeline.process(frames, device, offloads);
+  EXPECT_TRUE(device.sent.empty());
+  EXPECT_EQ(pipeline.node_frames[(sz)PipelineNode::Drop], 1);
+}
+
+TEST(PipelineTest, ForwardedPacketsWaitForTheirNeighbor) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 3}));
+  NeighborCache neighbors;
+  pipeline.neighbors = &neighbors;
+  CollectingDevice device;
+
+  // Both miss, only one request goes out
+  std::vector<Buffer> frames = {pipeline_echo_request(),
+                                pipeline_echo_request()};
+  pipeline.process(frames, device);
+
+  ASSERT_EQ(device.sent.size(), 1);
+  auto request = EthernetView<DirectionIn>::try_from(device.sent[0]);
+  EXPECT_EQ(request->ethertype(), ETHERTYPE_ARP);
+  auto who_has = ArpIPv4View<DirectionIn>::try_from(request->payload());
+  EXPECT_EQ(who_has->oper(), 1);
+  EXPECT_EQ((IPv4(who_has->target_protocol_addr())), (IPv4({10, 0, 0, 2})));
+
+  // The answer releases both, addressed to whoever answered
+  MAC neighbor({0x02, 0, 0, 0, 0, 2});
+  auto reply = pipeline_arp_request();
+  using H = ArpHeader<6, 4>;
+  u8 *arp = reply.data() + EthernetHeader::SIZE;
+  H::Oper::store(arp, 2);
+  H::Sha::store(arp, neighbor);
+  H::Spa::store(arp, IPv4({10, 0, 0, 2}));
+  H::Tha::store(arp, PIPELINE_MAC);
+  H::Tpa::store(arp, IPv4({10, 0, 0, 3}));
+
+  device.sent.clear();
+  frames = {reply};
+  pipeline.process(frames, device);
+
+  ASSERT_EQ(device.sent.size(), 2);
+  for (auto &sent : device.sent) {
+    auto frame = EthernetView<DirectionIn>::try_from(sent);
+    EXPECT_EQ(frame->dst(), neighbor);
+    EXPECT_EQ(frame->src(), PIPELINE_MAC);
+    EXPECT_EQ(IpView<DirectionIn>::try_from(frame->payload())->ttl(), 0x3F);
+  }
+  EXPECT_EQ(neighbors.lookup(IPv4({10, 0, 0, 2})), neighbor);
+}
+
+TEST(PipelineTest, ForwardedPacketsFollowTheirRoute) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 3}));
+  NeighborCache neighbors;
+  RouteTable routes(16);
+  pipeline.neighbors = &neighbors;
+  pipeline.routes = &routes;
+  CollectingDevice device;
+
+  // Nothing routes 10.0.0.2 yet
+  std::vector<Buffer> frames = {pipeline_echo_request()};
+  pipeline.process(frames, device);
+  EXPECT_TRUE(device.sent.empty());
+  EXPECT_EQ(pipeline.node_frames[(sz)PipelineNode::Drop], 1);
+
+  // Through a gateway, it is the gateway that is asked for
+  routes.add(IPv4({10, 0, 0, 0}), 24, IPv4({10, 0, 0, 9}));
+  frames = {pipeline_echo_request()};
+  pipeline.process(frames, device);
+
+  ASSERT_EQ(device.sent.size(), 1);
+  auto request = EthernetView<DirectionIn>::try_from(device.sent[0]);
+  auto who_has = ArpIPv4View<DirectionIn>::try_from(request->payload());
+  EXPECT_EQ((IPv4(who_has->target_protocol_addr())), (IPv4({10, 0, 0, 9})));
+}
+
+TEST(PipelineTest, FragmentedEchoRequestsAreAnsweredInFragments) {
+  Pipeline pipeline(PIPELINE_MAC, IPv4({10, 0, 0, 2}));
+  pipeline.mtu = 576;
+  CollectingDevice device;
+
+  // The echo request of `ping -s 1400 -M dont`, fragmented on the way in
+  Buffer small = pipeline_echo_request();
+  PacketBuffer echo(IP_HEADER_SIZE + 8 + 1400, EthernetHeader::SIZE);
+  u8 *bytes = echo.put(IP_HEADER_SIZE + 8 + 1400);
+  std::memcpy(bytes, small.data() + EthernetHeader::SIZE, IP_HEADER_SIZE + 8);
+  for (sz i = 0; i < 1400; i++)
+    bytes[IP_HEADER_SIZE + 8 + i] = i;
+  IpHeader::TotalLength::store(bytes, echo.size());
+  IpHeader::Flags::store(bytes, 0);
+  IpHeader::Checksum::store(bytes, 0);
+  IpHeader::Checksum::store(bytes, checksum({bytes, IP_HEADER_SIZE}));
+  u8 *icmp = bytes + IP_HEADER_SIZE;
+  IcmpHeader::Checksum::store(icmp, 0);
+  IcmpHeader::Checksum::store(icmp, checksum({icmp, echo.size() - 20}));
+
+  auto fragments = fragment_ipv4(echo.span(), 1000);
+  std::vector<Buffer> frames;
+  for (auto &fragment : *fragments) {
+    u8 *ethernet = fragment.push(EthernetHeader::SIZE);
+    std::memcpy(ethernet, small.data(), EthernetHeader::SIZE);
+    frames.push_back(fragment.view());
+  }
+  ASSERT_EQ(frames.size(), 2);
+  pipeline.process(frames, device);
+
+  // The reply leaves in fragments of the pipeline's MTU, and comes back
+  // together as the request's payload
+  ASSERT_EQ(device.sent.size(), 3);
+  Reassembler reassembler;
+  std::optional<BufferChain> reply;
+  for (auto &sent : device.sent) {
+    EXPECT_LE(sent.size(), EthernetHeader::SIZE + 576);
+    reply = reassembler.push(sent.slice(EthernetHeader::SIZE, sent.size()), 0);
+  }
+  ASSERT_TRUE(reply.has_value());
+
+  auto ip = IpView<DirectionIn>::try_from(reply->linearize());
+  EXPECT_EQ(ip->dst(), (IPv4({10, 0, 0, 1})));
+  auto answer = IcmpView<DirectionIn>::try_from(ip->payload());
+  EXPECT_EQ(answer->type(), IcmpType::EchoReply);
+  EXPECT_TRUE(answer->checksum_ok());
+  EXPECT_EQ(ip->payload().size(), 8 + 1400);
+}
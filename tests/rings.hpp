@@ -0,0 +1,205 @@
+#include <chrono>
+#include <gtest/gtest.h>
+#include <thread>
+
+#include "nic/packet_ring.hpp"
+
+using namespace toad;
+
+constexpr sz TEST_RING_BLOCK_SIZE = 4096;
+constexpr sz TEST_RING_BLOCKS = 2;
+constexpr sz TEST_RING_TX_FRAME_SIZE = 2048;
+constexpr sz TEST_RING_TX_FRAMES = 4;
+/// @brief Experimental ethertype, nothing else on the link uses it
+constexpr u16 TEST_RING_ETHERTYPE = 0x88B5;
+
+/// @brief Rings in plain memory, filled the way the kernel fills them.
+struct FakeRing {
+  alignas(64) std::array<u8, TEST_RING_BLOCK_SIZE * TEST_RING_BLOCKS +
+                                 TEST_RING_TX_FRAME_SIZE * TEST_RING_TX_FRAMES>
+      memory = {};
+  PacketRingQueue queue{-1, memory, TEST_RING_BLOCK_SIZE, TEST_RING_BLOCKS,
+                        TEST_RING_TX_FRAME_SIZE};
+
+  auto block(sz i) -> tpacket_hdr_v1 & {
+    return ((tpacket_block_desc *)(memory.data() +
+                                   i * TEST_RING_BLOCK_SIZE))
+        ->hdr.bh1;
+  }
+
+  /// @brief Retires block `i` with a frame per entry of `payloads`.
+  void fill(sz i, std::vector<std::string> payloads,
+            u8 pkttype = PACKET_HOST) {
+    auto &desc = block(i);
+    u8 *base = memory.data() + i * TEST_RING_BLOCK_SIZE;
+    sz offset = TPACKET_ALIGN(sizeof(tpacket_block_desc));
+    desc.offset_to_first_pkt = offset;
+    desc.num_pkts = payloads.size();
+
+    for (sz j = 0; j < payloads.size(); j++) {
+      auto *packet = (tpacket3_hdr *)(base + offset);
+      auto *address =
+          (sockaddr_ll *)((u8 *)packet + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+      address->sll_pkttype = pkttype;
+      packet->tp_mac = 80;
+      packet->tp_len = packet->tp_snaplen =
+          EthernetHeader::SIZE + payloads[j].size();
+
+      u8 *frame = (u8 *)packet + packet->tp_mac;
+      EthernetHeader::Ethertype::store(frame, TEST_RING_ETHERTYPE);
+      std::memcpy(frame + EthernetHeader::SIZE, payloads[j].data(),
+                  payloads[j].size());
+
+      sz next = TPACKET_ALIGN(packet->tp_mac + packet->tp_snaplen);
+      packet->tp_next_offset = j + 1 < payloads.size() ? next : 0;
+      offset += next;
+    }
+    desc.block_status = TP_STATUS_USER;
+  }
+
+  auto receive() -> std::vector<EthernetFrame<DirectionIn>> {
+    std::vector<EthernetFrame<DirectionIn>> frames;
+    queue.receive([&](EthernetFrame<DirectionIn> frame) {
+      frames.push_back(std::move(frame));
+    });
+    return frames;
+  }
+};
+
+static auto payload_of(const EthernetFrame<DirectionIn> &frame)
+    -> std::string {
+  return {(char *)frame.payload.data(), frame.payload.size()};
+}
+
+TEST(PacketRingTest, ReadsFramesInPlace) {
+  FakeRing ring;
+  ring.fill(0, {"first", "second"});
+
+  auto frames = ring.receive();
+  ASSERT_EQ(frames.size(), 2);
+  EXPECT_EQ(payload_of(frames[0]), "first");
+  EXPECT_EQ(payload_of(frames[1]), "second");
+  EXPECT_EQ(frames[1].ethertype, TEST_RING_ETHERTYPE);
+  EXPECT_GE(frames[0].payload.data(), ring.memory.data());
+  EXPECT_LT(frames[1].payload.data(),
+            ring.memory.data() + TEST_RING_BLOCK_SIZE);
+  // The block was not filled again, only the next one may be ready
+  EXPECT_TRUE(ring.receive().empty());
+}
+
+TEST(PacketRingTest, ReturnsTheBlockOnceEveryFrameIsGone) {
+  FakeRing ring;
+  ring.fill(0, {"first", "second"});
+
+  auto frames = ring.receive();
+  EXPECT_EQ(ring.block(0).block_status, TP_STATUS_USER);
+  frames.pop_back();
+  EXPECT_EQ(ring.block(0).block_status, TP_STATUS_USER);
+  frames.clear();
+  EXPECT_EQ(ring.block(0).block_status, TP_STATUS_KERNEL);
+
+  // A block nobody kept goes back right after the walk
+  ring.fill(1, {"third"});
+  ring.receive();
+  EXPECT_EQ(ring.block(1).block_status, TP_STATUS_KERNEL);
+
+  // Around the ring and into the first block again
+  ring.fill(0, {"fourth"});
+  frames = ring.receive();
+  ASSERT_EQ(frames.size(), 1);
+  EXPECT_EQ(payload_of(frames[0]), "fourth");
+}
+
+TEST(PacketRingTest, WaitsForHeldBlocks) {
+  FakeRing ring;
+  ring.fill(0, {"first"});
+  auto held = ring.receive();
+  ring.fill(1, {"second"});
+  ring.receive();
+
+  // The kernel never hands the first block back, but its old status must not
+  // be taken for a new one
+  EXPECT_TRUE(ring.receive().empty());
+  held.clear();
+  EXPECT_TRUE(ring.receive().empty());
+}
+
+TEST(PacketRingTest, StopsPollingWhileTheNextBlockIsHeld) {
+  FakeRing ring;
+  FrameChannel channel;
+  ring.fill(0, {"first"});
+  EXPECT_TRUE(ring.queue._deliver(channel));
+  ring.fill(1, {"second"});
+  EXPECT_TRUE(ring.queue._deliver(channel));
+  EXPECT_EQ(channel.size(), 2);
+
+  // Both blocks wait in the channel, the socket would stay readable with
+  // nothing to walk
+  EXPECT_FALSE(ring.queue._deliver(channel));
+
+  // Once the frames are gone the kernel may fill the blocks again
+  while (channel.try_recv())
+    ;
+  EXPECT_TRUE(ring.queue._deliver(channel));
+  ring.fill(0, {"third"});
+  EXPECT_TRUE(ring.queue._deliver(channel));
+  ASSERT_EQ(channel.size(), 1);
+  EXPECT_EQ(payload_of(*channel.try_recv()), "third");
+
+  channel.close();
+  EXPECT_FALSE(ring.queue._deliver(channel));
+}
+
+TEST(PacketRingTest, SkipsOurOwnFrames) {
+  FakeRing ring;
+  ring.fill(0, {"looped"}, PACKET_OUTGOING);
+  EXPECT_TRUE(ring.receive().empty());
+  EXPECT_EQ(ring.block(0).block_status, TP_STATUS_KERNEL);
+}
+
+TEST(PacketRingTest, FillsTransmitSlotsUntilTheRingIsFull) {
+  FakeRing ring;
+  u8 *tx = ring.memory.data() + TEST_RING_BLOCK_SIZE * TEST_RING_BLOCKS;
+
+  for (sz i = 0; i <= TEST_RING_TX_FRAMES; i++) {
+    PacketBuffer packet(EthernetHeader::SIZE + 1);
+    u8 *frame = packet.put(EthernetHeader::SIZE + 1);
+    std::memset(frame, 0, EthernetHeader::SIZE);
+    frame[EthernetHeader::SIZE] = i;
+    ring.queue.queue_eth(packet);
+  }
+
+  for (sz i = 0; i < TEST_RING_TX_FRAMES; i++) {
+    auto *slot = (tpacket3_hdr *)(tx + i * TEST_RING_TX_FRAME_SIZE);
+    EXPECT_EQ(slot->tp_status, TP_STATUS_SEND_REQUEST);
+    EXPECT_EQ(slot->tp_len, EthernetHeader::SIZE + 1);
+    // The frame past the end found the first slot still waiting
+    EXPECT_EQ(((u8 *)slot)[PACKET_RING_TX_OFFSET + EthernetHeader::SIZE], i);
+  }
+}
+
+TEST(PacketRingTest, SendsToItselfOverLoopback) {
+  auto device = PacketRingDevice::try_new("lo", "127.0.0.1");
+  if (!device)
+    GTEST_SKIP() << "Packet sockets need CAP_NET_RAW";
+
+  PacketBuffer packet(EthernetHeader::SIZE + 4);
+  u8 *frame = packet.put(EthernetHeader::SIZE + 4);
+  std::memset(frame, 0, EthernetHeader::SIZE);
+  EthernetHeader::Ethertype::store(frame, TEST_RING_ETHERTYPE);
+  std::memcpy(frame + EthernetHeader::SIZE, "toad", 4);
+  device->queue_eth(packet);
+  device->flush();
+
+  bool found = false;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (!found && std::chrono::steady_clock::now() < deadline) {
+    device->queues[0].receive([&](EthernetFrame<DirectionIn> frame) {
+      found |= frame.ethertype == TEST_RING_ETHERTYPE &&
+               frame.payload.size() >= 4 &&
+               std::memcmp(frame.payload.data(), "toad", 4) == 0;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_TRUE(found);
+}
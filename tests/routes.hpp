@@ -0,0 +1,121 @@
+#include <atomic>
+#include <gtest/gtest.h>
+#include <thread>
+
+#include "nic/route.hpp"
+
+using namespace toad;
+
+static const IPv4 GATEWAY_A({192, 168, 0, 1});
+static const IPv4 GATEWAY_B({192, 168, 0, 2});
+
+TEST(RouteTableTest, LongestPrefixWins) {
+  RouteTable routes(16);
+  EXPECT_FALSE(routes.next_hop(IPv4({10, 1, 2, 3})).has_value());
+
+  routes.add(IPv4({10, 0, 0, 0}), 8, GATEWAY_A);
+  routes.add(IPv4({10, 1, 0, 0}), 16, GATEWAY_B);
+  routes.add(IPv4({10, 1, 2, 0}), 24);
+
+  EXPECT_EQ(routes.next_hop(IPv4({10, 9, 9, 9})), GATEWAY_A);
+  EXPECT_EQ(routes.next_hop(IPv4({10, 1, 9, 9})), GATEWAY_B);
+  EXPECT_EQ(routes.next_hop(IPv4({10, 1, 2, 3})), (IPv4({10, 1, 2, 3})));
+  EXPECT_FALSE(routes.next_hop(IPv4({11, 0, 0, 1})).has_value());
+
+  // Adding the shorter prefix last must not cover the longer ones
+  routes.add(IPv4({0, 0, 0, 0}), 0, GATEWAY_B);
+  EXPECT_EQ(routes.next_hop(IPv4({11, 0, 0, 1})), GATEWAY_B);
+  EXPECT_EQ(routes.next_hop(IPv4({10, 9, 9, 9})), GATEWAY_A);
+  EXPECT_EQ(routes.size(), 4);
+}
+
+TEST(RouteTableTest, RemovingHandsAddressesToTheShorterPrefix) {
+  RouteTable routes(16);
+  routes.add(IPv4({10, 0, 0, 0}), 8, GATEWAY_A);
+  routes.add(IPv4({10, 1, 0, 0}), 16, GATEWAY_B);
+
+  EXPECT_TRUE(routes.remove(IPv4({10, 1, 0, 0}), 16));
+  EXPECT_FALSE(routes.remove(IPv4({10, 1, 0, 0}), 16));
+  EXPECT_EQ(routes.next_hop(IPv4({10, 1, 9, 9})), GATEWAY_A);
+
+  EXPECT_TRUE(routes.remove(IPv4({10, 0, 0, 0}), 8));
+  EXPECT_FALSE(routes.next_hop(IPv4({10, 1, 9, 9})).has_value());
+}
+
+TEST(RouteTableTest, LongPrefixesLiveInGroups) {
+  RouteTable routes(16);
+  routes.add(IPv4({10, 1, 2, 0}), 24, GATEWAY_A);
+  routes.add(IPv4({10, 1, 2, 128}), 25, GATEWAY_B);
+  routes.add(IPv4({10, 1, 2, 7}), 32);
+
+  EXPECT_EQ(routes.next_hop(IPv4({10, 1, 2, 1})), GATEWAY_A);
+  EXPECT_EQ(routes.next_hop(IPv4({10, 1, 2, 200})), GATEWAY_B);
+  EXPECT_EQ(routes.next_hop(IPv4({10, 1, 2, 7})), (IPv4({10, 1, 2, 7})));
+
+  // A shorter prefix added later still reaches into the group
+  routes.add(IPv4({10, 1, 0, 0}), 16, GATEWAY_B);
+  routes.remove(IPv4({10, 1, 2, 0}), 24);
+  EXPECT_EQ(routes.next_hop(IPv4({10, 1, 2, 1})), GATEWAY_B);
+  EXPECT_EQ(routes.next_hop(IPv4({10, 1, 2, 7})), (IPv4({10, 1, 2, 7})));
+
+  routes.remove(IPv4({10, 1, 2, 7}), 32);
+  EXPECT_EQ(routes.next_hop(IPv4({10, 1, 2, 7})), GATEWAY_B);
+}
+
+TEST(RouteTableTest, RunsOutOfGroups) {
+  RouteTable routes(2);
+  EXPECT_TRUE(routes.add(IPv4({10, 0, 0, 1}), 32));
+  EXPECT_TRUE(routes.add(IPv4({10, 0, 1, 1}), 32));
+  EXPECT_TRUE(routes.add(IPv4({10, 0, 1, 2}), 32));
+  EXPECT_FALSE(routes.add(IPv4({10, 0, 2, 1}), 32));
+  EXPECT_FALSE(routes.next_hop(IPv4({10, 0, 2, 1})).has_value());
+  EXPECT_EQ(routes.size(), 3);
+}
+
+TEST(RouteTableTest, BulkLookupsMatchSingleOnes) {
+  RouteTable routes(64);
+  u64 state = 0x9E3779B97F4A7C15;
+  auto next = [&]() -> u32 {
+    state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+    return (u32)state;
+  };
+
+  for (sz i = 0; i < 200; i++) {
+    u32 bits = next();
+    u8 length = 8 + next() % 25;
+    routes.add(RouteTable::_ip(bits), length, RouteTable::_ip(next()));
+  }
+
+  std::vector<u32> addresses(1000), hops(1000);
+  for (auto &address : addresses)
+    address = next();
+  routes.lookup_bulk(addresses, hops);
+  for (sz i = 0; i < addresses.size(); i++)
+    EXPECT_EQ(hops[i], routes.lookup(addresses[i]));
+}
+
+TEST(RouteTableTest, ReadersNeverSeeAHole) {
+  RouteTable routes(16);
+  routes.add(IPv4({10, 0, 0, 0}), 8, GATEWAY_A);
+
+  std::atomic<bool> stop = false;
+  std::atomic<u64> misses = 0;
+  std::thread reader([&]() {
+    while (!stop.load(std::memory_order_relaxed))
+      for (u8 last : {1, 100, 200})
+        if (!routes.next_hop(IPv4({10, 1, 2, last})))
+          misses++;
+  });
+
+  // Longer prefixes come and go under the reader's addresses
+  for (sz i = 0; i < 20000; i++) {
+    routes.add(IPv4({10, 1, 0, 0}), 16, GATEWAY_B);
+    routes.add(IPv4({10, 1, 2, 64}), 26, GATEWAY_B);
+    routes.remove(IPv4({10, 1, 0, 0}), 16);
+    routes.remove(IPv4({10, 1, 2, 64}), 26);
+  }
+  stop = true;
+  reader.join();
+
+  EXPECT_EQ(misses.load(), 0);
+}
@@ -41,3 +41,56 @@ TEST_P(TasksTest, NotifyAllUnblocksWorkers) {
 }
 
 INSTANTIATE_TEST_SUITE_P(WorkersRange, TasksTest, ::testing::Range(1, 11));
+
+Task count(std::atomic<int> &counter) {
+  counter.fetch_add(1, std::memory_order_seq_cst);
+  co_return;
+}
+
+TEST(SpawnBatchTest, RunsEveryTask) {
+  Executor executor(4);
+  std::atomic<int> counter{0};
+
+  std::vector<Task> tasks;
+  for (int i = 0; i < 64; i++)
+    tasks.push_back(count(counter));
+  executor.spawn_batch(tasks);
+
+  while (counter.load() != 64)
+    std::this_thread::yield();
+}
+
+TEST(SpawnBatchTest, WakesAtMostOneWorkerEach) {
+  const sz WORKERS = 4;
+  Executor executor(WORKERS);
+
+  // Let every worker go to sleep first
+  while (executor._sleeping.load() != WORKERS)
+    std::this_thread::yield();
+
+  auto before = executor._notifications.load();
+
+  std::atomic<int> counter{0};
+  std::vector<Task> tasks;
+  for (int i = 0; i < 64; i++)
+    tasks.push_back(count(counter));
+  executor.spawn_batch(tasks);
+
+  while (counter.load() != 64)
+    std::this_thread::yield();
+
+  ASSERT_LE(executor._notifications.load() - before, WORKERS);
+}
+
+TEST(ExecutorTest, FirstExecutorOnAThreadStaysItsOwn) {
+  {
+    Executor shared(1);
+    {
+      // Like the worker of a queue loop, created after the shared one
+      Executor queue(1);
+      ASSERT_EQ(&this_executor(), &shared);
+    }
+    ASSERT_EQ(&this_executor(), &shared);
+  }
+  ASSERT_EQ(_this_executor, nullptr);
+}
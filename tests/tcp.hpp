@@ -0,0 +1,579 @@
+#include <atomic>
+#include <functional>
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+
+#include "concurrency/executor.hpp"
+#include "nic/tcp.hpp"
+
+using namespace toad;
+
+static const IPv4 TCP_CLIENT_IP({10, 0, 0, 1});
+static const IPv4 TCP_SERVER_IP({10, 0, 0, 2});
+
+/// @brief Two stacks wired to each other, with a clock that only moves when
+/// told to.
+struct TcpLoopback {
+  TcpStack a{TCP_CLIENT_IP};
+  TcpStack b{TCP_SERVER_IP};
+  u64 now = 1'000'000'000;
+  /// @brief Whether a packet on its way from `from` gets lost
+  std::function<bool(const TcpStack &from, const Buffer &packet)> lose;
+  sz lost = 0;
+  /// @brief Largest packet carried, super-segments included
+  sz largest = 0;
+
+  /// @brief Moves the clock and carries what both stacks have to send, a
+  /// vector each way.
+  void step(u64 elapsed = 1'000'000) {
+    now += elapsed;
+    _carry(a, b);
+    _carry(b, a);
+  }
+
+  void _carry(TcpStack &from, TcpStack &to) {
+    std::vector<Buffer> packets;
+    for (auto &packet : from.poll(now)) {
+      // The device would finish what was left to it, cutting super-segments
+      // changes nothing the receiver could tell apart
+      EXPECT_TRUE(packet.offload.complete_checksum(packet.span()));
+      largest = std::max(largest, packet.size());
+      Buffer bytes = packet.view();
+      if (lose && lose(from, bytes)) {
+        lost++;
+        continue;
+      }
+      packets.push_back(std::move(bytes));
+    }
+    if (!packets.empty())
+      to.input(packets, now);
+  }
+
+  /// @brief Steps until `done`, giving the coroutines a chance in between.
+  template <typename F>
+  bool run_until(F &&done, u64 elapsed = 1'000'000, sz steps = 1'000'000) {
+    for (sz i = 0; i < steps && !done(); i++) {
+      step(elapsed);
+      std::this_thread::yield();
+    }
+    return done();
+  }
+};
+
+static auto tcp_bytes(std::string_view text) -> Buffer {
+  return Buffer(std::vector<u8>(text.begin(), text.end()));
+}
+
+/// @brief Sends everything received on the first connection back.
+Task tcp_echo(TcpStack &stack, TcpListener &listener,
+              std::atomic<bool> &done) {
+  {
+    auto socket = co_await stack.submit_accept_ipv4(listener);
+    if (socket)
+      while (auto data = co_await stack.submit_read_some(*socket, 4096))
+        co_await stack.submit_write(*socket, BufferChain(std::move(*data)));
+  }
+  done = true;
+}
+
+/// @brief Sends `message` and reads until as much came back.
+Task tcp_ask(TcpStack &stack, std::string message, std::string &reply,
+             std::atomic<bool> &connected, std::atomic<bool> &done) {
+  {
+    auto socket = co_await stack.submit_connect_ipv4(TCP_SERVER_IP, 7);
+    connected = socket.has_value();
+    if (socket) {
+      co_await stack.submit_write(*socket, BufferChain(tcp_bytes(message)));
+      while (reply.size() < message.size()) {
+        auto data = co_await stack.submit_read_some(*socket, 4096);
+        if (!data)
+          break;
+        reply.append((const char *)data->data(), data->size());
+      }
+    }
+  }
+  done = true;
+}
+
+TEST(TcpTest, ConnectsAndEchoes) {
+  TcpLoopback link;
+  Executor executor(1);
+  auto listener = link.b.new_listener(7);
+  std::string reply;
+  std::atomic<bool> connected = false, asked = false, echoed = false;
+
+  executor.spawn(tcp_echo(link.b, listener, echoed));
+  executor.spawn(tcp_ask(link.a, "hello, world", reply, connected, asked));
+  ASSERT_TRUE(link.run_until([&]() { return asked && echoed; }));
+
+  EXPECT_TRUE(connected);
+  EXPECT_EQ(reply, "hello, world");
+  EXPECT_EQ(link.a.malformed + link.b.malformed, 0);
+  EXPECT_EQ(link.a.resets_sent + link.b.resets_sent, 0);
+}
+
+TEST(TcpTest, RefusedWithoutListener) {
+  TcpLoopback link;
+  Executor executor(1);
+  std::string reply;
+  std::atomic<bool> connected = true, asked = false;
+
+  executor.spawn(tcp_ask(link.a, "hello", reply, connected, asked));
+  ASSERT_TRUE(link.run_until([&]() { return asked.load(); }));
+
+  EXPECT_FALSE(connected);
+  EXPECT_EQ(link.b.resets_sent, 1);
+  EXPECT_EQ(link.a.size(), 0);
+  EXPECT_EQ(link.b.size(), 0);
+}
+
+TEST(TcpTest, ParsesWhatItSends) {
+  TcpStack stack(TCP_CLIENT_IP);
+  TcpConnection connection;
+  connection.key = FlowKey(TCP_SERVER_IP, TCP_CLIENT_IP, 80, 50000,
+                           PROTOCOL_TCP);
+  connection.state = TcpState::SynSent;
+  connection.scaling = connection.sack_permitted = true;
+  connection.rcv_shift = TCP_WINDOW_SHIFT;
+  connection.iss = connection.snd_una = 1000;
+
+  std::vector<TcpPacket> out;
+  stack._emit_locked(connection, TCP_SYN, 1000, 0, out);
+  ASSERT_EQ(out.size(), 1);
+
+  // Seen from the other end, the key turns around
+  auto segment = TcpSegment::try_from(out[0].view());
+  ASSERT_TRUE(segment.has_value());
+  EXPECT_EQ(segment->key, connection.key.reversed());
+  EXPECT_EQ(segment->seq, 1000);
+  EXPECT_EQ(segment->flags, TCP_SYN);
+  EXPECT_EQ(segment->mss, 1460);
+  EXPECT_EQ(segment->window_shift, TCP_WINDOW_SHIFT);
+  EXPECT_TRUE(segment->sack_permitted);
+  EXPECT_EQ(segment->window, 0xFFFF);
+
+  // A flipped bit anywhere fails the checksum
+  Buffer corrupt = out[0].view();
+  corrupt.data()[corrupt.size() - 1] ^= 0x10;
+  EXPECT_FALSE(TcpSegment::try_from(corrupt).has_value());
+}
+
+TEST(TcpTest, NegotiatesWindowScalingAndSack) {
+  TcpLoopback link;
+  Executor executor(1);
+  auto listener = link.b.new_listener(7);
+  std::string reply;
+  std::atomic<bool> connected = false, asked = false, echoed = false;
+
+  executor.spawn(tcp_echo(link.b, listener, echoed));
+  executor.spawn(tcp_ask(link.a, "hi", reply, connected, asked));
+  ASSERT_TRUE(link.run_until([&]() { return asked && echoed; }));
+
+  std::lock_guard guard(link.a._mutex);
+  auto *connection = link.a._connections.find(
+      FlowKey(TCP_SERVER_IP, TCP_CLIENT_IP, 7, TCP_EPHEMERAL_FIRST,
+              PROTOCOL_TCP),
+      link.now);
+  ASSERT_NE(connection, nullptr);
+  EXPECT_EQ((*connection)->snd_shift, TCP_WINDOW_SHIFT);
+  EXPECT_EQ((*connection)->rcv_shift, TCP_WINDOW_SHIFT);
+  EXPECT_TRUE((*connection)->sack_permitted);
+  EXPECT_EQ((*connection)->mss, 1460);
+  // The window grew past what 16 bits hold unscaled
+  EXPECT_GT((*connection)->snd_wnd, 0xFFFF);
+}
+
+/// @brief Writes `size` bytes of a pattern, in pieces.
+Task tcp_upload(TcpStack &stack, sz size, std::atomic<bool> &done) {
+  {
+    auto socket = co_await stack.submit_connect_ipv4(TCP_SERVER_IP, 9);
+    for (sz sent = 0; socket && sent < size;) {
+      sz length = std::min<sz>(size - sent, 100'000);
+      Buffer piece(length, uninitialized);
+      for (sz i = 0; i < length; i++)
+        piece.data()[i] = (sent + i) % 251;
+      if (!co_await stack.submit_write(*socket, BufferChain(piece)))
+        break;
+      sent += length;
+    }
+  }
+  done = true;
+}
+
+/// @brief Reads until the peer closes, checking the pattern.
+Task tcp_download(TcpStack &stack, TcpListener &listener,
+                  std::atomic<sz> &received, std::atomic<sz> &wrong,
+                  std::atomic<bool> &done) {
+  {
+    auto socket = co_await stack.submit_accept_ipv4(listener);
+    while (socket) {
+      auto data = co_await stack.submit_read_some(*socket, 1 << 16);
+      if (!data)
+        break;
+      sz at = received;
+      for (sz i = 0; i < data->size(); i++)
+        if (data->data()[i] != (at + i) % 251)
+          wrong++;
+      received += data->size();
+    }
+  }
+  done = true;
+}
+
+TEST(TcpTest, BulkTransferRecoversFromLossWithSack) {
+  const sz SIZE = 4 << 20;
+  TcpLoopback link;
+  Executor executor(1);
+  auto listener = link.b.new_listener(9);
+  std::atomic<sz> received = 0, wrong = 0;
+  std::atomic<bool> uploaded = false, downloaded = false;
+
+  // Every 50th segment carrying data gets lost
+  sz data_segments = 0;
+  link.lose = [&](const TcpStack &from, const Buffer &packet) {
+    auto segment = TcpSegment::try_from(packet);
+    return &from == &link.a && segment->payload.size() > 0 &&
+           ++data_segments % 50 == 0;
+  };
+
+  executor.spawn(tcp_download(link.b, listener, received, wrong, downloaded));
+  executor.spawn(tcp_upload(link.a, SIZE, uploaded));
+  ASSERT_TRUE(link.run_until([&]() { return uploaded && downloaded; }));
+
+  EXPECT_EQ(received.load(), SIZE);
+  EXPECT_EQ(wrong.load(), 0);
+  EXPECT_GT(link.lost, 0);
+  EXPECT_GT(link.a.fast_retransmits, 0);
+  EXPECT_GE(link.a.retransmitted, link.lost);
+  // SACK finds the holes, the timer only the odd lost retransmission
+  EXPECT_LT(link.a.timeouts, link.a.fast_retransmits);
+}
+
+TEST(TcpTest, SendsSuperSegmentsToDevicesThatCutThem) {
+  const sz SIZE = 4 << 20;
+  TcpLoopback link;
+  link.a.gso_max_size = TAP_GSO_FRAME_SIZE - EthernetHeader::SIZE;
+  Executor executor(1);
+  auto listener = link.b.new_listener(9);
+  std::atomic<sz> received = 0, wrong = 0;
+  std::atomic<bool> uploaded = false, downloaded = false;
+
+  sz super_segments = 0;
+  link.lose = [&](const TcpStack &from, const Buffer &packet) {
+    auto segment = TcpSegment::try_from(packet);
+    if (&from == &link.a && segment->payload.size() > link.b.mss)
+      super_segments++;
+    return false;
+  };
+
+  executor.spawn(tcp_download(link.b, listener, received, wrong, downloaded));
+  executor.spawn(tcp_upload(link.a, SIZE, uploaded));
+  ASSERT_TRUE(link.run_until([&]() { return uploaded && downloaded; }));
+
+  EXPECT_EQ(received.load(), SIZE);
+  EXPECT_EQ(wrong.load(), 0);
+  EXPECT_GT(super_segments, 0);
+  EXPECT_LE(link.largest, link.a.gso_max_size);
+  EXPECT_EQ(link.a.malformed + link.b.malformed, 0);
+}
+
+/// @brief Connects, then writes each of `sizes` when told to.
+Task tcp_write_each(TcpStack &stack, std::vector<sz> sizes,
+                    std::atomic<int> &stage, std::atomic<int> &go,
+                    std::atomic<bool> &done) {
+  {
+    auto socket = co_await stack.submit_connect_ipv4(TCP_SERVER_IP, 9);
+    stage = 1;
+    for (sz size : sizes) {
+      while (go < stage)
+        co_await suspend();
+      co_await stack.submit_write(*socket, BufferChain(Buffer(size)));
+      stage++;
+    }
+  }
+  done = true;
+}
+
+TEST(TcpTest, DelaysAndBatchesAcks) {
+  TcpLoopback link;
+  Executor executor(1);
+  auto listener = link.b.new_listener(9);
+  std::atomic<sz> received = 0, wrong = 0;
+  std::atomic<int> stage = -1, go = 0;
+  std::atomic<bool> written = false, downloaded = false;
+
+  executor.spawn(tcp_download(link.b, listener, received, wrong, downloaded));
+  executor.spawn(
+      tcp_write_each(link.a, {100, 100, 10 * 1460}, stage, go, written));
+  ASSERT_TRUE(link.run_until([&]() { return stage == 1; }));
+
+  // Reading the first bytes opens the window from what the SYN-ACK could
+  // announce unscaled to the whole buffer, which is worth an update
+  go = 1;
+  ASSERT_TRUE(link.run_until([&]() { return received == 100; }, 0));
+  link.step(0);
+
+  // A lone segment waits for a second one, or for the timer
+  go = 2;
+  ASSERT_TRUE(link.run_until([&]() { return received == 200; }, 0));
+  u64 acks = link.b.acks_sent;
+  for (int i = 0; i < 39; i++)
+    link.step();
+  EXPECT_EQ(link.b.acks_sent, acks);
+  link.step(2'000'000);
+  EXPECT_EQ(link.b.acks_sent, acks + 1);
+
+  // Ten segments in one vector are answered with one ACK
+  go = 3;
+  ASSERT_TRUE(link.run_until([&]() { return stage == 4; }, 0));
+  u64 sent = link.a.segments_sent;
+  link.step(0);
+  EXPECT_EQ(link.a.segments_sent, sent + 10);
+  EXPECT_EQ(link.b.acks_sent, acks + 2);
+
+  ASSERT_TRUE(link.run_until([&]() { return written && downloaded; }));
+  EXPECT_EQ(received.load(), 200 + 10 * 1460);
+}
+
+/// @brief Writes `message` and closes, then waits for the peer to close.
+Task tcp_say(TcpStack &stack, std::string message, std::atomic<bool> &done) {
+  {
+    auto socket = co_await stack.submit_connect_ipv4(TCP_SERVER_IP, 7);
+    co_await stack.submit_write(*socket, BufferChain(tcp_bytes(message)));
+  }
+  done = true;
+}
+
+/// @brief Reads until the peer closes, then closes as well.
+Task tcp_hear(TcpStack &stack, TcpListener &listener, std::string &heard,
+              std::atomic<bool> &done) {
+  {
+    auto socket = co_await stack.submit_accept_ipv4(listener);
+    while (auto data = co_await stack.submit_read_some(*socket, 4096))
+      heard.append((const char *)data->data(), data->size());
+  }
+  done = true;
+}
+
+TEST(TcpTest, ClosesGracefully) {
+  TcpLoopback link;
+  Executor executor(1);
+  auto listener = link.b.new_listener(7);
+  std::string heard;
+  std::atomic<bool> said = false, listened = false;
+
+  executor.spawn(tcp_hear(link.b, listener, heard, listened));
+  executor.spawn(tcp_say(link.a, "goodbye", said));
+  ASSERT_TRUE(link.run_until([&]() { return said && listened; }));
+  EXPECT_EQ(heard, "goodbye");
+
+  // The server's side goes away once its FIN is acknowledged, the client's
+  // lingers in TIME-WAIT
+  ASSERT_TRUE(link.run_until([&]() { return link.b.size() == 0; }));
+  EXPECT_EQ(link.a.size(), 1);
+  ASSERT_TRUE(link.run_until([&]() { return link.a.size() == 0; },
+                             1'000'000'000,
+                             TCP_TIME_WAIT_NS / 1'000'000'000 + 2));
+  EXPECT_EQ(link.a.resets_sent + link.b.resets_sent, 0);
+}
+
+TEST(TcpTest, ServesThroughThePipeline) {
+  TcpStack peer(TCP_CLIENT_IP);
+  TcpStack stack(TCP_SERVER_IP);
+  Pipeline pipeline(PIPELINE_MAC, TCP_SERVER_IP);
+  pipeline.tcp = &stack;
+  pipeline.next_hop = PEER_MAC;
+  CollectingDevice device;
+  Executor executor(1);
+
+  auto listener = stack.new_listener(7);
+  std::string reply;
+  std::atomic<bool> connected = false, asked = false, echoed = false;
+  executor.spawn(tcp_echo(stack, listener, echoed));
+  executor.spawn(tcp_ask(peer, "through the pipeline", reply, connected,
+                         asked));
+
+  for (sz i = 0; i < 1'000'000 && !(asked && echoed); i++) {
+    std::vector<Buffer> frames;
+    for (auto &packet : peer.poll(neighbor_now())) {
+      u8 *header = packet.push(EthernetHeader::SIZE);
+      EthernetHeader::Dst::store(header, PIPELINE_MAC);
+      EthernetHeader::Src::store(header, PEER_MAC);
+      EthernetHeader::Ethertype::store(header, ETHERTYPE_IPV4);
+      frames.push_back(packet.view());
+    }
+    pipeline.process(frames, device);
+
+    std::vector<Buffer> packets;
+    for (auto &frame : device.sent) {
+      EXPECT_EQ(EthernetHeader::Dst::load(frame.data()), PEER_MAC);
+      packets.push_back(frame.slice(EthernetHeader::SIZE, frame.size()));
+    }
+    device.sent.clear();
+    if (!packets.empty())
+      peer.input(packets, neighbor_now());
+    std::this_thread::yield();
+  }
+
+  EXPECT_EQ(reply, "through the pipeline");
+  EXPECT_GT(pipeline.node_frames[(sz)PipelineNode::TcpInput], 0);
+  EXPECT_EQ(pipeline.node_frames[(sz)PipelineNode::Drop], 0);
+}
+
+TEST(TcpTest, PipelineTrustsChecksumsTheKernelLeftPartial) {
+  TcpStack peer(TCP_CLIENT_IP);
+  TcpStack stack(TCP_SERVER_IP);
+  Pipeline pipeline(PIPELINE_MAC, TCP_SERVER_IP);
+  pipeline.tcp = &stack;
+  pipeline.next_hop = PEER_MAC;
+  CollectingDevice device;
+  auto listener = stack.new_listener(7);
+
+  auto connecting = peer.submit_connect_ipv4(TCP_SERVER_IP, 7);
+  auto packets = peer.poll(neighbor_now());
+  ASSERT_EQ(packets.size(), 1);
+  u8 *header = packets[0].push(EthernetHeader::SIZE);
+  EthernetHeader::Dst::store(header, PIPELINE_MAC);
+  EthernetHeader::Src::store(header, PEER_MAC);
+  EthernetHeader::Ethertype::store(header, ETHERTYPE_IPV4);
+  Buffer syn = packets[0].view();
+
+  // Only the pseudo header is summed, as for a sender on the same host
+  u8 *tcp = syn.data() + EthernetHeader::SIZE + IP_HEADER_SIZE;
+  sz length = syn.size() - EthernetHeader::SIZE - IP_HEADER_SIZE;
+  TcpHeader::Checksum::store(
+      tcp, fold_sum(TcpSegment::pseudo_sum(FlowKey::_bits(TCP_CLIENT_IP),
+                                           FlowKey::_bits(TCP_SERVER_IP),
+                                           length)));
+
+  // Without the offload the checksum is checked, and wrong
+  std::vector<Buffer> frames = {syn};
+  pipeline.process(frames, device);
+  EXPECT_EQ(stack.malformed, 1);
+  EXPECT_TRUE(device.sent.empty());
+
+  frames = {syn};
+  std::vector<VirtioNetHeader> offloads = {VirtioNetHeader::partial_checksum(
+      EthernetHeader::SIZE + IP_HEADER_SIZE, 16)};
+  pipeline.process(frames, device, offloads);
+  EXPECT_EQ(stack.malformed, 1);
+  ASSERT_EQ(device.sent.size(), 1);
+  const u8 *answer = device.sent[0].data() + EthernetHeader::SIZE +
+                     IP_HEADER_SIZE;
+  EXPECT_EQ(TcpHeader::Flags::load(answer), TCP_SYN | TCP_ACK);
+}
+
+/// @brief A queue nothing ever arrives on, keeping whatever leaves it. Its
+/// timer only fires when the test calls `tick`.
+struct QuietQueue {
+  std::mutex mutex;
+  std::vector<Buffer> sent;
+  std::shared_ptr<FrameChannel> channel = std::make_shared<FrameChannel>();
+  u64 tick_ns = 0;
+
+  auto frames() -> std::shared_ptr<FrameChannel> { return channel; }
+  void wake_every(std::shared_ptr<FrameChannel>, u64 interval_ns) {
+    tick_ns = interval_ns;
+  }
+  void tick() { channel->wake(); }
+
+  void queue_eth(const EthernetView<DirectionOut> &frame) {
+    std::lock_guard guard(mutex);
+    sent.push_back(frame.buffer);
+  }
+  void flush() {}
+
+  /// @brief SYNs sent so far
+  auto syns() -> sz {
+    std::lock_guard guard(mutex);
+    return std::count_if(sent.begin(), sent.end(), [](const Buffer &frame) {
+      const u8 *tcp = frame.data() + EthernetHeader::SIZE + IP_HEADER_SIZE;
+      return (tcp[13] & TCP_SYN) != 0;
+    });
+  }
+};
+
+TEST(TcpTest, ServePipelineSendsWithoutInboundTraffic) {
+  TcpStack stack(TCP_SERVER_IP);
+  Pipeline pipeline(PIPELINE_MAC, TCP_SERVER_IP);
+  pipeline.tcp = &stack;
+  pipeline.next_hop = PEER_MAC;
+  QuietQueue queue;
+  Executor executor(1);
+
+  executor.spawn(serve_pipeline(pipeline, queue));
+  while (true) {
+    std::lock_guard guard(queue.channel->_mutex);
+    if (queue.channel->_receiver)
+      break;
+  }
+  EXPECT_EQ(queue.tick_ns, PIPELINE_TICK_NS);
+
+  // The SYN leaves as soon as it is queued, no frame has to arrive first
+  auto connecting = stack.submit_connect_ipv4(TCP_CLIENT_IP, 7);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (queue.syns() < 1 && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::yield();
+  EXPECT_EQ(queue.syns(), 1);
+
+  // Nobody answers, the ticks alone retransmit it once the RTO runs out
+  while (queue.syns() < 2 && std::chrono::steady_clock::now() < deadline) {
+    queue.tick();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(queue.syns(), 2);
+  EXPECT_EQ(stack.timeouts, 1);
+
+  queue.channel->close();
+}
+
+TEST(TcpTest, ServePipelineAnswersAsMainConfiguresIt) {
+  TcpStack peer(TCP_CLIENT_IP);
+  TcpStack stack(TCP_SERVER_IP);
+  NeighborCache neighbors;
+  Pipeline pipeline(PIPELINE_MAC, TCP_SERVER_IP);
+  pipeline.prefix_length = 24;
+  pipeline.neighbors = &neighbors;
+  pipeline.tcp = &stack;
+  QuietQueue queue;
+  Executor executor(1);
+  auto listener = stack.new_listener(7);
+  executor.spawn(serve_pipeline(pipeline, queue));
+
+  // As read off the device, the payload slices the frame after its header
+  auto arrive = [&](Buffer frame) {
+    EthernetFrame<DirectionIn> in;
+    in.payload = frame.slice(EthernetHeader::SIZE, frame.size());
+    queue.channel->try_send(std::move(in));
+  };
+  // The peer asks for us first and is learned from it, no next hop is set
+  arrive(pipeline_arp_request());
+  auto connecting = peer.submit_connect_ipv4(TCP_SERVER_IP, 7);
+  for (auto &packet : peer.poll(neighbor_now())) {
+    u8 *header = packet.push(EthernetHeader::SIZE);
+    EthernetHeader::Dst::store(header, PIPELINE_MAC);
+    EthernetHeader::Src::store(header, PEER_MAC);
+    EthernetHeader::Ethertype::store(header, ETHERTYPE_IPV4);
+    arrive(packet.view());
+  }
+
+  auto syn_acks = [&]() {
+    std::lock_guard guard(queue.mutex);
+    return std::count_if(
+        queue.sent.begin(), queue.sent.end(), [](const Buffer &frame) {
+          const u8 *tcp = frame.data() + EthernetHeader::SIZE + IP_HEADER_SIZE;
+          return EthernetHeader::Ethertype::load(frame.data()) ==
+                     ETHERTYPE_IPV4 &&
+                 EthernetHeader::Dst::load(frame.data()) == PEER_MAC &&
+                 TcpHeader::Flags::load(tcp) == (TCP_SYN | TCP_ACK);
+        });
+  };
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (syn_acks() < 1 && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::yield();
+  EXPECT_EQ(syn_acks(), 1);
+  EXPECT_EQ(pipeline.node_frames[(sz)PipelineNode::Drop], 0);
+
+  queue.channel->close();
+}
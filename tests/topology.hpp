@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+
+#include "concurrency/topology.hpp"
+
+using namespace toad;
+
+TEST(TopologyTest, ParsesCpuLists) {
+  EXPECT_EQ(parse_cpu_list("0"), (std::vector<u32>{0}));
+  EXPECT_EQ(parse_cpu_list("0-3"), (std::vector<u32>{0, 1, 2, 3}));
+  EXPECT_EQ(parse_cpu_list("0-1,8,10-11\n"),
+            (std::vector<u32>{0, 1, 8, 10, 11}));
+  EXPECT_TRUE(parse_cpu_list("").empty());
+}
+
+TEST(TopologyTest, CompactLayoutStaysOnNode) {
+  Topology topology;
+  topology.num_nodes = 2;
+  for (u32 cpu = 0; cpu < 8; cpu++)
+    topology.cpus.push_back({cpu, cpu / 4, cpu / 4, cpu % 4});
+
+  auto layout = WorkerLayout::compact(topology, 1, 3);
+  ASSERT_EQ(layout.event_loop_cpu, 4u);
+  ASSERT_EQ(layout.worker_cpus, (std::vector<u32>{5, 6, 7}));
+  for (u32 node : layout.worker_nodes)
+    EXPECT_EQ(node, 1u);
+}
+
+TEST(TopologyTest, CompactLayoutDefaultsToOneNode) {
+  Topology topology;
+  topology.num_nodes = 2;
+  for (u32 cpu = 0; cpu < 8; cpu++)
+    topology.cpus.push_back({cpu, cpu / 4, cpu / 4, cpu % 4});
+
+  auto layout = WorkerLayout::compact(topology);
+  ASSERT_EQ(layout.event_loop_cpu, 0u);
+  ASSERT_EQ(layout.worker_cpus, (std::vector<u32>{1, 2, 3}));
+
+  // Asked for more, the workers spill over to the next node
+  layout = WorkerLayout::compact(topology, 0, 5);
+  ASSERT_EQ(layout.worker_cpus, (std::vector<u32>{1, 2, 3, 4, 5}));
+}
+
+TEST(TopologyTest, PinsToCpusPastTheDefaultSetSize) {
+  // Beyond `CPU_SETSIZE` no such CPU exists, the kernel refuses it, but
+  // building the mask must not write past it
+  EXPECT_FALSE(pin_this_thread(CPU_SETSIZE + 1));
+}
+
+TEST(TopologyTest, SpreadLayoutAlternatesNodes) {
+  Topology topology;
+  topology.num_nodes = 2;
+  for (u32 cpu = 0; cpu < 4; cpu++)
+    topology.cpus.push_back({cpu, cpu % 2, cpu % 2, cpu / 2});
+
+  auto layout = WorkerLayout::spread(topology, 4);
+  ASSERT_EQ(layout.worker_nodes, (std::vector<u32>{0, 1, 0, 1}));
+}
+
+TEST(TopologyTest, DiscoversAtLeastOneCpu) {
+  auto topology = Topology::discover();
+  ASSERT_FALSE(topology.cpus.empty());
+  ASSERT_GE(topology.num_nodes, 1u);
+}
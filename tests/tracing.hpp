@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+#include <sstream>
+
+#include "concurrency/executor.hpp"
+#include "concurrency/join.hpp"
+
+using namespace toad;
+
+Task traced_child(std::atomic<int> &done) {
+  co_await suspend();
+  done++;
+}
+
+Task traced_parent(std::atomic<int> &done) {
+  spawn(traced_child(done));
+  co_await suspend();
+  done++;
+}
+
+TEST(TracingTest, DumpsRunSpansOfSampledTasks) {
+  auto &tracer = tracing::tracer();
+  tracer.sample_every = 1;
+
+  std::atomic<int> done = 0;
+  {
+    Executor executor(2);
+    executor.spawn(traced_parent(done));
+    while (done.load() != 2)
+      std::this_thread::yield();
+  }
+
+  tracer.sample_every = 0;
+
+  std::ostringstream out;
+  tracer.dump_chrome_json(out);
+  auto json = out.str();
+
+  EXPECT_TRUE(json.starts_with("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+  EXPECT_TRUE(json.ends_with("]}\n"));
+  // Two resumes of the parent and two of the child
+  sz spans = 0;
+  for (sz at = 0; (at = json.find("\"ph\":\"X\"", at)) != std::string::npos;
+       at++)
+    spans++;
+  EXPECT_EQ(spans, 4);
+}
+
+TEST(TracingTest, ChildrenOfSampledTasksAreTraced) {
+  auto &tracer = tracing::tracer();
+  tracer.sample_every = 0;
+
+  std::atomic<int> done = 0;
+  Task task = traced_parent(done);
+  EXPECT_FALSE(task.promise().traced);
+
+  tracing::thread_traced_ = true;
+  Executor::_inherit(task);
+  tracing::thread_traced_ = false;
+  EXPECT_TRUE(task.promise().traced);
+}